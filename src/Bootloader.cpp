@@ -24,11 +24,136 @@
 
 #include "Bootloader.h"
 
+#if defined(BACKUPRETRY) || defined(MAILBOX) || defined(BLOCK_IMAGES) || defined(RELOCATION)
+#include "Crc32.h"
+#endif
+
+#ifdef RELOCATION
+#include "Relocation.h"
+#endif
+
+#ifdef MAILBOX
+#include "BootloaderClient.h"
+#endif
+
+#ifdef VERIFYHASH
+static_assert(sizeof(ImageHeader::sha256) == SHA256_DIGEST_SIZE, "Image hash is not a SHA-256 digest");
+
+/* Finish a hash calculation of a binary and compare it with its image header */
+static bool hashMatches(Sha256& context, const ImageHeader& header)
+{
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256Final(context, digest);
+    uint8_t difference = 0;
+    for (uint32_t i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        difference |= digest[i] ^ header.sha256[i];
+    }
+    return difference == 0;
+}
+#endif
+
+#ifdef BLOCK_IMAGES
+/* Check if an app is stored as blocks, compressed or as a delta */
+static bool isBlockImage(const ImageHeader& header)
+{
+    #ifdef COMPRESSION
+    if (header.magic == IMAGE_HEADER_MAGIC_LZ4) {
+        return true;
+    }
+    #endif
+    #ifdef DELTA
+    if (header.magic == IMAGE_HEADER_MAGIC_DELTA) {
+        return true;
+    }
+    #endif
+    return false;
+}
+#endif
+
+/* Check the magic number of an image header */
+static bool isImage(const ImageHeader& header)
+{
+    #ifdef LEGACY_IMAGES
+    if (header.magic == IMAGE_HEADER_MAGIC_LEGACY) {
+        return true;
+    }
+    #endif
+    #ifdef BLOCK_IMAGES
+    if (isBlockImage(header)) {
+        return true;
+    }
+    #endif
+    #ifdef RELOCATION
+    if (header.magic == IMAGE_HEADER_MAGIC_RELOC) {
+        return true;
+    }
+    #endif
+    return header.magic == IMAGE_HEADER_MAGIC;
+}
+
+#ifdef LEGACY_IMAGES
+/* Check if an image header was never written */
+static bool isErased(const ImageHeader& header)
+{
+    const uint32_t* words = (const uint32_t*)&header;
+    for (uint32_t i = 0; i < sizeof(header) / sizeof(uint32_t); i++) {
+        if (words[i] != 0xFFFFFFFF) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+#ifdef MAILBOX
+static_assert(sizeof(Mailbox) <= MAILBOX_SIZE, "Mailbox does not fit into MAILBOX_SIZE");
+#endif
+
+#ifdef SWAPBINARY
+/* Offset and size of a batch of a swap, the last one is the header page */
+static uint32_t swapBatch(uint32_t swapLength, uint32_t batch, uint32_t& size)
+{
+    uint32_t offset = batch * SWAP_SCRATCH_SIZE;
+    if (offset >= swapLength) {
+        size = FLASH_PAGE_SIZE;
+        return SWAP_HEADER_PAGE;
+    }
+    size = swapLength - offset < SWAP_SCRATCH_SIZE ? swapLength - offset : SWAP_SCRATCH_SIZE;
+    return offset;
+}
+#endif
+
 void Bootloader::boot(System& system, bool enableWatchdog)
 {
+    #ifdef MAILBOX
+    system.startCycleCounter();
+    #endif
+    TRACE_PHASE(system, bootEntered, 0);
+
+    for (uint32_t app = 0; app < BOOTLOADER_MAX_APPS; app++) {
+        slotIndex.states[app] = slotUnknown;
+    }
+
     /* grab the status reg */
     BootloaderStatus statusReg;
     system.readStatusReg(statusReg);
+    TRACE_PHASE(system, statusRead, statusReg.status);
+
+    #ifdef BACKUPRETRY
+    /* Add what warm boots counted in the backup registers. Their retry count
+     * is only used if the status was not written since */
+    BackupState backup;
+    system.readBackupRegisters((uint16_t*)&backup, BACKUP_STATE_REGISTERS);
+    bool warmBoot = backup.magic == BACKUP_STATE_MAGIC;
+    bool warmRetry = warmBoot && backup.statusTag == statusTag(statusReg);
+    if (warmBoot) {
+        statusReg.statistics.boots += backup.pendingBoots;
+        statusReg.statistics.trialBoots += backup.pendingTrialBoots;
+    }
+    if (warmRetry && backup.retryCount > statusReg.retryCount) {
+        statusReg.retryCount = backup.retryCount;
+    }
+    #endif
 
     /* Check if BootloaderStatus has ever been initialized */
     const char* src = BOOTLOADER_NAME;
@@ -45,41 +170,232 @@ void Bootloader::boot(System& system, bool enableWatchdog)
         statusReg.status = BootloaderState::noState;
     }
 
+    #ifdef SWAPBINARY
+    /* Finish a swap interrupted by a reset first, until then the boot region
+     * and the slot each hold parts of both apps */
+    if (statusReg.status != BootloaderState::noState && statusReg.swapSlot < BOOTLOADER_MAX_APPS
+        && statusReg.swapLength <= SWAP_HEADER_PAGE && statusReg.installProgress < SWAP_STEPS(statusReg.swapLength)) {
+        #ifdef CLOCKBOOST
+        system.boostClock();
+        TRACE_PHASE(system, clockSwitched, 1);
+        #endif
+        swapApp(system, statusReg);
+        system.writeStatusReg(statusReg);
+    }
+    #endif
+
+    /* Count this boot. It is stored with the status if that is written anyway,
+     * in a boot mark otherwise */
+    statusReg.statistics.boots++;
+
+    #ifdef MAILBOX
+    /* A mailbox that does not check out, as after a power loss, is started over */
+    Mailbox mailbox;
+    system.readMailbox(mailbox);
+    if (mailbox.magic != MAILBOX_MAGIC || mailbox.version != MAILBOX_VERSION
+        || mailbox.crc != mailboxCrc(mailbox)) {
+        mailbox = {};
+        mailbox.magic = MAILBOX_MAGIC;
+        mailbox.version = MAILBOX_VERSION;
+        mailbox.trialApp = MAILBOX_NO_TRIAL;
+    }
+    bool trial = false;
+    #endif
+
+    #ifdef SIGNATURE
+    /* The marker only holds for the apps the bootloader booted before, a new
+     * app is always checked in full */
+    verifiedApp = NO_APP;
+    if (statusReg.status == BootloaderState::attemptNewApp || statusReg.status == BootloaderState::stableApp) {
+        verifiedApp = statusReg.verifiedApp;
+        verifiedHash[0] = statusReg.verifiedHash[0];
+        verifiedHash[1] = statusReg.verifiedHash[1];
+    }
+    #endif
+
     /* Boot logic */
+    ImageHeader header;
     switch (statusReg.status) {
         case BootloaderState::stableApp: {
+            bool changed = false;
+            #ifdef MAILBOX
+            /* Trials requested by the app only live in the mailbox */
+            changed = handleMailbox(system, statusReg, mailbox, header);
+            trial = mailbox.trialApp != MAILBOX_NO_TRIAL;
+            #endif
+
+            #if defined(COPYBINARY) && !defined(SWAPBINARY)
+            /* Install the app to boot if a reset interrupted its install, or if
+             * another app was installed since, as after falling back from a
+             * rejected new app or a trial */
+            #ifdef MAILBOX
+            if (trial) {
+                changed |= installApp(system, statusReg, mailbox.trialApp, header);
+            } else
+            #endif
+            if (!isInstalled(system, statusReg, statusReg.liveAppSelect)
+                && selectApp(system, statusReg, statusReg.liveAppSelect, 0, header)) {
+                changed |= installApp(system, statusReg, statusReg.liveAppSelect, header);
+            }
+            #elif defined(RELOCATION) && defined(MAILBOX)
+            /* An app on trial may run from its slot for the first time */
+            if (trial) {
+                relocateApp(system, mailbox.trialApp, header);
+            }
+            #endif
+
+            if (changed) {
+                #ifdef SIGNATURE
+                recordVerified(statusReg);
+                #endif
+                system.writeStatusReg(statusReg);
+                break;
+            }
+
             /* Good to go */
+            #ifdef BACKUPRETRY
+            /* Warm boots are counted in the backup registers */
+            if (!warmBoot) {
+                system.addStatusBoot();
+            }
+            #else
+            system.addStatusBoot();
+            #endif
             break;
         }
         case BootloaderState::newApp: {
+            #ifdef CLOCKBOOST
+            system.boostClock();
+            TRACE_PHASE(system, clockSwitched, 1);
+            #endif
+            /* A new app starts a new fallback chain */
+            statusReg.givenUpApps = 0;
+            if (!verifyApp(system, statusReg.liveAppSelect, header)) {
+                /* Invalid binary, fall back to the newest other app */
+                statusReg.status = BootloaderState::stableApp;
+                statusReg.statistics.rollbacks[statusReg.liveAppSelect]++;
+                statusReg.givenUpApps |= 1U << statusReg.liveAppSelect;
+                #ifdef SWAPBINARY
+                /* The stable app is still in the boot region */
+                if (verifyBootRegion(system, statusReg.swapSlot, header)) {
+                    if (statusReg.swapSlot < BOOTLOADER_MAX_APPS) {
+                        statusReg.liveAppSelect = statusReg.swapSlot;
+                    }
+                } else if (selectApp(system, statusReg, NO_APP, statusReg.givenUpApps, header)) {
+                    startSwap(system, statusReg, statusReg.liveAppSelect, header);
+                }
+                #elif defined(COPYBINARY)
+                if (selectApp(system, statusReg, NO_APP, statusReg.givenUpApps, header)) {
+                    installApp(system, statusReg, statusReg.liveAppSelect, header);
+                }
+                #elif defined(RELOCATION)
+                if (selectApp(system, statusReg, NO_APP, statusReg.givenUpApps, header)) {
+                    relocateApp(system, statusReg.liveAppSelect, header);
+                }
+                #else
+                selectApp(system, statusReg, NO_APP, statusReg.givenUpApps, header);
+                #endif
+                #ifdef SIGNATURE
+                recordVerified(statusReg);
+                #endif
+                system.writeStatusReg(statusReg);
+                break;
+            }
+
             /* Let's do it */
             statusReg.status = BootloaderState::attemptNewApp;
             statusReg.retryCount = 0;
-            system.writeStatusReg(statusReg);
-            #ifdef COPYBINARY
-            system.copyFlashBlock(BOOTLOADER_APP_ADDRESS[statusReg.liveAppSelect], BOOT_ADDRESS, APP_SIZE);
+            statusReg.statistics.trialBoots++;
+            #ifdef SIGNATURE
+            recordVerified(statusReg);
             #endif
+            #ifdef SWAPBINARY
+            startSwap(system, statusReg, statusReg.liveAppSelect, header);
+            #elif defined(COPYBINARY)
+            installApp(system, statusReg, statusReg.liveAppSelect, header);
+            #elif defined(RELOCATION)
+            relocateApp(system, statusReg.liveAppSelect, header);
+            #endif
+            system.writeStatusReg(statusReg);
             break;
         }
         case BootloaderState::attemptNewApp: {
+            #ifdef CLOCKBOOST
+            system.boostClock();
+            TRACE_PHASE(system, clockSwitched, 1);
+            #endif
             statusReg.retryCount++;
-            if (statusReg.retryCount >= BOOTLOADER_MAX_RETRIES) {
+            statusReg.statistics.trialBoots++;
+
+            /* An app that became invalid does not get any more attempts */
+            #ifdef SWAPBINARY
+            bool valid = verifyBootRegion(system, statusReg.liveAppSelect, header);
+            #else
+            bool valid = verifyApp(system, statusReg.liveAppSelect, header);
+            #endif
+            bool retry = valid && statusReg.retryCount < BOOTLOADER_MAX_RETRIES;
+            if (!retry) {
                 statusReg.retryCount = 0;
+                statusReg.statistics.rollbacks[statusReg.liveAppSelect]++;
 
-                /* try other app */
-                statusReg.liveAppSelect++;
-                if (statusReg.liveAppSelect >= BOOTLOADER_MAX_APPS) {
-                    statusReg.liveAppSelect = 0;
+                #ifdef SWAPBINARY
+                /* Swap back the app from before, or swap in the newest app
+                 * not given up on if it is gone or given up on as well. The
+                 * app given up on moves to the slot swapped in, so that slot
+                 * is recorded. The slot of the app given up on holds the app
+                 * from before, unless it was never swapped in */
+                uint32_t givenUpApp = statusReg.liveAppSelect;
+                uint32_t excludedApps = statusReg.givenUpApps;
+                if (statusReg.swapSlot != givenUpApp) {
+                    excludedApps |= 1U << givenUpApp;
                 }
-                system.writeStatusReg(statusReg);
-            } else {
-                /* try again */
-                system.writeStatusReg(statusReg); 
+                uint32_t previousApp = statusReg.swapSlot;
+                if (previousApp < BOOTLOADER_MAX_APPS && (excludedApps & (1U << previousApp)) != 0) {
+                    previousApp = NO_APP;
+                }
+                if (selectApp(system, statusReg, previousApp, excludedApps, header)
+                    && (excludedApps & (1U << statusReg.liveAppSelect)) == 0) {
+                    statusReg.givenUpApps = excludedApps | (1U << statusReg.liveAppSelect);
+                    startSwap(system, statusReg, statusReg.liveAppSelect, header);
+                } else {
+                    /* Every other app is given up on as well, stay with this
+                     * one */
+                    statusReg.liveAppSelect = givenUpApp;
+                }
+                #else
+                statusReg.givenUpApps |= 1U << statusReg.liveAppSelect;
+
+                /* try the newest app not given up on yet, which is the next
+                 * older one along the chain, or stay with this one if there
+                 * is none */
+                valid = selectApp(system, statusReg, NO_APP, statusReg.givenUpApps, header);
+                #endif
+            }
+            #ifdef SIGNATURE
+            recordVerified(statusReg);
+            #endif
+
+            #if defined(COPYBINARY) && !defined(SWAPBINARY)
+            /* copy app binary from the live app's location to boot location,
+             * unless a previous attempt has installed it already */
+            if (valid) {
+                installApp(system, statusReg, statusReg.liveAppSelect, header);
+            }
+            #elif defined(RELOCATION)
+            /* relocate the app for its slot, unless a previous attempt has
+             * done so already */
+            if (valid) {
+                relocateApp(system, statusReg.liveAppSelect, header);
+            }
+            #endif
+
+            #ifdef BACKUPRETRY
+            /* Warm retries of the same app are counted in the backup registers */
+            if (retry && warmRetry) {
+                break;
             }
-            #ifdef COPYBINARY
-            /* again copy app binary from the live app's location to boot location */
-            system.copyFlashBlock(BOOTLOADER_APP_ADDRESS[statusReg.liveAppSelect], BOOT_ADDRESS, APP_SIZE);
             #endif
+            system.writeStatusReg(statusReg);
             break;
         }
         case BootloaderState::noState:
@@ -96,28 +412,828 @@ void Bootloader::boot(System& system, bool enableWatchdog)
             statusReg.bootloaderVersion = (BOOTLOADER_VERSION_BUILD << 16)
                 + (BOOTLOADER_VERSION_MINOR << 8) + (BOOTLOADER_VERSION_MAJOR);
 
-            /* first boot, always attempt to boot from app A */
             statusReg.status = BootloaderState::attemptNewApp;
-            statusReg.liveAppSelect = 0;
             statusReg.retryCount = 0;
+            statusReg.givenUpApps = 0;
+            statusReg.statistics.trialBoots++;
 
-            #ifdef COPYBINARY
-            system.copyFlashBlock(BOOTLOADER_APP_ADDRESS[statusReg.liveAppSelect], BOOT_ADDRESS, APP_SIZE);
+            #ifdef CLOCKBOOST
+            system.boostClock();
+            TRACE_PHASE(system, clockSwitched, 1);
+            #endif
+
+            /* first boot, attempt to boot the newest valid app */
+            statusReg.liveAppSelect = 0;
+            statusReg.installedLength = 0;
+            statusReg.installedCrc = 0;
+            statusReg.installProgress = 0;
+            #ifdef SIGNATURE
+            statusReg.verifiedApp = NO_APP;
+            #endif
+            #ifdef SWAPBINARY
+            statusReg.swapSlot = NO_APP;
+            statusReg.swapLength = 0;
+            if (selectApp(system, statusReg, NO_APP, 0, header)) {
+                startSwap(system, statusReg, statusReg.liveAppSelect, header);
+            }
+            #elif defined(COPYBINARY)
+            if (selectApp(system, statusReg, NO_APP, 0, header)) {
+                installApp(system, statusReg, statusReg.liveAppSelect, header);
+            }
+            #elif defined(RELOCATION)
+            if (selectApp(system, statusReg, NO_APP, 0, header)) {
+                relocateApp(system, statusReg.liveAppSelect, header);
+            }
+            #else
+            selectApp(system, statusReg, NO_APP, 0, header);
+            #endif
+            #ifdef SIGNATURE
+            recordVerified(statusReg);
             #endif
             system.writeStatusReg(statusReg);
             break;
         }
     }
+    TRACE_PHASE(system, bootDecided, statusReg.liveAppSelect);
+
+    #ifdef BACKUPRETRY
+    saveBackupState(system, statusReg);
+    #endif
+
+    #ifdef CLOCKBOOST
+    /* The app expects the clocks in their reset state */
+    system.restoreClock();
+    TRACE_PHASE(system, clockSwitched, 0);
+    #endif
 
     /* Watchdog must be enabled after copying over the app, if we had to do so */
     if (enableWatchdog) {
         system.enableWatchdog();
     }
 
+    #ifdef MAILBOX
+    /* Report the boot to the app. Other states than stableApp end a trial
+     * and leave requests unhandled */
+    if (!trial) {
+        mailbox.trialApp = MAILBOX_NO_TRIAL;
+    }
+    if (mailbox.request != MailboxRequest::noRequest) {
+        mailbox.request = MailboxRequest::noRequest;
+        mailbox.response = MailboxResponse::requestIgnored;
+    }
+    mailbox.bootedApp = trial ? mailbox.trialApp : statusReg.liveAppSelect;
+    mailbox.bootState = trial ? (uint32_t)BootloaderState::attemptNewApp : statusReg.status;
+    mailbox.retryCount = trial ? mailbox.trialRetries : statusReg.retryCount;
+    mailbox.bootCycles = system.cycleCount();
+    mailbox.crc = mailboxCrc(mailbox);
+    system.writeMailbox(mailbox);
+    #ifndef TRACEBOOT
+    /* Only the trace leaves the cycle counter running for the app */
+    system.stopCycleCounter();
+    #endif
+    #endif
+
     /* Boot the app */
     #ifdef COPYBINARY
     system.executeFromAddress(BOOT_ADDRESS);
+    #elif defined(MAILBOX)
+    system.executeFromAddress(BOOTLOADER_APP_ADDRESS[mailbox.bootedApp]);
     #else
     system.executeFromAddress(BOOTLOADER_APP_ADDRESS[statusReg.liveAppSelect]);
     #endif
 }
+
+bool Bootloader::verifyApp(System& system, uint32_t app, ImageHeader& header)
+{
+    header = slotHeader(system, app);
+    if (slotIndex.states[app] != slotHeaderRead) {
+        return slotIndex.states[app] == slotValid;
+    }
+
+    bool valid = verifyImage(system, app, BOOTLOADER_APP_ADDRESS[app], header);
+    slotIndex.states[app] = valid ? slotValid : slotInvalid;
+    return valid;
+}
+
+bool Bootloader::verifyImage(System& system, uint32_t app, uint32_t address, const ImageHeader& header)
+{
+    TRACE_PHASE(system, verifyStarted, app);
+    #ifndef SIGNATURE
+    (void)app;
+    #endif
+
+    #ifdef COPYBINARY
+    uint32_t loadAddress = BOOT_ADDRESS;
+    #else
+    uint32_t loadAddress = address;
+    #endif
+
+    /* A compressed or delta binary may be larger than the slot */
+    uint32_t maxLength = APP_HEADER_OFFSET;
+    #ifdef BLOCK_IMAGES
+    bool blocks = isBlockImage(header);
+    if (blocks) {
+        maxLength = BOOT_SIZE;
+    }
+    #endif
+
+    /* A relocatable binary runs from any address */
+    bool linked = header.loadAddress == loadAddress;
+    #ifdef RELOCATION
+    bool relocatable = header.magic == IMAGE_HEADER_MAGIC_RELOC;
+    linked |= relocatable;
+    #endif
+
+    bool valid = isImage(header) && linked && header.length >= 2 * sizeof(uint32_t) && header.length <= maxLength
+        && header.length % sizeof(uint32_t) == 0;
+
+    #if defined(VERIFY_BINARY) || defined(BLOCK_IMAGES) || defined(RELOCATION)
+    /* The binary of an app recorded as verified is not read again, only its
+     * header and vector table are checked */
+    #ifdef SIGNATURE
+    bool checkBinary = !isVerified(app, header);
+    #else
+    bool checkBinary = true;
+    #endif
+    #endif
+
+    /* Initial stack pointer must be in RAM, reset vector inside the binary */
+    if (valid) {
+        uint32_t vectors[2];
+        #ifdef BLOCK_IMAGES
+        if (blocks) {
+            valid = verifyBlockApp(system, app, header, vectors, checkBinary);
+        } else
+        #endif
+        #ifdef RELOCATION
+        if (relocatable) {
+            valid = verifyRelocations(system, address, header, vectors, checkBinary);
+        } else
+        #endif
+        system.readFlash(address, (uint8_t*)vectors, sizeof(vectors));
+        uint32_t resetVector = vectors[1] & ~1U;
+        valid = valid && vectors[0] > RAM_START && vectors[0] <= RAM_END && resetVector >= loadAddress
+            && resetVector < loadAddress + header.length;
+    }
+
+    /* The CRC and hash of a compressed or delta binary are checked while
+     * decoding it, those of a relocatable binary with its relocation table */
+    #ifdef VERIFYCRC
+    if (valid && checkBinary && header.magic == IMAGE_HEADER_MAGIC) {
+        valid = system.crcFlash(address, header.length) == header.crc;
+    }
+    #endif
+    #ifdef VERIFYHASH
+    if (valid && checkBinary && header.magic == IMAGE_HEADER_MAGIC) {
+        Sha256 context;
+        sha256Init(context);
+        system.hash(context, system.flashPointer(address), header.length);
+        valid = hashMatches(context, header);
+    }
+    #endif
+
+    /* The hash matches the binary, the signature binds it to the key */
+    #ifdef SIGNATURE
+    if (valid && checkBinary) {
+        valid = system.verifySignature(header.sha256, header.signature);
+    }
+    #endif
+
+    TRACE_PHASE(system, verifyFinished, valid);
+    return valid;
+}
+
+bool Bootloader::selectApp(System& system, BootloaderStatus& statusReg, uint32_t preferredApp, uint32_t excludedApps,
+    ImageHeader& header)
+{
+    if (preferredApp < BOOTLOADER_MAX_APPS && verifyApp(system, preferredApp, header)) {
+        statusReg.liveAppSelect = preferredApp;
+        return true;
+    }
+    if (selectNewestApp(system, statusReg, excludedApps, header)) {
+        return true;
+    }
+
+    /* All valid apps are excluded: stay with the live app, or take the newest
+     * excluded one if the live app is invalid as well */
+    if (statusReg.liveAppSelect < BOOTLOADER_MAX_APPS && verifyApp(system, statusReg.liveAppSelect, header)) {
+        return true;
+    }
+    return selectNewestApp(system, statusReg, 0, header);
+}
+
+bool Bootloader::selectNewestApp(System& system, BootloaderStatus& statusReg, uint32_t excludedApps,
+    ImageHeader& header)
+{
+    /* Try the apps from the highest version down, equal versions in slot
+     * order. Each failed check marks the app invalid in the slot index */
+    while (true) {
+        uint32_t newestApp = NO_APP;
+        for (uint32_t app = 0; app < BOOTLOADER_MAX_APPS; app++) {
+            const ImageHeader& candidate = slotHeader(system, app);
+            if ((excludedApps & (1U << app)) != 0 || slotIndex.states[app] == slotInvalid || !isImage(candidate)) {
+                continue;
+            }
+            if (newestApp == NO_APP || candidate.version > slotIndex.headers[newestApp].version) {
+                newestApp = app;
+            }
+        }
+        if (newestApp == NO_APP) {
+            return false;
+        }
+        if (verifyApp(system, newestApp, header)) {
+            statusReg.liveAppSelect = newestApp;
+            return true;
+        }
+    }
+}
+
+const ImageHeader& Bootloader::slotHeader(System& system, uint32_t app)
+{
+    if (slotIndex.states[app] == slotUnknown) {
+        ImageHeader& header = slotIndex.headers[app];
+        system.readFlash(BOOTLOADER_APP_ADDRESS[app] + APP_HEADER_OFFSET, (uint8_t*)&header, sizeof(header));
+        #ifdef LEGACY_IMAGES
+        /* A legacy app takes the whole slot and is older than any app with a
+         * header. The slot number tells the installed legacy apps apart */
+        if (isErased(header)) {
+            #ifdef COPYBINARY
+            header = { IMAGE_HEADER_MAGIC_LEGACY, APP_HEADER_OFFSET, BOOT_ADDRESS, app, 0 };
+            #else
+            header = { IMAGE_HEADER_MAGIC_LEGACY, APP_HEADER_OFFSET, BOOTLOADER_APP_ADDRESS[app], app, 0 };
+            #endif
+        }
+        #endif
+        slotIndex.states[app] = slotHeaderRead;
+    }
+    return slotIndex.headers[app];
+}
+
+#ifdef SIGNATURE
+bool Bootloader::isVerified(uint32_t app, const ImageHeader& header)
+{
+    const uint32_t* hash = (const uint32_t*)header.sha256;
+    return app != NO_APP && app == verifiedApp && hash[0] == verifiedHash[0] && hash[1] == verifiedHash[1];
+}
+
+void Bootloader::recordVerified(BootloaderStatus& statusReg)
+{
+    uint32_t app = statusReg.liveAppSelect;
+    if (slotIndex.states[app] == slotValid) {
+        const uint32_t* hash = (const uint32_t*)slotIndex.headers[app].sha256;
+        statusReg.verifiedApp = app;
+        statusReg.verifiedHash[0] = hash[0];
+        statusReg.verifiedHash[1] = hash[1];
+    } else if (statusReg.verifiedApp != app || slotIndex.states[app] == slotInvalid) {
+        statusReg.verifiedApp = NO_APP;
+    }
+}
+#endif
+
+#ifdef BACKUPRETRY
+uint16_t Bootloader::statusTag(const BootloaderStatus& statusReg)
+{
+    return crc32((const uint32_t*)&statusReg, sizeof(statusReg) / sizeof(uint32_t)) & 0xFFFF;
+}
+
+void Bootloader::saveBackupState(System& system, BootloaderStatus& statusReg)
+{
+    BootloaderStatus flashStatus;
+    system.readStatusReg(flashStatus);
+
+    /* Write the counters to flash before they overflow the registers */
+    if (statusReg.statistics.boots - flashStatus.statistics.boots >= BACKUP_PENDING_LIMIT
+        || statusReg.statistics.trialBoots - flashStatus.statistics.trialBoots >= BACKUP_PENDING_LIMIT) {
+        system.writeStatusReg(statusReg);
+        system.readStatusReg(flashStatus);
+    }
+
+    BackupState backup;
+    backup.magic = BACKUP_STATE_MAGIC;
+    backup.statusTag = statusTag(flashStatus);
+    backup.retryCount = statusReg.retryCount;
+    backup.pendingBoots = statusReg.statistics.boots - flashStatus.statistics.boots;
+    backup.pendingTrialBoots = statusReg.statistics.trialBoots - flashStatus.statistics.trialBoots;
+    system.writeBackupRegisters((const uint16_t*)&backup, BACKUP_STATE_REGISTERS);
+}
+#endif
+
+#ifdef MAILBOX
+bool Bootloader::handleMailbox(System& system, BootloaderStatus& statusReg, Mailbox& mailbox, ImageHeader& header)
+{
+    uint32_t request = mailbox.request;
+    mailbox.request = MailboxRequest::noRequest;
+    if (mailbox.trialApp >= BOOTLOADER_MAX_APPS) {
+        mailbox.trialApp = MAILBOX_NO_TRIAL;
+    }
+
+    /* A new trial replaces the one running. It is not written to flash, a
+     * power loss boots the stable app again */
+    if (request == MailboxRequest::trialBoot) {
+        mailbox.trialApp = MAILBOX_NO_TRIAL;
+        mailbox.trialRetries = 0;
+        if (mailbox.requestApp >= BOOTLOADER_MAX_APPS || !verifyApp(system, mailbox.requestApp, header)) {
+            mailbox.response = MailboxResponse::trialRejected;
+            return false;
+        }
+        mailbox.trialApp = mailbox.requestApp;
+        mailbox.response = MailboxResponse::trialStarted;
+        statusReg.statistics.trialBoots++;
+        return false;
+    }
+
+    if (mailbox.trialApp == MAILBOX_NO_TRIAL) {
+        if (request != MailboxRequest::noRequest) {
+            mailbox.response = MailboxResponse::requestIgnored;
+        }
+        return false;
+    }
+
+    /* The confirmation must survive a power loss. An app on trial that became
+     * invalid is given up on instead */
+    bool valid = verifyApp(system, mailbox.trialApp, header);
+    if (request == MailboxRequest::confirmStable && valid) {
+        statusReg.liveAppSelect = mailbox.trialApp;
+        statusReg.retryCount = 0;
+        statusReg.givenUpApps = 0;
+        mailbox.trialApp = MAILBOX_NO_TRIAL;
+        mailbox.response = MailboxResponse::stableConfirmed;
+        return true;
+    }
+    if (request != MailboxRequest::noRequest && request != MailboxRequest::confirmStable) {
+        mailbox.response = MailboxResponse::requestIgnored;
+    }
+
+    /* The app on trial was reset before it was confirmed. Giving up on it is
+     * written, to keep the rollback in the statistics */
+    mailbox.trialRetries++;
+    if (mailbox.trialRetries >= BOOTLOADER_MAX_RETRIES || !valid) {
+        statusReg.statistics.rollbacks[mailbox.trialApp]++;
+        mailbox.trialApp = MAILBOX_NO_TRIAL;
+        mailbox.response = MailboxResponse::trialFailed;
+        return true;
+    }
+    statusReg.statistics.trialBoots++;
+    return false;
+}
+#endif
+
+#ifdef RELOCATION
+bool Bootloader::verifyRelocations(System& system, uint32_t address, const ImageHeader& header, uint32_t* vectors,
+    bool checkBinary)
+{
+    /* The table must fit between the binary and the image header */
+    uint32_t count;
+    if (header.length + sizeof(count) > (uint32_t)APP_HEADER_OFFSET) {
+        return false;
+    }
+    system.readFlash(address + header.length, (uint8_t*)&count, sizeof(count));
+    if (count > (APP_HEADER_OFFSET - header.length - sizeof(count)) / sizeof(uint32_t)) {
+        return false;
+    }
+    system.readFlash(address, (uint8_t*)vectors, 2 * sizeof(uint32_t));
+
+    #ifdef VERIFY_BINARY
+    /* The crc and hash cover the relocated words erased, as they are stored */
+    const uint32_t erased = 0xFFFFFFFF;
+    uint32_t checked = 0;
+    #endif
+    #ifdef VERIFYCRC
+    uint32_t crc = CRC32_INITIAL;
+    #endif
+    #ifdef VERIFYHASH
+    Sha256 context;
+    sha256Init(context);
+    #endif
+    uint32_t words = header.length / sizeof(uint32_t);
+    uint32_t position = RELOCATION_START;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t entry;
+        uint32_t offset;
+        system.readFlash(address + header.length + (i + 1) * sizeof(entry), (uint8_t*)&entry, sizeof(entry));
+        bool relocated = relocationEntry(entry, position, offset);
+        if ((entry >> RELOCATION_OFFSET_BITS) == 0 || position >= words) {
+            return false;
+        }
+        if (!relocated) {
+            continue;
+        }
+        if (offset > header.length) {
+            return false;
+        }
+
+        /* The vector table may not be relocated yet */
+        uint32_t value = address + offset;
+        if (position < 2) {
+            vectors[position] = value;
+        }
+
+        #ifdef VERIFY_BINARY
+        if (!checkBinary) {
+            continue;
+        }
+
+        /* A relocated word is erased, relocated for this slot, or on its way
+         * there if a reset interrupted programming it */
+        uint32_t word;
+        system.readFlash(address + position * sizeof(word), (uint8_t*)&word, sizeof(word));
+        if ((word & value) != value) {
+            return false;
+        }
+        const uint8_t* stored = system.flashPointer(address + checked * sizeof(word));
+        #ifdef VERIFYCRC
+        crc = crc32((const uint32_t*)stored, position - checked, crc);
+        crc = crc32(&erased, 1, crc);
+        #endif
+        #ifdef VERIFYHASH
+        system.hash(context, stored, (position - checked) * sizeof(word));
+        system.hash(context, (const uint8_t*)&erased, sizeof(erased));
+        #endif
+        checked = position + 1;
+        #endif
+    }
+
+    #ifdef VERIFY_BINARY
+    if (!checkBinary) {
+        return true;
+    }
+    #endif
+    bool valid = true;
+    #ifdef VERIFY_BINARY
+    const uint8_t* stored = system.flashPointer(address + checked * sizeof(uint32_t));
+    #endif
+    #ifdef VERIFYCRC
+    valid = valid && crc32((const uint32_t*)stored, words - checked, crc) == header.crc;
+    #endif
+    #ifdef VERIFYHASH
+    system.hash(context, stored, (words - checked) * sizeof(uint32_t));
+    valid = valid && hashMatches(context, header);
+    #endif
+    return valid;
+}
+
+void Bootloader::relocateApp(System& system, uint32_t app, const ImageHeader& header)
+{
+    if (header.magic != IMAGE_HEADER_MAGIC_RELOC) {
+        return;
+    }
+    TRACE_PHASE(system, installStarted, 0);
+
+    /* Words relocated before are only read */
+    uint32_t address = BOOTLOADER_APP_ADDRESS[app];
+    uint32_t count;
+    system.readFlash(address + header.length, (uint8_t*)&count, sizeof(count));
+    uint32_t position = RELOCATION_START;
+    uint32_t written = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t entry;
+        uint32_t offset;
+        system.readFlash(address + header.length + (i + 1) * sizeof(entry), (uint8_t*)&entry, sizeof(entry));
+        if (relocationEntry(entry, position, offset)
+            && system.writeFlashWord(address + position * sizeof(uint32_t), address + offset)) {
+            written++;
+        }
+    }
+    TRACE_PHASE(system, installFinished, written);
+}
+#endif
+
+#ifdef COPYBINARY
+bool Bootloader::isInstalled(System& system, const BootloaderStatus& statusReg, uint32_t app)
+{
+    const ImageHeader& header = slotHeader(system, app);
+    return header.length == statusReg.installedLength && header.crc == statusReg.installedCrc
+        && statusReg.installProgress * INSTALL_CHECKPOINT_SIZE >= statusReg.installedLength;
+}
+
+bool Bootloader::installApp(System& system, BootloaderStatus& statusReg, uint32_t app, const ImageHeader& header)
+{
+    uint32_t checkpoints = (header.length + INSTALL_CHECKPOINT_SIZE - 1) / INSTALL_CHECKPOINT_SIZE;
+    bool installed = statusReg.installProgress >= checkpoints;
+
+    /* Resume the install of this app, or start over if the boot address was
+     * last written with another one */
+    if (statusReg.installedLength != header.length || statusReg.installedCrc != header.crc) {
+        installed = false;
+        statusReg.installedLength = header.length;
+        statusReg.installedCrc = header.crc;
+        statusReg.installProgress = 0;
+        system.writeStatusReg(statusReg);
+    }
+
+    #ifdef BLOCK_IMAGES
+    /* A compressed or delta app is decoded one block, one checkpoint, at a
+     * time. The blocks of the checkpoints done are only skipped */
+    bool blocks = isBlockImage(header);
+    uint32_t blockOffset = 0;
+    uint32_t baseApp = NO_APP;
+    if (blocks && !blockStart(system, app, header, blockOffset, baseApp)) {
+        return false;
+    }
+    for (uint32_t block = 0; blocks && block < statusReg.installProgress && block < checkpoints; block++) {
+        readBlock(system, app, baseApp, blockOffset, 0, false);
+    }
+    #endif
+
+    /* Copy one checkpoint at a time. After a reset, the pages of the first
+     * incomplete checkpoint are compared again by copyFlashBlock(), and only
+     * the ones that did not make it are rewritten */
+    uint32_t sourceAddress = BOOTLOADER_APP_ADDRESS[app];
+    TRACE_PHASE(system, installStarted, statusReg.installProgress);
+    while (statusReg.installProgress < checkpoints) {
+        uint32_t offset = statusReg.installProgress * INSTALL_CHECKPOINT_SIZE;
+        uint32_t size = header.length - offset;
+        if (size > INSTALL_CHECKPOINT_SIZE) {
+            size = INSTALL_CHECKPOINT_SIZE;
+        }
+
+        CopyResult result;
+        #ifdef BLOCK_IMAGES
+        if (blocks) {
+            /* The app was verified, a block that does not decode any more
+             * stops the install */
+            if (!readBlock(system, app, baseApp, blockOffset, size, true)) {
+                break;
+            }
+            result = system.writeFlashBlock(BOOT_ADDRESS + offset, (const uint8_t*)system.blockBuffer(), size);
+        } else
+        #endif
+        result = system.copyFlashBlock(sourceAddress + offset, BOOT_ADDRESS + offset, size);
+        statusReg.statistics.pagesCopied += result.pagesWritten;
+        system.addStatusProgress();
+        statusReg.installProgress++;
+    }
+    TRACE_PHASE(system, installFinished, checkpoints);
+    return !installed;
+}
+#endif
+
+#ifdef SWAPBINARY
+bool Bootloader::verifyBootRegion(System& system, uint32_t app, ImageHeader& header)
+{
+    system.readFlash(BOOT_ADDRESS + APP_HEADER_OFFSET, (uint8_t*)&header, sizeof(header));
+    return verifyImage(system, app, BOOT_ADDRESS, header);
+}
+
+void Bootloader::startSwap(System& system, BootloaderStatus& statusReg, uint32_t app, const ImageHeader& header)
+{
+    /* The app in the boot region goes to the slot, so the swap covers both */
+    ImageHeader bootHeader;
+    system.readFlash(BOOT_ADDRESS + APP_HEADER_OFFSET, (uint8_t*)&bootHeader, sizeof(bootHeader));
+    uint32_t length = header.length;
+    if (isImage(bootHeader) && bootHeader.length > length) {
+        length = bootHeader.length;
+    }
+    length = (length + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1);
+
+    statusReg.swapSlot = app;
+    statusReg.swapLength = length < SWAP_HEADER_PAGE ? length : SWAP_HEADER_PAGE;
+    statusReg.installedLength = header.length;
+    statusReg.installedCrc = header.crc;
+    statusReg.installProgress = 0;
+    #ifdef SIGNATURE
+    /* The app was verified, it keeps the marker in the boot region */
+    const uint32_t* hash = (const uint32_t*)header.sha256;
+    statusReg.verifiedApp = app;
+    statusReg.verifiedHash[0] = hash[0];
+    statusReg.verifiedHash[1] = hash[1];
+    #endif
+    system.writeStatusReg(statusReg);
+    swapApp(system, statusReg);
+
+    /* The slot holds the other app now */
+    slotIndex.states[app] = slotUnknown;
+}
+
+void Bootloader::swapApp(System& system, BootloaderStatus& statusReg)
+{
+    uint32_t slotAddress = BOOTLOADER_APP_ADDRESS[statusReg.swapSlot];
+    uint32_t steps = SWAP_STEPS(statusReg.swapLength);
+    TRACE_PHASE(system, installStarted, statusReg.installProgress);
+    while (statusReg.installProgress < steps) {
+        uint32_t batch = statusReg.installProgress / 3;
+        uint32_t size;
+        uint32_t offset = swapBatch(statusReg.swapLength, batch, size);
+
+        /* Each step leaves its source intact, so it is simply taken again
+         * after a reset. copyFlashBlock() skips the pages that made it */
+        CopyResult result;
+        switch (statusReg.installProgress % 3) {
+            case 0:
+                if (system.compareFlash(BOOT_ADDRESS + offset, slotAddress + offset, size)) {
+                    /* Equal batches are skipped together in a status record.
+                     * Marks for their steps one at a time could be cut short
+                     * by a reset, and the scratch area copied over the slot */
+                    do {
+                        batch++;
+                        offset = swapBatch(statusReg.swapLength, batch, size);
+                    } while (3 * batch < steps
+                        && system.compareFlash(BOOT_ADDRESS + offset, slotAddress + offset, size));
+                    statusReg.installProgress = 3 * batch;
+                    system.writeStatusReg(statusReg);
+                    continue;
+                }
+                result = system.copyFlashBlock(BOOT_ADDRESS + offset, SWAP_SCRATCH_ADDRESS, size);
+                break;
+            case 1:
+                result = system.copyFlashBlock(slotAddress + offset, BOOT_ADDRESS + offset, size);
+                break;
+            default:
+                /* A blank batch of the boot region, as on the first boot, is
+                 * not worth erasing the slot for. It keeps its old data */
+                if (offset != SWAP_HEADER_PAGE && system.isBlank(SWAP_SCRATCH_ADDRESS, size)) {
+                    result = { 0, 0 };
+                    break;
+                }
+                result = system.copyFlashBlock(SWAP_SCRATCH_ADDRESS, slotAddress + offset, size);
+                break;
+        }
+        statusReg.statistics.pagesCopied += result.pagesWritten;
+        system.addStatusProgress();
+        statusReg.installProgress++;
+    }
+    TRACE_PHASE(system, installFinished, steps);
+}
+#endif
+
+#ifdef BLOCK_IMAGES
+bool Bootloader::verifyBlockApp(System& system, uint32_t app, const ImageHeader& header, uint32_t* vectors,
+    bool checkBinary)
+{
+    #ifndef VERIFY_BINARY
+    (void)checkBinary;
+    #endif
+    uint32_t offset;
+    uint32_t baseApp;
+    if (!blockStart(system, app, header, offset, baseApp)) {
+        return false;
+    }
+
+    #ifdef VERIFYCRC
+    uint32_t crc = CRC32_INITIAL;
+    #endif
+    #ifdef VERIFYHASH
+    Sha256 context;
+    sha256Init(context);
+    #endif
+    for (uint32_t position = 0; position < header.length; position += IMAGE_BLOCK_SIZE) {
+        uint32_t size = header.length - position;
+        if (size > IMAGE_BLOCK_SIZE) {
+            size = IMAGE_BLOCK_SIZE;
+        }
+
+        #ifdef VERIFY_BINARY
+        bool decode = checkBinary || position == 0;
+        #else
+        bool decode = position == 0;
+        #endif
+        if (!readBlock(system, app, baseApp, offset, size, decode)) {
+            return false;
+        }
+        if (position == 0) {
+            vectors[0] = system.blockBuffer()[0];
+            vectors[1] = system.blockBuffer()[1];
+        }
+        #ifdef VERIFY_BINARY
+        if (!checkBinary) {
+            continue;
+        }
+        #endif
+        #ifdef VERIFYCRC
+        crc = crc32(system.blockBuffer(), size / sizeof(uint32_t), crc);
+        #endif
+        #ifdef VERIFYHASH
+        system.hash(context, (const uint8_t*)system.blockBuffer(), size);
+        #endif
+    }
+
+    #ifdef VERIFY_BINARY
+    if (!checkBinary) {
+        return true;
+    }
+    #endif
+    bool valid = true;
+    #ifdef VERIFYCRC
+    valid = valid && crc == header.crc;
+    #endif
+    #ifdef VERIFYHASH
+    valid = valid && hashMatches(context, header);
+    #endif
+    return valid;
+}
+
+bool Bootloader::blockStart(System& system, uint32_t app, const ImageHeader& header, uint32_t& offset,
+    uint32_t& baseApp)
+{
+    offset = 0;
+    baseApp = NO_APP;
+    #ifdef DELTA
+    if (header.magic == IMAGE_HEADER_MAGIC_DELTA) {
+        offset = sizeof(DeltaHeader);
+        baseApp = deltaBase(system, app);
+        return baseApp != NO_APP;
+    }
+    #endif
+    return true;
+}
+
+bool Bootloader::readBlock(System& system, uint32_t app, uint32_t baseApp, uint32_t& offset, uint32_t size,
+    bool decode)
+{
+    uint32_t address = BOOTLOADER_APP_ADDRESS[app];
+    uint32_t storedSize;
+    if (offset + sizeof(storedSize) > (uint32_t)APP_HEADER_OFFSET) {
+        return false;
+    }
+    system.readFlash(address + offset, (uint8_t*)&storedSize, sizeof(storedSize));
+    uint32_t dataAddress = address + offset + sizeof(storedSize);
+    bool raw = storedSize & IMAGE_BLOCK_RAW;
+    storedSize &= ~IMAGE_BLOCK_RAW;
+    if (storedSize > APP_HEADER_OFFSET - offset - sizeof(storedSize)) {
+        return false;
+    }
+    offset += sizeof(storedSize) + ((storedSize + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1));
+
+    if (!decode) {
+        return true;
+    }
+    uint8_t* data = (uint8_t*)system.blockBuffer();
+    if (raw) {
+        if (storedSize != size) {
+            return false;
+        }
+        system.readFlash(dataAddress, data, size);
+        return true;
+    }
+    #ifdef DELTA
+    if (baseApp != NO_APP) {
+        return applyDelta(system, baseApp, dataAddress, storedSize, data, size);
+    }
+    #endif
+    #ifdef COMPRESSION
+    return system.decompressFlash(dataAddress, storedSize, data, size) == (int32_t)size;
+    #else
+    return false;
+    #endif
+}
+#endif
+
+#ifdef DELTA
+uint32_t Bootloader::deltaBase(System& system, uint32_t app)
+{
+    DeltaHeader delta;
+    system.readFlash(BOOTLOADER_APP_ADDRESS[app], (uint8_t*)&delta, sizeof(delta));
+
+    /* The base must be a plain app, and valid itself */
+    for (uint32_t base = 0; base < BOOTLOADER_MAX_APPS; base++) {
+        const ImageHeader& candidate = slotHeader(system, base);
+        ImageHeader baseHeader;
+        if (base != app && candidate.magic == IMAGE_HEADER_MAGIC && candidate.length == delta.baseLength
+            && candidate.crc == delta.baseCrc && verifyApp(system, base, baseHeader)) {
+            return base;
+        }
+    }
+    return NO_APP;
+}
+
+bool Bootloader::applyDelta(System& system, uint32_t baseApp, uint32_t address, uint32_t storedSize, uint8_t* data,
+    uint32_t size)
+{
+    uint32_t baseLength = slotIndex.headers[baseApp].length;
+    uint32_t end = address + storedSize;
+    uint32_t position = 0;
+    while (address < end) {
+        uint32_t op;
+        if (end - address < sizeof(op)) {
+            return false;
+        }
+        system.readFlash(address, (uint8_t*)&op, sizeof(op));
+        address += sizeof(op);
+        uint32_t length = op & DELTA_LENGTH_MASK;
+        if (length > size - position) {
+            return false;
+        }
+
+        if (op & DELTA_OP_COPY) {
+            uint32_t source;
+            if (end - address < sizeof(source)) {
+                return false;
+            }
+            system.readFlash(address, (uint8_t*)&source, sizeof(source));
+            address += sizeof(source);
+            if (source > baseLength || length > baseLength - source) {
+                return false;
+            }
+            system.readFlash(BOOTLOADER_APP_ADDRESS[baseApp] + source, data + position, length);
+        } else {
+            if (length > end - address) {
+                return false;
+            }
+            system.readFlash(address, data + position, length);
+            address += (length + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+        }
+        position += length;
+    }
+    return position == size;
+}
+#endif
@@ -37,4 +37,288 @@ class Bootloader
      * to boot.
      */
     void boot(System& _system, bool enableWatchdog);
+
+  private:
+    /**
+     * @brief check the image header and the vector table of an app slot.
+     * With VERIFYCRC and VERIFYHASH, the CRC and SHA-256 of the binary are
+     * checked as well, with SIGNATURE also the signature of the SHA-256,
+     * unless the app is recorded as verified (see isVerified()).
+     *
+     * @param app number of the app to check
+     * @param header image header of the app
+     * @return true if the app can be booted
+     */
+    bool verifyApp(System& system, uint32_t app, ImageHeader& header);
+
+    /**
+     * @brief check an image header and the binary it belongs to, see verifyApp()
+     *
+     * @param app number of the app to check, for the boot region the slot it
+     * was swapped in from or NO_APP
+     * @param address absolute memory address of the binary
+     * @param header image header of the binary
+     * @return true if the binary can be booted
+     */
+    bool verifyImage(System& system, uint32_t app, uint32_t address, const ImageHeader& header);
+
+    /**
+     * @brief select the app to boot. The preferred app is kept while it is
+     * valid, otherwise the valid app with the highest version that is not
+     * excluded is selected. If all valid apps are excluded, the live app is
+     * kept, or the newest excluded app is selected if it is invalid too
+     *
+     * @param statusReg current status, liveAppSelect is set to the selected app
+     * and left unchanged if no app is valid
+     * @param preferredApp app to keep if valid, or NO_APP
+     * @param excludedApps apps to select last, a bit per slot
+     * @param header image header of the selected app
+     * @return true if a valid app was found
+     */
+    bool selectApp(System& system, BootloaderStatus& statusReg, uint32_t preferredApp, uint32_t excludedApps,
+        ImageHeader& header);
+
+    /**
+     * @brief select the valid app with the highest version that is not
+     * excluded
+     *
+     * @param statusReg current status, liveAppSelect is set to the selected app
+     * @param excludedApps apps to skip, a bit per slot
+     * @param header image header of the selected app
+     * @return true if a valid app was found
+     */
+    bool selectNewestApp(System& system, BootloaderStatus& statusReg, uint32_t excludedApps, ImageHeader& header);
+
+    /**
+     * @brief get the image header of an app slot from the slot index, it is
+     * read from flash the first time during a boot. With LEGACY_IMAGES, an
+     * erased header is replaced by the one of a legacy app
+     *
+     * @param app number of the app
+     * @return image header of the app
+     */
+    const ImageHeader& slotHeader(System& system, uint32_t app);
+
+#ifdef SIGNATURE
+    /**
+     * @brief check if the binary of an app was verified on an earlier boot,
+     * when the app was installed or selected. The marker of the status only
+     * holds for the live app with the same image hash.
+     *
+     * @param app number of the app, NO_APP is never verified
+     * @param header image header of the app
+     * @return true if the hash and signature need not be checked again
+     */
+    bool isVerified(uint32_t app, const ImageHeader& header);
+
+    /**
+     * @brief record the live app as verified in the status if it was checked
+     * during this boot. The marker is dropped if it belongs to another app.
+     *
+     * @param statusReg current status, verifiedApp and verifiedHash are set
+     */
+    void recordVerified(BootloaderStatus& statusReg);
+#endif
+
+#ifdef BACKUPRETRY
+    /**
+     * @brief tag a status as read from flash, to check that the backup
+     * state belongs to it. Any write of the status changes the tag.
+     *
+     * @return the low half of the crc32() of the status
+     */
+    uint16_t statusTag(const BootloaderStatus& statusReg);
+
+    /**
+     * @brief keep what was counted but not written to flash during this boot
+     * in the backup registers, for the next boot
+     *
+     * @param statusReg status of this boot
+     */
+    void saveBackupState(System& system, BootloaderStatus& statusReg);
+#endif
+
+#ifdef MAILBOX
+    /**
+     * @brief handle the request of the app while the status is stableApp,
+     * and count the boots of the app on trial
+     *
+     * @param statusReg current status, changed on a confirmation or rollback
+     * @param mailbox mailbox of this boot, trialApp is the app to start
+     * unless it is MAILBOX_NO_TRIAL
+     * @param header image header of the app on trial, if it was verified
+     * @return true if the status changed and must be written
+     */
+    bool handleMailbox(System& system, BootloaderStatus& statusReg, Mailbox& mailbox, ImageHeader& header);
+#endif
+
+#ifdef COPYBINARY
+    /**
+     * @brief check that the status shows an app completely installed at
+     * BOOT_ADDRESS, by comparing the image header of the app
+     *
+     * @param app number of the app to check
+     * @return true if the app is installed
+     */
+    bool isInstalled(System& system, const BootloaderStatus& statusReg, uint32_t app);
+
+    /**
+     * @brief copy an app to BOOT_ADDRESS, unless the status shows it is
+     * installed there already. The progress is checkpointed in the status,
+     * an install interrupted by a reset resumes at the last checkpoint.
+     *
+     * @param statusReg current status, updated and written when copying
+     * @param app number of the app to install
+     * @param header image header of the app
+     * @return true if the app was not installed completely before
+     */
+    bool installApp(System& system, BootloaderStatus& statusReg, uint32_t app, const ImageHeader& header);
+#endif
+
+#ifdef SWAPBINARY
+    /**
+     * @brief check the app in the boot region, like verifyApp()
+     *
+     * @param app slot the app was swapped in from, NO_APP if unknown
+     * @param header image header of the app in the boot region
+     * @return true if the app can be booted
+     */
+    bool verifyBootRegion(System& system, uint32_t app, ImageHeader& header);
+
+    /**
+     * @brief start to exchange an app slot with the boot region, and swap
+     * them. The swap covers the longer of both apps.
+     *
+     * @param statusReg current status, the swap is recorded and written
+     * before the first step
+     * @param app number of the app slot to swap in
+     * @param header image header of the app to swap in
+     */
+    void startSwap(System& system, BootloaderStatus& statusReg, uint32_t app, const ImageHeader& header);
+
+    /**
+     * @brief take the remaining steps of the swap in the status. Each step
+     * is checkpointed in the status, a swap interrupted by a reset resumes
+     * at the step it was taking. Batches that are equal in both regions are
+     * skipped, without writing the scratch area.
+     *
+     * @param statusReg current status, updated when swapping
+     */
+    void swapApp(System& system, BootloaderStatus& statusReg);
+#endif
+
+#ifdef RELOCATION
+    /**
+     * @brief check the relocation table of a relocatable app, and get its
+     * vector table as relocated for the slot. With VERIFYCRC or VERIFYHASH,
+     * the CRC or hash of the binary and the relocated words are checked as well.
+     *
+     * @param address absolute memory address of the slot
+     * @param header image header of the app
+     * @param vectors initial stack pointer and reset vector of the app
+     * @param checkBinary false to only check the table, for an app recorded
+     * as verified
+     * @return true if the table fits into the slot and only relocates words of
+     * the binary to addresses in the binary
+     */
+    bool verifyRelocations(System& system, uint32_t address, const ImageHeader& header, uint32_t* vectors,
+        bool checkBinary);
+
+    /**
+     * @brief program the relocated words of a relocatable app for its slot,
+     * unless they hold the relocated addresses already. A relocation
+     * interrupted by a reset is completed by the next boot that installs the
+     * app. Does nothing for other apps.
+     *
+     * @param app number of the app, which was verified during this boot
+     * @param header image header of the app
+     */
+    void relocateApp(System& system, uint32_t app, const ImageHeader& header);
+#endif
+
+#ifdef BLOCK_IMAGES
+    /**
+     * @brief check the blocks of a compressed or delta app, and get its
+     * vector table. With VERIFYCRC or VERIFYHASH, all blocks are decoded to
+     * check the CRC or hash of the binary, otherwise only the first one.
+     *
+     * @param app number of the app
+     * @param header image header of the app
+     * @param vectors initial stack pointer and reset vector of the app
+     * @param checkBinary false to only decode the first block, for an app
+     * recorded as verified
+     * @return true if all blocks fit into the slot and the checked ones
+     * decode to the binary
+     */
+    bool verifyBlockApp(System& system, uint32_t app, const ImageHeader& header, uint32_t* vectors,
+        bool checkBinary);
+
+    /**
+     * @brief find the first block of a compressed or delta app, and the base
+     * of a delta app
+     *
+     * @param app number of the app
+     * @param header image header of the app
+     * @param offset offset of the first block in the slot
+     * @param baseApp base of a delta app, NO_APP for a compressed app
+     * @return false if a delta app has no valid base
+     */
+    bool blockStart(System& system, uint32_t app, const ImageHeader& header, uint32_t& offset, uint32_t& baseApp);
+
+    /**
+     * @brief read a block of a compressed or delta app into the block buffer
+     *
+     * @param app number of the app
+     * @param baseApp base of a delta app, NO_APP for a compressed app
+     * @param offset offset of the block in the slot, moved on to the next block
+     * @param size number of bytes of the binary in the block
+     * @param decode false to only check that the block fits into the slot
+     * @return true if the block fits into the slot and holds size bytes
+     */
+    bool readBlock(System& system, uint32_t app, uint32_t baseApp, uint32_t& offset, uint32_t size, bool decode);
+#endif
+
+#ifdef DELTA
+    /**
+     * @brief find the base of a delta app, the valid plain app in another
+     * slot that its DeltaHeader names
+     *
+     * @param app number of the delta app
+     * @return number of the base app, or NO_APP
+     */
+    uint32_t deltaBase(System& system, uint32_t app);
+
+    /**
+     * @brief build a block of the binary from the operations of a delta block
+     *
+     * @param baseApp number of the base app
+     * @param address absolute memory address of the operations
+     * @param storedSize size in bytes of the operations
+     * @param data buffer for the block of the binary
+     * @param size number of bytes of the binary in the block
+     * @return true if the operations stay inside the patch and the base, and
+     * build exactly size bytes
+     */
+    bool applyDelta(System& system, uint32_t baseApp, uint32_t address, uint32_t storedSize, uint8_t* data,
+        uint32_t size);
+#endif
+
+    /* What is known about an app slot during a boot */
+    enum SlotState : uint8_t { slotUnknown = 0, slotHeaderRead, slotValid, slotInvalid };
+
+    /* Index of the app slots, cleared on each boot. Each header is read and
+     * each app is checked at most once per boot, and a stable boot does not
+     * look at the other slots at all */
+    struct SlotIndex {
+        ImageHeader headers[BOOTLOADER_MAX_APPS];
+        SlotState states[BOOTLOADER_MAX_APPS];
+    };
+    SlotIndex slotIndex;
+
+#ifdef SIGNATURE
+    /* Marker of the status for this boot, see BootloaderStatus::verifiedApp.
+     * NO_APP while a new app is checked */
+    uint32_t verifiedApp;
+    uint32_t verifiedHash[2];
+#endif
 };
@@ -0,0 +1,202 @@
+/*
+ * Okra Bootloader
+ * Copyright (C) 2019 Okra Solar Pty Ltd
+ * https://www.okrasolar.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "Config.h"
+#include "Crc32.h"
+#include "StatusJournal.h"
+
+#ifdef MAILBOX
+/**
+ * @brief crc of a mailbox, over the words before its crc field
+ */
+inline uint32_t mailboxCrc(const Mailbox& mailbox)
+{
+    return crc32((const uint32_t*)&mailbox, offsetof(Mailbox, crc) / sizeof(uint32_t));
+}
+#endif
+
+/* Status handling for apps, header-only. Device provides the flash primitives
+ * of System that BasicStatusJournal uses, and readMailbox() and writeMailbox()
+ * with MAILBOX. The native System backend is one, apps implement them on top
+ * of their flash driver. Each call uses the cheapest write that does the job,
+ * and none writes anything if the status would not change */
+template <class Device>
+class BootloaderClient
+{
+  public:
+    BootloaderClient(Device& device) :
+        device(device),
+        journal(device)
+    {
+    }
+
+    /**
+     * @brief read the current status
+     *
+     * @param status struct to read the status into, zeroed if there is none
+     * @return true if the bootloader has initialized the status
+     */
+    bool queryStatus(BootloaderStatus& status)
+    {
+        return journal.read(status) && status.status != BootloaderState::noState;
+    }
+
+    /**
+     * @brief confirm that the running app works. A new app on trial is
+     * confirmed by clearing the confirm mark of the newest status record, a
+     * single half-word write. With MAILBOX, an app on trial through the
+     * mailbox is confirmed in the mailbox, which takes effect at the next reset.
+     *
+     * @return true if the running app is confirmed, false if the status does
+     * not allow it (no status, or an update staged but not booted yet)
+     */
+    bool confirmBoot()
+    {
+        #ifdef MAILBOX
+        Mailbox mailbox;
+        if (readMailbox(mailbox) && mailbox.trialApp != MAILBOX_NO_TRIAL) {
+            mailbox.request = MailboxRequest::confirmStable;
+            writeMailbox(mailbox);
+            return true;
+        }
+        #endif
+
+        BootloaderStatus status;
+        if (!queryStatus(status)) {
+            return false;
+        }
+        if (status.status == BootloaderState::stableApp) {
+            return true;
+        }
+        return journal.confirm();
+    }
+
+    /**
+     * @brief stage the app in a slot as the new app, to be attempted from the
+     * next reset on. Appends a status record, unless it is staged already.
+     *
+     * @param slot app slot holding the new app and its image header
+     * @return true if the app is staged, false if the slot does not hold an
+     * image or the bootloader has not initialized the status
+     */
+    bool stageUpdate(uint32_t slot)
+    {
+        BootloaderStatus status;
+        if (!hasImage(slot) || !queryStatus(status)) {
+            return false;
+        }
+        status.status = BootloaderState::newApp;
+        status.liveAppSelect = slot;
+        journal.write(status);
+        return true;
+    }
+
+    #ifdef MAILBOX
+    /**
+     * @brief request a trial boot of the app in a slot through the mailbox,
+     * without any flash write. The request is handled at the next reset.
+     *
+     * @param slot app slot holding the app and its image header
+     * @return true if the trial is requested
+     */
+    bool requestTrial(uint32_t slot)
+    {
+        if (!hasImage(slot)) {
+            return false;
+        }
+        Mailbox mailbox;
+        readMailbox(mailbox);
+        mailbox.request = MailboxRequest::trialBoot;
+        mailbox.requestApp = slot;
+        writeMailbox(mailbox);
+        return true;
+    }
+
+    /**
+     * @brief read what the bootloader reported about the last boot
+     *
+     * @param mailbox struct to read the mailbox into, reset if it is invalid
+     * @return true if the mailbox is valid
+     */
+    bool readMailbox(Mailbox& mailbox)
+    {
+        device.readMailbox(mailbox);
+        if (mailbox.magic == MAILBOX_MAGIC && mailbox.version == MAILBOX_VERSION
+            && mailbox.crc == mailboxCrc(mailbox)) {
+            return true;
+        }
+        mailbox = {};
+        mailbox.magic = MAILBOX_MAGIC;
+        mailbox.version = MAILBOX_VERSION;
+        mailbox.trialApp = MAILBOX_NO_TRIAL;
+        return false;
+    }
+    #endif
+
+  private:
+    /**
+     * @brief check the image header of a slot. The bootloader verifies the
+     * app before it attempts it, this only avoids staging an empty slot.
+     */
+    bool hasImage(uint32_t slot)
+    {
+        if (slot >= BOOTLOADER_MAX_APPS) {
+            return false;
+        }
+        ImageHeader header;
+        device.readFlash(BOOTLOADER_APP_ADDRESS[slot] + APP_HEADER_OFFSET, (uint8_t*)&header, sizeof(header));
+        #ifdef RELOCATION
+        if (header.magic == IMAGE_HEADER_MAGIC_RELOC) {
+            return header.length <= (uint32_t)APP_HEADER_OFFSET;
+        }
+        #endif
+        #ifdef COMPRESSION
+        if (header.magic == IMAGE_HEADER_MAGIC_LZ4) {
+            return header.length <= BOOT_SIZE;
+        }
+        #endif
+        #ifdef DELTA
+        if (header.magic == IMAGE_HEADER_MAGIC_DELTA) {
+            return header.length <= BOOT_SIZE;
+        }
+        #endif
+        return header.magic == IMAGE_HEADER_MAGIC && header.length <= (uint32_t)APP_HEADER_OFFSET;
+    }
+
+    #ifdef MAILBOX
+    void writeMailbox(Mailbox& mailbox)
+    {
+        mailbox.crc = mailboxCrc(mailbox);
+        device.writeMailbox(mailbox);
+    }
+    #endif
+
+    Device& device;
+    BasicStatusJournal<Device> journal;
+};
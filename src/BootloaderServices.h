@@ -0,0 +1,101 @@
+/*
+ * Okra Bootloader
+ * Copyright (C) 2019 Okra Solar Pty Ltd
+ * https://www.okrasolar.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "Config.h"
+
+/* Magic number of the service table, "OKSV" */
+const uint32_t SERVICES_MAGIC = 0x4F4B5356;
+
+/* Version of the service table. Entries are only ever appended to the table,
+ * each new entry increments the version */
+const uint32_t SERVICES_VERSION = 1;
+
+/* Routines of the bootloader for the app, in a table at
+ * BOOTLOADER_SERVICES_ADDRESS with the SERVICES build option. Apps call them
+ * instead of linking their own flash, CRC and status journal code. They run
+ * on the stack of the caller and use no RAM of the bootloader, which belongs
+ * to the app once it runs. Flash addresses are absolute, sizes in bytes */
+struct BootloaderServices {
+    uint32_t magic;     // SERVICES_MAGIC
+    uint32_t version;   // SERVICES_VERSION of the bootloader
+    uint32_t size;      // Size of the table in bytes
+    uint32_t statusSize;    // sizeof(BootloaderStatus) of the bootloader
+
+    /* Check that a block of flash is erased, see System::isBlank() */
+    bool (*isBlank)(uint32_t address, uint32_t size);
+
+    /* Erase a flash page of the apps, from APP_FLASH_START to APP_FLASH_END.
+     * Unlocks the flash and leaves it locked or unlocked as it was. Returns
+     * false for an address outside of the apps */
+    bool (*erasePage)(uint32_t address);
+
+    /* Program up to a page of flash of the apps, skipping half-words that
+     * already hold the data. Unlocks the flash and leaves it locked or unlocked
+     * as it was. Returns false for a block outside of the apps */
+    bool (*programHalfWords)(uint32_t address, const uint16_t* data, uint32_t size);
+
+    /* CRC of a block of flash, see crc32(). Uses the CRC unit and DMA1
+     * channel 1, or the CPU if the app has that channel enabled */
+    uint32_t (*crcFlash)(uint32_t address, uint32_t size);
+
+    /* crc32() over words in RAM or flash, continuing from crc */
+    uint32_t (*crc32)(const uint32_t* data, uint32_t words, uint32_t crc);
+
+    /* Read the newest status, see BasicStatusJournal::read() */
+    bool (*readStatus)(BootloaderStatus* status);
+
+    /* Append a status to the journal, see BasicStatusJournal::write() */
+    void (*writeStatus)(const BootloaderStatus* status);
+
+    /* Confirm the attemptNewApp status, see BasicStatusJournal::confirm() */
+    bool (*confirmStatus)();
+};
+
+/**
+ * @brief find the service table of the bootloader
+ *
+ * @param minimumVersion lowest SERVICES_VERSION that has all entries the app uses
+ * @param table address of the table
+ * @return the table, or nullptr if the bootloader has none, an older one or
+ * one with another BootloaderStatus layout
+ */
+inline const BootloaderServices* bootloaderServices(
+    uint32_t minimumVersion = 1, const void* table = (const void*)BOOTLOADER_SERVICES_ADDRESS)
+{
+    const BootloaderServices* services = (const BootloaderServices*)table;
+    if (services->magic != SERVICES_MAGIC || services->version < minimumVersion
+        || services->statusSize != sizeof(BootloaderStatus)) {
+        return nullptr;
+    }
+    return services;
+}
+
+#ifdef SERVICES
+/* Table of this bootloader build, placed at BOOTLOADER_SERVICES_ADDRESS */
+extern const BootloaderServices bootloaderServiceTable;
+#endif
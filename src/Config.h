@@ -8,36 +8,285 @@ const uint8_t BOOTLOADER_NAME_LENGTH = 16;
 const char BOOTLOADER_NAME[BOOTLOADER_NAME_LENGTH] = "Okra Bootloader";
 
 /* Version of the bootloader */
-const uint8_t BOOTLOADER_VERSION_BUILD = 1;
-const uint8_t BOOTLOADER_VERSION_MINOR = 1;
-const uint8_t BOOTLOADER_VERSION_MAJOR = 0;
+const uint8_t BOOTLOADER_VERSION_BUILD = 0;
+const uint8_t BOOTLOADER_VERSION_MINOR = 0;
+const uint8_t BOOTLOADER_VERSION_MAJOR = 1;
 
 /* Number of retries before switching to the next app */
 const uint8_t BOOTLOADER_MAX_RETRIES = 2;
 
-/* Flash address for the bootloader status structure.
- * This address must be aligned to a flash page. Each time a new application
- * is detected by the bootloader (BootloaderState::newApp),
- * the full page is erased, and the updated struct is written to the address */
-const uint32_t BOOTLOADER_STATUS_STRUCT_ADDR = 0x08000800;
+/* Size of a flash page in bytes. High density devices (like the STM32F103RCT)
+ * use 2 KB pages, low and medium density devices use 1 KB pages */
+#if (defined(STM32F101x6) || defined(STM32F102x6) || defined(STM32F103x6) || defined(STM32F100xB) || defined(STM32F101xB) || defined(STM32F102xB) || defined(STM32F103xB))
+#define FLASH_PAGE_SIZE          0x400U
+#else
+#define FLASH_PAGE_SIZE          0x800U
+#endif
+
+/* Address of the BootloaderServices table with the SERVICES build option,
+ * right after the initial stack pointer and reset vector of the bootloader.
+ * The bootloader code follows, up to the status journal */
+const uint32_t BOOTLOADER_SERVICES_ADDRESS = 0x08000008;
+
+/* Flash reserved for the bootloader code, from the start of the flash up to
+ * the status journal. It is fixed with room for all build options, so the
+ * journal and the apps stay at the same addresses whichever options the
+ * bootloader is built with. linker.ld checks that the code fits */
+const uint32_t BOOTLOADER_SIZE = 0x5000;
+static_assert(BOOTLOADER_SIZE % FLASH_PAGE_SIZE == 0, "The status journal must start on a flash page");
 
-/* Number of apps in the flash memory. In most scenarios, this should
- * be set to 2, to allow A/B switching between apps after an update */
-const uint8_t BOOTLOADER_MAX_APPS = 2;
+/* Flash address for the bootloader status journal, right behind the
+ * bootloader. This address must be aligned to a flash page. Each status update
+ * is appended to the journal as a new StatusRecord, a page is only erased when
+ * the journal runs out of space and moves on to the next page */
+const uint32_t BOOTLOADER_STATUS_STRUCT_ADDR = 0x08000000 + BOOTLOADER_SIZE;
+
+/* Number of consecutive flash pages used by the status journal. Once a page is
+ * full, the live record is moved to the next page before the old one is
+ * reused, so a power loss during the erase never loses the status. This takes
+ * at least two pages, a single page would be erased under the live record */
+const uint8_t BOOTLOADER_STATUS_PAGES = 2;
+static_assert(BOOTLOADER_STATUS_PAGES >= 2, "The status journal needs at least two pages");
+
+/* Number of app slots, set with the APP_SLOTS build option. In most
+ * scenarios, this should be 2, to allow A/B switching between apps after an
+ * update. More slots keep older apps (for example the previous and the factory
+ * app) to fall back to */
+#ifndef APP_SLOTS
+#define APP_SLOTS 2
+#endif
+const uint8_t BOOTLOADER_MAX_APPS = APP_SLOTS;
+static_assert(APP_SLOTS >= 2 && APP_SLOTS <= 4, "APP_SLOTS must be 2 to 4");
+
+/* App number that stands for no app */
+const uint32_t NO_APP = 0xFFFFFFFF;
+
+/* Compressed and delta apps are decoded when they are copied to the boot
+ * address, so COMPRESSION and DELTA need COPYBINARY. Both are stored as
+ * blocks, BLOCK_IMAGES covers what they share */
+#ifndef COPYBINARY
+#undef COMPRESSION
+#undef DELTA
+#endif
+
+/* SWAPBINARY exchanges the boot region with a slot instead of copying the
+ * slot over it, so it needs COPYBINARY. The other app stays in the slot as a
+ * plain app to swap back to, which rules out the compressed and delta apps,
+ * and the mailbox trials that reinstall the stable app afterwards */
+#ifndef COPYBINARY
+#undef SWAPBINARY
+#endif
+#ifdef SWAPBINARY
+#undef COMPRESSION
+#undef DELTA
+#undef MAILBOX
+#endif
 
+/* Relocatable apps run from their slot, so RELOCATION is only available
+ * without COPYBINARY */
 #ifdef COPYBINARY
-/* Source address of the applications */
-const uint32_t BOOTLOADER_APP_ADDRESS[BOOTLOADER_MAX_APPS] = { 0x08040800, 0x08080000 };
-#else
-const uint32_t BOOTLOADER_APP_ADDRESS[BOOTLOADER_MAX_APPS] = { 0x08001000, 0x08040800 };
+#undef RELOCATION
+#endif
+
+/* A word left half programmed by a reset takes a rewrite of its page from RAM,
+ * which another reset may leave incomplete. RELOCATION turns on VERIFYCRC
+ * unless VERIFYHASH or SIGNATURE is set, so an app that lost data that way is
+ * rejected */
+#if defined(RELOCATION) && !defined(VERIFYHASH) && !defined(SIGNATURE) && !defined(VERIFYCRC)
+#define VERIFYCRC
 #endif
 
+#if defined(COMPRESSION) || defined(DELTA)
+#define BLOCK_IMAGES
+#endif
+
+/* SIGNATURE checks the signature of the image hash, so it turns on VERIFYHASH */
+#ifdef SIGNATURE
+#ifndef VERIFYHASH
+#define VERIFYHASH
+#endif
+#endif
+
+/* VERIFYCRC and VERIFYHASH both read every byte of the binary to check it,
+ * VERIFY_BINARY covers what they share */
+#if defined(VERIFYCRC) || defined(VERIFYHASH)
+#define VERIFY_BINARY
+#endif
+
+/* Flash behind the status journal that is split into the app regions: the
+ * slots, and the boot address with COPYBINARY. All regions have APP_SIZE
+ * bytes, with 2 slots each is 244 KB. With COMPRESSION, the boot address takes
+ * two regions, for apps that only fit into a slot compressed. With SWAPBINARY,
+ * the swap scratch area is taken from the end first */
+const uint32_t APP_FLASH_START = BOOTLOADER_STATUS_STRUCT_ADDR + BOOTLOADER_STATUS_PAGES * FLASH_PAGE_SIZE;
 #ifdef COPYBINARY
-/* Actual boot address */
-const uint32_t BOOT_ADDRESS = 0x08001000;
+#ifdef COMPRESSION
+const uint32_t BOOT_REGIONS = 2;
+#else
+const uint32_t BOOT_REGIONS = 1;
+#endif
+const uint32_t APP_FLASH_END = 0x080C0000;   // 768 KB devices
+const uint32_t APP_REGIONS = BOOTLOADER_MAX_APPS + BOOT_REGIONS;
+#else
+const uint32_t APP_FLASH_END = 0x08080000;   // 512 KB devices
+const uint32_t APP_REGIONS = BOOTLOADER_MAX_APPS;
+#endif
+
+#ifdef SWAPBINARY
+/* Scratch area at the end of the app flash. A swap exchanges the regions one
+ * batch of this size at a time, the batch of the boot region waits here while
+ * the slot is copied over it */
+const uint32_t SWAP_SCRATCH_SIZE = 4 * FLASH_PAGE_SIZE;
+const uint32_t SWAP_SCRATCH_ADDRESS = APP_FLASH_END - SWAP_SCRATCH_SIZE;
+#else
+const uint32_t SWAP_SCRATCH_SIZE = 0;
+#endif
 
 /* Size of each app in bytes */
-const int32_t APP_SIZE = 260096;
+const int32_t APP_SIZE = ((APP_FLASH_END - SWAP_SCRATCH_SIZE - APP_FLASH_START) / APP_REGIONS)
+    & ~(FLASH_PAGE_SIZE - 1);
+
+#ifdef COPYBINARY
+/* Actual boot address and the size of its region, followed by the slots */
+const uint32_t BOOT_ADDRESS = APP_FLASH_START;
+const uint32_t BOOT_SIZE = BOOT_REGIONS * APP_SIZE;
+#define APP_SLOT_ADDRESS(slot) (BOOT_ADDRESS + BOOT_SIZE + (slot)*APP_SIZE)
+#else
+#define APP_SLOT_ADDRESS(slot) (APP_FLASH_START + (slot)*APP_SIZE)
+#endif
+
+/* Source address of the applications */
+const uint32_t BOOTLOADER_APP_ADDRESS[BOOTLOADER_MAX_APPS] = {
+    APP_SLOT_ADDRESS(0),
+    APP_SLOT_ADDRESS(1),
+#if APP_SLOTS > 2
+    APP_SLOT_ADDRESS(2),
+#endif
+#if APP_SLOTS > 3
+    APP_SLOT_ADDRESS(3),
+#endif
+};
+
+/* RAM area of the MCU, used to check the initial stack pointer of an app */
+const uint32_t RAM_START = 0x20000000;
+const uint32_t RAM_END = 0x2000C000;
+
+/* Magic number of the image header, "OKRA" */
+const uint32_t IMAGE_HEADER_MAGIC = 0x4F4B5241;
+
+/* Without a check of the binary, a slot with an erased image header holds an
+ * app stored without one, by the update procedure from before the header. It
+ * is booted as a legacy app. A swap tells the apps apart by their headers, so
+ * SWAPBINARY needs them as well */
+#if !defined(VERIFY_BINARY) && !defined(SWAPBINARY)
+#define LEGACY_IMAGES
+#endif
+
+#ifdef LEGACY_IMAGES
+/* Magic number of the image header the bootloader makes up for a legacy app,
+ * "OKRL". It is never stored */
+const uint32_t IMAGE_HEADER_MAGIC_LEGACY = 0x4F4B524C;
+#endif
+
+/* Image header, stored at APP_HEADER_OFFSET in each app slot. The header is
+ * written by the app after storing a new binary, before setting newApp.
+ * The bootloader only attempts apps with a valid header and vector table,
+ * and only copies and checks the first length bytes of the slot. With
+ * LEGACY_IMAGES, an erased header stands for a legacy app: the whole slot up
+ * to the header, with version 0, and the slot number as its crc */
+struct ImageHeader {
+    uint32_t magic;         // IMAGE_HEADER_MAGIC
+    uint32_t length;        // Length of the binary in bytes, a multiple of 4
+    uint32_t loadAddress;   // Address the binary is linked to run from
+    uint32_t crc;           // crc32() over the first length bytes of the slot
+    uint32_t version;       // Version of the app, higher is newer
+#ifdef VERIFYHASH
+    uint8_t sha256[32];     // SHA-256 (see Sha256.h) over the same bytes as the crc
+#endif
+#ifdef SIGNATURE
+    uint8_t signature[64];   // ECDSA P-256 signature (see P256.h) of sha256, r and s big endian
+#endif
+};
+
+#ifdef SIGNATURE
+/* Public key that signs the apps with SIGNATURE, x and y of the P-256 point
+ * big endian. This is the test key of RFC 6979 A.2.5, whose private key is
+ * public: replace it with the key of your release signing */
+const uint8_t SIGNATURE_PUBLIC_KEY[64] = {
+    0x60, 0xFE, 0xD4, 0xBA, 0x25, 0x5A, 0x9D, 0x31, 0xC9, 0x61, 0xEB, 0x74, 0xC6, 0x35, 0x6D, 0x68,
+    0xC0, 0x49, 0xB8, 0x92, 0x3B, 0x61, 0xFA, 0x6C, 0xE6, 0x69, 0x62, 0x2E, 0x60, 0xF2, 0x9F, 0xB6,
+    0x79, 0x03, 0xFE, 0x10, 0x08, 0xB8, 0xBC, 0x99, 0xA4, 0x1A, 0xE9, 0xE9, 0x56, 0x28, 0xBC, 0x64,
+    0xF2, 0xF1, 0xB2, 0x0C, 0x2D, 0x7E, 0x9F, 0x51, 0x77, 0xA3, 0xC2, 0x94, 0xD4, 0x46, 0x22, 0x99
+};
+#endif
+
+/* Offset of the image header in each app slot, at the end of the slot */
+const int32_t APP_HEADER_OFFSET = APP_SIZE - sizeof(ImageHeader);
+
+#ifdef RELOCATION
+/* Magic number of the image header of a relocatable app, "OKRR". One binary
+ * runs from any slot: the words that hold an address inside the binary are
+ * stored erased, and the relocation table (see Relocation.h) follows the binary
+ * in the slot, as a word with the number of entries and the entries. The
+ * bootloader programs the relocated words for the slot when the app is
+ * installed, before it runs for the first time. The loadAddress of the header
+ * is the link address and is not checked, the crc is that of the binary as
+ * stored, with the relocated words erased */
+const uint32_t IMAGE_HEADER_MAGIC_RELOC = 0x4F4B5252;
+#endif
+
+#ifdef COPYBINARY
+/* Bytes copied to BOOT_ADDRESS between two install checkpoints. An install
+ * interrupted by a reset resumes at the last checkpoint */
+const uint32_t INSTALL_CHECKPOINT_SIZE = 4 * FLASH_PAGE_SIZE;
+
+#ifdef SWAPBINARY
+/* A swap exchanges swapLength bytes from the start of both regions in batches
+ * of SWAP_SCRATCH_SIZE, followed by a batch of the last page, which holds the
+ * image header. Each batch takes three steps: the boot region to the scratch
+ * area, the slot to the boot region, and the scratch area to the slot */
+const uint32_t SWAP_HEADER_PAGE = APP_SIZE - FLASH_PAGE_SIZE;
+#define SWAP_STEPS(length) (3 * (((length) + SWAP_SCRATCH_SIZE - 1) / SWAP_SCRATCH_SIZE + 1))
+#endif
+
+#ifdef BLOCK_IMAGES
+/* Compressed and delta apps are stored as a sequence of blocks. Each block
+ * holds the next IMAGE_BLOCK_SIZE bytes of the binary (the last one the rest)
+ * as a word with its stored size in bytes, followed by the data padded to a
+ * word: the encoded block, or the binary as is if IMAGE_BLOCK_RAW is set in
+ * the stored size. Blocks are independent, each one is an install checkpoint.
+ * The length and crc of the image header are those of the decoded binary,
+ * which may be up to BOOT_SIZE bytes */
+const uint32_t IMAGE_BLOCK_SIZE = INSTALL_CHECKPOINT_SIZE;
+const uint32_t IMAGE_BLOCK_RAW = 0x80000000;
+#endif
+
+#ifdef COMPRESSION
+/* Magic number of the image header of a compressed app, "OKRZ". Its blocks
+ * start at the start of the slot, each one in the LZ4 block format */
+const uint32_t IMAGE_HEADER_MAGIC_LZ4 = 0x4F4B525A;
+#endif
+
+#ifdef DELTA
+/* Magic number of the image header of a delta app, "OKRD". The slot starts
+ * with a DeltaHeader naming the base app, followed by the blocks */
+const uint32_t IMAGE_HEADER_MAGIC_DELTA = 0x4F4B5244;
+
+/* Base of a delta app: the plain app in another slot with this length and crc
+ * in its image header */
+struct DeltaHeader {
+    uint32_t baseLength;
+    uint32_t baseCrc;
+};
+
+/* Each delta block is a sequence of operations that build the binary from the
+ * base and the patch. An operation is a word with the number of bytes it adds
+ * in DELTA_LENGTH_MASK. With DELTA_OP_COPY set, it is followed by a word with
+ * the offset in the base binary to copy them from. Otherwise the bytes follow
+ * in the patch, padded to a word */
+const uint32_t DELTA_OP_COPY = 0x80000000;
+const uint32_t DELTA_LENGTH_MASK = 0x0000FFFF;
+#endif
 #endif
 
 /* Bootloader state enumeration. This state needs to be set to "newApp"
@@ -50,6 +299,17 @@ enum BootloaderState {
     stableApp,       // Set by App after sucessful boot of the new app
 };
 
+/* Cumulative boot statistics, kept in the status and never reset by the
+ * bootloader. Boots are counted with the boot marks of the status record, the
+ * other counters change on boots that append a record anyway */
+struct BootStatistics {
+    uint32_t boots;                            // All boots
+    uint32_t trialBoots;                       // Boots in attemptNewApp
+    uint32_t rollbacks[BOOTLOADER_MAX_APPS];   // Apps given up on per slot, rejected or failed trials
+    uint32_t pagesCopied;                      // Pages written by installs (COPYBINARY)
+    uint32_t statusErases;                     // Page erases of the status journal, counted by the journal
+};
+
 /* Bootloader status struct. This struct's status field should be updated
  * in flash by the app after first boot (stableApp) or after an update of the
  * other firmware binary (newApp) */
@@ -59,8 +319,169 @@ struct BootloaderStatus {
     uint32_t status;   // Update this field and write to flash in your app!
     uint32_t liveAppSelect;
     uint32_t retryCount;
+    uint32_t givenUpApps;       // Apps given up on since the last update or confirmation, a bit per slot
+    uint32_t installedLength;   // Length of the app installed at BOOT_ADDRESS, 0 if unknown
+    uint32_t installedCrc;      // CRC of the app installed at BOOT_ADDRESS
+    uint32_t installProgress;   // Install checkpoints (swap steps with SWAPBINARY) completed so far
+    BootStatistics statistics;
+#ifdef SWAPBINARY
+    uint32_t swapSlot;     // Slot exchanged with the boot region by the last swap, NO_APP if none
+    uint32_t swapLength;   // Bytes exchanged before the last page of both regions, whole pages
+#endif
+#ifdef SIGNATURE
+    uint32_t verifiedApp;       // Live app whose hash and signature were checked, NO_APP if none
+    uint32_t verifiedHash[2];   // First 8 bytes of the sha256 of that app's image header
+#endif
+};
+
+/* Number of progress and boot marks in each status record */
+const uint32_t STATUS_PROGRESS_MARKS = 8;
+const uint32_t STATUS_BOOT_MARKS = 16;
+
+/* Entry of the status journal. Records are appended to the journal pages in
+ * order, the valid record with the highest sequence number is the current
+ * status. The crc covers the sequence number and the status (see crc32()).
+ * The marks are not covered by the crc. They are left erased when the record
+ * is appended and cleared to 0x0000 one at a time afterwards, each cleared
+ * progress or boot mark adds one to status.installProgress or
+ * status.statistics.boots. A cleared confirm mark turns an attemptNewApp
+ * status into stableApp, so the app confirms a new app with a single
+ * half-word write. The marks are folded into the next record that is appended */
+struct StatusRecord {
+    uint32_t sequence;   // Incremented for each record, never 0xFFFFFFFF
+    BootloaderStatus status;
+    uint32_t crc;
+    uint16_t progressMarks[STATUS_PROGRESS_MARKS];
+    uint16_t bootMarks[STATUS_BOOT_MARKS];
+    uint16_t confirmMark;
+    uint16_t reserved;   // Left erased, keeps the record word aligned
+};
+
+#ifdef BACKUPRETRY
+/* Boot state kept in the backup data registers BKP_DR1 to BKP_DR5, one
+ * half-word each. They survive resets, and power loss if VBAT is powered.
+ * Warm retries and boots are counted here instead of in flash, the flash
+ * status is only written on state changes and after a cold boot */
+struct BackupState {
+    uint16_t magic;               // BACKUP_STATE_MAGIC if the registers were set by the bootloader
+    uint16_t statusTag;           // Tag of the flash status retryCount belongs to, see Bootloader::statusTag()
+    uint16_t retryCount;          // Retries of that status, which may be ahead of the flash status
+    uint16_t pendingBoots;        // Boots not yet counted in the flash status
+    uint16_t pendingTrialBoots;   // Trial boots not yet counted in the flash status
 };
 
+/* Magic number of the backup state, "OK" */
+const uint16_t BACKUP_STATE_MAGIC = 0x4F4B;
+
+/* Number of backup registers used by the backup state */
+const uint32_t BACKUP_STATE_REGISTERS = sizeof(BackupState) / sizeof(uint16_t);
+
+/* Pending boots are written to the flash status before they overflow */
+const uint16_t BACKUP_PENDING_LIMIT = 0xFFFF;
+#endif
+
+/* RAM shared with the app at the start of RAM, the .noinit region of
+ * linker.ld. Neither the bootloader nor the app initialize it, so data left
+ * there by one survives the jump to the other and a reset, but not a power
+ * loss. The app must leave it out of its own RAM region */
+const uint32_t SHARED_RAM_ADDRESS = 0x20000000;
+const uint32_t SHARED_RAM_SIZE = 0x200;
+
+/* Bytes of the shared RAM reserved for the mailbox, at its start */
+const uint32_t MAILBOX_SIZE = 0x40;
+
+#ifdef MAILBOX
+/* Requests of the app to the bootloader, see Mailbox */
+enum MailboxRequest {
+    noRequest = 0,
+    trialBoot,       // Boot Mailbox::requestApp on trial from the next reset on
+    confirmStable,   // Make the app on trial the stable app
+};
+
+/* Responses of the bootloader to the last request */
+enum MailboxResponse {
+    noResponse = 0,
+    trialStarted,      // The requested app is on trial
+    trialRejected,     // The requested app is invalid
+    trialFailed,       // The app on trial was not confirmed and was rolled back
+    stableConfirmed,   // The app on trial was made the stable app
+    requestIgnored,    // The request does not apply to the current state
+};
+
+/* Magic number and layout version of the mailbox */
+const uint32_t MAILBOX_MAGIC = 0x4F4B4D42;   // "OKMB"
+const uint32_t MAILBOX_VERSION = 1;
+
+/* Value of Mailbox::trialApp while no app is on trial */
+const uint32_t MAILBOX_NO_TRIAL = 0xFFFFFFFF;
+
+/* Mailbox at MAILBOX_ADDRESS, to request trials and confirmations without
+ * writing the status to flash. The app sets the request fields, the crc and
+ * resets; the bootloader validates the mailbox, handles the request and
+ * reports the boot. Requests are only handled while the status in flash is
+ * stableApp. A trial is kept in RAM only: the status is written when the trial
+ * app is confirmed (at the next reset) or given up on, and a power loss in
+ * between boots the stable app again */
+struct Mailbox {
+    uint32_t magic;          // MAILBOX_MAGIC
+    uint32_t version;        // MAILBOX_VERSION
+    uint32_t request;        // MailboxRequest, cleared by the bootloader once handled
+    uint32_t requestApp;     // App to boot on trial with trialBoot
+    uint32_t response;       // MailboxResponse to the last request
+    uint32_t trialApp;       // App on trial, MAILBOX_NO_TRIAL if none
+    uint32_t trialRetries;   // Boots of the app on trial before the last one
+    uint32_t bootedApp;      // App started by the last boot
+    uint32_t bootState;      // BootloaderState of the last boot, attemptNewApp on a trial
+    uint32_t retryCount;     // Retries of the app started by the last boot
+    uint32_t bootCycles;     // Core clock cycles spent in the bootloader on the last boot
+    uint32_t crc;            // crc32() over the words above
+};
+
+/* Address of the mailbox, at the start of the shared RAM */
+const uint32_t MAILBOX_ADDRESS = SHARED_RAM_ADDRESS;
+#endif
+
+#ifdef TRACEBOOT
+/* Boot phases timestamped by the boot trace */
+enum BootPhase {
+    bootEntered = 0,   // Bootloader entered, the timestamps start at 0
+    statusRead,        // Status read from the journal, argument: its state
+    verifyStarted,     // Argument: app that is verified
+    verifyFinished,    // Argument: 1 if the app is valid, 0 otherwise
+    installStarted,    // Argument: first install checkpoint to copy
+    installFinished,   // Argument: install checkpoints of the app, words programmed by a relocation
+    clockSwitched,     // Argument: 1 if the clock was boosted, 0 if restored
+    bootDecided,       // Status written, argument: live app
+    appStarted,        // Jumping to the app
+};
+
+/* Magic number of a complete boot trace, "TRCE" */
+const uint32_t BOOT_TRACE_MAGIC = 0x54524345;
+
+/* Number of entries of the boot trace, phases after these are only counted */
+const uint32_t BOOT_TRACE_ENTRIES = 24;
+
+/* Timestamped boot phase */
+struct BootTraceEntry {
+    uint32_t timestamp;   // DWT cycle count since bootEntered, in core clock cycles
+    uint16_t phase;       // BootPhase
+    uint16_t argument;    // Depends on the phase, see BootPhase
+};
+
+/* Boot trace handed off to the app at BOOT_TRACE_ADDRESS. The bootloader
+ * clears it when entered and sets the magic right before it jumps to the
+ * app. The DWT cycle counter keeps running, the app can read it to continue
+ * the timeline. Note that the core clock changes at clockSwitched entries */
+struct BootTrace {
+    uint32_t magic;   // BOOT_TRACE_MAGIC once the trace is complete
+    uint32_t count;   // Number of phases traced, may exceed BOOT_TRACE_ENTRIES
+    BootTraceEntry entries[BOOT_TRACE_ENTRIES];
+};
+
+/* Address of the boot trace, behind the mailbox */
+const uint32_t BOOT_TRACE_ADDRESS = SHARED_RAM_ADDRESS + MAILBOX_SIZE;
+#endif
+
 /*
  * Enables the watchdog for the MCU. The actual implementation details,
  * as well as the value for the watchdog counter are platform dependent
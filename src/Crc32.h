@@ -0,0 +1,77 @@
+/*
+ * Okra Bootloader
+ * Copyright (C) 2019 Okra Solar Pty Ltd
+ * https://www.okrasolar.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/* Initial value of the CRC calculation */
+const uint32_t CRC32_INITIAL = 0xFFFFFFFF;
+
+const uint32_t CRC32_POLYNOMIAL = 0x04C11DB7;
+
+/* Shift the CRC register by a number of bits */
+constexpr uint32_t crc32Shift(uint32_t crc, int bits)
+{
+    return bits == 0 ? crc
+                     : crc32Shift((crc & 0x80000000) ? (crc << 1) ^ CRC32_POLYNOMIAL : crc << 1,
+                           bits - 1);
+}
+
+/* CRC register change for the upper 4 bits of the register */
+constexpr uint32_t crc32Nibble(uint32_t nibble)
+{
+    return crc32Shift(nibble << 28, 4);
+}
+
+/**
+ * @brief calculate the CRC-32 over a block of 32 bit words. The result matches
+ * the STM32F1 CRC unit: polynomial 0x04C11DB7, initial value 0xFFFFFFFF, each
+ * word is processed MSB first and there is no final XOR. Header-only, so apps
+ * can use it with BootloaderClient.h.
+ *
+ * @param data pointer to the words to process
+ * @param words number of words to process
+ * @param crc result of a previous calculation, to continue over several blocks
+ * @return the resulting CRC
+ */
+inline uint32_t crc32(const uint32_t* data, uint32_t words, uint32_t crc = CRC32_INITIAL)
+{
+    /* Lookup table for 4 bits at a time, generated at compile time. It is small
+     * enough to keep the bootloader size down, and there is a single copy of it */
+    static const uint32_t table[16] = {
+        crc32Nibble(0), crc32Nibble(1), crc32Nibble(2), crc32Nibble(3),
+        crc32Nibble(4), crc32Nibble(5), crc32Nibble(6), crc32Nibble(7),
+        crc32Nibble(8), crc32Nibble(9), crc32Nibble(10), crc32Nibble(11),
+        crc32Nibble(12), crc32Nibble(13), crc32Nibble(14), crc32Nibble(15)
+    };
+
+    while (words--) {
+        crc ^= *data++;
+        for (int nibble = 0; nibble < 8; nibble++) {
+            crc = (crc << 4) ^ table[crc >> 28];
+        }
+    }
+    return crc;
+}
@@ -0,0 +1,189 @@
+/*
+ * Okra Bootloader
+ * Copyright (C) 2019 Okra Solar Pty Ltd
+ * https://www.okrasolar.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "Config.h"
+
+/* Flash area emulated by the native System backend, large enough for the
+ * biggest STM32F1 devices (XL density, 1 MB) */
+const uint32_t SIMULATOR_FLASH_START = 0x08000000;
+const uint32_t SIMULATOR_FLASH_SIZE = 0x100000;
+
+/* Number of backup data registers of high density devices */
+const uint32_t SIMULATOR_BACKUP_REGISTERS = 42;
+
+/* Operations reported to FlashSimulator::observer */
+enum SimulatorOperation {
+    flashRead,         // Bytes were read from flash by the CPU or DMA
+    pageErase,         // A page was erased
+    halfWordProgram,   // Half-words were programmed
+    clockBoost,        // The core clock was switched to the PLL
+    hashBytes,         // Bytes were added to a SHA-256 calculation
+    signatureCheck,    // An image signature was checked
+};
+
+/* Thrown by the native System backend when the simulated power fails,
+ * see FlashSimulator::powerCut */
+struct PowerFailure {
+};
+
+/* Value of FlashSimulator::powerCut that keeps the power on */
+const uint32_t NO_POWER_CUT = 0xFFFFFFFF;
+
+/* In memory model of the STM32F1 flash used by System_native.cpp.
+ * Erased flash reads 0xFF and is erased in pages of FLASH_PAGE_SIZE bytes.
+ * Flash is programmed one half-word at a time, and a half-word can only be
+ * programmed while it is erased, or to 0x0000. Other writes leave the flash
+ * untouched (PGERR on the hardware). Erasing and programming need an unlocked
+ * flash. Violations are counted instead of aborting, so tests can check them.
+ * Power failures can be injected before or in the middle of any write */
+class FlashSimulator
+{
+  public:
+    FlashSimulator();
+
+    /**
+     * @brief erase the whole flash, clear the backup registers and the
+     * mailbox, lock the flash and clear all counters and events
+     */
+    void reset();
+
+    /**
+     * @brief clear the counters and events, the flash contents are kept
+     */
+    void clearCounters();
+
+    /**
+     * @brief simulate a software or watchdog reset. The flash contents, the
+     * shared RAM and the backup registers (powered from VBAT) are kept, the
+     * flash is locked, the clocks and the watchdog are back in their reset
+     * state and the counters are cleared.
+     */
+    void restart();
+
+    /**
+     * @brief simulate a reset after a power failure: restart(), and the
+     * simulated shared RAM loses its contents
+     */
+    void powerCycle();
+
+    /**
+     * @brief get a pointer into the simulated flash, to set up or inspect its
+     * contents directly
+     *
+     * @param address absolute memory address in flash
+     * @param size size in bytes of the block that is accessed
+     * @return pointer to the flash contents, nullptr if the block is not in flash
+     */
+    uint8_t* memory(uint32_t address, uint32_t size = 1);
+
+    /**
+     * @brief record an operation in the counters and report it to the observer
+     *
+     * @param operation kind of operation
+     * @param address absolute memory address of the operation
+     * @param size bytes read, or number of pages or half-words written
+     */
+    void count(SimulatorOperation operation, uint32_t address, uint32_t size);
+
+    /**
+     * @brief count a write operation (a page erase or the program of a
+     * half-word) before it starts
+     *
+     * @return true if the power fails during this operation
+     */
+    bool powerFails();
+
+    // Called for each operation after it took effect, unless it is nullptr.
+    // Kept over reset(), used to model the time and energy of a boot and
+    // to record the write operations
+    void (*observer)(SimulatorOperation operation, uint32_t address, uint32_t size);
+
+    // The power fails when write operation number powerCut starts, and
+    // PowerFailure is thrown. With tornWrite, the operation is left half
+    // done, otherwise it has no effect
+    uint32_t powerCut;
+    bool tornWrite;
+
+    // Flash state
+    bool locked;
+
+    // Backup data registers BKP_DR1 onwards, cleared when VBAT is lost
+    uint16_t backupRegisters[SIMULATOR_BACKUP_REGISTERS];
+
+    // Flash operations
+    uint32_t bytesRead;
+    uint32_t pagesErased;
+    uint32_t halfWordsProgrammed;
+    uint32_t writeOperations;   // Page erases and half-word programs, including a failed one
+    uint32_t errors;   // Writes while locked, PGERR and accesses outside of flash
+
+    // Events
+    uint32_t boots;         // Calls to executeFromAddress()
+    uint32_t bootAddress;   // Address of the last executeFromAddress()
+    uint32_t clockBoosts;   // Calls to boostClock()
+    uint32_t bytesHashed;   // Bytes added to SHA-256 calculations
+    uint32_t signatureChecks;   // Calls to verifySignature()
+    bool clockBoosted;      // Core clock is boosted right now
+    bool watchdogEnabled;
+
+    #if defined(TRACEBOOT) || defined(MAILBOX)
+    // Host time of startCycleCounter() in nanoseconds, the simulated cycles
+    // are host nanoseconds
+    uint64_t cycleStart;
+    bool cycleCounterRunning;  // Left running for the app
+    #endif
+
+    #ifdef MAILBOX
+    // Mailbox in the simulated shared RAM, kept over restart()
+    Mailbox mailbox;
+    #endif
+
+    #ifdef TRACEBOOT
+    // Boot trace in the simulated shared RAM, kept over restart() and reset()
+    // like the .noinit RAM. Timestamps are host nanoseconds since bootEntered
+    BootTrace bootTrace;
+
+    // Called for each traced boot phase unless it is nullptr, kept over
+    // reset(). printBootTrace() by default
+    void (*traceSink)(BootPhase phase, uint32_t argument, uint32_t timestamp);
+    #endif
+
+  private:
+    alignas(uint32_t) uint8_t flash[SIMULATOR_FLASH_SIZE];   // Word aligned like the real flash
+};
+
+#ifdef TRACEBOOT
+/**
+ * @brief trace sink that prints each boot phase to stdout
+ */
+void printBootTrace(BootPhase phase, uint32_t argument, uint32_t timestamp);
+#endif
+
+/* Simulated flash of the native System backend, one per thread so that
+ * simulated boots can run in parallel */
+extern thread_local FlashSimulator flashSimulator;
@@ -0,0 +1,105 @@
+/*
+ * Okra Bootloader
+ * Copyright (C) 2019 Okra Solar Pty Ltd
+ * https://www.okrasolar.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/* Shortest match of the LZ4 block format */
+const uint32_t LZ4_MIN_MATCH = 4;
+
+/* Read an LZ4 length extension: bytes of 255 continue it */
+inline bool lz4Length(const uint8_t*& in, const uint8_t* inEnd, uint32_t& length)
+{
+    uint32_t byte;
+    do {
+        if (in == inEnd) {
+            return false;
+        }
+        byte = *in++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+/**
+ * @brief decompress a block in the LZ4 block format (no frame, as written by
+ * LZ4_compress_default()). Matches only reach back into the output of this
+ * block, so the output buffer is the whole window. Header-only, so host tools
+ * and tests use the same decoder. Malformed input never reads or writes
+ * outside of the buffers.
+ *
+ * @param source compressed block
+ * @param sourceSize size of the compressed block in bytes
+ * @param destination buffer for the decompressed data
+ * @param destinationSize size of the buffer in bytes
+ * @return number of bytes decompressed, or -1 if the block is malformed or
+ * does not fit into the buffer
+ */
+inline int32_t lz4Decompress(const uint8_t* source, uint32_t sourceSize, uint8_t* destination, uint32_t destinationSize)
+{
+    const uint8_t* in = source;
+    const uint8_t* inEnd = source + sourceSize;
+    uint8_t* out = destination;
+    uint8_t* outEnd = destination + destinationSize;
+
+    while (in < inEnd) {
+        uint32_t token = *in++;
+
+        /* Literals, the last sequence of a block has nothing else */
+        uint32_t length = token >> 4;
+        if (length == 15 && !lz4Length(in, inEnd, length)) {
+            return -1;
+        }
+        if (length > (uint32_t)(inEnd - in) || length > (uint32_t)(outEnd - out)) {
+            return -1;
+        }
+        while (length--) {
+            *out++ = *in++;
+        }
+        if (in == inEnd) {
+            break;
+        }
+
+        /* Match, copied a byte at a time so an overlapping match repeats */
+        if (inEnd - in < 2) {
+            return -1;
+        }
+        uint32_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        length = token & 15;
+        if (length == 15 && !lz4Length(in, inEnd, length)) {
+            return -1;
+        }
+        length += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > (uint32_t)(out - destination) || length > (uint32_t)(outEnd - out)) {
+            return -1;
+        }
+        const uint8_t* match = out - offset;
+        while (length--) {
+            *out++ = *match++;
+        }
+    }
+    return out - destination;
+}
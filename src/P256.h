@@ -0,0 +1,450 @@
+/*
+ * Okra Bootloader
+ * Copyright (C) 2019 Okra Solar Pty Ltd
+ * https://www.okrasolar.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/* ECDSA verification on the NIST P-256 curve (FIPS 186-4), for the signature
+ * of the image hash. Header-only, so the tests sign images with the same
+ * arithmetic. Numbers are arrays of P256_WORDS words, least significant first,
+ * and are multiplied in Montgomery form. All curve and Montgomery constants are
+ * precomputed and const, so they stay in flash. The code only handles public
+ * data and is not constant time, it must not be used with a private key on the
+ * device.
+ *
+ * A verification takes some 6000 multiplications modulo p or n, about 5100 of
+ * them in the points of the double scalar multiplication and the rest in the
+ * two inversions. Target on the STM32F1: at most P256_VERIFY_TARGET_CYCLES,
+ * measured with the DWT cycle counter around p256Verify(), so 750 ms at the
+ * 8 MHz reset clock and 85 ms with CLOCKBOOST */
+const uint32_t P256_VERIFY_TARGET_CYCLES = 6000000;
+const uint32_t P256_WORDS = 8;
+const uint32_t P256_SIZE = 32;
+const uint32_t P256_PUBLIC_KEY_SIZE = 2 * P256_SIZE;   // x and y of the point, big endian
+const uint32_t P256_SIGNATURE_SIZE = 2 * P256_SIZE;    // r and s, big endian
+
+/* A prime modulus with its Montgomery constants, for R = 2^256 */
+struct P256Modulus {
+    uint32_t value[P256_WORDS];
+    uint32_t rSquared[P256_WORDS];   // R^2 mod value
+    uint32_t inverse;                // -value^-1 mod 2^32
+};
+
+/* Field prime p */
+inline const P256Modulus& p256Prime()
+{
+    static const P256Modulus prime = {
+        { 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0x00000000, 0x00000000, 0x00000000, 0x00000001, 0xFFFFFFFF },
+        { 0x00000003, 0x00000000, 0xFFFFFFFF, 0xFFFFFFFB, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFD, 0x00000004 },
+        0x00000001
+    };
+    return prime;
+}
+
+/* Group order n */
+inline const P256Modulus& p256Order()
+{
+    static const P256Modulus order = {
+        { 0xFC632551, 0xF3B9CAC2, 0xA7179E84, 0xBCE6FAAD, 0xFFFFFFFF, 0xFFFFFFFF, 0x00000000, 0xFFFFFFFF },
+        { 0xBE79EEA2, 0x83244C95, 0x49BD6FA6, 0x4699799C, 0x2B6BEC59, 0x2845B239, 0xF3D95620, 0x66E12D94 },
+        0xEE00BC4F
+    };
+    return order;
+}
+
+/* Point in Jacobian coordinates (x / z^2, y / z^3), in Montgomery form
+ * modulo p. The point at infinity has z = 0 */
+struct P256Point {
+    uint32_t x[P256_WORDS];
+    uint32_t y[P256_WORDS];
+    uint32_t z[P256_WORDS];
+};
+
+/* Read a big endian number */
+inline void p256Load(uint32_t* number, const uint8_t* bytes)
+{
+    for (uint32_t i = 0; i < P256_WORDS; i++) {
+        const uint8_t* word = bytes + P256_SIZE - 4 * (i + 1);
+        number[i] = (uint32_t)word[0] << 24 | (uint32_t)word[1] << 16 | (uint32_t)word[2] << 8 | word[3];
+    }
+}
+
+/* Write a big endian number */
+inline void p256Store(uint8_t* bytes, const uint32_t* number)
+{
+    for (uint32_t i = 0; i < P256_SIZE; i++) {
+        bytes[i] = number[P256_WORDS - 1 - i / 4] >> (24 - 8 * (i % 4));
+    }
+}
+
+inline void p256Copy(uint32_t* result, const uint32_t* a)
+{
+    for (uint32_t i = 0; i < P256_WORDS; i++) {
+        result[i] = a[i];
+    }
+}
+
+inline bool p256IsZero(const uint32_t* a)
+{
+    uint32_t bits = 0;
+    for (uint32_t i = 0; i < P256_WORDS; i++) {
+        bits |= a[i];
+    }
+    return bits == 0;
+}
+
+inline bool p256Equal(const uint32_t* a, const uint32_t* b)
+{
+    uint32_t difference = 0;
+    for (uint32_t i = 0; i < P256_WORDS; i++) {
+        difference |= a[i] ^ b[i];
+    }
+    return difference == 0;
+}
+
+inline bool p256Less(const uint32_t* a, const uint32_t* b)
+{
+    for (uint32_t i = P256_WORDS; i-- > 0;) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i];
+        }
+    }
+    return false;
+}
+
+/* result = a + b, returns the carry */
+inline uint32_t p256AddWords(uint32_t* result, const uint32_t* a, const uint32_t* b)
+{
+    uint64_t carry = 0;
+    for (uint32_t i = 0; i < P256_WORDS; i++) {
+        carry += (uint64_t)a[i] + b[i];
+        result[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    return (uint32_t)carry;
+}
+
+/* result = a - b, returns the borrow */
+inline uint32_t p256SubtractWords(uint32_t* result, const uint32_t* a, const uint32_t* b)
+{
+    int64_t borrow = 0;
+    for (uint32_t i = 0; i < P256_WORDS; i++) {
+        borrow += (int64_t)a[i] - b[i];
+        result[i] = (uint32_t)borrow;
+        borrow >>= 32;
+    }
+    return (uint32_t)-borrow;
+}
+
+/* result = a + b mod m, for a and b below m */
+inline void p256Add(uint32_t* result, const uint32_t* a, const uint32_t* b, const P256Modulus& m)
+{
+    if (p256AddWords(result, a, b) || !p256Less(result, m.value)) {
+        p256SubtractWords(result, result, m.value);
+    }
+}
+
+/* result = a - b mod m, for a and b below m */
+inline void p256Subtract(uint32_t* result, const uint32_t* a, const uint32_t* b, const P256Modulus& m)
+{
+    if (p256SubtractWords(result, a, b)) {
+        p256AddWords(result, result, m.value);
+    }
+}
+
+/* result = a * b / R mod m (Montgomery multiplication, CIOS), for a and b
+ * below m. result may be a or b */
+inline void p256Multiply(uint32_t* result, const uint32_t* a, const uint32_t* b, const P256Modulus& m)
+{
+    uint32_t t[P256_WORDS + 2] = { 0 };
+    for (uint32_t i = 0; i < P256_WORDS; i++) {
+        uint64_t carry = 0;
+        for (uint32_t j = 0; j < P256_WORDS; j++) {
+            carry += t[j] + (uint64_t)a[j] * b[i];
+            t[j] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        carry += t[P256_WORDS];
+        t[P256_WORDS] = (uint32_t)carry;
+        t[P256_WORDS + 1] = (uint32_t)(carry >> 32);
+
+        /* Add a multiple of m that clears the lowest word, and drop it */
+        uint32_t factor = t[0] * m.inverse;
+        carry = (t[0] + (uint64_t)factor * m.value[0]) >> 32;
+        for (uint32_t j = 1; j < P256_WORDS; j++) {
+            carry += t[j] + (uint64_t)factor * m.value[j];
+            t[j - 1] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        carry += t[P256_WORDS];
+        t[P256_WORDS - 1] = (uint32_t)carry;
+        t[P256_WORDS] = t[P256_WORDS + 1] + (uint32_t)(carry >> 32);
+    }
+
+    if (t[P256_WORDS] || !p256Less(t, m.value)) {
+        p256SubtractWords(t, t, m.value);
+    }
+    p256Copy(result, t);
+}
+
+/* Convert a number below m into Montgomery form */
+inline void p256ToMontgomery(uint32_t* result, const uint32_t* a, const P256Modulus& m)
+{
+    p256Multiply(result, a, m.rSquared, m);
+}
+
+/* Convert a number out of Montgomery form */
+inline void p256FromMontgomery(uint32_t* result, const uint32_t* a, const P256Modulus& m)
+{
+    const uint32_t one[P256_WORDS] = { 1 };
+    p256Multiply(result, a, one, m);
+}
+
+/* result = 1 / a mod m in Montgomery form, as a^(m - 2) for the prime m */
+inline void p256Invert(uint32_t* result, const uint32_t* a, const P256Modulus& m)
+{
+    const uint32_t two[P256_WORDS] = { 2 };
+    uint32_t exponent[P256_WORDS];
+    uint32_t power[P256_WORDS] = { 1 };
+    p256SubtractWords(exponent, m.value, two);
+    p256ToMontgomery(power, power, m);
+    for (uint32_t bit = 32 * P256_WORDS; bit-- > 0;) {
+        p256Multiply(power, power, power, m);
+        if ((exponent[bit / 32] >> (bit % 32)) & 1) {
+            p256Multiply(power, power, a, m);
+        }
+    }
+    p256Copy(result, power);
+}
+
+/* result = 2 * a, with the formulas for a = -3 (dbl-2001-b) */
+inline void p256Double(P256Point& result, const P256Point& a)
+{
+    const P256Modulus& p = p256Prime();
+    uint32_t delta[P256_WORDS], gamma[P256_WORDS], beta[P256_WORDS], alpha[P256_WORDS];
+    uint32_t t[P256_WORDS], u[P256_WORDS];
+
+    p256Multiply(delta, a.z, a.z, p);
+    p256Multiply(gamma, a.y, a.y, p);
+    p256Multiply(beta, a.x, gamma, p);
+    p256Subtract(t, a.x, delta, p);
+    p256Add(u, a.x, delta, p);
+    p256Multiply(alpha, t, u, p);
+    p256Add(t, alpha, alpha, p);
+    p256Add(alpha, t, alpha, p);
+
+    /* z = (y + z)^2 - gamma - delta, the last use of a */
+    p256Add(t, a.y, a.z, p);
+    p256Multiply(t, t, t, p);
+    p256Subtract(t, t, gamma, p);
+    p256Subtract(result.z, t, delta, p);
+
+    /* x = alpha^2 - 8 * beta */
+    p256Add(beta, beta, beta, p);
+    p256Add(beta, beta, beta, p);
+    p256Multiply(t, alpha, alpha, p);
+    p256Subtract(t, t, beta, p);
+    p256Subtract(result.x, t, beta, p);
+
+    /* y = alpha * (4 * beta - x) - 8 * gamma^2 */
+    p256Subtract(t, beta, result.x, p);
+    p256Multiply(t, alpha, t, p);
+    p256Multiply(u, gamma, gamma, p);
+    p256Add(u, u, u, p);
+    p256Add(u, u, u, p);
+    p256Add(u, u, u, p);
+    p256Subtract(result.y, t, u, p);
+}
+
+/* result = a + b (add-2007-bl) */
+inline void p256AddPoints(P256Point& result, const P256Point& a, const P256Point& b)
+{
+    const P256Modulus& p = p256Prime();
+    if (p256IsZero(a.z)) {
+        result = b;
+        return;
+    }
+    if (p256IsZero(b.z)) {
+        result = a;
+        return;
+    }
+
+    uint32_t z1z1[P256_WORDS], z2z2[P256_WORDS], u1[P256_WORDS], u2[P256_WORDS], s1[P256_WORDS];
+    uint32_t s2[P256_WORDS], h[P256_WORDS], r[P256_WORDS], t[P256_WORDS];
+    p256Multiply(z1z1, a.z, a.z, p);
+    p256Multiply(z2z2, b.z, b.z, p);
+    p256Multiply(u1, a.x, z2z2, p);
+    p256Multiply(u2, b.x, z1z1, p);
+    p256Multiply(s1, a.y, b.z, p);
+    p256Multiply(s1, s1, z2z2, p);
+    p256Multiply(s2, b.y, a.z, p);
+    p256Multiply(s2, s2, z1z1, p);
+    p256Subtract(h, u2, u1, p);
+    p256Subtract(r, s2, s1, p);
+    if (p256IsZero(h)) {
+        if (p256IsZero(r)) {
+            p256Double(result, a);
+        } else {
+            result.z[0] = result.z[1] = result.z[2] = result.z[3] = 0;
+            result.z[4] = result.z[5] = result.z[6] = result.z[7] = 0;
+        }
+        return;
+    }
+    p256Add(r, r, r, p);
+
+    /* z = ((z1 + z2)^2 - z1z1 - z2z2) * h, before a and b may be overwritten */
+    uint32_t z[P256_WORDS];
+    p256Add(z, a.z, b.z, p);
+    p256Multiply(z, z, z, p);
+    p256Subtract(z, z, z1z1, p);
+    p256Subtract(z, z, z2z2, p);
+    p256Multiply(result.z, z, h, p);
+
+    /* i = (2 * h)^2, j = h * i, v = u1 * i, reusing z1z1, z2z2 and u2 */
+    uint32_t* i = z1z1;
+    uint32_t* j = z2z2;
+    uint32_t* v = u2;
+    p256Add(t, h, h, p);
+    p256Multiply(i, t, t, p);
+    p256Multiply(j, h, i, p);
+    p256Multiply(v, u1, i, p);
+
+    /* x = r^2 - j - 2 * v */
+    p256Multiply(t, r, r, p);
+    p256Subtract(t, t, j, p);
+    p256Subtract(t, t, v, p);
+    p256Subtract(result.x, t, v, p);
+
+    /* y = r * (v - x) - 2 * s1 * j */
+    p256Subtract(t, v, result.x, p);
+    p256Multiply(t, r, t, p);
+    p256Multiply(s1, s1, j, p);
+    p256Add(s1, s1, s1, p);
+    p256Subtract(result.y, t, s1, p);
+}
+
+/* Point from its big endian affine coordinates, which are not checked */
+inline void p256LoadPoint(P256Point& point, const uint8_t* bytes)
+{
+    const P256Modulus& p = p256Prime();
+    const uint32_t one[P256_WORDS] = { 1 };
+    p256Load(point.x, bytes);
+    p256Load(point.y, bytes + P256_SIZE);
+    p256ToMontgomery(point.x, point.x, p);
+    p256ToMontgomery(point.y, point.y, p);
+    p256ToMontgomery(point.z, one, p);
+}
+
+/* Base point G */
+inline void p256Generator(P256Point& point)
+{
+    static const uint8_t generator[P256_PUBLIC_KEY_SIZE] = {
+        0x6B, 0x17, 0xD1, 0xF2, 0xE1, 0x2C, 0x42, 0x47, 0xF8, 0xBC, 0xE6, 0xE5, 0x63, 0xA4, 0x40, 0xF2,
+        0x77, 0x03, 0x7D, 0x81, 0x2D, 0xEB, 0x33, 0xA0, 0xF4, 0xA1, 0x39, 0x45, 0xD8, 0x98, 0xC2, 0x96,
+        0x4F, 0xE3, 0x42, 0xE2, 0xFE, 0x1A, 0x7F, 0x9B, 0x8E, 0xE7, 0xEB, 0x4A, 0x7C, 0x0F, 0x9E, 0x16,
+        0x2B, 0xCE, 0x33, 0x57, 0x6B, 0x31, 0x5E, 0xCE, 0xCB, 0xB6, 0x40, 0x68, 0x37, 0xBF, 0x51, 0xF5
+    };
+    p256LoadPoint(point, generator);
+}
+
+/* result = u1 * a + u2 * b, both at once (Shamir's trick) */
+inline void p256DoubleMultiply(P256Point& result, const uint32_t* u1, const P256Point& a, const uint32_t* u2,
+    const P256Point& b)
+{
+    P256Point sum;
+    p256AddPoints(sum, a, b);
+    result.z[0] = result.z[1] = result.z[2] = result.z[3] = 0;
+    result.z[4] = result.z[5] = result.z[6] = result.z[7] = 0;
+    for (uint32_t bit = 32 * P256_WORDS; bit-- > 0;) {
+        p256Double(result, result);
+        uint32_t select = ((u1[bit / 32] >> (bit % 32)) & 1) | ((u2[bit / 32] >> (bit % 32)) & 1) << 1;
+        if (select != 0) {
+            p256AddPoints(result, result, select == 1 ? a : select == 2 ? b : sum);
+        }
+    }
+}
+
+/* Affine x of a point that is not at infinity, out of Montgomery form */
+inline void p256AffineX(uint32_t* x, const P256Point& point)
+{
+    const P256Modulus& p = p256Prime();
+    uint32_t inverse[P256_WORDS];
+    p256Invert(inverse, point.z, p);
+    p256Multiply(inverse, inverse, inverse, p);
+    p256Multiply(x, point.x, inverse, p);
+    p256FromMontgomery(x, x, p);
+}
+
+/* A hash as a number below n, the hash is as long as n */
+inline void p256LoadHash(uint32_t* e, const uint8_t* hash)
+{
+    p256Load(e, hash);
+    if (!p256Less(e, p256Order().value)) {
+        p256SubtractWords(e, e, p256Order().value);
+    }
+}
+
+/**
+ * @brief verify an ECDSA P-256 signature of a SHA-256 hash
+ *
+ * @param publicKey uncompressed public key, x and y big endian, on the curve
+ * @param hash the SHA256_DIGEST_SIZE bytes of the signed hash
+ * @param signature r and s, big endian
+ * @return true if the signature is valid
+ */
+inline bool p256Verify(const uint8_t* publicKey, const uint8_t* hash, const uint8_t* signature)
+{
+    const P256Modulus& n = p256Order();
+    uint32_t r[P256_WORDS], s[P256_WORDS], e[P256_WORDS];
+    p256Load(r, signature);
+    p256Load(s, signature + P256_SIZE);
+    if (p256IsZero(r) || p256IsZero(s) || !p256Less(r, n.value) || !p256Less(s, n.value)) {
+        return false;
+    }
+    p256LoadHash(e, hash);
+
+    /* u1 = e / s and u2 = r / s mod n, the inverse in Montgomery form */
+    uint32_t w[P256_WORDS], u1[P256_WORDS], u2[P256_WORDS];
+    p256ToMontgomery(s, s, n);
+    p256Invert(w, s, n);
+    p256Multiply(u1, e, w, n);
+    p256Multiply(u2, r, w, n);
+
+    P256Point generator, key, point;
+    p256Generator(generator);
+    p256LoadPoint(key, publicKey);
+    p256DoubleMultiply(point, u1, generator, u2, key);
+    if (p256IsZero(point.z)) {
+        return false;
+    }
+
+    /* Valid if the x of the point is r mod n, x < p < 2 * n */
+    uint32_t x[P256_WORDS];
+    p256AffineX(x, point);
+    if (!p256Less(x, n.value)) {
+        p256SubtractWords(x, x, n.value);
+    }
+    return p256Equal(x, r);
+}
@@ -0,0 +1,93 @@
+/*
+ * Okra Bootloader
+ * Copyright (C) 2019 Okra Solar Pty Ltd
+ * https://www.okrasolar.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/* Relocation table of a relocatable app. Each entry is a word that names the
+ * next word of the binary to relocate, by its distance in words from the word
+ * of the previous entry in the upper bits, and holds the offset of the address
+ * to write into it, from the start of the binary, in the lower
+ * RELOCATION_OFFSET_BITS. An entry with RELOCATION_SKIP as offset only moves
+ * on, for distances that do not fit into an entry. Header-only, so the
+ * post-link tool, the bootloader and the tests use the same format */
+const uint32_t RELOCATION_OFFSET_BITS = 18;
+const uint32_t RELOCATION_SKIP = (1U << RELOCATION_OFFSET_BITS) - 1;
+const uint32_t RELOCATION_MAX_DISTANCE = 0xFFFFFFFF >> RELOCATION_OFFSET_BITS;
+
+/* Word before the first one of the binary, where the table starts */
+const uint32_t RELOCATION_START = 0xFFFFFFFF;
+
+/**
+ * @brief decode an entry of a relocation table
+ *
+ * @param entry the entry
+ * @param position word of the previous entry, RELOCATION_START for the first
+ * one, moved on to the word of this entry
+ * @param offset offset of the address to write into the word
+ * @return true if the word is relocated, false for a skip entry
+ */
+inline bool relocationEntry(uint32_t entry, uint32_t& position, uint32_t& offset)
+{
+    position += entry >> RELOCATION_OFFSET_BITS;
+    offset = entry & RELOCATION_SKIP;
+    return offset != RELOCATION_SKIP;
+}
+
+/**
+ * @brief encode the relocations of a binary into a relocation table
+ *
+ * @param positions words of the binary to relocate, in ascending order
+ * @param offsets offsets of the addresses to write into them
+ * @param count number of words to relocate
+ * @param table buffer for the entries
+ * @param capacity number of entries that fit into the buffer
+ * @return number of entries, or -1 if the positions are not ascending, an
+ * offset does not fit into an entry or the entries do not fit into the buffer
+ */
+inline int32_t relocationEncode(const uint32_t* positions, const uint32_t* offsets, uint32_t count, uint32_t* table,
+    uint32_t capacity)
+{
+    uint32_t entries = 0;
+    uint32_t position = RELOCATION_START;
+    for (uint32_t i = 0; i < count; i++) {
+        if ((i > 0 && positions[i] <= position) || offsets[i] >= RELOCATION_SKIP) {
+            return -1;
+        }
+        while (positions[i] - position > RELOCATION_MAX_DISTANCE) {
+            if (entries == capacity) {
+                return -1;
+            }
+            table[entries++] = (RELOCATION_MAX_DISTANCE << RELOCATION_OFFSET_BITS) | RELOCATION_SKIP;
+            position += RELOCATION_MAX_DISTANCE;
+        }
+        if (entries == capacity) {
+            return -1;
+        }
+        table[entries++] = ((positions[i] - position) << RELOCATION_OFFSET_BITS) | offsets[i];
+        position = positions[i];
+    }
+    return entries;
+}
@@ -0,0 +1,123 @@
+/*
+ * Okra Bootloader
+ * Copyright (C) 2019 Okra Solar Pty Ltd
+ * https://www.okrasolar.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "BootloaderServices.h"
+#include "Crc32.h"
+#include "StatusJournal.h"
+#include "System.h"
+
+#ifdef SERVICES
+/* Entry points of the service table. System has no state and the journal
+ * lives on the stack, so all of them can be called from the app */
+
+static bool serviceIsBlank(uint32_t address, uint32_t size)
+{
+    System system;
+    return system.isBlank(address, size);
+}
+
+/* The app may only erase and program the flash of the apps. The bootloader
+ * and the status journal, which has its own routines, are left alone */
+static bool isAppFlash(uint32_t address, uint32_t size)
+{
+    return address >= APP_FLASH_START && address < APP_FLASH_END && size <= APP_FLASH_END - address;
+}
+
+static bool serviceErasePage(uint32_t address)
+{
+    if (!isAppFlash(address, FLASH_PAGE_SIZE)) {
+        return false;
+    }
+    System system;
+    bool locked = system.isFlashLocked();
+    system.unlockFlash();
+    system.erasePage(address);
+    if (locked) {
+        system.lockFlash();
+    }
+    return true;
+}
+
+static bool serviceProgramHalfWords(uint32_t address, const uint16_t* data, uint32_t size)
+{
+    if (!isAppFlash(address, size)) {
+        return false;
+    }
+    System system;
+    bool locked = system.isFlashLocked();
+    system.unlockFlash();
+    system.programHalfWords(address, data, size);
+    if (locked) {
+        system.lockFlash();
+    }
+    return true;
+}
+
+static uint32_t serviceCrcFlash(uint32_t address, uint32_t size)
+{
+    System system;
+    return system.crcFlash(address, size);
+}
+
+static uint32_t serviceCrc32(const uint32_t* data, uint32_t words, uint32_t crc)
+{
+    return crc32(data, words, crc);
+}
+
+static bool serviceReadStatus(BootloaderStatus* status)
+{
+    System system;
+    StatusJournal journal(system);
+    return journal.read(*status);
+}
+
+static void serviceWriteStatus(const BootloaderStatus* status)
+{
+    System system;
+    StatusJournal journal(system);
+    journal.write(*status);
+}
+
+static bool serviceConfirmStatus()
+{
+    System system;
+    StatusJournal journal(system);
+    return journal.confirm();
+}
+
+__attribute__((section(".services"), used)) const BootloaderServices bootloaderServiceTable = {
+    SERVICES_MAGIC,
+    SERVICES_VERSION,
+    sizeof(BootloaderServices),
+    sizeof(BootloaderStatus),
+    serviceIsBlank,
+    serviceErasePage,
+    serviceProgramHalfWords,
+    serviceCrcFlash,
+    serviceCrc32,
+    serviceReadStatus,
+    serviceWriteStatus,
+    serviceConfirmStatus,
+};
+#endif
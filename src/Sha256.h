@@ -0,0 +1,223 @@
+/*
+ * Okra Bootloader
+ * Copyright (C) 2019 Okra Solar Pty Ltd
+ * https://www.okrasolar.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/* SHA-256 (FIPS 180-4) for the image hash. Header-only, so the post-link tool,
+ * the bootloader and the tests use the same code.
+ *
+ * sha256Blocks() is written for the Cortex-M3: the eight working variables
+ * stay in registers, the message schedule is a rolling window of 16 words and
+ * the rounds are unrolled eight at a time, so the variables only change roles
+ * and are never moved. Unrolling all 64 rounds would be a little faster, but
+ * does not fit into the bootloader. Word aligned input is read straight from
+ * memory mapped flash, one load and a REV per word.
+ *
+ * Target on the STM32F1: at most SHA256_TARGET_CYCLES_PER_BYTE, measured with
+ * the DWT cycle counter between verifyStarted and verifyFinished of the boot
+ * trace (TRACEBOOT) for a plain image, so 256 KB take about 1.5 s at the 8 MHz
+ * reset clock and 160 ms with CLOCKBOOST */
+const uint32_t SHA256_BLOCK_SIZE = 64;
+const uint32_t SHA256_DIGEST_SIZE = 32;
+const uint32_t SHA256_TARGET_CYCLES_PER_BYTE = 45;
+
+/* State of a hash calculation */
+struct Sha256 {
+    uint32_t state[8];
+    uint32_t buffer[SHA256_BLOCK_SIZE / sizeof(uint32_t)];   // Bytes of the last partial block
+    uint32_t length;                                          // Bytes hashed so far
+};
+
+inline uint32_t sha256Rotate(uint32_t x, uint32_t bits)
+{
+    return (x >> bits) | (x << (32 - bits));
+}
+
+/* Big endian word of the message, the MCU and the hosts are little endian */
+inline uint32_t sha256BigEndian(uint32_t word)
+{
+    return __builtin_bswap32(word);
+}
+
+/* Word i of the message schedule, the window holds the last 16 words */
+inline uint32_t sha256Word(uint32_t* window, const uint32_t* data, uint32_t i)
+{
+    uint32_t word;
+    if (i < 16) {
+        word = sha256BigEndian(data[i]);
+    } else {
+        uint32_t w2 = window[(i - 2) & 15];
+        uint32_t w15 = window[(i - 15) & 15];
+        word = window[i & 15] + (sha256Rotate(w2, 17) ^ sha256Rotate(w2, 19) ^ (w2 >> 10)) + window[(i - 7) & 15]
+            + (sha256Rotate(w15, 7) ^ sha256Rotate(w15, 18) ^ (w15 >> 3));
+    }
+    window[i & 15] = word;
+    return word;
+}
+
+/* One round of sha256Blocks(), with its k, window and data. The caller rotates
+ * the roles of the variables instead of moving them: the new a is left in h,
+ * and d becomes the new e */
+#define SHA256_ROUND(a, b, c, d, e, f, g, h, i)                                                                   \
+    h += (sha256Rotate(e, 6) ^ sha256Rotate(e, 11) ^ sha256Rotate(e, 25)) + (g ^ (e & (f ^ g))) + k[i]         \
+        + sha256Word(window, data, i);                                                                            \
+    d += h;                                                                                                       \
+    h += (sha256Rotate(a, 2) ^ sha256Rotate(a, 13) ^ sha256Rotate(a, 22)) + ((a & b) | (c & (a | b)))
+
+/**
+ * @brief hash whole blocks of 64 bytes
+ *
+ * @param state hash state to update
+ * @param data message blocks, word aligned
+ * @param blocks number of blocks
+ */
+inline void sha256Blocks(uint32_t* state, const uint32_t* data, uint32_t blocks)
+{
+    /* Round constants, in flash */
+    static const uint32_t k[64] = {
+        0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+        0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+        0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+        0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+        0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+        0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+        0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+        0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+    };
+
+    for (; blocks > 0; blocks--, data += SHA256_BLOCK_SIZE / sizeof(uint32_t)) {
+        uint32_t window[16];
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (uint32_t i = 0; i < 64; i += 8) {
+            SHA256_ROUND(a, b, c, d, e, f, g, h, i);
+            SHA256_ROUND(h, a, b, c, d, e, f, g, i + 1);
+            SHA256_ROUND(g, h, a, b, c, d, e, f, i + 2);
+            SHA256_ROUND(f, g, h, a, b, c, d, e, i + 3);
+            SHA256_ROUND(e, f, g, h, a, b, c, d, i + 4);
+            SHA256_ROUND(d, e, f, g, h, a, b, c, i + 5);
+            SHA256_ROUND(c, d, e, f, g, h, a, b, i + 6);
+            SHA256_ROUND(b, c, d, e, f, g, h, a, i + 7);
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#undef SHA256_ROUND
+
+/* Start a hash calculation */
+inline void sha256Init(Sha256& context)
+{
+    context.state[0] = 0x6A09E667;
+    context.state[1] = 0xBB67AE85;
+    context.state[2] = 0x3C6EF372;
+    context.state[3] = 0xA54FF53A;
+    context.state[4] = 0x510E527F;
+    context.state[5] = 0x9B05688C;
+    context.state[6] = 0x1F83D9AB;
+    context.state[7] = 0x5BE0CD19;
+    context.length = 0;
+}
+
+/**
+ * @brief add bytes to a hash calculation. Whole blocks of word aligned data
+ * are hashed where they are, the rest goes through the buffer of the context
+ *
+ * @param context hash calculation, see sha256Init()
+ * @param data bytes to add
+ * @param size number of bytes
+ */
+inline void sha256Update(Sha256& context, const uint8_t* data, uint32_t size)
+{
+    uint8_t* buffer = (uint8_t*)context.buffer;
+    uint32_t used = context.length % SHA256_BLOCK_SIZE;
+    context.length += size;
+
+    /* Fill up a partial block first */
+    if (used != 0) {
+        for (; size > 0 && used < SHA256_BLOCK_SIZE; size--) {
+            buffer[used++] = *data++;
+        }
+        if (used < SHA256_BLOCK_SIZE) {
+            return;
+        }
+        sha256Blocks(context.state, context.buffer, 1);
+    }
+
+    uint32_t blocks = size / SHA256_BLOCK_SIZE;
+    if (((uintptr_t)data & (sizeof(uint32_t) - 1)) == 0) {
+        sha256Blocks(context.state, (const uint32_t*)data, blocks);
+        data += blocks * SHA256_BLOCK_SIZE;
+    } else {
+        for (; blocks > 0; blocks--) {
+            for (uint32_t i = 0; i < SHA256_BLOCK_SIZE; i++) {
+                buffer[i] = *data++;
+            }
+            sha256Blocks(context.state, context.buffer, 1);
+        }
+    }
+    for (uint32_t i = 0; i < size % SHA256_BLOCK_SIZE; i++) {
+        buffer[i] = data[i];
+    }
+}
+
+/**
+ * @brief finish a hash calculation
+ *
+ * @param context hash calculation, it cannot be updated anymore
+ * @param digest the SHA256_DIGEST_SIZE bytes of the hash
+ */
+inline void sha256Final(Sha256& context, uint8_t* digest)
+{
+    /* A 1 bit, zeros and the length in bits, which may need another block */
+    uint8_t* buffer = (uint8_t*)context.buffer;
+    uint32_t used = context.length % SHA256_BLOCK_SIZE;
+    buffer[used++] = 0x80;
+    if (used > SHA256_BLOCK_SIZE - 2 * sizeof(uint32_t)) {
+        while (used < SHA256_BLOCK_SIZE) {
+            buffer[used++] = 0;
+        }
+        sha256Blocks(context.state, context.buffer, 1);
+        used = 0;
+    }
+    while (used < SHA256_BLOCK_SIZE - 2 * sizeof(uint32_t)) {
+        buffer[used++] = 0;
+    }
+    context.buffer[14] = sha256BigEndian(context.length >> 29);
+    context.buffer[15] = sha256BigEndian(context.length << 3);
+    sha256Blocks(context.state, context.buffer, 1);
+
+    for (uint32_t i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        digest[i] = context.state[i / 4] >> (24 - 8 * (i % 4));
+    }
+}
@@ -0,0 +1,386 @@
+/*
+ * Okra Bootloader
+ * Copyright (C) 2019 Okra Solar Pty Ltd
+ * https://www.okrasolar.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "Config.h"
+#include "Crc32.h"
+
+/* Number of status records that fit into a single journal page */
+const uint32_t STATUS_RECORDS_PER_PAGE = FLASH_PAGE_SIZE / sizeof(StatusRecord);
+
+static_assert(STATUS_RECORDS_PER_PAGE > 0, "StatusRecord does not fit into a flash page");
+static_assert(sizeof(StatusRecord) % 4 == 0, "StatusRecord must be word aligned");
+
+/* Value of an erased flash word */
+const uint32_t STATUS_ERASED_WORD = 0xFFFFFFFF;
+
+/* Value of an erased and a cleared mark */
+const uint16_t STATUS_ERASED_MARK = 0xFFFF;
+const uint16_t STATUS_CLEARED_MARK = 0x0000;
+
+/* Status journal on top of the flash primitives of Flash: readFlash(),
+ * isBlank(), erasePage(), programHalfWords(), unlockFlash() and lockFlash(),
+ * as System declares them. The journal is header-only, so apps can use it
+ * with their own flash driver, see BootloaderClient.h */
+template <class Flash>
+class BasicStatusJournal
+{
+  public:
+    BasicStatusJournal(Flash& flash) :
+        flash(flash)
+    {
+    }
+
+    /**
+     * @brief find the newest valid record in the journal
+     *
+     * @param status struct to read the status into, zeroed if the journal is empty
+     * @return true if a valid record was found
+     */
+    bool read(BootloaderStatus& status);
+
+    /**
+     * @brief append a status record to the journal. Nothing is written if the
+     * status equals the newest record.
+     *
+     * @param status new status data to write
+     */
+    void write(const BootloaderStatus& status);
+
+    /**
+     * @brief add one to the installProgress of the newest record, by clearing
+     * its next progress mark in place. Once all marks are used, a record with
+     * the progress folded into the status is appended instead. Nothing is
+     * written if the journal is empty.
+     */
+    void addProgress();
+
+    /**
+     * @brief add one to the boot count of the newest record, in the same
+     * way as addProgress() but with the boot marks
+     */
+    void addBoot();
+
+    /**
+     * @brief confirm the attemptNewApp status of the newest record, by
+     * clearing its confirm mark in place
+     *
+     * @return true if the newest status is confirmed now or was already,
+     * false if it is not attemptNewApp or the journal is empty
+     */
+    bool confirm();
+
+  private:
+    /**
+     * @brief search the newest valid record over all journal pages
+     *
+     * @param record newest record found
+     * @param page journal page of the newest record, or 0 if none was found
+     * @param index slot of the newest record in its page
+     * @return true if a valid record was found
+     */
+    bool findNewest(StatusRecord& record, uint8_t& page, uint32_t& index);
+
+    /**
+     * @brief clear the next erased mark of the newest record in place
+     *
+     * @param record newest record, with all its marks folded into the status
+     * @param marksOffset offset of the marks in StatusRecord
+     * @param markCount number of marks
+     * @return true if all marks were cleared already and nothing was written,
+     * false if a mark was cleared or the journal is empty
+     */
+    bool clearNextMark(StatusRecord& record, uint32_t marksOffset, uint32_t markCount);
+
+    /**
+     * @brief clear a mark of a record in place
+     *
+     * @param page journal page of the record
+     * @param index slot of the record in its page
+     * @param markOffset offset of the mark in StatusRecord
+     */
+    void clearMark(uint8_t page, uint32_t index, uint32_t markOffset);
+
+    /**
+     * @brief count the cleared marks of a record. Marks are cleared in order,
+     * so this is also the index of the next mark to clear.
+     */
+    uint32_t clearedMarks(const uint16_t* marks, uint32_t markCount);
+
+    /**
+     * @brief add the cleared marks of a record to its status and mark them
+     * as erased again
+     */
+    void foldMarks(StatusRecord& record);
+
+    /**
+     * @brief count the programmed record slots of a page. Records are always
+     * appended, so the programmed slots form a prefix of the page and can be
+     * found with a binary search.
+     *
+     * @param page journal page index
+     * @return number of programmed record slots
+     */
+    uint32_t usedRecords(uint8_t page);
+
+    /**
+     * @brief read a record and check its crc
+     *
+     * @return true if the record is valid
+     */
+    bool readRecord(uint8_t page, uint32_t index, StatusRecord& record);
+
+    uint32_t recordAddress(uint8_t page, uint32_t index);
+
+    /* Number of words covered by the record crc */
+    static const uint32_t RECORD_CRC_WORDS = offsetof(StatusRecord, crc) / 4;
+
+    Flash& flash;
+};
+
+/* Status journal of the bootloader */
+class System;
+typedef BasicStatusJournal<System> StatusJournal;
+
+template <class Flash>
+bool BasicStatusJournal<Flash>::read(BootloaderStatus& status)
+{
+    StatusRecord record;
+    uint8_t page;
+    uint32_t index;
+    if (!findNewest(record, page, index)) {
+        memset(&status, 0, sizeof(status));
+        return false;
+    }
+    foldMarks(record);
+    status = record.status;
+    return true;
+}
+
+template <class Flash>
+void BasicStatusJournal<Flash>::write(const BootloaderStatus& status)
+{
+    StatusRecord record;
+    uint8_t page;
+    uint32_t index;
+    bool found = findNewest(record, page, index);
+
+    // The journal counts its own erases, the caller's copy may be outdated
+    uint32_t statusErases = 0;
+    if (found) {
+        foldMarks(record);
+        statusErases = record.status.statistics.statusErases;
+        record.status.statistics.statusErases = status.statistics.statusErases;
+        if (memcmp(&record.status, &status, sizeof(status)) == 0) {
+            return;
+        }
+    }
+
+    record.sequence = found ? record.sequence + 1 : 0;
+    record.status = status;
+    memset(record.progressMarks, 0xFF, sizeof(record.progressMarks));
+    memset(record.bootMarks, 0xFF, sizeof(record.bootMarks));
+    record.confirmMark = STATUS_ERASED_MARK;
+    record.reserved = STATUS_ERASED_MARK;
+
+    flash.unlockFlash();
+
+    // Append behind the last programmed slot, or compact into the next page.
+    // Torn records are skipped, as their slots are no longer erased
+    index = usedRecords(page);
+    if (index >= STATUS_RECORDS_PER_PAGE) {
+        page = (page + 1) % BOOTLOADER_STATUS_PAGES;
+        index = 0;
+        if (!flash.isBlank(recordAddress(page, 0), FLASH_PAGE_SIZE)) {
+            flash.erasePage(recordAddress(page, 0));
+            statusErases++;
+        }
+    }
+    record.status.statistics.statusErases = statusErases;
+    record.crc = crc32((uint32_t*)&record, RECORD_CRC_WORDS);
+
+    // The sequence number is programmed first, so an interrupted write
+    // always leaves a programmed (and invalid) slot behind
+    flash.programHalfWords(recordAddress(page, index), (const uint16_t*)&record, sizeof(record));
+
+    flash.lockFlash();
+}
+
+template <class Flash>
+void BasicStatusJournal<Flash>::addProgress()
+{
+    StatusRecord record;
+    if (clearNextMark(record, offsetof(StatusRecord, progressMarks), STATUS_PROGRESS_MARKS)) {
+        record.status.installProgress++;
+        write(record.status);
+    }
+}
+
+template <class Flash>
+void BasicStatusJournal<Flash>::addBoot()
+{
+    StatusRecord record;
+    if (clearNextMark(record, offsetof(StatusRecord, bootMarks), STATUS_BOOT_MARKS)) {
+        record.status.statistics.boots++;
+        write(record.status);
+    }
+}
+
+template <class Flash>
+bool BasicStatusJournal<Flash>::confirm()
+{
+    StatusRecord record;
+    uint8_t page;
+    uint32_t index;
+    if (!findNewest(record, page, index) || record.status.status != BootloaderState::attemptNewApp) {
+        return false;
+    }
+    if (record.confirmMark == STATUS_ERASED_MARK) {
+        clearMark(page, index, offsetof(StatusRecord, confirmMark));
+    }
+    return true;
+}
+
+template <class Flash>
+bool BasicStatusJournal<Flash>::clearNextMark(StatusRecord& record, uint32_t marksOffset, uint32_t markCount)
+{
+    uint8_t page;
+    uint32_t index;
+    if (!findNewest(record, page, index)) {
+        return false;
+    }
+
+    const uint16_t* marks = (const uint16_t*)((const uint8_t*)&record + marksOffset);
+    uint32_t mark = clearedMarks(marks, markCount);
+    foldMarks(record);
+    if (mark >= markCount) {
+        return true;
+    }
+
+    clearMark(page, index, marksOffset + mark * sizeof(uint16_t));
+    return false;
+}
+
+template <class Flash>
+void BasicStatusJournal<Flash>::clearMark(uint8_t page, uint32_t index, uint32_t markOffset)
+{
+    // Clearing an erased half-word is a plain program operation, the record
+    // stays valid as the marks are not covered by its crc
+    flash.unlockFlash();
+    flash.programHalfWords(recordAddress(page, index) + markOffset, &STATUS_CLEARED_MARK,
+        sizeof(STATUS_CLEARED_MARK));
+    flash.lockFlash();
+}
+
+template <class Flash>
+bool BasicStatusJournal<Flash>::findNewest(StatusRecord& record, uint8_t& page, uint32_t& index)
+{
+    bool found = false;
+    page = 0;
+    index = 0;
+
+    for (uint8_t p = 0; p < BOOTLOADER_STATUS_PAGES; p++) {
+        // Walk back from the last programmed slot to skip torn records
+        StatusRecord candidate;
+        for (uint32_t i = usedRecords(p); i > 0; i--) {
+            if (readRecord(p, i - 1, candidate)) {
+                if (!found || candidate.sequence > record.sequence) {
+                    record = candidate;
+                    page = p;
+                    index = i - 1;
+                    found = true;
+                }
+                break;
+            }
+        }
+    }
+
+    return found;
+}
+
+template <class Flash>
+uint32_t BasicStatusJournal<Flash>::clearedMarks(const uint16_t* marks, uint32_t markCount)
+{
+    // A mark torn by a reset may read back as anything but erased, it still
+    // counts as the step was reached before the mark was written
+    uint32_t cleared = 0;
+    while (cleared < markCount && marks[cleared] != STATUS_ERASED_MARK) {
+        cleared++;
+    }
+    return cleared;
+}
+
+template <class Flash>
+void BasicStatusJournal<Flash>::foldMarks(StatusRecord& record)
+{
+    record.status.installProgress += clearedMarks(record.progressMarks, STATUS_PROGRESS_MARKS);
+    record.status.statistics.boots += clearedMarks(record.bootMarks, STATUS_BOOT_MARKS);
+    if (record.confirmMark != STATUS_ERASED_MARK && record.status.status == BootloaderState::attemptNewApp) {
+        record.status.status = BootloaderState::stableApp;
+        record.status.retryCount = 0;
+        record.status.givenUpApps = 0;
+    }
+    memset(record.progressMarks, 0xFF, sizeof(record.progressMarks));
+    memset(record.bootMarks, 0xFF, sizeof(record.bootMarks));
+    record.confirmMark = STATUS_ERASED_MARK;
+}
+
+template <class Flash>
+uint32_t BasicStatusJournal<Flash>::usedRecords(uint8_t page)
+{
+    uint32_t low = 0;
+    uint32_t high = STATUS_RECORDS_PER_PAGE;
+
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        uint32_t sequence;
+        flash.readFlash(recordAddress(page, mid), (uint8_t*)&sequence, sizeof(sequence));
+        if (sequence != STATUS_ERASED_WORD) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+template <class Flash>
+bool BasicStatusJournal<Flash>::readRecord(uint8_t page, uint32_t index, StatusRecord& record)
+{
+    flash.readFlash(recordAddress(page, index), (uint8_t*)&record, sizeof(record));
+    return record.sequence != STATUS_ERASED_WORD
+        && record.crc == crc32((uint32_t*)&record, RECORD_CRC_WORDS);
+}
+
+template <class Flash>
+uint32_t BasicStatusJournal<Flash>::recordAddress(uint8_t page, uint32_t index)
+{
+    return BOOTLOADER_STATUS_STRUCT_ADDR + page * FLASH_PAGE_SIZE + index * sizeof(StatusRecord);
+}
@@ -0,0 +1,149 @@
+/*
+ * Okra Bootloader
+ * Copyright (C) 2019 Okra Solar Pty Ltd
+ * https://www.okrasolar.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "StatusJournal.h"
+#include "System.h"
+
+void System::readStatusReg(BootloaderStatus& status)
+{
+    StatusJournal journal(*this);
+    journal.read(status);
+}
+
+void System::writeStatusReg(BootloaderStatus& status)
+{
+    // Append the status to the journal in flash
+    // See ST PM0075 on how to program the flash memory
+    // https://www.st.com/resource/en/programming_manual/cd00283419.pdf
+    StatusJournal journal(*this);
+    journal.write(status);
+}
+
+void System::addStatusProgress()
+{
+    StatusJournal journal(*this);
+    journal.addProgress();
+}
+
+void System::addStatusBoot()
+{
+    StatusJournal journal(*this);
+    journal.addBoot();
+}
+
+CopyResult System::copyFlashBlock(uint32_t sourceAddress, uint32_t destinationAddress, int32_t size)
+{
+    CopyResult result = { 0, 0 };
+
+    // First unlock flash
+    unlockFlash();
+
+    // Then copy over pages one at a time from source to destination
+    while (size != 0) {
+        int32_t bytesUntilPageEnd = FLASH_PAGE_SIZE - (sourceAddress % FLASH_PAGE_SIZE);
+        int32_t bytesToProgram = size;
+
+        if (size > bytesUntilPageEnd) {
+            bytesToProgram = bytesUntilPageEnd;
+        }
+
+        // Pages that already hold the right data are left untouched
+        if (compareFlash(sourceAddress, destinationAddress, bytesToProgram)) {
+            result.pagesSkipped++;
+        } else {
+            // Program straight from the memory mapped source
+            rewritePage(destinationAddress, (const uint16_t*)flashPointer(sourceAddress), bytesToProgram);
+            result.pagesWritten++;
+        }
+
+        size -= bytesToProgram;
+        sourceAddress += bytesToProgram;
+        destinationAddress += bytesToProgram;
+    }
+
+    lockFlash();
+
+    return result;
+}
+
+#ifdef BLOCK_IMAGES
+CopyResult System::writeFlashBlock(uint32_t destinationAddress, const uint8_t* data, int32_t size)
+{
+    CopyResult result = { 0, 0 };
+
+    unlockFlash();
+    while (size != 0) {
+        int32_t bytesToProgram = size > (int32_t)FLASH_PAGE_SIZE ? FLASH_PAGE_SIZE : size;
+
+        if (compareFlash(destinationAddress, data, bytesToProgram)) {
+            result.pagesSkipped++;
+        } else {
+            rewritePage(destinationAddress, (const uint16_t*)data, bytesToProgram);
+            result.pagesWritten++;
+        }
+
+        size -= bytesToProgram;
+        data += bytesToProgram;
+        destinationAddress += bytesToProgram;
+    }
+    lockFlash();
+
+    return result;
+}
+#endif
+
+#ifdef RELOCATION
+bool System::writeFlashWord(uint32_t address, uint32_t value)
+{
+    uint32_t word;
+    readFlash(address, (uint8_t*)&word, sizeof(word));
+    if (word == value) {
+        return false;
+    }
+
+    unlockFlash();
+    if (isProgrammable(address, (const uint16_t*)&value, sizeof(value))) {
+        programHalfWords(address, (const uint16_t*)&value, sizeof(value));
+    } else {
+        // Keep the other words of the page in RAM while it is erased
+        uint32_t pageAddress = address & ~(FLASH_PAGE_SIZE - 1);
+        uint32_t* page = pageBuffer();
+        readFlash(pageAddress, (uint8_t*)page, FLASH_PAGE_SIZE);
+        page[(address - pageAddress) / sizeof(uint32_t)] = value;
+        erasePage(pageAddress);
+        programHalfWords(pageAddress, (const uint16_t*)page, FLASH_PAGE_SIZE);
+    }
+    lockFlash();
+    return true;
+}
+#endif
+
+void System::rewritePage(uint32_t address, const uint16_t* data, uint32_t size)
+{
+    // Erase the page, unless the data can be programmed over it as is
+    if (!isBlank(address, size) && !isProgrammable(address, data, size)) {
+        erasePage(address);
+    }
+    programHalfWords(address, data, size);
+}
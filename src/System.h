@@ -28,23 +28,49 @@
 
 #include "Config.h"
 
+#ifdef VERIFYHASH
+#include "Sha256.h"
+#endif
+
+#ifdef SIGNATURE
+#include "P256.h"
+#endif
+
+/* Result of a flash block copy */
+struct CopyResult {
+    uint32_t pagesSkipped;   // Destination page already held the data
+    uint32_t pagesWritten;   // Destination page was erased and programmed
+};
+
 class System
 {
   public:
     /**
-     * @brief read the status from flash
+     * @brief read the newest status from the status journal in flash
      *
-     * @param status struct to read the status into
+     * @param status struct to read the status into, zeroed if there is none
      */
     void readStatusReg(BootloaderStatus& status);
 
     /**
-     * @brief write the status into flash
+     * @brief append the status to the status journal in flash
      *
      * @param status new status data to write
      */
     void writeStatusReg(BootloaderStatus& status);
 
+    /**
+     * @brief add one to the installProgress of the status in flash, without
+     * appending a new record to the status journal
+     */
+    void addStatusProgress();
+
+    /**
+     * @brief add one to the boot count of the status in flash, without
+     * appending a new record to the status journal
+     */
+    void addStatusBoot();
+
     /**
      * @brief execute the binary at address bootAddress
      *
@@ -53,13 +79,82 @@ class System
     void executeFromAddress(uint32_t bootAddress);
 
     /**
-     * @brief copy a block of flash from one address to another
+     * @brief copy a block of flash from one address to another. Destination
+     * pages that already match the source are neither erased nor programmed.
      *
      * @param sourceAddress absolute memory address of the flash block
      * @param destinationAddress absolute memory of the location to write the flash block
      * @param size size in bytes of the flash block
+     * @return number of skipped and rewritten pages
+     */
+    CopyResult copyFlashBlock(uint32_t sourceAddress, uint32_t destinationAddress, int32_t size);
+
+    #ifdef BLOCK_IMAGES
+    /**
+     * @brief write a block of data from RAM to flash, in the same way as
+     * copyFlashBlock()
+     *
+     * @param destinationAddress absolute memory address to write the block to, page aligned
+     * @param data data to write, word aligned
+     * @param size size in bytes of the block
+     * @return number of skipped and rewritten pages
      */
-    void copyFlashBlock(uint32_t sourceAddress, uint32_t destinationAddress, int32_t size);
+    CopyResult writeFlashBlock(uint32_t destinationAddress, const uint8_t* data, int32_t size);
+
+    /**
+     * @brief compare a block of flash with data in RAM
+     *
+     * @param address absolute memory address of the flash block
+     * @param data data to compare with, word aligned
+     * @param size size in bytes of the blocks
+     * @return true if both blocks are equal
+     */
+    bool compareFlash(uint32_t address, const uint8_t* data, uint32_t size);
+
+    /**
+     * @brief RAM for one decoded block of IMAGE_BLOCK_SIZE bytes, static
+     * because it does not fit on the stack
+     *
+     * @return word aligned buffer
+     */
+    uint32_t* blockBuffer();
+    #endif
+
+    #ifdef COMPRESSION
+    /**
+     * @brief decompress an LZ4 block stored in flash, see lz4Decompress()
+     *
+     * @param address absolute memory address of the compressed block
+     * @param storedSize size in bytes of the compressed block
+     * @param data buffer for the decompressed data
+     * @param size size of the buffer in bytes
+     * @return number of bytes decompressed, or -1 if the block is malformed
+     * or does not fit into the buffer
+     */
+    int32_t decompressFlash(uint32_t address, uint32_t storedSize, uint8_t* data, uint32_t size);
+    #endif
+
+    #ifdef RELOCATION
+    /**
+     * @brief program a word of flash. A word that data cannot be programmed
+     * over, like one left half programmed by a reset, has its page erased and
+     * rewritten with the other words of the page kept. A reset during the
+     * rewrite loses them, which VERIFYCRC or VERIFYHASH detect
+     *
+     * @param address absolute memory address of the word, word aligned
+     * @param value value to program
+     * @return true if the word did not hold the value already
+     */
+    bool writeFlashWord(uint32_t address, uint32_t value);
+
+    /**
+     * @brief RAM for the words of one flash page while writeFlashWord()
+     * rewrites the page, static to keep it off the stack
+     *
+     * @return word aligned buffer
+     */
+    uint32_t* pageBuffer();
+    #endif
 
     /**
      * @brief read a block of flash into a data buffer
@@ -71,20 +166,95 @@ class System
     void readFlash(uint32_t address, uint8_t* data, int32_t size);
 
     /**
-     * @brief erase a page of flash at specified address
+     * @brief get a pointer to memory mapped flash, to read or program from
+     * flash without copying it into a buffer
+     *
+     * @param address absolute memory address in flash
+     * @return pointer to the flash contents at address
+     */
+    const uint8_t* flashPointer(uint32_t address);
+
+    /**
+     * @brief compare two blocks of flash
+     *
+     * @param address absolute memory address of the first block
+     * @param otherAddress absolute memory address of the second block
+     * @param size size in bytes of the blocks
+     * @return true if both blocks are equal
+     */
+    bool compareFlash(uint32_t address, uint32_t otherAddress, uint32_t size);
+
+    /**
+     * @brief calculate the CRC of a block of flash, see crc32()
+     *
+     * @param address absolute memory address of the block, word aligned
+     * @param size size in bytes of the block, a multiple of 4
+     * @return the CRC of the block
+     */
+    uint32_t crcFlash(uint32_t address, uint32_t size);
+
+    #ifdef VERIFYHASH
+    /**
+     * @brief add bytes to a SHA-256 calculation, see sha256Update(). Flash is
+     * hashed where it is mapped, without copying it
+     *
+     * @param context hash calculation
+     * @param data bytes to add, in RAM or from flashPointer()
+     * @param size number of bytes
+     */
+    void hash(Sha256& context, const uint8_t* data, uint32_t size);
+    #endif
+
+    #ifdef SIGNATURE
+    /**
+     * @brief check the signature of an image hash with SIGNATURE_PUBLIC_KEY,
+     * see p256Verify()
+     *
+     * @param hash SHA256_DIGEST_SIZE bytes of the image hash
+     * @param signature P256_SIGNATURE_SIZE bytes of the signature
+     * @return true if the signature is valid
+     */
+    bool verifySignature(const uint8_t* hash, const uint8_t* signature);
+    #endif
+
+    /**
+     * @brief check if a block of flash is erased
+     *
+     * @param address absolute memory address of the block, word aligned
+     * @param size size in bytes of the block, a multiple of 4
+     * @return true if all bytes of the block are 0xFF
+     */
+    bool isBlank(uint32_t address, uint32_t size);
+
+    /**
+     * @brief check if data can be programmed over a block of flash without
+     * erasing it first. Each half-word of flash must either hold the data
+     * already, be erased (0xFFFF), or be cleared to 0x0000.
+     *
+     * @param address absolute memory address of the block
+     * @param data pointer to data that we want to program
+     * @param size size in bytes of the data
+     * @return true if no erase is needed
+     */
+    bool isProgrammable(uint32_t address, const uint16_t* data, uint32_t size);
+
+    /**
+     * @brief erase a page of flash at specified address. The flash must be
+     * unlocked, returns when the erase has finished.
      *
      * @param address
      */
     void erasePage(uint32_t address);
 
     /**
-     * @brief program up to a single page of flash
+     * @brief program up to a single page of flash. Half-words that already
+     * hold the data are skipped.
      *
      * @param address absolute memory address to program
      * @param data pointer to data that we want to program
      * @param size size in bytes of the data that we want to program
      */
-    void programHalfWords(uint32_t address, uint16_t* data, uint32_t size);
+    void programHalfWords(uint32_t address, const uint16_t* data, uint32_t size);
 
     /**
      * @brief unlock the flash
@@ -96,8 +266,111 @@ class System
      */
     void lockFlash();
 
+    /**
+     * @brief check if the flash is locked
+     *
+     * @return true if erasing and programming need unlockFlash() first
+     */
+    bool isFlashLocked();
+
+    /**
+     * @brief switch the core to its maximum clock speed, to speed up
+     * copying and verifying apps. Does nothing if the clock is already boosted.
+     */
+    void boostClock();
+
+    /**
+     * @brief switch the clocks back to their reset state. Must be called
+     * before the app is started if the clock was boosted.
+     */
+    void restoreClock();
+
     /**
      * @brief enables the MCU's watchdog.
      */
     void enableWatchdog();
+
+    #ifdef BACKUPRETRY
+    /**
+     * @brief read the first backup data registers (BKP_DR1 onwards)
+     *
+     * @param data buffer for the register values
+     * @param count number of registers to read
+     */
+    void readBackupRegisters(uint16_t* data, uint32_t count);
+
+    /**
+     * @brief write the first backup data registers (BKP_DR1 onwards)
+     *
+     * @param data register values to write
+     * @param count number of registers to write
+     */
+    void writeBackupRegisters(const uint16_t* data, uint32_t count);
+    #endif
+
+    #if defined(TRACEBOOT) || defined(MAILBOX)
+    /**
+     * @brief start counting core clock cycles from 0. The counter is left
+     * running for the app unless stopCycleCounter() is called.
+     */
+    void startCycleCounter();
+
+    /**
+     * @brief stop the cycle counter, and the trace block unless a debugger
+     * is attached, as they are out of reset
+     */
+    void stopCycleCounter();
+
+    /**
+     * @brief get the core clock cycles since startCycleCounter()
+     *
+     * @return cycle count, wrapping around after 2^32 cycles
+     */
+    uint32_t cycleCount();
+    #endif
+
+    #ifdef MAILBOX
+    /**
+     * @brief read the mailbox from the shared RAM, without checking it
+     *
+     * @param mailbox struct to read the mailbox into
+     */
+    void readMailbox(Mailbox& mailbox);
+
+    /**
+     * @brief write the mailbox to the shared RAM
+     *
+     * @param mailbox mailbox to write, including its crc
+     */
+    void writeMailbox(const Mailbox& mailbox);
+    #endif
+
+    #ifdef TRACEBOOT
+    /**
+     * @brief timestamp a boot phase in the boot trace. bootEntered restarts
+     * the trace and its timestamps, appStarted completes it.
+     *
+     * @param phase boot phase that was reached
+     * @param argument detail of the phase, see BootPhase
+     */
+    void tracePhase(BootPhase phase, uint32_t argument);
+    #endif
+
+  private:
+    /**
+     * @brief program data over a part of a flash page, erasing the page
+     * first unless the data can be programmed over it as is
+     *
+     * @param address absolute memory address in the page
+     * @param data data to program
+     * @param size size in bytes of the data, up to the end of the page
+     */
+    void rewritePage(uint32_t address, const uint16_t* data, uint32_t size);
 };
+
+/* Trace a boot phase, compiled out unless TRACEBOOT is defined */
+#ifdef TRACEBOOT
+#define TRACE_PHASE(system, phase, argument) (system).tracePhase(BootPhase::phase, argument)
+#else
+#define TRACE_PHASE(system, phase, argument)
+#endif
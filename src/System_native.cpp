@@ -22,27 +22,447 @@
  *
  */
 
+#include "Crc32.h"
+#include "FlashSimulator.h"
+#include "Lz4.h"
 #include "System.h"
 
-void System::readStatusReg(BootloaderStatus& status)
+#include <stdio.h>
+#include <string.h>
+
+#if defined(TRACEBOOT) || defined(MAILBOX)
+#include <chrono>
+#endif
+
+thread_local FlashSimulator flashSimulator;
+
+FlashSimulator::FlashSimulator() :
+    observer(nullptr)
+{
+    #ifdef TRACEBOOT
+    memset(&bootTrace, 0, sizeof(bootTrace));
+    traceSink = printBootTrace;
+    #endif
+    reset();
+}
+
+void FlashSimulator::reset()
+{
+    memset(flash, 0xFF, sizeof(flash));
+    memset(backupRegisters, 0, sizeof(backupRegisters));
+    powerCycle();
+}
+
+void FlashSimulator::clearCounters()
+{
+    bytesRead = 0;
+    pagesErased = 0;
+    halfWordsProgrammed = 0;
+    writeOperations = 0;
+    errors = 0;
+    boots = 0;
+    bootAddress = 0;
+    clockBoosts = 0;
+    bytesHashed = 0;
+    signatureChecks = 0;
+}
+
+void FlashSimulator::restart()
+{
+    locked = true;
+    clockBoosted = false;
+    watchdogEnabled = false;
+    powerCut = NO_POWER_CUT;
+    tornWrite = false;
+    #if defined(TRACEBOOT) || defined(MAILBOX)
+    cycleStart = 0;
+    cycleCounterRunning = false;
+    #endif
+    clearCounters();
+}
+
+void FlashSimulator::powerCycle()
+{
+    #ifdef MAILBOX
+    memset(&mailbox, 0, sizeof(mailbox));
+    #endif
+    restart();
+}
+
+void FlashSimulator::count(SimulatorOperation operation, uint32_t address, uint32_t size)
+{
+    switch (operation) {
+        case SimulatorOperation::flashRead:
+            bytesRead += size;
+            break;
+        case SimulatorOperation::pageErase:
+            pagesErased += size;
+            break;
+        case SimulatorOperation::halfWordProgram:
+            halfWordsProgrammed += size;
+            break;
+        case SimulatorOperation::clockBoost:
+            clockBoosts += size;
+            break;
+        case SimulatorOperation::hashBytes:
+            bytesHashed += size;
+            break;
+        case SimulatorOperation::signatureCheck:
+            signatureChecks += size;
+            break;
+    }
+
+    if (observer != nullptr) {
+        observer(operation, address, size);
+    }
+}
+
+bool FlashSimulator::powerFails()
+{
+    return writeOperations++ == powerCut;
+}
+
+uint8_t* FlashSimulator::memory(uint32_t address, uint32_t size)
+{
+    if (address < SIMULATOR_FLASH_START || size > SIMULATOR_FLASH_SIZE
+        || address - SIMULATOR_FLASH_START > SIMULATOR_FLASH_SIZE - size) {
+        return nullptr;
+    }
+    return &flash[address - SIMULATOR_FLASH_START];
+}
+
+void System::executeFromAddress(uint32_t bootAddress)
+{
+    TRACE_PHASE(*this, appStarted, 0);
+
+    // The simulated app returns right away
+    flashSimulator.boots++;
+    flashSimulator.bootAddress = bootAddress;
+}
+
+void System::readFlash(uint32_t address, uint8_t* data, int32_t size)
+{
+    const uint8_t* flash = flashSimulator.memory(address, size);
+    if (flash == nullptr) {
+        flashSimulator.errors++;
+        memset(data, 0xFF, size);
+        return;
+    }
+    memcpy(data, flash, size);
+    flashSimulator.count(SimulatorOperation::flashRead, address, size);
+}
+
+const uint8_t* System::flashPointer(uint32_t address)
+{
+    return flashSimulator.memory(address);
+}
+
+bool System::compareFlash(uint32_t address, uint32_t otherAddress, uint32_t size)
+{
+    const uint8_t* flash = flashSimulator.memory(address, size);
+    const uint8_t* otherFlash = flashSimulator.memory(otherAddress, size);
+    if (flash == nullptr || otherFlash == nullptr) {
+        flashSimulator.errors++;
+        return false;
+    }
+    // Stops at the first difference, like the target
+    uint32_t i = 0;
+    while (i < size && flash[i] == otherFlash[i]) {
+        i++;
+    }
+    flashSimulator.count(SimulatorOperation::flashRead, address, 2 * i);
+    return i == size;
+}
+
+#ifdef BLOCK_IMAGES
+bool System::compareFlash(uint32_t address, const uint8_t* data, uint32_t size)
+{
+    const uint8_t* flash = flashSimulator.memory(address, size);
+    if (flash == nullptr) {
+        flashSimulator.errors++;
+        return false;
+    }
+    uint32_t i = 0;
+    while (i < size && flash[i] == data[i]) {
+        i++;
+    }
+    flashSimulator.count(SimulatorOperation::flashRead, address, i);
+    return i == size;
+}
+
+uint32_t* System::blockBuffer()
+{
+    // One per thread, like the simulated flash
+    static thread_local uint32_t buffer[IMAGE_BLOCK_SIZE / sizeof(uint32_t)];
+    return buffer;
+}
+#endif
+
+#ifdef RELOCATION
+uint32_t* System::pageBuffer()
+{
+    static thread_local uint32_t buffer[FLASH_PAGE_SIZE / sizeof(uint32_t)];
+    return buffer;
+}
+#endif
+
+#ifdef COMPRESSION
+int32_t System::decompressFlash(uint32_t address, uint32_t storedSize, uint8_t* data, uint32_t size)
+{
+    const uint8_t* flash = flashSimulator.memory(address, storedSize);
+    if (flash == nullptr) {
+        flashSimulator.errors++;
+        return -1;
+    }
+    flashSimulator.count(SimulatorOperation::flashRead, address, storedSize);
+    return lz4Decompress(flash, storedSize, data, size);
+}
+#endif
+
+uint32_t System::crcFlash(uint32_t address, uint32_t size)
+{
+    const uint8_t* flash = flashSimulator.memory(address, size);
+    if (flash == nullptr) {
+        flashSimulator.errors++;
+        return 0;
+    }
+    flashSimulator.count(SimulatorOperation::flashRead, address, size);
+    return crc32((const uint32_t*)flash, size / sizeof(uint32_t));
+}
+
+#ifdef VERIFYHASH
+void System::hash(Sha256& context, const uint8_t* data, uint32_t size)
+{
+    const uint8_t* flash = flashSimulator.memory(SIMULATOR_FLASH_START);
+    if (data >= flash && data < flash + SIMULATOR_FLASH_SIZE) {
+        flashSimulator.count(SimulatorOperation::flashRead, SIMULATOR_FLASH_START + (data - flash), size);
+    }
+    flashSimulator.count(SimulatorOperation::hashBytes, 0, size);
+    sha256Update(context, data, size);
+}
+#endif
+
+#ifdef SIGNATURE
+bool System::verifySignature(const uint8_t* hash, const uint8_t* signature)
+{
+    flashSimulator.count(SimulatorOperation::signatureCheck, 0, 1);
+    return p256Verify(SIGNATURE_PUBLIC_KEY, hash, signature);
+}
+#endif
+
+bool System::isBlank(uint32_t address, uint32_t size)
+{
+    const uint8_t* flash = flashSimulator.memory(address, size);
+    if (flash == nullptr) {
+        flashSimulator.errors++;
+        return false;
+    }
+    uint32_t i = 0;
+    while (i < size && flash[i] == 0xFF) {
+        i++;
+    }
+    flashSimulator.count(SimulatorOperation::flashRead, address, i);
+    return i == size;
+}
+
+bool System::isProgrammable(uint32_t address, const uint16_t* data, uint32_t size)
+{
+    const uint8_t* flash = flashSimulator.memory(address, size);
+    if (flash == nullptr) {
+        flashSimulator.errors++;
+        return false;
+    }
+    for (uint32_t i = 0; i < size / sizeof(uint16_t); i++) {
+        uint16_t halfWord;
+        memcpy(&halfWord, flash + i * sizeof(uint16_t), sizeof(halfWord));
+        if (halfWord != data[i] && halfWord != 0xFFFF && data[i] != 0x0000) {
+            flashSimulator.count(SimulatorOperation::flashRead, address, 2 * (i + 1) * sizeof(uint16_t));
+            return false;
+        }
+    }
+    flashSimulator.count(SimulatorOperation::flashRead, address, 2 * size);
+    return true;
+}
+
+void System::erasePage(uint32_t address)
+{
+    // The hardware erases the page that contains the address
+    uint32_t pageAddress = address - (address % FLASH_PAGE_SIZE);
+    uint8_t* flash = flashSimulator.memory(pageAddress, FLASH_PAGE_SIZE);
+    if (flash == nullptr || flashSimulator.locked) {
+        flashSimulator.errors++;
+        return;
+    }
+
+    // An interrupted erase leaves the page in between, here half erased
+    if (flashSimulator.powerFails()) {
+        if (flashSimulator.tornWrite) {
+            memset(flash, 0xFF, FLASH_PAGE_SIZE / 2);
+        }
+        throw PowerFailure();
+    }
+
+    memset(flash, 0xFF, FLASH_PAGE_SIZE);
+    flashSimulator.count(SimulatorOperation::pageErase, pageAddress, 1);
+}
+
+void System::programHalfWords(uint32_t address, const uint16_t* data, uint32_t size)
+{
+    uint8_t* flash = flashSimulator.memory(address, size);
+    if (flash == nullptr || flashSimulator.locked || address % sizeof(uint16_t) != 0) {
+        flashSimulator.errors++;
+        return;
+    }
+
+    // Each half-word is programmed and reported on its own, in order
+    for (uint32_t i = 0; i < size / sizeof(uint16_t); i++) {
+        // Half-words that already hold the data are skipped, as on the target
+        uint16_t halfWord;
+        memcpy(&halfWord, flash, sizeof(halfWord));
+        flashSimulator.count(SimulatorOperation::flashRead, address, 2 * sizeof(uint16_t));
+        if (halfWord != data[i]) {
+            if (halfWord == 0xFFFF || data[i] == 0x0000) {
+                // An interrupted program leaves some of the bits cleared, here
+                // those of the low byte
+                if (flashSimulator.powerFails()) {
+                    if (flashSimulator.tornWrite) {
+                        halfWord &= data[i] | 0xFF00;
+                        memcpy(flash, &halfWord, sizeof(halfWord));
+                    }
+                    throw PowerFailure();
+                }
+                memcpy(flash, &data[i], sizeof(halfWord));
+                flashSimulator.count(SimulatorOperation::halfWordProgram, address, 1);
+            } else {
+                flashSimulator.errors++;
+            }
+        }
+        flash += sizeof(uint16_t);
+        address += sizeof(uint16_t);
+    }
+}
+
+void System::unlockFlash()
+{
+    flashSimulator.locked = false;
+}
+
+void System::lockFlash()
+{
+    flashSimulator.locked = true;
+}
+
+bool System::isFlashLocked()
+{
+    return flashSimulator.locked;
+}
+
+void System::boostClock()
+{
+    flashSimulator.clockBoosted = true;
+    flashSimulator.count(SimulatorOperation::clockBoost, 0, 1);
+}
+
+void System::restoreClock()
 {
-    status = { 0 };
+    flashSimulator.clockBoosted = false;
 }
 
-void System::writeStatusReg(BootloaderStatus& status) {}
+void System::enableWatchdog()
+{
+    flashSimulator.watchdogEnabled = true;
+}
 
-void System::executeFromAddress(uint32_t bootAddress) {}
+#ifdef BACKUPRETRY
+void System::readBackupRegisters(uint16_t* data, uint32_t count)
+{
+    if (count > SIMULATOR_BACKUP_REGISTERS) {
+        flashSimulator.errors++;
+        count = SIMULATOR_BACKUP_REGISTERS;
+    }
+    memcpy(data, flashSimulator.backupRegisters, count * sizeof(uint16_t));
+}
 
-void System::copyFlashBlock(uint32_t sourceAddress, uint32_t destinationAddress, int32_t size) {}
+void System::writeBackupRegisters(const uint16_t* data, uint32_t count)
+{
+    if (count > SIMULATOR_BACKUP_REGISTERS) {
+        flashSimulator.errors++;
+        count = SIMULATOR_BACKUP_REGISTERS;
+    }
+    memcpy(flashSimulator.backupRegisters, data, count * sizeof(uint16_t));
+}
+#endif
 
-void System::readFlash(uint32_t address, uint8_t* data, int32_t size) {}
+#if defined(TRACEBOOT) || defined(MAILBOX)
+static uint64_t hostNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
 
-void System::erasePage(uint32_t address) {}
+void System::startCycleCounter()
+{
+    flashSimulator.cycleStart = hostNanoseconds();
+    flashSimulator.cycleCounterRunning = true;
+}
 
-void System::programHalfWords(uint32_t address, uint16_t* data, uint32_t size) {}
+void System::stopCycleCounter()
+{
+    flashSimulator.cycleCounterRunning = false;
+}
 
-void System::unlockFlash() {}
+uint32_t System::cycleCount()
+{
+    return (uint32_t)(hostNanoseconds() - flashSimulator.cycleStart);
+}
+#endif
+
+#ifdef MAILBOX
+void System::readMailbox(Mailbox& mailbox)
+{
+    mailbox = flashSimulator.mailbox;
+}
+
+void System::writeMailbox(const Mailbox& mailbox)
+{
+    flashSimulator.mailbox = mailbox;
+}
+#endif
 
-void System::lockFlash() {}
+#ifdef TRACEBOOT
+void System::tracePhase(BootPhase phase, uint32_t argument)
+{
+    BootTrace& trace = flashSimulator.bootTrace;
+    if (phase == BootPhase::bootEntered) {
+        startCycleCounter();
+        trace.magic = 0;
+        trace.count = 0;
+    }
+
+    uint32_t timestamp = phase == BootPhase::bootEntered ? 0 : cycleCount();
+    if (trace.count < BOOT_TRACE_ENTRIES) {
+        BootTraceEntry& entry = trace.entries[trace.count];
+        entry.timestamp = timestamp;
+        entry.phase = phase;
+        entry.argument = argument;
+    }
+    trace.count++;
 
-void System::enableWatchdog() {}
+    if (phase == BootPhase::appStarted) {
+        trace.magic = BOOT_TRACE_MAGIC;
+    }
+
+    if (flashSimulator.traceSink != nullptr) {
+        flashSimulator.traceSink(phase, argument, timestamp);
+    }
+}
+
+void printBootTrace(BootPhase phase, uint32_t argument, uint32_t timestamp)
+{
+    static const char* const names[] = { "bootEntered", "statusRead", "verifyStarted", "verifyFinished",
+        "installStarted", "installFinished", "clockSwitched", "bootDecided", "appStarted" };
+    const char* name = phase < sizeof(names) / sizeof(names[0]) ? names[phase] : "unknown";
+    printf("boot trace %10.3f ms  %-16s %u\n", timestamp / 1e6, name, argument);
+}
+#endif
@@ -22,6 +22,8 @@
  *
  */
 
+#include "Crc32.h"
+#include "Lz4.h"
 #include "System.h"
 #include "stm32f1xx.h"
 
@@ -29,23 +31,29 @@
 #define MIN_PROG_SIZE 2U   // half word
 #define INVALID_PAGE_SIZE 0xFFFFFFFF
 
-#if (defined(STM32F101x6) || defined(STM32F102x6) || defined(STM32F103x6) || defined(STM32F100xB) || defined(STM32F101xB) || defined(STM32F102xB) || defined(STM32F103xB))
-#define FLASH_PAGE_SIZE          0x400U
-#endif /* STM32F101x6 || STM32F102x6 || STM32F103x6 */
-       /* STM32F100xB || STM32F101xB || STM32F102xB || STM32F103xB */
-
-#if (defined(STM32F100xE) || defined(STM32F101xE) || defined(STM32F103xE) || defined(STM32F101xG) || defined(STM32F103xG) || defined(STM32F105xC) || defined(STM32F107xC))
-#define FLASH_PAGE_SIZE          0x800U
-#endif /* STM32F100xB || STM32F101xB || STM32F102xB || STM32F103xB */
-       /* STM32F101xG || STM32F103xG */
-       /* STM32F105xC || STM32F107xC */
-
 // Watchdog clock frequency is ~40kHz, divide clock by 64
 static const uint32_t WATCHDOG_PRESCALER = 0b100;
 
 // Watchdog timeout of 5 seconds
 static const uint32_t WATCHDOG_COUNTER = 3125;
 
+// HSE crystal frequency of 8 MHz, multiplied by 9 to run the core at 72 MHz
+static const uint32_t BOOST_PLL_MULTIPLIER_HSE = RCC_CFGR_PLLMULL9;
+static const uint32_t BOOST_CLOCK_HSE = 72000000;
+
+// If the HSE does not start, HSI / 2 is multiplied by 16 to run at 64 MHz
+static const uint32_t BOOST_PLL_MULTIPLIER_HSI = RCC_CFGR_PLLMULL16;
+static const uint32_t BOOST_CLOCK_HSI = 64000000;
+
+// Clock after reset, the 8 MHz HSI
+static const uint32_t RESET_CLOCK_HSI = 8000000;
+
+// Number of polls to wait for the HSE to become ready
+static const uint32_t HSE_STARTUP_POLLS = 0x5000;
+
+// Maximum number of transfers of a single DMA run
+static const uint32_t DMA_MAX_TRANSFERS = 0xFFFF;
+
 /* application entry point */
 typedef void (*AppEntry)(void);
 
@@ -54,38 +62,15 @@ volatile static uint32_t stackPointer = 0;
 volatile static uint32_t applicationEntry = 0;
 volatile static AppEntry application = 0;
 
-void System::readStatusReg(BootloaderStatus& status)
-{
-    status = *((BootloaderStatus*)BOOTLOADER_STATUS_STRUCT_ADDR);
-}
-
-void System::writeStatusReg(BootloaderStatus& status)
-{
-    // Write the status register to the flash
-    // See ST PM0075 on how to program the flash memory
-    // https://www.st.com/resource/en/programming_manual/cd00283419.pdf
-
-    // Make sure the status reg is halfword aligned
-    static_assert(sizeof(status) % 2 == 0);
-
-    unlockFlash();
-    while (READ_BIT(FLASH->SR, FLASH_SR_BSY))
-        ;
-
-    erasePage(BOOTLOADER_STATUS_STRUCT_ADDR);
-    while (READ_BIT(FLASH->SR, FLASH_SR_BSY))
-        ;
-    CLEAR_BIT(FLASH->CR, FLASH_CR_PER);
-
-    uint16_t* data = (uint16_t*)&status;
-    uint32_t address = BOOTLOADER_STATUS_STRUCT_ADDR;
-    uint32_t size = sizeof(status);
-    programHalfWords(address, data, size);
+#ifdef MAILBOX
+/* Mailbox shared with the app, placed at MAILBOX_ADDRESS by linker.ld */
+__attribute__((section(".noinit.mailbox"), used)) static Mailbox mailbox;
+#endif
 
-    lockFlash();
-    while (READ_BIT(FLASH->SR, FLASH_SR_BSY))
-        ;
-}
+#ifdef TRACEBOOT
+/* Boot trace for the app, placed at BOOT_TRACE_ADDRESS by linker.ld */
+__attribute__((section(".noinit.boottrace"), used)) static BootTrace bootTrace;
+#endif
 
 void System::executeFromAddress(uint32_t bootAddress)
 {
@@ -97,6 +82,8 @@ void System::executeFromAddress(uint32_t bootAddress)
     applicationEntry = vectorTable[1];
     application = (AppEntry)applicationEntry;
 
+    TRACE_PHASE(*this, appStarted, 0);
+
     /* Vector table redirection */
     SCB->VTOR = bootAddress;
 
@@ -115,49 +102,172 @@ void System::executeFromAddress(uint32_t bootAddress)
     __NOP();
 }
 
-void System::copyFlashBlock(uint32_t sourceAddress, uint32_t destinationAddress, int32_t size)
+void System::readFlash(uint32_t address, uint8_t* data, int32_t size)
 {
-    // First unlock flash
-    unlockFlash();
-    while (READ_BIT(FLASH->SR, FLASH_SR_BSY))
-        ;
+    uint8_t* src = (uint8_t*)address;
 
-    // Then copy over pages one at a time from source to destination
-    while(size != 0) {
-        int32_t bytesUntilPageEnd = FLASH_PAGE_SIZE - (sourceAddress % FLASH_PAGE_SIZE);
-        int32_t bytesToProgram = size;
+    // Copy whole words if both sides are word aligned
+    if ((address | (uint32_t)data) % sizeof(uint32_t) == 0) {
+        uint32_t* srcWord = (uint32_t*)src;
+        uint32_t* dstWord = (uint32_t*)data;
+        for (; size >= (int32_t)sizeof(uint32_t); size -= sizeof(uint32_t)) {
+            *dstWord++ = *srcWord++;
+        }
+        src = (uint8_t*)srcWord;
+        data = (uint8_t*)dstWord;
+    }
+
+    for (int i = 0; i < size; i++) {
+        *data++ = *src++;
+    }
+}
+
+const uint8_t* System::flashPointer(uint32_t address)
+{
+    return (const uint8_t*)address;
+}
 
-        if (size > bytesUntilPageEnd) {
-            bytesToProgram = bytesUntilPageEnd;
+bool System::compareFlash(uint32_t address, uint32_t otherAddress, uint32_t size)
+{
+    const uint32_t* a = (const uint32_t*)address;
+    const uint32_t* b = (const uint32_t*)otherAddress;
+    uint32_t words = size / sizeof(uint32_t);
+
+    // Compare blocks of four words, so the loads are merged into LDM instructions
+    for (; words >= 4; words -= 4) {
+        uint32_t a0 = a[0], a1 = a[1], a2 = a[2], a3 = a[3];
+        uint32_t b0 = b[0], b1 = b[1], b2 = b[2], b3 = b[3];
+        if ((a0 ^ b0) | (a1 ^ b1) | (a2 ^ b2) | (a3 ^ b3)) {
+            return false;
+        }
+        a += 4;
+        b += 4;
+    }
+    for (; words > 0; words--) {
+        if (*a++ != *b++) {
+            return false;
         }
-        uint8_t buffer[bytesToProgram];
+    }
 
-        // Read the bytes for this page into the buffer
-        readFlash(sourceAddress, buffer, bytesToProgram);
+    const uint8_t* tailA = (const uint8_t*)a;
+    const uint8_t* tailB = (const uint8_t*)b;
+    for (uint32_t i = 0; i < size % sizeof(uint32_t); i++) {
+        if (*tailA++ != *tailB++) {
+            return false;
+        }
+    }
+    return true;
+}
 
-        // Erase the page at the destination
-        erasePage(destinationAddress);
-        while (READ_BIT(FLASH->SR, FLASH_SR_BSY))
-            ;
-        CLEAR_BIT(FLASH->CR, FLASH_CR_PER);
+#ifdef BLOCK_IMAGES
+bool System::compareFlash(uint32_t address, const uint8_t* data, uint32_t size)
+{
+    // RAM and flash share the address space
+    return compareFlash(address, (uint32_t)data, size);
+}
 
-        // Write the buffer into the destination
-        programHalfWords(destinationAddress, (uint16_t*)buffer, bytesToProgram);
+uint32_t* System::blockBuffer()
+{
+    static uint32_t buffer[IMAGE_BLOCK_SIZE / sizeof(uint32_t)];
+    return buffer;
+}
+#endif
+
+#ifdef RELOCATION
+uint32_t* System::pageBuffer()
+{
+    static uint32_t buffer[FLASH_PAGE_SIZE / sizeof(uint32_t)];
+    return buffer;
+}
+#endif
 
-        size -= bytesToProgram;
-        sourceAddress += bytesToProgram;
-        destinationAddress += bytesToProgram;
+#ifdef COMPRESSION
+int32_t System::decompressFlash(uint32_t address, uint32_t storedSize, uint8_t* data, uint32_t size)
+{
+    return lz4Decompress((const uint8_t*)address, storedSize, data, size);
+}
+#endif
+
+uint32_t System::crcFlash(uint32_t address, uint32_t size)
+{
+    // The app may call this through the service table. A DMA channel it
+    // is using is left alone, and the clocks it enabled stay enabled
+    uint32_t enabledClocks = READ_BIT(RCC->AHBENR, RCC_AHBENR_CRCEN | RCC_AHBENR_DMA1EN);
+    if ((enabledClocks & RCC_AHBENR_DMA1EN) && READ_BIT(DMA1_Channel1->CCR, DMA_CCR_EN)) {
+        return crc32((const uint32_t*)address, size / sizeof(uint32_t));
     }
 
-    lockFlash();
+    SET_BIT(RCC->AHBENR, RCC_AHBENR_CRCEN | RCC_AHBENR_DMA1EN);
+    WRITE_REG(CRC->CR, CRC_CR_RESET);
+
+    // Memory to memory DMA feeds the flash words into the CRC unit at bus speed
+    uint32_t words = size / sizeof(uint32_t);
+    while (words > 0) {
+        uint32_t transfers = words > DMA_MAX_TRANSFERS ? DMA_MAX_TRANSFERS : words;
+
+        WRITE_REG(DMA1_Channel1->CPAR, (uint32_t)&CRC->DR);
+        WRITE_REG(DMA1_Channel1->CMAR, address);
+        WRITE_REG(DMA1_Channel1->CNDTR, transfers);
+        WRITE_REG(DMA1_Channel1->CCR, DMA_CCR_MEM2MEM | DMA_CCR_MSIZE_1 | DMA_CCR_PSIZE_1
+                | DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_EN);
+        while (!READ_BIT(DMA1->ISR, DMA_ISR_TCIF1 | DMA_ISR_TEIF1))
+            ;
+        WRITE_REG(DMA1_Channel1->CCR, 0);
+        WRITE_REG(DMA1->IFCR, DMA_IFCR_CGIF1);
+
+        address += transfers * sizeof(uint32_t);
+        words -= transfers;
+    }
+
+    uint32_t crc = READ_REG(CRC->DR);
+    CLEAR_BIT(RCC->AHBENR, ~enabledClocks & (RCC_AHBENR_CRCEN | RCC_AHBENR_DMA1EN));
+    return crc;
 }
 
-void System::readFlash(uint32_t address, uint8_t* data, int32_t size)
+#ifdef VERIFYHASH
+void System::hash(Sha256& context, const uint8_t* data, uint32_t size)
 {
-    uint8_t* src = (uint8_t*)address;
-    for (int i = 0; i < size; i++) {
-        *data++ = *src++;
+    sha256Update(context, data, size);
+}
+#endif
+
+#ifdef SIGNATURE
+bool System::verifySignature(const uint8_t* hash, const uint8_t* signature)
+{
+    return p256Verify(SIGNATURE_PUBLIC_KEY, hash, signature);
+}
+#endif
+
+bool System::isBlank(uint32_t address, uint32_t size)
+{
+    const uint32_t* word = (const uint32_t*)address;
+    uint32_t words = size / sizeof(uint32_t);
+
+    // Check blocks of four words, so the loads are merged into LDM instructions
+    for (; words >= 4; words -= 4) {
+        if ((word[0] & word[1] & word[2] & word[3]) != 0xFFFFFFFF) {
+            return false;
+        }
+        word += 4;
     }
+    for (; words > 0; words--) {
+        if (*word++ != 0xFFFFFFFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool System::isProgrammable(uint32_t address, const uint16_t* data, uint32_t size)
+{
+    const uint16_t* halfWord = (const uint16_t*)address;
+    for (uint32_t i = 0; i < size / sizeof(uint16_t); i++) {
+        if (*halfWord != data[i] && *halfWord != 0xFFFF && data[i] != 0x0000) {
+            return false;
+        }
+        halfWord++;
+    }
+    return true;
 }
 
 void System::erasePage(uint32_t address)
@@ -166,25 +276,39 @@ void System::erasePage(uint32_t address)
     SET_BIT(FLASH->CR, FLASH_CR_PER);
     WRITE_REG(FLASH->AR, address);
     SET_BIT(FLASH->CR, FLASH_CR_STRT);
+    while (READ_BIT(FLASH->SR, FLASH_SR_BSY))
+        ;
+    CLEAR_BIT(FLASH->CR, FLASH_CR_PER);
 }
 
-void System::programHalfWords(uint32_t address, uint16_t* data, uint32_t size)
+void System::programHalfWords(uint32_t address, const uint16_t* data, uint32_t size)
 {
+    // PG stays set while programming the whole block
+    SET_BIT(FLASH->CR, FLASH_CR_PG);
     for (unsigned int i = 0; i < size / sizeof(uint16_t); i++) {
-        SET_BIT(FLASH->CR, FLASH_CR_PG);
-        *(__IO uint16_t*)address = *data;
-        while (READ_BIT(FLASH->SR, FLASH_SR_BSY))
-            ;
-        CLEAR_BIT(FLASH->CR, FLASH_CR_PG);
+        // Half-words that already hold the data are skipped
+        if (*(__IO uint16_t*)address != *data) {
+            *(__IO uint16_t*)address = *data;
+            while (READ_BIT(FLASH->SR, FLASH_SR_BSY))
+                ;
+        }
         data++;
         address += 2;
     }
+    CLEAR_BIT(FLASH->CR, FLASH_CR_PG);
 }
 
 void System::unlockFlash()
 {
-    WRITE_REG(FLASH->KEYR, FLASH_KEY1);
-    WRITE_REG(FLASH->KEYR, FLASH_KEY2);
+    // The keys are only written while locked, the flash may be unlocked
+    // already when the app calls the services. A wrong key sequence locks
+    // the FPEC until the next reset
+    if (READ_BIT(FLASH->CR, FLASH_CR_LOCK)) {
+        WRITE_REG(FLASH->KEYR, FLASH_KEY1);
+        WRITE_REG(FLASH->KEYR, FLASH_KEY2);
+    }
+    while (READ_BIT(FLASH->SR, FLASH_SR_BSY))
+        ;
 }
 
 void System::lockFlash()
@@ -192,6 +316,71 @@ void System::lockFlash()
     SET_BIT(FLASH->CR, FLASH_CR_LOCK);
 }
 
+bool System::isFlashLocked()
+{
+    return READ_BIT(FLASH->CR, FLASH_CR_LOCK) != 0;
+}
+
+void System::boostClock()
+{
+    if ((RCC->CFGR & RCC_CFGR_SWS) == RCC_CFGR_SWS_PLL) {
+        return;
+    }
+
+    // Start the HSE, fall back to the HSI if it does not come up
+    SET_BIT(RCC->CR, RCC_CR_HSEON);
+    uint32_t polls = HSE_STARTUP_POLLS;
+    while (!READ_BIT(RCC->CR, RCC_CR_HSERDY) && --polls)
+        ;
+
+    uint32_t pllConfig = BOOST_PLL_MULTIPLIER_HSE | RCC_CFGR_PLLSRC;
+    uint32_t clock = BOOST_CLOCK_HSE;
+    if (!READ_BIT(RCC->CR, RCC_CR_HSERDY)) {
+        CLEAR_BIT(RCC->CR, RCC_CR_HSEON);
+        pllConfig = BOOST_PLL_MULTIPLIER_HSI;
+        clock = BOOST_CLOCK_HSI;
+    }
+
+    // Two wait states and the prefetch buffer are required above 48 MHz
+    WRITE_REG(FLASH->ACR, FLASH_ACR_PRFTBE | (2U << FLASH_ACR_LATENCY_Pos));
+
+    // APB1 must not exceed 36 MHz. The HSI stays on, the flash programming
+    // interface runs from it
+    MODIFY_REG(RCC->CFGR, RCC_CFGR_PLLSRC | RCC_CFGR_PLLXTPRE | RCC_CFGR_PLLMULL | RCC_CFGR_PPRE1,
+        pllConfig | RCC_CFGR_PPRE1_DIV2);
+    SET_BIT(RCC->CR, RCC_CR_PLLON);
+    while (!READ_BIT(RCC->CR, RCC_CR_PLLRDY))
+        ;
+
+    MODIFY_REG(RCC->CFGR, RCC_CFGR_SW, RCC_CFGR_SW_PLL);
+    while ((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_PLL)
+        ;
+
+    SystemCoreClock = clock;
+}
+
+void System::restoreClock()
+{
+    if ((RCC->CFGR & RCC_CFGR_SWS) == RCC_CFGR_SWS_HSI) {
+        return;
+    }
+
+    // Back to the reset state: HSI as system clock, PLL and HSE off
+    MODIFY_REG(RCC->CFGR, RCC_CFGR_SW, RCC_CFGR_SW_HSI);
+    while ((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_HSI)
+        ;
+
+    CLEAR_BIT(RCC->CR, RCC_CR_PLLON | RCC_CR_HSEON);
+    while (READ_BIT(RCC->CR, RCC_CR_PLLRDY))
+        ;
+    CLEAR_BIT(RCC->CFGR, RCC_CFGR_PLLSRC | RCC_CFGR_PLLXTPRE | RCC_CFGR_PLLMULL | RCC_CFGR_PPRE1);
+
+    // Wait states are only lowered once the clock is slow again
+    WRITE_REG(FLASH->ACR, FLASH_ACR_PRFTBE);
+
+    SystemCoreClock = RESET_CLOCK_HSI;
+}
+
 void System::enableWatchdog()
 {
     WRITE_REG(IWDG->KR, 0x5555);               // Disable write protection of IWDG registers
@@ -201,3 +390,88 @@ void System::enableWatchdog()
     WRITE_REG(IWDG->KR, 0xCCCC);               // Start IWDG
     WRITE_REG(IWDG->KR, 0xAAAA);               // Kick IWDG
 }
+
+#ifdef BACKUPRETRY
+void System::readBackupRegisters(uint16_t* data, uint32_t count)
+{
+    // BKP_DR1 to BKP_DR10 are consecutive words, holding a half-word each
+    SET_BIT(RCC->APB1ENR, RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN);
+    __IO uint32_t* backupRegister = &BKP->DR1;
+    for (uint32_t i = 0; i < count; i++) {
+        data[i] = (uint16_t)backupRegister[i];
+    }
+    CLEAR_BIT(RCC->APB1ENR, RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN);
+}
+
+void System::writeBackupRegisters(const uint16_t* data, uint32_t count)
+{
+    // The backup domain is write protected until DBP is set
+    SET_BIT(RCC->APB1ENR, RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN);
+    SET_BIT(PWR->CR, PWR_CR_DBP);
+    __IO uint32_t* backupRegister = &BKP->DR1;
+    for (uint32_t i = 0; i < count; i++) {
+        backupRegister[i] = data[i];
+    }
+    CLEAR_BIT(PWR->CR, PWR_CR_DBP);
+    CLEAR_BIT(RCC->APB1ENR, RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN);
+}
+#endif
+
+#if defined(TRACEBOOT) || defined(MAILBOX)
+void System::startCycleCounter()
+{
+    // The DWT cycle counter needs the trace block enabled
+    SET_BIT(CoreDebug->DEMCR, CoreDebug_DEMCR_TRCENA_Msk);
+    WRITE_REG(DWT->CYCCNT, 0);
+    SET_BIT(DWT->CTRL, DWT_CTRL_CYCCNTENA_Msk);
+}
+
+void System::stopCycleCounter()
+{
+    CLEAR_BIT(DWT->CTRL, DWT_CTRL_CYCCNTENA_Msk);
+    // A debugger may use the trace block itself
+    if (!READ_BIT(CoreDebug->DHCSR, CoreDebug_DHCSR_C_DEBUGEN_Msk)) {
+        CLEAR_BIT(CoreDebug->DEMCR, CoreDebug_DEMCR_TRCENA_Msk);
+    }
+}
+
+uint32_t System::cycleCount()
+{
+    return READ_REG(DWT->CYCCNT);
+}
+#endif
+
+#ifdef MAILBOX
+void System::readMailbox(Mailbox& data)
+{
+    data = mailbox;
+}
+
+void System::writeMailbox(const Mailbox& data)
+{
+    mailbox = data;
+}
+#endif
+
+#ifdef TRACEBOOT
+void System::tracePhase(BootPhase phase, uint32_t argument)
+{
+    if (phase == BootPhase::bootEntered) {
+        startCycleCounter();
+        bootTrace.magic = 0;
+        bootTrace.count = 0;
+    }
+
+    if (bootTrace.count < BOOT_TRACE_ENTRIES) {
+        BootTraceEntry& entry = bootTrace.entries[bootTrace.count];
+        entry.timestamp = cycleCount();
+        entry.phase = phase;
+        entry.argument = argument;
+    }
+    bootTrace.count++;
+
+    if (phase == BootPhase::appStarted) {
+        bootTrace.magic = BOOT_TRACE_MAGIC;
+    }
+}
+#endif
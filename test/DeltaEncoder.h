@@ -0,0 +1,132 @@
+#pragma once
+
+#include "Config.h"
+
+#include <string.h>
+
+/* Delta encoder for tests and benchmarks. It writes the operations of one
+ * block of the new binary, copies from the base where at least
+ * DELTA_MIN_COPY bytes match and literals elsewhere. The base is first tried
+ * at the same distance as the last copy, starting with the same offset, then
+ * at any half-word offset, so code moved by an insertion is found as well */
+
+static const uint32_t DELTA_MIN_COPY = 16;
+static const uint32_t DELTA_HASH_BITS = 14;
+
+static inline uint32_t deltaHash(const uint8_t* data)
+{
+    uint32_t words[2];
+    memcpy(words, data, sizeof(words));
+    return ((words[0] ^ (words[1] * 2246822519U)) * 2654435761U) >> (32 - DELTA_HASH_BITS);
+}
+
+static inline bool deltaPutWord(uint8_t*& out, const uint8_t* outEnd, uint32_t word)
+{
+    if (outEnd - out < (int32_t)sizeof(word)) {
+        return false;
+    }
+    memcpy(out, &word, sizeof(word));
+    out += sizeof(word);
+    return true;
+}
+
+static inline bool deltaPutLiterals(uint8_t*& out, const uint8_t* outEnd, const uint8_t* literals, uint32_t length)
+{
+    uint32_t padded = (length + 3) & ~3;
+    if (length == 0) {
+        return true;
+    }
+    if (!deltaPutWord(out, outEnd, length) || (uint32_t)(outEnd - out) < padded) {
+        return false;
+    }
+    memcpy(out, literals, length);
+    memset(out + length, 0, padded - length);
+    out += padded;
+    return true;
+}
+
+/**
+ * @brief encode a block of the new binary as delta operations on the base
+ *
+ * @return size of the operations, or 0 if they do not fit into capacity
+ */
+static inline uint32_t deltaEncode(const uint8_t* base, uint32_t baseLength, uint32_t blockPosition,
+    const uint8_t* block, uint32_t size, uint8_t* destination, uint32_t capacity)
+{
+    static thread_local uint32_t table[1 << DELTA_HASH_BITS];
+    memset(table, 0xFF, sizeof(table));
+    for (uint32_t i = 0; i + DELTA_MIN_COPY <= baseLength; i += 2) {
+        table[deltaHash(base + i)] = i;
+    }
+
+    uint8_t* out = destination;
+    const uint8_t* outEnd = destination + capacity;
+    uint32_t anchor = 0;
+    uint32_t position = 0;
+    int32_t distance = 0;
+    while (position + DELTA_MIN_COPY <= size) {
+        uint32_t source = blockPosition + position + distance;
+        if (source + DELTA_MIN_COPY > baseLength || memcmp(base + source, block + position, DELTA_MIN_COPY) != 0) {
+            source = table[deltaHash(block + position)];
+        }
+        if (source == 0xFFFFFFFF || memcmp(base + source, block + position, DELTA_MIN_COPY) != 0) {
+            position += 2;
+            continue;
+        }
+        distance = source - (blockPosition + position);
+
+        uint32_t length = DELTA_MIN_COPY;
+        while (position + length < size && source + length < baseLength
+            && block[position + length] == base[source + length]) {
+            length++;
+        }
+        if (!deltaPutLiterals(out, outEnd, block + anchor, position - anchor)
+            || !deltaPutWord(out, outEnd, DELTA_OP_COPY | length) || !deltaPutWord(out, outEnd, source)) {
+            return 0;
+        }
+        position += length;
+        anchor = position;
+    }
+
+    if (!deltaPutLiterals(out, outEnd, block + anchor, size - anchor)) {
+        return 0;
+    }
+    return out - destination;
+}
+
+/* Apply the operations of a delta block like the bootloader, to check it */
+static inline bool deltaApply(const uint8_t* base, uint32_t baseLength, const uint8_t* ops, uint32_t opsSize,
+    uint8_t* block, uint32_t size)
+{
+    uint32_t in = 0;
+    uint32_t position = 0;
+    while (in + sizeof(uint32_t) <= opsSize) {
+        uint32_t op;
+        memcpy(&op, ops + in, sizeof(op));
+        in += sizeof(op);
+        uint32_t length = op & DELTA_LENGTH_MASK;
+        if (length > size - position) {
+            return false;
+        }
+        if (op & DELTA_OP_COPY) {
+            uint32_t source;
+            if (in + sizeof(source) > opsSize) {
+                return false;
+            }
+            memcpy(&source, ops + in, sizeof(source));
+            in += sizeof(source);
+            if (source > baseLength || length > baseLength - source) {
+                return false;
+            }
+            memcpy(block + position, base + source, length);
+        } else {
+            if (length > opsSize - in) {
+                return false;
+            }
+            memcpy(block + position, ops + in, length);
+            in += (length + 3) & ~3;
+        }
+        position += length;
+    }
+    return in == opsSize && position == size;
+}
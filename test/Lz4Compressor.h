@@ -0,0 +1,104 @@
+#pragma once
+
+#include "Lz4.h"
+
+#include <string.h>
+
+/* Greedy LZ4 block compressor for tests and benchmarks. Its output is in the
+ * plain LZ4 block format, like LZ4_compress_default(), only less compact */
+
+/* The last literals and the distance of the last match from the block end,
+ * as the LZ4 block format requires */
+static const uint32_t LZ4_LAST_LITERALS = 5;
+static const uint32_t LZ4_MATCH_FIND_LIMIT = 12;
+static const uint32_t LZ4_MAX_OFFSET = 65535;
+static const uint32_t LZ4_HASH_BITS = 12;
+
+static inline bool lz4PutLength(uint8_t*& out, const uint8_t* outEnd, uint32_t length)
+{
+    for (; length >= 255; length -= 255) {
+        if (out == outEnd) {
+            return false;
+        }
+        *out++ = 255;
+    }
+    if (out == outEnd) {
+        return false;
+    }
+    *out++ = length;
+    return true;
+}
+
+/* Append a sequence, a match length of 0 ends the block with the literals only */
+static inline bool lz4PutSequence(uint8_t*& out, const uint8_t* outEnd, const uint8_t* literals,
+    uint32_t literalLength, uint32_t offset, uint32_t matchLength)
+{
+    if (out == outEnd) {
+        return false;
+    }
+    uint32_t matchCode = matchLength != 0 ? matchLength - LZ4_MIN_MATCH : 0;
+    *out++ = ((literalLength < 15 ? literalLength : 15) << 4) | (matchCode < 15 ? matchCode : 15);
+    if (literalLength >= 15 && !lz4PutLength(out, outEnd, literalLength - 15)) {
+        return false;
+    }
+    if (literalLength > (uint32_t)(outEnd - out)) {
+        return false;
+    }
+    memcpy(out, literals, literalLength);
+    out += literalLength;
+    if (matchLength == 0) {
+        return true;
+    }
+
+    if (outEnd - out < 2) {
+        return false;
+    }
+    *out++ = offset & 0xFF;
+    *out++ = offset >> 8;
+    return matchCode < 15 || lz4PutLength(out, outEnd, matchCode - 15);
+}
+
+/**
+ * @brief compress a block into the LZ4 block format
+ *
+ * @return size of the compressed block, or 0 if it does not fit into capacity
+ */
+static inline uint32_t lz4Compress(const uint8_t* source, uint32_t size, uint8_t* destination, uint32_t capacity)
+{
+    static thread_local uint32_t table[1 << LZ4_HASH_BITS];
+    memset(table, 0xFF, sizeof(table));
+
+    uint8_t* out = destination;
+    const uint8_t* outEnd = destination + capacity;
+    uint32_t anchor = 0;
+    uint32_t position = 0;
+    while (position + LZ4_MATCH_FIND_LIMIT < size) {
+        uint32_t sequence;
+        memcpy(&sequence, source + position, sizeof(sequence));
+        uint32_t hash = (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+        uint32_t candidate = table[hash];
+        table[hash] = position;
+
+        if (candidate == 0xFFFFFFFF || position - candidate > LZ4_MAX_OFFSET
+            || memcmp(source + candidate, source + position, LZ4_MIN_MATCH) != 0) {
+            position++;
+            continue;
+        }
+
+        uint32_t matchEnd = position + LZ4_MIN_MATCH;
+        while (matchEnd < size - LZ4_LAST_LITERALS && source[matchEnd] == source[candidate + matchEnd - position]) {
+            matchEnd++;
+        }
+        if (!lz4PutSequence(out, outEnd, source + anchor, position - anchor, position - candidate,
+                matchEnd - position)) {
+            return 0;
+        }
+        position = matchEnd;
+        anchor = position;
+    }
+
+    if (!lz4PutSequence(out, outEnd, source + anchor, size - anchor, 0, 0)) {
+        return 0;
+    }
+    return out - destination;
+}
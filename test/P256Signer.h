@@ -0,0 +1,86 @@
+#pragma once
+
+#include "P256.h"
+#include "Sha256.h"
+
+#include <string.h>
+
+/* ECDSA P-256 signing for tests and benchmarks, on the arithmetic of P256.h.
+ * The nonce is the SHA-256 of the private key and the hash, deterministic but
+ * not RFC 6979, and nothing is constant time: never sign releases with it */
+
+/* Private key of SIGNATURE_PUBLIC_KEY, the test key of RFC 6979 A.2.5 */
+static const uint8_t SIGNATURE_TEST_PRIVATE_KEY[P256_SIZE] = { 0xC9, 0xAF, 0xA9, 0xD8, 0x45, 0xBA, 0x75, 0x16,
+    0x6B, 0x5C, 0x21, 0x57, 0x67, 0xB1, 0xD6, 0x93, 0x4E, 0x50, 0xC3, 0xDB, 0x36, 0xE8, 0x9B, 0x12, 0x7B, 0x8A,
+    0x62, 0x2B, 0x12, 0x0F, 0x67, 0x21 };
+
+/* scalar * G in affine coordinates, out of Montgomery form */
+static inline void p256MultiplyGenerator(const uint32_t* scalar, uint32_t* x, uint32_t* y)
+{
+    const P256Modulus& p = p256Prime();
+    const uint32_t zero[P256_WORDS] = { 0 };
+    P256Point generator, point;
+    p256Generator(generator);
+    p256DoubleMultiply(point, scalar, generator, zero, generator);
+
+    uint32_t inverse[P256_WORDS], inverseSquared[P256_WORDS];
+    p256Invert(inverse, point.z, p);
+    p256Multiply(inverseSquared, inverse, inverse, p);
+    p256Multiply(x, point.x, inverseSquared, p);
+    p256Multiply(y, point.y, inverseSquared, p);
+    p256Multiply(y, y, inverse, p);
+    p256FromMontgomery(x, x, p);
+    p256FromMontgomery(y, y, p);
+}
+
+/* Public key of a private key, x and y big endian */
+static inline void p256PublicKey(const uint8_t* privateKey, uint8_t* publicKey)
+{
+    uint32_t d[P256_WORDS], x[P256_WORDS], y[P256_WORDS];
+    p256Load(d, privateKey);
+    p256MultiplyGenerator(d, x, y);
+    p256Store(publicKey, x);
+    p256Store(publicKey + P256_SIZE, y);
+}
+
+/**
+ * @brief sign a SHA-256 hash with ECDSA P-256
+ *
+ * @param privateKey P256_SIZE bytes, big endian, below the group order
+ * @param hash SHA256_DIGEST_SIZE bytes
+ * @param signature P256_SIGNATURE_SIZE bytes, r and s big endian
+ */
+static inline void p256Sign(const uint8_t* privateKey, const uint8_t* hash, uint8_t* signature)
+{
+    const P256Modulus& n = p256Order();
+    uint32_t d[P256_WORDS], e[P256_WORDS], k[P256_WORDS];
+    p256Load(d, privateKey);
+    p256LoadHash(e, hash);
+
+    uint8_t nonce[SHA256_DIGEST_SIZE];
+    Sha256 context;
+    sha256Init(context);
+    sha256Update(context, privateKey, P256_SIZE);
+    sha256Update(context, hash, SHA256_DIGEST_SIZE);
+    sha256Final(context, nonce);
+    p256LoadHash(k, nonce);
+
+    /* r = x of k * G mod n */
+    uint32_t r[P256_WORDS], y[P256_WORDS];
+    p256MultiplyGenerator(k, r, y);
+    if (!p256Less(r, n.value)) {
+        p256SubtractWords(r, r, n.value);
+    }
+
+    /* s = (e + r * d) / k mod n */
+    uint32_t s[P256_WORDS], inverse[P256_WORDS];
+    p256ToMontgomery(k, k, n);
+    p256Invert(inverse, k, n);
+    p256ToMontgomery(s, r, n);
+    p256Multiply(s, s, d, n);
+    p256Add(s, s, e, n);
+    p256Multiply(s, inverse, s, n);
+
+    p256Store(signature, r);
+    p256Store(signature + P256_SIZE, s);
+}
@@ -0,0 +1,439 @@
+#pragma once
+
+#include "BootloaderClient.h"
+#include "Config.h"
+#include "Crc32.h"
+#include "FlashSimulator.h"
+#include "System.h"
+
+#ifdef COMPRESSION
+#include "Lz4Compressor.h"
+#endif
+#ifdef DELTA
+#include "DeltaEncoder.h"
+#endif
+#ifdef RELOCATION
+#include "Relocation.h"
+#endif
+
+#ifdef SIGNATURE
+#include "P256Signer.h"
+#endif
+
+#include <string.h>
+
+/* Helpers to set up the simulated flash like a device in the field */
+
+#ifdef COPYBINARY
+#define LOAD_ADDRESS(app) BOOT_ADDRESS
+#else
+#define LOAD_ADDRESS(app) BOOTLOADER_APP_ADDRESS[app]
+#endif
+
+#ifdef VERIFYHASH
+/* Set the hash of an image header, over the same bytes as its crc, and sign
+ * it with the test key with SIGNATURE */
+static inline void setImageHash(ImageHeader& header, const void* binary)
+{
+    Sha256 context;
+    sha256Init(context);
+    sha256Update(context, (const uint8_t*)binary, header.length);
+    sha256Final(context, header.sha256);
+    #ifdef SIGNATURE
+    p256Sign(SIGNATURE_TEST_PRIVATE_KEY, header.sha256, header.signature);
+    #endif
+}
+#endif
+
+#ifdef SWAPBINARY
+/* Image header of the app last stored in each slot, a swap moves the app */
+static inline ImageHeader& storedHeader(uint32_t app)
+{
+    static thread_local ImageHeader headers[BOOTLOADER_MAX_APPS];
+    return headers[app];
+}
+#endif
+
+/* Store a binary and its image header in a slot, like the app does after an update */
+static inline ImageHeader storeApp(uint32_t app, uint32_t length, uint32_t seed, uint32_t version = 1)
+{
+    uint32_t address = BOOTLOADER_APP_ADDRESS[app];
+    uint32_t* binary = (uint32_t*)flashSimulator.memory(address, length);
+    binary[0] = RAM_END;
+    binary[1] = LOAD_ADDRESS(app) + 0x101;
+    for (uint32_t i = 2; i < length / sizeof(uint32_t); i++) {
+        binary[i] = seed * 0x01000193 + i;
+    }
+
+    ImageHeader header = { IMAGE_HEADER_MAGIC, length, LOAD_ADDRESS(app),
+        crc32(binary, length / sizeof(uint32_t)), version };
+    #ifdef VERIFYHASH
+    setImageHash(header, binary);
+    #endif
+    memcpy(flashSimulator.memory(address + APP_HEADER_OFFSET, sizeof(header)), &header, sizeof(header));
+    #ifdef SWAPBINARY
+    storedHeader(app) = header;
+    #endif
+    return header;
+}
+
+static inline ImageHeader* slotHeader(uint32_t app)
+{
+    return (ImageHeader*)flashSimulator.memory(BOOTLOADER_APP_ADDRESS[app] + APP_HEADER_OFFSET);
+}
+
+static inline uint32_t* slotWords(uint32_t app)
+{
+    return (uint32_t*)flashSimulator.memory(BOOTLOADER_APP_ADDRESS[app]);
+}
+
+#ifdef COMPRESSION
+/* Store a binary compressed in blocks, like the app does after downloading a
+ * compressed update. A compressible binary shrinks to about half, like a
+ * typical app, the other one is stored in raw blocks */
+static inline ImageHeader storeCompressedApp(uint32_t app, uint32_t length, uint32_t seed, bool compressible = true)
+{
+    static thread_local uint32_t binary[BOOT_SIZE / sizeof(uint32_t)];
+    binary[0] = RAM_END;
+    binary[1] = BOOT_ADDRESS + 0x101;
+    for (uint32_t i = 2; i < length / sizeof(uint32_t); i++) {
+        bool repeated = compressible && i % 8 < 5;
+        binary[i] = repeated ? 0x20000000 + (i % 64) * 4 : seed * 0x01000193 + i;
+    }
+
+    uint8_t* slot = flashSimulator.memory(BOOTLOADER_APP_ADDRESS[app], APP_HEADER_OFFSET);
+    uint32_t offset = 0;
+    for (uint32_t position = 0; position < length; position += IMAGE_BLOCK_SIZE) {
+        uint32_t size = length - position < IMAGE_BLOCK_SIZE ? length - position : IMAGE_BLOCK_SIZE;
+        const uint8_t* data = (const uint8_t*)binary + position;
+        uint32_t storedSize = lz4Compress(data, size, slot + offset + sizeof(uint32_t), size - 1);
+        if (storedSize == 0) {
+            memcpy(slot + offset + sizeof(uint32_t), data, size);
+            storedSize = size | IMAGE_BLOCK_RAW;
+        }
+        memcpy(slot + offset, &storedSize, sizeof(storedSize));
+        offset += sizeof(uint32_t) + (((storedSize & ~IMAGE_BLOCK_RAW) + 3) & ~3);
+    }
+
+    ImageHeader header = { IMAGE_HEADER_MAGIC_LZ4, length, BOOT_ADDRESS,
+        crc32(binary, length / sizeof(uint32_t)), 1 };
+    #ifdef VERIFYHASH
+    setImageHash(header, binary);
+    #endif
+    memcpy(slot + APP_HEADER_OFFSET, &header, sizeof(header));
+    return header;
+}
+
+#endif
+
+#ifdef DELTA
+/* Store a delta of the plain app in another slot, like the app does after
+ * downloading a delta update. The binary is the base with a word changed every
+ * changeDistance bytes, and from the middle on moved by a half-word, like code
+ * after an insertion. With unrelated set, the binary is a new one */
+static inline ImageHeader storeDeltaApp(uint32_t app, uint32_t baseApp, uint32_t changeDistance, uint32_t version = 2,
+    bool unrelated = false)
+{
+    static thread_local uint8_t binary[BOOT_SIZE];
+    const ImageHeader* base = slotHeader(baseApp);
+    const uint8_t* baseBinary = flashSimulator.memory(BOOTLOADER_APP_ADDRESS[baseApp], base->length);
+    uint32_t length = base->length;
+    uint32_t middle = length / 2;
+    memcpy(binary, baseBinary, middle);
+    binary[middle] = 0xBF;
+    binary[middle + 1] = 0x00;
+    memcpy(binary + middle + 2, baseBinary + middle, length - middle - 2);
+    for (uint32_t i = changeDistance; i < length; i += changeDistance) {
+        binary[i] ^= 0x5A;
+    }
+    for (uint32_t i = 8; unrelated && i < length; i++) {
+        binary[i] = i * 0x9E3779B1 >> 24;
+    }
+
+    uint8_t* slot = flashSimulator.memory(BOOTLOADER_APP_ADDRESS[app], APP_HEADER_OFFSET);
+    DeltaHeader delta = { base->length, base->crc };
+    memcpy(slot, &delta, sizeof(delta));
+    uint32_t offset = sizeof(delta);
+    for (uint32_t position = 0; position < length; position += IMAGE_BLOCK_SIZE) {
+        uint32_t size = length - position < IMAGE_BLOCK_SIZE ? length - position : IMAGE_BLOCK_SIZE;
+        uint32_t storedSize = deltaEncode(baseBinary, base->length, position, binary + position, size,
+            slot + offset + sizeof(uint32_t), size - 1);
+        if (storedSize == 0) {
+            memcpy(slot + offset + sizeof(uint32_t), binary + position, size);
+            storedSize = size | IMAGE_BLOCK_RAW;
+        }
+        memcpy(slot + offset, &storedSize, sizeof(storedSize));
+        offset += sizeof(uint32_t) + (((storedSize & ~IMAGE_BLOCK_RAW) + 3) & ~3);
+    }
+
+    ImageHeader header = { IMAGE_HEADER_MAGIC_DELTA, length, BOOT_ADDRESS,
+        crc32((const uint32_t*)binary, length / sizeof(uint32_t)), version };
+    #ifdef VERIFYHASH
+    setImageHash(header, binary);
+    #endif
+    memcpy(slot + APP_HEADER_OFFSET, &header, sizeof(header));
+    return header;
+}
+#endif
+
+#ifdef BLOCK_IMAGES
+/* Offset of a block of a compressed or delta app in its slot */
+static inline uint32_t blockOffset(uint32_t app, uint32_t block)
+{
+    uint32_t offset = 0;
+    #ifdef DELTA
+    if (slotHeader(app)->magic == IMAGE_HEADER_MAGIC_DELTA) {
+        offset = sizeof(DeltaHeader);
+    }
+    #endif
+    for (uint32_t i = 0; i < block; i++) {
+        offset += sizeof(uint32_t) + (((slotWords(app)[offset / 4] & ~IMAGE_BLOCK_RAW) + 3) & ~3);
+    }
+    return offset;
+}
+#endif
+
+#ifdef RELOCATION
+/* Address the relocatable apps are linked for, outside of all slots */
+static const uint32_t RELOCATION_LINK_ADDRESS = 0x08400000;
+
+/* Store a relocatable binary, like the app does after an update. The reset
+ * vector and every relocationDistance-th word hold an address in the binary,
+ * they are stored erased and listed in the relocation table */
+static inline ImageHeader storeRelocatableApp(uint32_t app, uint32_t length, uint32_t seed, uint32_t version = 1,
+    uint32_t relocationDistance = 37)
+{
+    static thread_local uint32_t positions[APP_SIZE / sizeof(uint32_t)];
+    static thread_local uint32_t offsets[APP_SIZE / sizeof(uint32_t)];
+    uint32_t* slot = slotWords(app);
+    uint32_t words = length / sizeof(uint32_t);
+    uint32_t count = 0;
+    slot[0] = RAM_END;
+    for (uint32_t i = 1; i < words; i++) {
+        slot[i] = seed * 0x01000193 + i;
+        if (i == 1 || i % relocationDistance == 0) {
+            positions[count] = i;
+            offsets[count] = i == 1 ? 0x101 : (seed * 0x9E3779B1 + i) % length;
+            slot[i] = 0xFFFFFFFF;
+            count++;
+        }
+    }
+    slot[words] = relocationEncode(positions, offsets, count, slot + words + 1,
+        (APP_HEADER_OFFSET - length) / sizeof(uint32_t) - 1);
+
+    ImageHeader header = { IMAGE_HEADER_MAGIC_RELOC, length, RELOCATION_LINK_ADDRESS, crc32(slot, words), version };
+    #ifdef VERIFYHASH
+    setImageHash(header, slot);
+    #endif
+    memcpy(slotHeader(app), &header, sizeof(header));
+    return header;
+}
+
+/* Call visit(word, address) for each relocated word of an app, with the
+ * address it holds once relocated for its slot */
+template <typename Visit> static inline void visitRelocations(uint32_t app, Visit visit)
+{
+    uint32_t* slot = slotWords(app);
+    const uint32_t* table = slot + slotHeader(app)->length / sizeof(uint32_t);
+    uint32_t position = RELOCATION_START;
+    for (uint32_t i = 1; i <= table[0]; i++) {
+        uint32_t offset;
+        if (relocationEntry(table[i], position, offset)) {
+            visit(slot[position], BOOTLOADER_APP_ADDRESS[app] + offset);
+        }
+    }
+}
+
+/* Check that the relocated words of an app hold the addresses for its slot */
+static inline bool isRelocated(uint32_t app)
+{
+    bool relocated = true;
+    visitRelocations(app, [&](uint32_t& word, uint32_t address) { relocated &= word == address; });
+    return relocated;
+}
+#endif
+
+/* Binary of the app in a slot, decoded if it is stored compressed or as a
+ * delta, with the relocated words erased if it is relocatable */
+static inline const uint8_t* slotBinary(uint32_t app)
+{
+    #ifdef RELOCATION
+    if (slotHeader(app)->magic == IMAGE_HEADER_MAGIC_RELOC) {
+        static thread_local uint8_t binary[APP_SIZE];
+        memcpy(binary, slotWords(app), slotHeader(app)->length);
+        uint32_t* words = (uint32_t*)binary;
+        uint32_t* slot = slotWords(app);
+        visitRelocations(app, [&](uint32_t& word, uint32_t) { words[&word - slot] = 0xFFFFFFFF; });
+        return binary;
+    }
+    #endif
+    #ifdef BLOCK_IMAGES
+    static thread_local uint8_t binary[BOOT_SIZE];
+    const ImageHeader* header = slotHeader(app);
+    #ifdef DELTA
+    const uint8_t* base = nullptr;
+    uint32_t baseLength = 0;
+    if (header->magic == IMAGE_HEADER_MAGIC_DELTA) {
+        const DeltaHeader* delta = (const DeltaHeader*)slotWords(app);
+        for (uint32_t other = 0; other < BOOTLOADER_MAX_APPS; other++) {
+            if (other != app && slotHeader(other)->magic == IMAGE_HEADER_MAGIC
+                && slotHeader(other)->length == delta->baseLength && slotHeader(other)->crc == delta->baseCrc) {
+                base = flashSimulator.memory(BOOTLOADER_APP_ADDRESS[other]);
+                baseLength = delta->baseLength;
+            }
+        }
+    }
+    #endif
+    bool blocks = false;
+    #ifdef COMPRESSION
+    blocks = blocks || header->magic == IMAGE_HEADER_MAGIC_LZ4;
+    #endif
+    #ifdef DELTA
+    blocks = blocks || header->magic == IMAGE_HEADER_MAGIC_DELTA;
+    #endif
+    if (blocks) {
+        const uint8_t* slot = flashSimulator.memory(BOOTLOADER_APP_ADDRESS[app]);
+        for (uint32_t block = 0; block * IMAGE_BLOCK_SIZE < header->length; block++) {
+            uint32_t offset = blockOffset(app, block);
+            uint32_t storedSize = slotWords(app)[offset / 4];
+            uint32_t position = block * IMAGE_BLOCK_SIZE;
+            uint32_t size = header->length - position;
+            size = size < IMAGE_BLOCK_SIZE ? size : IMAGE_BLOCK_SIZE;
+            const uint8_t* data = slot + offset + sizeof(uint32_t);
+            if (storedSize & IMAGE_BLOCK_RAW) {
+                memcpy(binary + position, data, size);
+                continue;
+            }
+            bool decoded = false;
+            #ifdef DELTA
+            if (base != nullptr) {
+                decoded = deltaApply(base, baseLength, data, storedSize, binary + position, size);
+            }
+            #endif
+            #ifdef COMPRESSION
+            if (header->magic == IMAGE_HEADER_MAGIC_LZ4) {
+                decoded = lz4Decompress(data, storedSize, binary + position, size) == (int32_t)size;
+            }
+            #endif
+            if (!decoded) {
+                memset(binary + position, 0, size);
+            }
+        }
+        return binary;
+    }
+    #endif
+    return flashSimulator.memory(BOOTLOADER_APP_ADDRESS[app]);
+}
+
+/* Initialized status, as written by the bootloader */
+static inline BootloaderStatus statusFor(uint32_t state, uint32_t app)
+{
+    BootloaderStatus status = { 0 };
+    strcpy(status.bootloaderName, BOOTLOADER_NAME);
+    status.bootloaderVersion = (BOOTLOADER_VERSION_BUILD << 16) + (BOOTLOADER_VERSION_MINOR << 8)
+        + (BOOTLOADER_VERSION_MAJOR);
+    status.status = state;
+    status.liveAppSelect = app;
+    #ifdef SWAPBINARY
+    status.swapSlot = NO_APP;
+    #endif
+    return status;
+}
+
+/* Install the app at the boot address and record it in the status, as the
+ * bootloader leaves it after a completed install. Without COPYBINARY, only a
+ * relocatable app is relocated for its slot. With SIGNATURE, the app is
+ * recorded as verified */
+static inline void installApp(BootloaderStatus& status, uint32_t app)
+{
+    #ifdef SIGNATURE
+    status.verifiedApp = app;
+    memcpy(status.verifiedHash, slotHeader(app)->sha256, sizeof(status.verifiedHash));
+    #endif
+    #ifdef SWAPBINARY
+    /* Swap the whole regions, the app in the boot region goes to the slot */
+    static thread_local uint8_t region[APP_SIZE];
+    uint8_t* boot = flashSimulator.memory(BOOT_ADDRESS, APP_SIZE);
+    uint8_t* slot = flashSimulator.memory(BOOTLOADER_APP_ADDRESS[app], APP_SIZE);
+    memcpy(region, boot, APP_SIZE);
+    memcpy(boot, slot, APP_SIZE);
+    memcpy(slot, region, APP_SIZE);
+    const ImageHeader* header = (const ImageHeader*)(boot + APP_HEADER_OFFSET);
+    status.installedLength = header->length;
+    status.installedCrc = header->crc;
+    status.swapSlot = app;
+    status.swapLength = (header->length + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1);
+    status.installProgress = SWAP_STEPS(status.swapLength);
+    #elif defined(COPYBINARY)
+    ImageHeader* header = slotHeader(app);
+    memcpy(flashSimulator.memory(BOOT_ADDRESS, header->length), slotBinary(app), header->length);
+    status.installedLength = header->length;
+    status.installedCrc = header->crc;
+    status.installProgress = (header->length + INSTALL_CHECKPOINT_SIZE - 1) / INSTALL_CHECKPOINT_SIZE;
+    #else
+    (void)status;
+    #ifdef RELOCATION
+    if (slotHeader(app)->magic == IMAGE_HEADER_MAGIC_RELOC) {
+        visitRelocations(app, [](uint32_t& word, uint32_t address) { word = address; });
+    }
+    #else
+    (void)app;
+    #endif
+    #endif
+}
+
+#ifdef COPYBINARY
+/* Check that the first length bytes of the app are installed at the boot address */
+static inline bool isInstalled(uint32_t app, uint32_t length)
+{
+    #ifdef SWAPBINARY
+    /* The slot holds the other app after a swap, the whole app is checked */
+    const ImageHeader& stored = storedHeader(app);
+    const ImageHeader* header = (const ImageHeader*)flashSimulator.memory(BOOT_ADDRESS + APP_HEADER_OFFSET);
+    return length <= stored.length && memcmp(header, &stored, sizeof(stored)) == 0
+        && crc32((const uint32_t*)flashSimulator.memory(BOOT_ADDRESS, stored.length), stored.length / 4) == stored.crc;
+    #else
+    return memcmp(flashSimulator.memory(BOOT_ADDRESS, length), slotBinary(app), length) == 0;
+    #endif
+}
+#endif
+
+#ifdef BACKUPRETRY
+/* Backup state left by the last boot */
+static inline BackupState backupState()
+{
+    BackupState backup;
+    memcpy(&backup, flashSimulator.backupRegisters, sizeof(backup));
+    return backup;
+}
+
+/* Set the backup state of a warm boot of the status in the journal, as if the
+ * last boot had counted retryCount retries of it in the backup registers */
+static inline void setWarmBoot(uint32_t retryCount)
+{
+    System sys;
+    BootloaderStatus status;
+    sys.readStatusReg(status);
+    BackupState backup = { BACKUP_STATE_MAGIC,
+        (uint16_t)(crc32((const uint32_t*)&status, sizeof(status) / sizeof(uint32_t)) & 0xFFFF),
+        (uint16_t)retryCount, 0, 0 };
+    memcpy(flashSimulator.backupRegisters, &backup, sizeof(backup));
+}
+#endif
+
+#ifdef MAILBOX
+/* Post a request in the mailbox, as the app does before it resets */
+static inline void requestMailbox(uint32_t request, uint32_t app)
+{
+    Mailbox& mailbox = flashSimulator.mailbox;
+    if (mailbox.magic != MAILBOX_MAGIC || mailbox.crc != mailboxCrc(mailbox)) {
+        memset(&mailbox, 0, sizeof(mailbox));
+        mailbox.magic = MAILBOX_MAGIC;
+        mailbox.version = MAILBOX_VERSION;
+        mailbox.trialApp = MAILBOX_NO_TRIAL;
+    }
+    mailbox.request = request;
+    mailbox.requestApp = app;
+    mailbox.crc = mailboxCrc(mailbox);
+}
+#endif
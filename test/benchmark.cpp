@@ -0,0 +1,563 @@
+#include "Bootloader.h"
+#include "FlashSimulator.h"
+#include "SimulatedDevice.h"
+#include "System.h"
+
+#include <stdio.h>
+#include <string.h>
+#if defined(COMPRESSION) || defined(VERIFYHASH)
+#include <time.h>
+#endif
+#ifdef VERIFYHASH
+#include "Sha256Reference.h"
+#endif
+
+/*
+ * Runs each path through Bootloader::boot() on the simulated flash and
+ * estimates its time and energy. The results are printed as JSON, and the
+ * run fails if a path exceeds one of the thresholds given with --thresholds.
+ *
+ * Usage: benchmark [--thresholds FILE] [--output FILE]
+ */
+
+/* Cost model. Typical STM32F103xC/D/E figures from the datasheet (DS5792)
+ * at 3.3 V, the core runs from the HSI unless the clock is boosted */
+static const double SUPPLY_VOLTAGE = 3.3;
+static const double RESET_CLOCK_HZ = 8e6;
+static const double BOOST_CLOCK_HZ = 72e6;
+static const double RESET_RUN_CURRENT = 5.5e-3;    // Run mode from flash, peripherals off
+static const double BOOST_RUN_CURRENT = 32.8e-3;   // Run mode from flash, peripherals off
+static const double FLASH_WRITE_CURRENT = 5e-3;    // Flash IDD in write/erase mode, on top
+static const double PROGRAM_TIME = 52.5e-6;        // tPROG of a half-word
+static const double ERASE_TIME = 30e-3;            // tERASE of a page, 20 to 40 ms
+static const double BOOST_STARTUP_TIME = 2.2e-3;   // HSE startup and PLL lock
+static const double RESET_CYCLES_PER_WORD = 2;     // Flash reads with 0 wait states
+static const double BOOST_CYCLES_PER_WORD = 4;     // Flash reads with 2 wait states and prefetch
+
+/* Length of the apps used for all paths, a typical 64 KB app */
+static const uint32_t BENCHMARK_APP_LENGTH = 0x10000;
+
+/* Hashing the binary takes far longer than the CRC, VERIFYHASH has limits of
+ * its own. So has SIGNATURE, which adds the signature to the hash */
+#ifdef SIGNATURE
+#define BENCHMARK_CONFIG_SUFFIX "_signature"
+#elif defined(VERIFYHASH)
+#define BENCHMARK_CONFIG_SUFFIX "_verifyhash"
+#else
+#define BENCHMARK_CONFIG_SUFFIX ""
+#endif
+
+#ifdef SWAPBINARY
+static const char* const BENCHMARK_CONFIG = "swapbinary" BENCHMARK_CONFIG_SUFFIX;
+#elif defined(COPYBINARY)
+static const char* const BENCHMARK_CONFIG = "copybinary" BENCHMARK_CONFIG_SUFFIX;
+#else
+static const char* const BENCHMARK_CONFIG = "direct" BENCHMARK_CONFIG_SUFFIX;
+#endif
+
+/* Metrics of a single boot path */
+struct BootCost {
+    uint32_t pagesErased;
+    uint32_t halfWordsProgrammed;
+    uint32_t bytesRead;
+    double seconds;
+    double joules;
+};
+
+static BootCost cost;
+
+static void accountOperation(SimulatorOperation operation, uint32_t address, uint32_t size)
+{
+    double current = flashSimulator.clockBoosted ? BOOST_RUN_CURRENT : RESET_RUN_CURRENT;
+    double cyclesPerWord = flashSimulator.clockBoosted ? BOOST_CYCLES_PER_WORD : RESET_CYCLES_PER_WORD;
+    double clock = flashSimulator.clockBoosted ? BOOST_CLOCK_HZ : RESET_CLOCK_HZ;
+    double seconds = 0;
+
+    switch (operation) {
+        case SimulatorOperation::flashRead:
+            seconds = size / (double)sizeof(uint32_t) * cyclesPerWord / clock;
+            break;
+        case SimulatorOperation::pageErase:
+            seconds = size * ERASE_TIME;
+            current += FLASH_WRITE_CURRENT;
+            break;
+        case SimulatorOperation::halfWordProgram:
+            seconds = size * PROGRAM_TIME;
+            current += FLASH_WRITE_CURRENT;
+            break;
+        case SimulatorOperation::clockBoost:
+            /* The core waits for the HSE and PLL at the reset clock */
+            seconds = size * BOOST_STARTUP_TIME;
+            current = RESET_RUN_CURRENT;
+            break;
+        case SimulatorOperation::hashBytes:
+            /* The target of sha256Blocks() includes the flash reads, which
+             * are accounted for on their own */
+            #ifdef VERIFYHASH
+            seconds = size * (SHA256_TARGET_CYCLES_PER_BYTE - cyclesPerWord / sizeof(uint32_t)) / clock;
+            #endif
+            break;
+        case SimulatorOperation::signatureCheck:
+            #ifdef SIGNATURE
+            seconds = size * (double)P256_VERIFY_TARGET_CYCLES / clock;
+            #endif
+            break;
+    }
+
+    cost.seconds += seconds;
+    cost.joules += seconds * current * SUPPLY_VOLTAGE;
+}
+
+/* Boot paths, each sets up the flash as a device would find it on reset.
+ * Only the retry paths use the retry count */
+
+static void setupDevice()
+{
+    flashSimulator.reset();
+    for (uint32_t app = 0; app < BOOTLOADER_MAX_APPS; app++) {
+        storeApp(app, BENCHMARK_APP_LENGTH, app + 1);
+    }
+}
+
+static void writeStatus(BootloaderStatus status)
+{
+    System sys;
+    sys.writeStatusReg(status);
+}
+
+static void firstBoot(uint32_t)
+{
+    setupDevice();
+}
+
+static void stableBoot(uint32_t)
+{
+    setupDevice();
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    installApp(status, 0);
+    writeStatus(status);
+}
+
+static void newAppBoot(uint32_t)
+{
+    setupDevice();
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 1);
+    installApp(status, 0);
+    writeStatus(status);
+}
+
+static void rejectedNewAppBoot(uint32_t)
+{
+    setupDevice();
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 1);
+    installApp(status, 0);
+    writeStatus(status);
+    slotHeader(1)->magic = 0;
+}
+
+static void retryBoot(uint32_t retryCount)
+{
+    setupDevice();
+    BootloaderStatus status = statusFor(BootloaderState::attemptNewApp, 1);
+    status.retryCount = retryCount;
+    #ifdef SWAPBINARY
+    /* The app from before waits in the slot of the new app */
+    installApp(status, 0);
+    #endif
+    installApp(status, 1);
+    writeStatus(status);
+}
+
+static void rollbackBoot(uint32_t)
+{
+    retryBoot(BOOTLOADER_MAX_RETRIES - 1);
+}
+
+#ifdef COMPRESSION
+static void compressedNewAppBoot(uint32_t)
+{
+    setupDevice();
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 1);
+    installApp(status, 0);
+    writeStatus(status);
+    storeCompressedApp(1, BENCHMARK_APP_LENGTH, 2);
+}
+#endif
+
+#ifdef DELTA
+/* Size of the delta of a monthly update relative to its binary */
+static double deltaPatchRatio;
+
+static void deltaNewAppBoot(uint32_t)
+{
+    setupDevice();
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 1);
+    installApp(status, 0);
+    writeStatus(status);
+    ImageHeader header = storeDeltaApp(1, 0, 0x400);
+    deltaPatchRatio = (double)blockOffset(1, (header.length + IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE)
+        / header.length;
+}
+#endif
+
+#ifdef MAILBOX
+static void mailboxTrialBoot(uint32_t)
+{
+    stableBoot(0);
+    requestMailbox(MailboxRequest::trialBoot, 1);
+}
+#endif
+
+#ifdef BACKUPRETRY
+static void warmRetryBoot(uint32_t)
+{
+    /* The previous boot started the new app and left the backup state */
+    newAppBoot(0);
+    Bootloader bl;
+    System sys;
+    bl.boot(sys, false);
+}
+#endif
+
+/* Measured result of a boot path */
+struct BootPathResult {
+    char name[32];
+    BootCost cost;
+};
+
+static const uint32_t MAX_BOOT_PATHS = 16;
+static BootPathResult results[MAX_BOOT_PATHS];
+static uint32_t resultCount = 0;
+
+static bool runBootPath(const char* name, uint32_t retryCount, void (*setup)(uint32_t))
+{
+    setup(retryCount);
+
+    flashSimulator.clearCounters();
+    memset(&cost, 0, sizeof(cost));
+    flashSimulator.observer = accountOperation;
+
+    Bootloader bl;
+    System sys;
+    bl.boot(sys, false);
+
+    flashSimulator.observer = nullptr;
+    cost.pagesErased = flashSimulator.pagesErased;
+    cost.halfWordsProgrammed = flashSimulator.halfWordsProgrammed;
+    cost.bytesRead = flashSimulator.bytesRead;
+
+    if (flashSimulator.errors != 0 || flashSimulator.boots != 1) {
+        fprintf(stderr, "%s: boot failed (%u flash errors)\n", name, flashSimulator.errors);
+        return false;
+    }
+
+    BootPathResult& result = results[resultCount++];
+    snprintf(result.name, sizeof(result.name), "%s", name);
+    result.cost = cost;
+    return true;
+}
+
+static bool runBootPaths()
+{
+    bool ok = runBootPath("first_boot", 0, firstBoot);
+    ok &= runBootPath("stable", 0, stableBoot);
+    ok &= runBootPath("new_app", 0, newAppBoot);
+    ok &= runBootPath("rejected_new_app", 0, rejectedNewAppBoot);
+    for (uint32_t retry = 0; retry + 1 < BOOTLOADER_MAX_RETRIES; retry++) {
+        char name[32];
+        snprintf(name, sizeof(name), "retry_%u", retry + 1);
+        ok &= runBootPath(name, retry, retryBoot);
+    }
+    ok &= runBootPath("rollback", 0, rollbackBoot);
+    #ifdef BACKUPRETRY
+    ok &= runBootPath("warm_retry", 0, warmRetryBoot);
+    #endif
+    #ifdef MAILBOX
+    ok &= runBootPath("mailbox_trial", 0, mailboxTrialBoot);
+    #endif
+    #ifdef COMPRESSION
+    ok &= runBootPath("compressed_new_app", 0, compressedNewAppBoot);
+    #endif
+    #ifdef DELTA
+    ok &= runBootPath("delta_new_app", 0, deltaNewAppBoot);
+    #endif
+    return ok;
+}
+
+#ifdef COMPRESSION
+/* Compression ratio of the benchmark app and speed of the decoder on the host */
+struct DecoderResult {
+    double ratio;
+    double hostMbPerSecond;
+};
+
+static DecoderResult decoder;
+
+static void runDecoder()
+{
+    flashSimulator.reset();
+    ImageHeader header = storeCompressedApp(0, BENCHMARK_APP_LENGTH, 2);
+    const uint8_t* slot = (const uint8_t*)slotWords(0);
+    uint32_t blocks = (header.length + IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE;
+    static uint8_t block[IMAGE_BLOCK_SIZE];
+
+    uint32_t rounds = 0;
+    clock_t start = clock();
+    do {
+        for (uint32_t i = 0, offset = 0; i < blocks; i++) {
+            uint32_t storedSize = slotWords(0)[offset / 4];
+            if (storedSize & IMAGE_BLOCK_RAW) {
+                memcpy(block, slot + offset + sizeof(storedSize), storedSize & ~IMAGE_BLOCK_RAW);
+            } else {
+                lz4Decompress(slot + offset + sizeof(storedSize), storedSize, block, sizeof(block));
+            }
+            offset += sizeof(storedSize) + (((storedSize & ~IMAGE_BLOCK_RAW) + 3) & ~3);
+        }
+        rounds++;
+    } while (clock() - start < CLOCKS_PER_SEC / 10);
+    double seconds = (clock() - start) / (double)CLOCKS_PER_SEC;
+
+    decoder.ratio = (double)blockOffset(0, blocks) / header.length;
+    decoder.hostMbPerSecond = rounds * (double)header.length / seconds / 1e6;
+}
+#endif
+
+#ifdef VERIFYHASH
+/* Speed of the SHA-256 engine and the plain reference implementation on the host */
+struct HashResult {
+    double hostMbPerSecond;
+    double referenceMbPerSecond;
+};
+
+static HashResult hashing;
+
+/* Host speed of a hash function over the benchmark app in slot 0 */
+static double hashSpeed(void (*hash)(const uint8_t*, uint32_t, uint8_t*), uint8_t* digest)
+{
+    const uint8_t* binary = (const uint8_t*)slotWords(0);
+    uint32_t rounds = 0;
+    clock_t start = clock();
+    do {
+        hash(binary, BENCHMARK_APP_LENGTH, digest);
+        rounds++;
+    } while (clock() - start < CLOCKS_PER_SEC / 10);
+    double seconds = (clock() - start) / (double)CLOCKS_PER_SEC;
+    return rounds * (double)BENCHMARK_APP_LENGTH / seconds / 1e6;
+}
+
+static void sha256Engine(const uint8_t* data, uint32_t size, uint8_t* digest)
+{
+    Sha256 context;
+    sha256Init(context);
+    sha256Update(context, data, size);
+    sha256Final(context, digest);
+}
+
+static bool runHash()
+{
+    flashSimulator.reset();
+    storeApp(0, BENCHMARK_APP_LENGTH, 1);
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint8_t referenceDigest[SHA256_DIGEST_SIZE];
+    hashing.hostMbPerSecond = hashSpeed(sha256Engine, digest);
+    hashing.referenceMbPerSecond = hashSpeed(sha256Reference, referenceDigest);
+
+    if (memcmp(digest, referenceDigest, sizeof(digest)) != 0) {
+        fprintf(stderr, "sha256: engine and reference disagree\n");
+        return false;
+    }
+    return true;
+}
+#endif
+
+#ifdef SIGNATURE
+/* Host speed of the signature check, on the signed benchmark app in slot 0 */
+static double verifiesPerSecond;
+
+static bool runSignature()
+{
+    flashSimulator.reset();
+    const ImageHeader header = storeApp(0, BENCHMARK_APP_LENGTH, 1);
+    uint32_t rounds = 0;
+    bool valid = true;
+    clock_t start = clock();
+    do {
+        valid &= p256Verify(SIGNATURE_PUBLIC_KEY, header.sha256, header.signature);
+        rounds++;
+    } while (clock() - start < CLOCKS_PER_SEC / 10);
+    verifiesPerSecond = rounds / ((clock() - start) / (double)CLOCKS_PER_SEC);
+
+    if (!valid) {
+        fprintf(stderr, "p256: signature of the benchmark app is invalid\n");
+    }
+    return valid;
+}
+#endif
+
+static void writeJson(FILE* file)
+{
+    fprintf(file, "{\n");
+    fprintf(file, "  \"config\": {\n");
+    fprintf(file, "    \"name\": \"%s\",\n", BENCHMARK_CONFIG);
+    #ifdef CLOCKBOOST
+    fprintf(file, "    \"clockboost\": true,\n");
+    #else
+    fprintf(file, "    \"clockboost\": false,\n");
+    #endif
+    #ifdef VERIFYCRC
+    fprintf(file, "    \"verifycrc\": true,\n");
+    #else
+    fprintf(file, "    \"verifycrc\": false,\n");
+    #endif
+    #ifdef VERIFYHASH
+    fprintf(file, "    \"verifyhash\": true,\n");
+    #else
+    fprintf(file, "    \"verifyhash\": false,\n");
+    #endif
+    #ifdef SIGNATURE
+    fprintf(file, "    \"signature\": true,\n");
+    #else
+    fprintf(file, "    \"signature\": false,\n");
+    #endif
+    fprintf(file, "    \"appLength\": %u\n", BENCHMARK_APP_LENGTH);
+    fprintf(file, "  },\n");
+    fprintf(file, "  \"paths\": {\n");
+    for (uint32_t i = 0; i < resultCount; i++) {
+        const BootCost& c = results[i].cost;
+        fprintf(file,
+            "    \"%s\": { \"pagesErased\": %u, \"halfWordsProgrammed\": %u, \"bytesRead\": %u, "
+            "\"timeMs\": %.3f, \"energyMj\": %.3f }%s\n",
+            results[i].name, c.pagesErased, c.halfWordsProgrammed, c.bytesRead, c.seconds * 1e3,
+            c.joules * 1e3, i + 1 < resultCount ? "," : "");
+    }
+    fprintf(file, "  }");
+    #ifdef COMPRESSION
+    fprintf(file, ",\n  \"decoder\": { \"ratio\": %.3f, \"hostMbPerSecond\": %.1f }", decoder.ratio,
+        decoder.hostMbPerSecond);
+    #endif
+    #ifdef DELTA
+    fprintf(file, ",\n  \"delta\": { \"patchRatio\": %.3f }", deltaPatchRatio);
+    #endif
+    #ifdef VERIFYHASH
+    fprintf(file,
+        ",\n  \"sha256\": { \"targetCyclesPerByte\": %u, \"hostMbPerSecond\": %.1f, \"referenceMbPerSecond\": %.1f }",
+        SHA256_TARGET_CYCLES_PER_BYTE, hashing.hostMbPerSecond, hashing.referenceMbPerSecond);
+    #endif
+    #ifdef SIGNATURE
+    fprintf(file, ",\n  \"p256\": { \"targetCycles\": %u, \"hostVerifiesPerSecond\": %.1f }",
+        P256_VERIFY_TARGET_CYCLES, verifiesPerSecond);
+    #endif
+    fprintf(file, "\n}\n");
+}
+
+static bool metricValue(const BootCost& c, const char* metric, double& value)
+{
+    if (strcmp(metric, "pagesErased") == 0) {
+        value = c.pagesErased;
+    } else if (strcmp(metric, "halfWordsProgrammed") == 0) {
+        value = c.halfWordsProgrammed;
+    } else if (strcmp(metric, "bytesRead") == 0) {
+        value = c.bytesRead;
+    } else if (strcmp(metric, "timeMs") == 0) {
+        value = c.seconds * 1e3;
+    } else if (strcmp(metric, "energyMj") == 0) {
+        value = c.joules * 1e3;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* Threshold file lines: <config> <path> <metric> <maximum>, where config is
+ * "direct", "copybinary", "swapbinary", one of them with "_verifyhash" or
+ * "_signature", or "*",
+ * and "#" starts a comment line */
+static bool checkThresholds(const char* fileName)
+{
+    FILE* file = fopen(fileName, "r");
+    if (file == nullptr) {
+        fprintf(stderr, "cannot open %s\n", fileName);
+        return false;
+    }
+
+    bool ok = true;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        char config[32], path[32], metric[32];
+        double maximum;
+        if (line[0] == '#' || sscanf(line, "%31s %31s %31s %lf", config, path, metric, &maximum) != 4) {
+            continue;
+        }
+        if (strcmp(config, "*") != 0 && strcmp(config, BENCHMARK_CONFIG) != 0) {
+            continue;
+        }
+
+        bool found = false;
+        for (uint32_t i = 0; i < resultCount; i++) {
+            double value;
+            if (strcmp(results[i].name, path) != 0) {
+                continue;
+            }
+            found = true;
+            if (!metricValue(results[i].cost, metric, value)) {
+                fprintf(stderr, "unknown metric %s\n", metric);
+                ok = false;
+            } else if (value > maximum) {
+                fprintf(stderr, "%s %s: %s is %.3f, threshold %.3f\n", BENCHMARK_CONFIG, path, metric, value,
+                    maximum);
+                ok = false;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "unknown boot path %s\n", path);
+            ok = false;
+        }
+    }
+
+    fclose(file);
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    const char* thresholds = nullptr;
+    const char* output = nullptr;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--thresholds") == 0) {
+            thresholds = argv[i + 1];
+        } else if (strcmp(argv[i], "--output") == 0) {
+            output = argv[i + 1];
+        }
+    }
+
+    #ifdef TRACEBOOT
+    /* Keep the JSON on stdout clean */
+    flashSimulator.traceSink = nullptr;
+    #endif
+
+    bool ok = runBootPaths();
+    #ifdef COMPRESSION
+    runDecoder();
+    #endif
+    #ifdef VERIFYHASH
+    ok &= runHash();
+    #endif
+    #ifdef SIGNATURE
+    ok &= runSignature();
+    #endif
+
+    FILE* file = output != nullptr ? fopen(output, "w") : stdout;
+    if (file == nullptr) {
+        fprintf(stderr, "cannot open %s\n", output);
+        return 1;
+    }
+    writeJson(file);
+    if (file != stdout) {
+        fclose(file);
+    }
+
+    if (thresholds != nullptr) {
+        ok &= checkThresholds(thresholds);
+    }
+    return ok ? 0 : 1;
+}
@@ -1,67 +1,53 @@
 #include "CppUTest/TestHarness.h"
-#include "CppUTestExt/MockSupport.h"
 
 #include "Bootloader.h"
+#include "FlashSimulator.h"
+#include "SimulatedDevice.h"
 #include "System.h"
 
 #include <string.h>
 
-BootloaderStatus inStatus;
-BootloaderStatus outStatus;
-uint32_t finalBootAddress = 0;
-uint32_t copySourceAddress = 0;
-uint32_t copyDestinationAddress = 0;
-bool readCalled = false;
-bool writeCalled = false;
-
-void System::readStatusReg(BootloaderStatus& status)
-{
-    readCalled = true;
-    status = inStatus;
-}
-
-void System::writeStatusReg(BootloaderStatus& status)
-{
-    writeCalled = true;
-    outStatus = status;
-}
+TEST_GROUP(BootLogicTest){
+    System sys;
+    Bootloader bl;
+    BootloaderStatus outStatus;
 
-void System::executeFromAddress(uint32_t bootAddress)
-{
-    finalBootAddress = bootAddress;
-}
+    virtual void setup()
+    {
+        flashSimulator.reset();
+        #ifdef TRACEBOOT
+        flashSimulator.traceSink = nullptr;
+        #endif
+        /* Valid image in each slot, with distinct contents */
+        for (uint32_t app = 0; app < BOOTLOADER_MAX_APPS; app++) {
+            storeApp(app, 0x1000, app + 1);
+        }
+    }
 
-void System::enableWatchdog() {}
+    virtual void teardown()
+    {
+        CHECK_EQUAL(0, flashSimulator.errors);
+        CHECK_TRUE(flashSimulator.locked);
+    }
 
-void System::copyFlashBlock(uint32_t sourceAddress, uint32_t destinationAddress, int32_t sizr)
-{
-    copySourceAddress = sourceAddress;
-    copyDestinationAddress = destinationAddress;
-}
+    void writeStatus(BootloaderStatus status)
+    {
+        sys.writeStatusReg(status);
+    }
 
-TEST_GROUP(BootLogicTest){
-    virtual void setup()
+    /* Boot with fresh counters and read back the resulting status */
+    void boot()
     {
-        inStatus = { 0 };
-        outStatus = { 0 };
-        readCalled = false;
-        writeCalled = false;
-        finalBootAddress = 0x0;
+        flashSimulator.clearCounters();
+        bl.boot(sys, false);
+        sys.readStatusReg(outStatus);
+        CHECK_EQUAL(1, flashSimulator.boots);
     }
 };
 
 TEST(BootLogicTest, FirstBoot)
 {
-    System sys;
-    bool enableWatchdog = false;
-
-    inStatus = { 0 };
-
-    Bootloader bl;
-    bl.boot(sys, enableWatchdog);
-
-    CHECK_TRUE(readCalled);
-    CHECK_TRUE(writeCalled);
+    boot();
 
     STRCMP_EQUAL(BOOTLOADER_NAME, outStatus.bootloaderName);
     CHECK_EQUAL((BOOTLOADER_VERSION_BUILD << 16) + (BOOTLOADER_VERSION_MINOR << 8)
@@ -71,180 +57,1653 @@ TEST(BootLogicTest, FirstBoot)
     CHECK_EQUAL(0, outStatus.liveAppSelect);
 
     #ifdef COPYBINARY
-    CHECK_EQUAL(copySourceAddress, BOOTLOADER_APP_ADDRESS[0]);
-    CHECK_EQUAL(copyDestinationAddress, BOOT_ADDRESS);
-    CHECK_EQUAL(BOOT_ADDRESS, finalBootAddress);
+    CHECK_TRUE(isInstalled(0, 0x1000));
+    CHECK_EQUAL(BOOT_ADDRESS, flashSimulator.bootAddress);
     #else
-    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[0], finalBootAddress);
+    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[0], flashSimulator.bootAddress);
     #endif
 }
 
 TEST(BootLogicTest, BootCurrentAppA)
 {
-    System sys;
-    bool enableWatchdog = false;
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    installApp(status, 0);
+    writeStatus(status);
 
-    strcpy(inStatus.bootloaderName, BOOTLOADER_NAME);
-    inStatus.bootloaderVersion = (BOOTLOADER_VERSION_BUILD << 16) + (BOOTLOADER_VERSION_MINOR << 8)
-        + (BOOTLOADER_VERSION_MAJOR);
-    inStatus.status = BootloaderState::stableApp;
-    inStatus.liveAppSelect = 0;
+    boot();
 
-    Bootloader bl;
-    bl.boot(sys, enableWatchdog);
-
-    CHECK_TRUE(readCalled);
-    CHECK_FALSE(writeCalled);
+    /* The stable app is installed already, only a boot mark is written */
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+    CHECK_EQUAL(1, flashSimulator.halfWordsProgrammed);
 
     #ifdef COPYBINARY
-    CHECK_EQUAL(copySourceAddress, BOOTLOADER_APP_ADDRESS[0]);
-    CHECK_EQUAL(copyDestinationAddress, BOOT_ADDRESS);
-    CHECK_EQUAL(BOOT_ADDRESS, finalBootAddress);
+    CHECK_EQUAL(BOOT_ADDRESS, flashSimulator.bootAddress);
     #else
-    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[0], finalBootAddress);
+    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[0], flashSimulator.bootAddress);
     #endif
 }
 
 TEST(BootLogicTest, BootCurrentAppB)
 {
-    System sys;
-    bool enableWatchdog = false;
-
-    strcpy(inStatus.bootloaderName, BOOTLOADER_NAME);
-    inStatus.bootloaderVersion = (BOOTLOADER_VERSION_BUILD << 16) + (BOOTLOADER_VERSION_MINOR << 8)
-        + (BOOTLOADER_VERSION_MAJOR);
-    inStatus.status = BootloaderState::stableApp;
-    inStatus.liveAppSelect = 1;
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 1);
+    installApp(status, 1);
+    writeStatus(status);
 
-    Bootloader bl;
-    bl.boot(sys, enableWatchdog);
+    boot();
 
-    CHECK_TRUE(readCalled);
-    CHECK_FALSE(writeCalled);
+    /* The stable app is installed already, only a boot mark is written */
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+    CHECK_EQUAL(1, flashSimulator.halfWordsProgrammed);
 
     #ifdef COPYBINARY
-    CHECK_EQUAL(copySourceAddress, BOOTLOADER_APP_ADDRESS[1]);
-    CHECK_EQUAL(copyDestinationAddress, BOOT_ADDRESS);
-    CHECK_EQUAL(BOOT_ADDRESS, finalBootAddress);
+    CHECK_EQUAL(BOOT_ADDRESS, flashSimulator.bootAddress);
     #else
-    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[1], finalBootAddress);
+    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[1], flashSimulator.bootAddress);
     #endif
 }
 
 TEST(BootLogicTest, BootNewAppA)
 {
-    System sys;
-    bool enableWatchdog = false;
-
-    strcpy(inStatus.bootloaderName, BOOTLOADER_NAME);
-    inStatus.bootloaderVersion = (BOOTLOADER_VERSION_BUILD << 16) + (BOOTLOADER_VERSION_MINOR << 8)
-        + (BOOTLOADER_VERSION_MAJOR);
-    inStatus.status = BootloaderState::newApp;
-    inStatus.liveAppSelect = 0;
-
-    Bootloader bl;
-    bl.boot(sys, enableWatchdog);
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 0);
+    installApp(status, 1);
+    writeStatus(status);
 
-    CHECK_TRUE(readCalled);
-    CHECK_TRUE(writeCalled);
+    boot();
 
     CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
 
     #ifdef COPYBINARY
-    CHECK_EQUAL(copySourceAddress, BOOTLOADER_APP_ADDRESS[0]);
-    CHECK_EQUAL(copyDestinationAddress, BOOT_ADDRESS);
-    CHECK_EQUAL(BOOT_ADDRESS, finalBootAddress);
+    CHECK_TRUE(isInstalled(0, 0x1000));
+    CHECK_EQUAL(BOOT_ADDRESS, flashSimulator.bootAddress);
     #else
-    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[0], finalBootAddress);
+    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[0], flashSimulator.bootAddress);
     #endif
 }
 
 TEST(BootLogicTest, BootNewAppB)
 {
-    System sys;
-    bool enableWatchdog = false;
-
-    strcpy(inStatus.bootloaderName, BOOTLOADER_NAME);
-    inStatus.bootloaderVersion = (BOOTLOADER_VERSION_BUILD << 16) + (BOOTLOADER_VERSION_MINOR << 8)
-        + (BOOTLOADER_VERSION_MAJOR);
-    inStatus.status = BootloaderState::newApp;
-    inStatus.liveAppSelect = 1;
-
-    Bootloader bl;
-    bl.boot(sys, enableWatchdog);
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 1);
+    installApp(status, 0);
+    writeStatus(status);
 
-    CHECK_TRUE(readCalled);
-    CHECK_TRUE(writeCalled);
+    boot();
 
     CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
 
     #ifdef COPYBINARY
-    CHECK_EQUAL(copySourceAddress, BOOTLOADER_APP_ADDRESS[1]);
-    CHECK_EQUAL(copyDestinationAddress, BOOT_ADDRESS);
-    CHECK_EQUAL(BOOT_ADDRESS, finalBootAddress);
+    CHECK_TRUE(isInstalled(1, 0x1000));
+    CHECK_EQUAL(BOOT_ADDRESS, flashSimulator.bootAddress);
     #else
-    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[1], finalBootAddress);
+    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[1], flashSimulator.bootAddress);
     #endif
 }
 
 TEST(BootLogicTest, BootBAfterAFails)
 {
-    System sys;
-    bool enableWatchdog = false;
+    writeStatus(statusFor(BootloaderState::attemptNewApp, 0));
 
-    strcpy(inStatus.bootloaderName, BOOTLOADER_NAME);
-    inStatus.bootloaderVersion = (BOOTLOADER_VERSION_BUILD << 16) + (BOOTLOADER_VERSION_MINOR << 8)
-        + (BOOTLOADER_VERSION_MAJOR);
-    inStatus.status = BootloaderState::attemptNewApp;
-    inStatus.liveAppSelect = 0;
-
-    Bootloader bl;
     for (int i = 0; i < BOOTLOADER_MAX_RETRIES; i++) {
-        bl.boot(sys, enableWatchdog);
-        inStatus = outStatus;
+        boot();
     }
 
-    CHECK_TRUE(readCalled);
-    CHECK_TRUE(writeCalled);
-
     CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(1, outStatus.liveAppSelect);
 
     #ifdef COPYBINARY
-    CHECK_EQUAL(copySourceAddress, BOOTLOADER_APP_ADDRESS[1]);
-    CHECK_EQUAL(copyDestinationAddress, BOOT_ADDRESS);
-    CHECK_EQUAL(BOOT_ADDRESS, finalBootAddress);
+    CHECK_TRUE(isInstalled(1, 0x1000));
+    CHECK_EQUAL(BOOT_ADDRESS, flashSimulator.bootAddress);
     #else
-    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[1], finalBootAddress);
+    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[1], flashSimulator.bootAddress);
     #endif
 }
 
 TEST(BootLogicTest, BootAAfterBFails)
 {
-    System sys;
-    bool enableWatchdog = false;
+    writeStatus(statusFor(BootloaderState::attemptNewApp, 1));
 
-    strcpy(inStatus.bootloaderName, BOOTLOADER_NAME);
-    inStatus.bootloaderVersion = (BOOTLOADER_VERSION_BUILD << 16) + (BOOTLOADER_VERSION_MINOR << 8)
-        + (BOOTLOADER_VERSION_MAJOR);
-    inStatus.status = BootloaderState::attemptNewApp;
-    inStatus.liveAppSelect = 1;
-
-    Bootloader bl;
     for (int i = 0; i < BOOTLOADER_MAX_RETRIES; i++) {
-        bl.boot(sys, enableWatchdog);
-        inStatus = outStatus;
+        boot();
     }
 
-    CHECK_TRUE(readCalled);
-    CHECK_TRUE(writeCalled);
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+
+    #ifdef COPYBINARY
+    CHECK_TRUE(isInstalled(0, 0x1000));
+    CHECK_EQUAL(BOOT_ADDRESS, flashSimulator.bootAddress);
+    #else
+    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[0], flashSimulator.bootAddress);
+    #endif
+}
+
+#ifdef CLOCKBOOST
+TEST(BootLogicTest, ClockBoostedForNewApp)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 0));
+
+    boot();
+
+    CHECK_TRUE(flashSimulator.clockBoosts > 0);
+    CHECK_FALSE(flashSimulator.clockBoosted);
+}
+
+TEST(BootLogicTest, ClockNotBoostedForStableApp)
+{
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    installApp(status, 0);
+    writeStatus(status);
+
+    boot();
+
+    CHECK_EQUAL(0, flashSimulator.clockBoosts);
+}
+#endif
+
+#ifdef VERIFYCRC
+TEST(BootLogicTest, CorruptNewAppIsRejected)
+{
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 1);
+    installApp(status, 0);
+    writeStatus(status);
+    slotWords(1)[0x100] ^= 1;
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+
+    #ifdef COPYBINARY
+    CHECK_TRUE(isInstalled(0, 0x1000));
+    CHECK_EQUAL(BOOT_ADDRESS, flashSimulator.bootAddress);
+    #else
+    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[0], flashSimulator.bootAddress);
+    #endif
+}
+
+TEST(BootLogicTest, FirstBootSkipsCorruptApp)
+{
+    slotWords(0)[0x100] ^= 1;
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(1, outStatus.liveAppSelect);
+
+    #ifdef COPYBINARY
+    CHECK_TRUE(isInstalled(1, 0x1000));
+    CHECK_EQUAL(BOOT_ADDRESS, flashSimulator.bootAddress);
+    #else
+    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[1], flashSimulator.bootAddress);
+    #endif
+}
+#endif
+
+#ifdef VERIFYHASH
+TEST(BootLogicTest, TamperedNewAppWithMatchingCrcIsRejected)
+{
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 1);
+    installApp(status, 0);
+    writeStatus(status);
+    slotWords(1)[0x100] ^= 1;
+    slotHeader(1)->crc = crc32(slotWords(1), slotHeader(1)->length / sizeof(uint32_t));
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+}
+
+TEST(BootLogicTest, NewAppIsHashedFromFlashOnce)
+{
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 1);
+    installApp(status, 0);
+    writeStatus(status);
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(slotHeader(1)->length, flashSimulator.bytesHashed);
+}
+
+TEST(BootLogicTest, StableBootHashesNothing)
+{
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    installApp(status, 0);
+    writeStatus(status);
+
+    boot();
+
+    CHECK_EQUAL(0, flashSimulator.bytesHashed);
+}
+#endif
+
+#ifdef SIGNATURE
+TEST(BootLogicTest, TamperedNewAppWithMatchingHashIsRejected)
+{
+    /* Whoever changes the binary can fix the crc and hash, but not the signature */
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 1);
+    installApp(status, 0);
+    writeStatus(status);
+    uint8_t signature[P256_SIGNATURE_SIZE];
+    memcpy(signature, slotHeader(1)->signature, sizeof(signature));
+    slotWords(1)[0x100] ^= 1;
+    slotHeader(1)->crc = crc32(slotWords(1), slotHeader(1)->length / sizeof(uint32_t));
+    setImageHash(*slotHeader(1), slotWords(1));
+    memcpy(slotHeader(1)->signature, signature, sizeof(signature));
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+}
+
+TEST(BootLogicTest, NewAppSignedWithAnotherKeyIsRejected)
+{
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 1);
+    installApp(status, 0);
+    writeStatus(status);
+    uint8_t otherKey[P256_SIZE];
+    memcpy(otherKey, SIGNATURE_TEST_PRIVATE_KEY, sizeof(otherKey));
+    otherKey[P256_SIZE - 1] ^= 1;
+    p256Sign(otherKey, slotHeader(1)->sha256, slotHeader(1)->signature);
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+}
+
+TEST(BootLogicTest, NewAppIsRecordedAsVerified)
+{
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 1);
+    installApp(status, 0);
+    writeStatus(status);
+    ImageHeader header = *slotHeader(1);
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(1, flashSimulator.signatureChecks);
+    CHECK_EQUAL(1, outStatus.verifiedApp);
+    MEMCMP_EQUAL(header.sha256, outStatus.verifiedHash, sizeof(outStatus.verifiedHash));
+}
+
+TEST(BootLogicTest, RetryOfVerifiedAppSkipsHashAndSignature)
+{
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 1);
+    installApp(status, 0);
+    writeStatus(status);
+    boot();
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(1, outStatus.liveAppSelect);
+    CHECK_EQUAL(0, flashSimulator.bytesHashed);
+    CHECK_EQUAL(0, flashSimulator.signatureChecks);
+}
+
+TEST(BootLogicTest, NewAppIsVerifiedDespiteTheMarker)
+{
+    /* The app stored the same image again, the marker is not trusted */
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 1);
+    installApp(status, 0);
+    status.verifiedApp = 1;
+    memcpy(status.verifiedHash, slotHeader(1)->sha256, sizeof(status.verifiedHash));
+    writeStatus(status);
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(1, flashSimulator.signatureChecks);
+    CHECK_EQUAL(0x1000, flashSimulator.bytesHashed);
+}
+
+TEST(BootLogicTest, AppWithAnotherHashIsVerifiedDespiteTheMarker)
+{
+    /* The marker belongs to the image hash, a different image in the slot is checked */
+    BootloaderStatus status = statusFor(BootloaderState::attemptNewApp, 1);
+    installApp(status, 1);
+    status.verifiedHash[0] ^= 1;
+    writeStatus(status);
+
+    boot();
 
     CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(1, outStatus.liveAppSelect);
+    CHECK_EQUAL(1, flashSimulator.signatureChecks);
+    CHECK_EQUAL(0x1000, flashSimulator.bytesHashed);
+}
+#endif
+
+TEST(BootLogicTest, NewAppWithInvalidVectorTableIsRejected)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    slotWords(1)[0] = 0xFFFFFFFF;
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+}
+
+#ifdef LEGACY_IMAGES
+TEST(BootLogicTest, NewAppWithoutHeaderIsAttemptedAsLegacyApp)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    memset(slotHeader(1), 0xFF, sizeof(ImageHeader));
 
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(1, outStatus.liveAppSelect);
     #ifdef COPYBINARY
-    CHECK_EQUAL(copySourceAddress, BOOTLOADER_APP_ADDRESS[0]);
-    CHECK_EQUAL(copyDestinationAddress, BOOT_ADDRESS);
-    CHECK_EQUAL(BOOT_ADDRESS, finalBootAddress);
+    CHECK_TRUE(isInstalled(1, APP_HEADER_OFFSET));
+    #endif
+}
+
+TEST(BootLogicTest, EmptySlotIsNoLegacyApp)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    memset(slotWords(1), 0xFF, APP_SIZE);
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+}
+#else
+TEST(BootLogicTest, NewAppWithoutHeaderIsRejected)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    memset(slotHeader(1), 0xFF, sizeof(ImageHeader));
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+}
+#endif
+
+TEST(BootLogicTest, InvalidAppIsRolledBackWithoutRetries)
+{
+    writeStatus(statusFor(BootloaderState::attemptNewApp, 0));
+    slotHeader(0)->magic = 0;
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(1, outStatus.liveAppSelect);
+    CHECK_EQUAL(0, outStatus.retryCount);
+}
+
+TEST(BootLogicTest, RollbackKeepsAppIfOtherIsInvalid)
+{
+    BootloaderStatus status = statusFor(BootloaderState::attemptNewApp, 0);
+    status.retryCount = BOOTLOADER_MAX_RETRIES - 1;
+    installApp(status, 0);
+    writeStatus(status);
+    for (uint32_t app = 1; app < BOOTLOADER_MAX_APPS; app++) {
+        slotHeader(app)->magic = 0;
+    }
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+    CHECK_EQUAL(0, outStatus.retryCount);
+    #ifndef COPYBINARY
+    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[0], flashSimulator.bootAddress);
+    #endif
+}
+
+#ifdef LEGACY_IMAGES
+TEST(BootLogicTest, FirstBootPrefersAppsWithHeader)
+{
+    memset(slotHeader(0), 0xFF, sizeof(ImageHeader));
+
+    boot();
+
+    CHECK_EQUAL(1, outStatus.liveAppSelect);
+}
+#endif
+
+TEST(BootLogicTest, FirstBootSelectsNewestApp)
+{
+    uint32_t newestApp = BOOTLOADER_MAX_APPS - 1;
+    storeApp(newestApp, 0x1000, newestApp + 1, 2);
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(newestApp, outStatus.liveAppSelect);
+}
+
+TEST(BootLogicTest, RollbackSelectsNextNewestApp)
+{
+    /* Versions count up with the slot, the last slot has the app on trial */
+    for (uint32_t app = 0; app < BOOTLOADER_MAX_APPS; app++) {
+        storeApp(app, 0x1000, app + 1, app + 1);
+    }
+    BootloaderStatus status = statusFor(BootloaderState::attemptNewApp, BOOTLOADER_MAX_APPS - 1);
+    status.retryCount = BOOTLOADER_MAX_RETRIES - 1;
+    installApp(status, BOOTLOADER_MAX_APPS - 1);
+    writeStatus(status);
+
+    boot();
+
+    CHECK_EQUAL(BOOTLOADER_MAX_APPS - 2, outStatus.liveAppSelect);
+    CHECK_EQUAL(1, outStatus.statistics.rollbacks[BOOTLOADER_MAX_APPS - 1]);
+}
+
+#if APP_SLOTS > 2
+TEST(BootLogicTest, RejectedNewAppSkipsInvalidNewerApp)
+{
+    for (uint32_t app = 0; app < BOOTLOADER_MAX_APPS; app++) {
+        storeApp(app, 0x1000, app + 1, BOOTLOADER_MAX_APPS - app);
+    }
+    writeStatus(statusFor(BootloaderState::newApp, BOOTLOADER_MAX_APPS - 1));
+    slotHeader(BOOTLOADER_MAX_APPS - 1)->magic = 0;
+    slotWords(0)[0] = 0xFFFFFFFF;
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(1, outStatus.liveAppSelect);
+}
+
+TEST(BootLogicTest, RollbacksMoveDownTheVersions)
+{
+    /* Versions 1, 2 and 3 in the first slots, the newest one is the new app */
+    for (uint32_t app = 0; app < BOOTLOADER_MAX_APPS; app++) {
+        storeApp(app, 0x1000, app + 1, app + 1);
+    }
+    for (uint32_t app = 3; app < BOOTLOADER_MAX_APPS; app++) {
+        slotHeader(app)->magic = 0;
+    }
+    writeStatus(statusFor(BootloaderState::newApp, 2));
+    boot();
+    CHECK_EQUAL(2, outStatus.liveAppSelect);
+
+    /* No app confirms, each one is given up on after its retries. The oldest
+     * app is kept once all are given up on */
+    const uint32_t fallbacks[] = { 1, 0, 0 };
+    for (uint32_t fallback : fallbacks) {
+        for (uint32_t retry = 0; retry < BOOTLOADER_MAX_RETRIES; retry++) {
+            boot();
+        }
+        CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+        CHECK_EQUAL(fallback, outStatus.liveAppSelect);
+    }
+    CHECK_EQUAL(7, outStatus.givenUpApps);
+}
+
+TEST(BootLogicTest, NewAppStartsANewFallbackChain)
+{
+    for (uint32_t app = 0; app < BOOTLOADER_MAX_APPS; app++) {
+        storeApp(app, 0x1000, app + 1, app + 1);
+    }
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 1);
+    status.givenUpApps = 1U << 2;
+    writeStatus(status);
+
+    boot();
+    for (uint32_t retry = 0; retry < BOOTLOADER_MAX_RETRIES; retry++) {
+        boot();
+    }
+
+    /* The newest app is tried again after an update */
+    CHECK_EQUAL(BOOTLOADER_MAX_APPS - 1, outStatus.liveAppSelect);
+    CHECK_EQUAL(1U << 1, outStatus.givenUpApps);
+}
+#endif
+
+static bool otherSlotRead;
+
+static void recordSlotRead(SimulatorOperation operation, uint32_t address, uint32_t)
+{
+    if (operation == SimulatorOperation::flashRead && address >= BOOTLOADER_APP_ADDRESS[1]) {
+        otherSlotRead = true;
+    }
+}
+
+TEST(BootLogicTest, StableBootReadsNoOtherSlot)
+{
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    installApp(status, 0);
+    writeStatus(status);
+
+    otherSlotRead = false;
+    flashSimulator.observer = recordSlotRead;
+    boot();
+    flashSimulator.observer = nullptr;
+
+    CHECK_FALSE(otherSlotRead);
+}
+
+TEST(BootLogicTest, StatisticsCountTrialsAndRollbacks)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+
+    for (int i = 0; i < BOOTLOADER_MAX_RETRIES + 1; i++) {
+        boot();
+    }
+
+    /* The new app and the app it was rolled back to are both on trial */
+    CHECK_EQUAL(BOOTLOADER_MAX_RETRIES + 1, outStatus.statistics.boots);
+    CHECK_EQUAL(BOOTLOADER_MAX_RETRIES + 1, outStatus.statistics.trialBoots);
+    CHECK_EQUAL(0, outStatus.statistics.rollbacks[0]);
+    CHECK_EQUAL(1, outStatus.statistics.rollbacks[1]);
+}
+
+TEST(BootLogicTest, RejectedNewAppCountsAsRollback)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    slotHeader(1)->magic = 0;
+
+    boot();
+
+    CHECK_EQUAL(1, outStatus.statistics.rollbacks[1]);
+    CHECK_EQUAL(0, outStatus.statistics.trialBoots);
+}
+
+TEST(BootLogicTest, StableBootsAreCountedWithoutErase)
+{
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    installApp(status, 0);
+    writeStatus(status);
+    uint32_t boots = 2 * STATUS_BOOT_MARKS + 1;
+
+    uint32_t erases = 0;
+    for (uint32_t i = 0; i < boots; i++) {
+        boot();
+        erases += flashSimulator.pagesErased;
+    }
+
+    #ifdef BACKUPRETRY
+    /* Only the cold boot was counted in flash, warm boots are pending */
+    CHECK_EQUAL(1, outStatus.statistics.boots);
+    CHECK_EQUAL(boots - 1, backupState().pendingBoots);
     #else
-    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[0], finalBootAddress);
+    CHECK_EQUAL(boots, outStatus.statistics.boots);
     #endif
+    CHECK_EQUAL(0, outStatus.statistics.trialBoots);
+    CHECK_EQUAL(0, erases);
+}
+
+#ifdef BACKUPRETRY
+TEST(BootLogicTest, WarmRetryDoesNotWriteFlash)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    boot();
+
+    boot();
+
+    CHECK_EQUAL(0, flashSimulator.halfWordsProgrammed);
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+    CHECK_EQUAL(0, outStatus.retryCount);
+    CHECK_EQUAL(BACKUP_STATE_MAGIC, backupState().magic);
+    CHECK_EQUAL(1, backupState().retryCount);
+    CHECK_EQUAL(1, backupState().pendingBoots);
+    CHECK_EQUAL(1, backupState().pendingTrialBoots);
+}
+
+TEST(BootLogicTest, ColdRetryIsWrittenToFlash)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    boot();
+    boot();
+
+    /* VBAT was lost, the warm retry and boot are gone */
+    memset(flashSimulator.backupRegisters, 0, sizeof(flashSimulator.backupRegisters));
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(1, outStatus.liveAppSelect);
+    CHECK_EQUAL(1, outStatus.retryCount);
+    CHECK_EQUAL(2, outStatus.statistics.boots);
+
+    /* The next warm retry continues from the flash status */
+    boot();
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+}
+
+TEST(BootLogicTest, PendingBootsAreWrittenWithTheNextStatus)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    boot();
+    for (int i = 1; i < BOOTLOADER_MAX_RETRIES; i++) {
+        boot();
+    }
+    CHECK_EQUAL(1, outStatus.statistics.boots);
+
+    /* The rollback writes the status, with the pending counts */
+    boot();
+
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+    CHECK_EQUAL(BOOTLOADER_MAX_RETRIES + 1, outStatus.statistics.boots);
+    CHECK_EQUAL(BOOTLOADER_MAX_RETRIES + 1, outStatus.statistics.trialBoots);
+    CHECK_EQUAL(0, backupState().pendingBoots);
+}
+
+TEST(BootLogicTest, StatusWrittenByAppInvalidatesWarmRetries)
+{
+    writeStatus(statusFor(BootloaderState::attemptNewApp, 1));
+    setWarmBoot(BOOTLOADER_MAX_RETRIES - 1);
+
+    /* The app confirmed, then stored another update */
+    writeStatus(statusFor(BootloaderState::stableApp, 1));
+    writeStatus(statusFor(BootloaderState::newApp, 0));
+    boot();
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+    CHECK_EQUAL(1, backupState().retryCount);
+}
+#endif
+
+#if defined(COPYBINARY) && !defined(SWAPBINARY)
+TEST(BootLogicTest, InstallCountsCopiedPages)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    storeApp(1, 0x2000, 3);
+
+    boot();
+    boot();
+
+    /* The retry finds the app installed already */
+    CHECK_EQUAL(0x2000 / FLASH_PAGE_SIZE, outStatus.statistics.pagesCopied);
+}
+
+TEST(BootLogicTest, RejectedNewAppReinstallsOtherApp)
+{
+    /* The new app was stored over the installed one's slot */
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 0);
+    installApp(status, 0);
+    writeStatus(status);
+    storeApp(0, 0x1000, 3);
+    slotHeader(0)->magic = 0;
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(1, outStatus.liveAppSelect);
+    CHECK_TRUE(isInstalled(1, 0x1000));
+}
+
+TEST(BootLogicTest, InterruptedInstallOfStableAppIsResumed)
+{
+    ImageHeader header = storeApp(1, 2 * INSTALL_CHECKPOINT_SIZE, 3);
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 1);
+    status.installedLength = header.length;
+    status.installedCrc = header.crc;
+    status.installProgress = 1;
+    writeStatus(status);
+    memcpy(flashSimulator.memory(BOOT_ADDRESS, INSTALL_CHECKPOINT_SIZE),
+        flashSimulator.memory(BOOTLOADER_APP_ADDRESS[1], INSTALL_CHECKPOINT_SIZE), INSTALL_CHECKPOINT_SIZE);
+
+    boot();
+
+    CHECK_TRUE(isInstalled(1, header.length));
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(2, outStatus.installProgress);
+}
+
+TEST(BootLogicTest, CopyUsesImageLength)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    storeApp(1, 0x2000, 3);
+
+    boot();
+
+    CHECK_TRUE(isInstalled(1, 0x2000));
+    CHECK_TRUE(sys.isBlank(BOOT_ADDRESS + 0x2000, FLASH_PAGE_SIZE));
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+}
+
+TEST(BootLogicTest, RetrySkipsCopyOfInstalledApp)
+{
+    BootloaderStatus status = statusFor(BootloaderState::attemptNewApp, 1);
+    installApp(status, 1);
+    writeStatus(status);
+
+    boot();
+
+    /* Only the status record with the new retry count is written */
+    CHECK_EQUAL(1, outStatus.retryCount);
+    CHECK_TRUE(flashSimulator.halfWordsProgrammed <= sizeof(StatusRecord) / sizeof(uint16_t));
+    CHECK_EQUAL(BOOT_ADDRESS, flashSimulator.bootAddress);
+}
+
+TEST(BootLogicTest, RollbackCopiesAndRecordsInstalledApp)
+{
+    BootloaderStatus status = statusFor(BootloaderState::attemptNewApp, 1);
+    status.retryCount = BOOTLOADER_MAX_RETRIES - 1;
+    installApp(status, 1);
+    writeStatus(status);
+    ImageHeader header = storeApp(0, 0x2000, 3);
+
+    boot();
+
+    CHECK_TRUE(isInstalled(0, 0x2000));
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+    CHECK_EQUAL(0x2000, outStatus.installedLength);
+    CHECK_EQUAL(header.crc, outStatus.installedCrc);
+    CHECK_EQUAL(1, outStatus.installProgress);
+}
+
+#ifdef LEGACY_IMAGES
+TEST(BootLogicTest, RollbackReinstallsTheOtherLegacyApp)
+{
+    for (uint32_t app = 0; app < BOOTLOADER_MAX_APPS; app++) {
+        memset(slotHeader(app), 0xFF, sizeof(ImageHeader));
+    }
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    boot();
+    CHECK_TRUE(isInstalled(1, APP_HEADER_OFFSET));
+
+    BootloaderStatus status = outStatus;
+    status.retryCount = BOOTLOADER_MAX_RETRIES - 1;
+    writeStatus(status);
+    boot();
+
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+    CHECK_TRUE(isInstalled(0, APP_HEADER_OFFSET));
+}
+#endif
+
+TEST(BootLogicTest, InstallIsCheckpointed)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    storeApp(1, 2 * INSTALL_CHECKPOINT_SIZE + 0x100, 3);
+
+    boot();
+
+    CHECK_TRUE(isInstalled(1, 2 * INSTALL_CHECKPOINT_SIZE + 0x100));
+    CHECK_EQUAL(3, outStatus.installProgress);
+}
+
+TEST(BootLogicTest, InterruptedInstallResumesAtCheckpoint)
+{
+    ImageHeader header = storeApp(1, 3 * INSTALL_CHECKPOINT_SIZE, 3);
+    BootloaderStatus status = statusFor(BootloaderState::attemptNewApp, 1);
+    status.installedLength = header.length;
+    status.installedCrc = header.crc;
+    status.installProgress = 2;
+    writeStatus(status);
+
+    /* Checkpoints that are recorded as done are not touched again */
+    memset(flashSimulator.memory(BOOT_ADDRESS, 2 * INSTALL_CHECKPOINT_SIZE), 0, 2 * INSTALL_CHECKPOINT_SIZE);
+
+    boot();
+
+    const uint8_t* bootFlash = flashSimulator.memory(BOOT_ADDRESS, header.length);
+    const uint8_t* appFlash = flashSimulator.memory(BOOTLOADER_APP_ADDRESS[1], header.length);
+    for (uint32_t i = 0; i < 2 * INSTALL_CHECKPOINT_SIZE; i++) {
+        CHECK_EQUAL(0, bootFlash[i]);
+    }
+    CHECK_EQUAL(0, memcmp(bootFlash + 2 * INSTALL_CHECKPOINT_SIZE, appFlash + 2 * INSTALL_CHECKPOINT_SIZE, INSTALL_CHECKPOINT_SIZE));
+    CHECK_EQUAL(3, outStatus.installProgress);
+    CHECK_EQUAL(1, outStatus.retryCount);
+}
+
+TEST(BootLogicTest, InterruptedPageIsCompletedWithoutErase)
+{
+    ImageHeader header = storeApp(1, 2 * INSTALL_CHECKPOINT_SIZE, 3);
+    BootloaderStatus status = statusFor(BootloaderState::attemptNewApp, 1);
+    status.installedLength = header.length;
+    status.installedCrc = header.crc;
+    status.installProgress = 1;
+    writeStatus(status);
+
+    /* The reset hit in the middle of the first page of the second checkpoint */
+    uint32_t copied = INSTALL_CHECKPOINT_SIZE + FLASH_PAGE_SIZE / 2;
+    memcpy(flashSimulator.memory(BOOT_ADDRESS, copied),
+        flashSimulator.memory(BOOTLOADER_APP_ADDRESS[1], copied), copied);
+
+    boot();
+
+    CHECK_TRUE(isInstalled(1, header.length));
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+    CHECK_EQUAL(2, outStatus.installProgress);
+}
+#endif
+
+#ifdef SWAPBINARY
+/* Check that a slot holds the app last stored in another slot */
+static bool slotHolds(uint32_t slot, uint32_t app)
+{
+    const ImageHeader& stored = storedHeader(app);
+    return memcmp(slotHeader(slot), &stored, sizeof(stored)) == 0
+        && crc32(slotWords(slot), stored.length / sizeof(uint32_t)) == stored.crc;
+}
+
+TEST(BootLogicTest, NewAppIsSwappedIn)
+{
+    /* The longer stable app is swapped out to the slot of the new app whole */
+    storeApp(0, 3 * SWAP_SCRATCH_SIZE, 3);
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    installApp(status, 0);
+    ImageHeader header = storeApp(1, SWAP_SCRATCH_SIZE, 4, 2);
+    status.status = BootloaderState::newApp;
+    status.liveAppSelect = 1;
+    writeStatus(status);
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_TRUE(isInstalled(1, header.length));
+    CHECK_TRUE(slotHolds(1, 0));
+    CHECK_EQUAL(1, outStatus.swapSlot);
+    CHECK_EQUAL(3 * SWAP_SCRATCH_SIZE, outStatus.swapLength);
+    CHECK_EQUAL(SWAP_STEPS(3 * SWAP_SCRATCH_SIZE), outStatus.installProgress);
+    CHECK_EQUAL(header.crc, outStatus.installedCrc);
+    CHECK_EQUAL(BOOT_ADDRESS, flashSimulator.bootAddress);
+}
+
+TEST(BootLogicTest, RetryDoesNotSwapAgain)
+{
+    BootloaderStatus status = statusFor(BootloaderState::attemptNewApp, 1);
+    installApp(status, 1);
+    writeStatus(status);
+
+    boot();
+
+    /* Only the status record with the new retry count is written */
+    CHECK_EQUAL(1, outStatus.retryCount);
+    CHECK_TRUE(flashSimulator.halfWordsProgrammed <= sizeof(StatusRecord) / sizeof(uint16_t));
+    CHECK_TRUE(isInstalled(1, 0x1000));
+}
+
+TEST(BootLogicTest, RollbackSwapsBackTheAppFromBefore)
+{
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    installApp(status, 0);
+    storeApp(1, 0x1000, 4, 2);
+    status.status = BootloaderState::newApp;
+    status.liveAppSelect = 1;
+    writeStatus(status);
+
+    for (int i = 0; i <= BOOTLOADER_MAX_RETRIES; i++) {
+        boot();
+    }
+
+    /* Nothing is copied again, the new app waits in its slot */
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.retryCount);
+    CHECK_EQUAL(1, outStatus.liveAppSelect);
+    CHECK_EQUAL(1, outStatus.statistics.rollbacks[1]);
+    CHECK_TRUE(isInstalled(0, 0x1000));
+    CHECK_TRUE(slotHolds(1, 1));
+}
+
+TEST(BootLogicTest, RollbackDoesNotSwapInTheAppGivenUpOn)
+{
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    installApp(status, 0);
+    storeApp(1, 0x1000, 4, 2);
+    status.status = BootloaderState::newApp;
+    status.liveAppSelect = 1;
+    writeStatus(status);
+
+    /* Give up on the new app, then twice on the app from before */
+    for (int i = 0; i <= 3 * BOOTLOADER_MAX_RETRIES; i++) {
+        boot();
+    }
+
+    /* The app from before stays, the new app is not swapped in again */
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(1U << 1, outStatus.givenUpApps);
+    CHECK_EQUAL(3, outStatus.statistics.rollbacks[1]);
+    CHECK_TRUE(isInstalled(0, 0x1000));
+    CHECK_TRUE(slotHolds(1, 1));
+}
+
+TEST(BootLogicTest, RejectedNewAppKeepsTheStableApp)
+{
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    installApp(status, 0);
+    storeApp(1, 0x1000, 4, 2);
+    slotHeader(1)->magic = 0;
+    status.status = BootloaderState::newApp;
+    status.liveAppSelect = 1;
+    writeStatus(status);
+
+    boot();
+
+    /* The stable app was never swapped out */
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+    CHECK_TRUE(isInstalled(0, 0x1000));
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+}
+
+TEST(BootLogicTest, InterruptedSwapResumesAtStep)
+{
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    storeApp(0, 2 * SWAP_SCRATCH_SIZE, 3);
+    installApp(status, 0);
+    ImageHeader header = storeApp(1, 2 * SWAP_SCRATCH_SIZE, 4, 2);
+    status.status = BootloaderState::attemptNewApp;
+    status.liveAppSelect = 1;
+    status.swapSlot = 1;
+    status.swapLength = header.length;
+    status.installProgress = 4;
+    writeStatus(status);
+
+    /* The first batch is swapped, the second one is in the scratch area, and
+     * the reset hit while copying the slot over it */
+    uint8_t* boot0 = flashSimulator.memory(BOOT_ADDRESS, APP_SIZE);
+    uint8_t* slot1 = flashSimulator.memory(BOOTLOADER_APP_ADDRESS[1], APP_SIZE);
+    uint8_t* scratch = flashSimulator.memory(SWAP_SCRATCH_ADDRESS, SWAP_SCRATCH_SIZE);
+    for (uint32_t i = 0; i < SWAP_SCRATCH_SIZE; i++) {
+        uint8_t byte = boot0[i];
+        boot0[i] = slot1[i];
+        slot1[i] = byte;
+    }
+    memcpy(scratch, boot0 + SWAP_SCRATCH_SIZE, SWAP_SCRATCH_SIZE);
+    memcpy(boot0 + SWAP_SCRATCH_SIZE, slot1 + SWAP_SCRATCH_SIZE, FLASH_PAGE_SIZE / 2);
+
+    boot();
+
+    CHECK_TRUE(isInstalled(1, header.length));
+    CHECK_TRUE(slotHolds(1, 0));
+    CHECK_EQUAL(SWAP_STEPS(header.length), outStatus.installProgress);
+    CHECK_EQUAL(1, outStatus.retryCount);
+}
+
+TEST(BootLogicTest, EqualBatchesAreNotSwapped)
+{
+    /* Same binary as the stable app, only the version in the header differs */
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    storeApp(0, 3 * SWAP_SCRATCH_SIZE, 3);
+    installApp(status, 0);
+    storeApp(1, 3 * SWAP_SCRATCH_SIZE, 3, 2);
+    status.status = BootloaderState::newApp;
+    status.liveAppSelect = 1;
+    writeStatus(status);
+
+    boot();
+
+    /* Only the header pages are swapped, through the blank scratch area */
+    CHECK_TRUE(isInstalled(1, 3 * SWAP_SCRATCH_SIZE));
+    CHECK_TRUE(slotHolds(1, 0));
+    LONGS_EQUAL(2, flashSimulator.pagesErased);
+    LONGS_EQUAL(3, outStatus.statistics.pagesCopied);
+}
+
+TEST(BootLogicTest, FirstBootSwapsOutTheBootRegion)
+{
+    storeApp(1, 0x1000, 4, 2);
+    memset(flashSimulator.memory(BOOT_ADDRESS, 0x1000), 0x5A, 0x1000);
+
+    boot();
+
+    CHECK_EQUAL(1, outStatus.liveAppSelect);
+    CHECK_EQUAL(1, outStatus.swapSlot);
+    CHECK_TRUE(isInstalled(1, 0x1000));
+    CHECK_EQUAL(0x5A, flashSimulator.memory(BOOTLOADER_APP_ADDRESS[1])[0]);
+}
+#endif
+
+#ifdef COMPRESSION
+TEST(BootLogicTest, CompressedAppIsInstalled)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    ImageHeader header = storeCompressedApp(1, 3 * IMAGE_BLOCK_SIZE + 0x100, 3);
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_TRUE(isInstalled(1, header.length));
+    CHECK_EQUAL(4, outStatus.installProgress);
+    CHECK_EQUAL(header.crc, sys.crcFlash(BOOT_ADDRESS, header.length));
+
+    /* The app takes less than two thirds of the slot space of the binary */
+    CHECK_TRUE(blockOffset(1, 4) < header.length * 2 / 3);
+}
+
+TEST(BootLogicTest, CompressedAppLargerThanASlotIsInstalled)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    ImageHeader header = storeCompressedApp(1, APP_SIZE + 2 * IMAGE_BLOCK_SIZE, 3);
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_TRUE(isInstalled(1, header.length));
+}
+
+TEST(BootLogicTest, IncompressibleBlocksAreInstalled)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    ImageHeader header = storeCompressedApp(1, 2 * IMAGE_BLOCK_SIZE, 3, false);
+    CHECK_TRUE(slotWords(1)[0] & IMAGE_BLOCK_RAW);
+
+    boot();
+
+    CHECK_TRUE(isInstalled(1, header.length));
+}
+
+TEST(BootLogicTest, InterruptedCompressedInstallResumesAtBlock)
+{
+    ImageHeader header = storeCompressedApp(1, 3 * IMAGE_BLOCK_SIZE, 3);
+    BootloaderStatus status = statusFor(BootloaderState::attemptNewApp, 1);
+    status.installedLength = header.length;
+    status.installedCrc = header.crc;
+    status.installProgress = 2;
+    writeStatus(status);
+
+    /* The blocks of the checkpoints done are not decompressed again */
+    memset(flashSimulator.memory(BOOT_ADDRESS, 2 * IMAGE_BLOCK_SIZE), 0, 2 * IMAGE_BLOCK_SIZE);
+
+    boot();
+
+    const uint8_t* bootFlash = flashSimulator.memory(BOOT_ADDRESS, header.length);
+    for (uint32_t i = 0; i < 2 * IMAGE_BLOCK_SIZE; i++) {
+        CHECK_EQUAL(0, bootFlash[i]);
+    }
+    CHECK_EQUAL(0, memcmp(bootFlash + 2 * IMAGE_BLOCK_SIZE, slotBinary(1) + 2 * IMAGE_BLOCK_SIZE,
+                       IMAGE_BLOCK_SIZE));
+    CHECK_EQUAL(3, outStatus.installProgress);
+}
+
+TEST(BootLogicTest, CompressedAppWithBlockOutsideTheSlotIsRejected)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    storeCompressedApp(1, 2 * IMAGE_BLOCK_SIZE, 3);
+    slotWords(1)[blockOffset(1, 1) / 4] = APP_SIZE;
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+}
+
+#ifdef VERIFYCRC
+TEST(BootLogicTest, CorruptCompressedAppIsRejected)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    storeCompressedApp(1, 2 * IMAGE_BLOCK_SIZE, 3);
+    flashSimulator.memory(BOOTLOADER_APP_ADDRESS[1])[blockOffset(1, 1) + 8] ^= 1;
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+}
+#endif
+
+#ifdef SIGNATURE
+TEST(BootLogicTest, RetryOfVerifiedCompressedAppOnlyDecodesTheFirstBlock)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    storeCompressedApp(1, 3 * IMAGE_BLOCK_SIZE, 3);
+    boot();
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(1, outStatus.liveAppSelect);
+    CHECK_EQUAL(0, flashSimulator.bytesHashed);
+    CHECK_EQUAL(0, flashSimulator.signatureChecks);
+    CHECK_TRUE(flashSimulator.bytesRead < 2 * IMAGE_BLOCK_SIZE);
+}
+#endif
+#endif
+
+#ifdef DELTA
+/* Base app of three blocks and the stable status that installed it */
+static const uint32_t DELTA_BASE_LENGTH = 3 * IMAGE_BLOCK_SIZE;
+
+TEST(BootLogicTest, DeltaAppIsInstalled)
+{
+    storeApp(0, DELTA_BASE_LENGTH, 1);
+    ImageHeader header = storeDeltaApp(1, 0, 0x400);
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(1, outStatus.liveAppSelect);
+    CHECK_TRUE(isInstalled(1, header.length));
+    CHECK_EQUAL(header.crc, sys.crcFlash(BOOT_ADDRESS, header.length));
+
+    /* The patch of a word changed every KB is a fraction of the binary */
+    CHECK_TRUE(blockOffset(1, 3) < header.length / 4);
+}
+
+TEST(BootLogicTest, UnrelatedDeltaAppIsInstalledFromRawBlocks)
+{
+    storeApp(0, DELTA_BASE_LENGTH, 1);
+    ImageHeader header = storeDeltaApp(1, 0, 0x400, 2, true);
+    CHECK_TRUE(slotWords(1)[blockOffset(1, 1) / 4] & IMAGE_BLOCK_RAW);
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+
+    boot();
+
+    CHECK_TRUE(isInstalled(1, header.length));
+}
+
+TEST(BootLogicTest, DeltaAppWithoutItsBaseIsRejected)
+{
+    storeApp(0, DELTA_BASE_LENGTH, 1);
+    storeDeltaApp(1, 0, 0x400);
+    storeApp(0, DELTA_BASE_LENGTH, 5);
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+}
+
+TEST(BootLogicTest, DeltaCopyOutsideTheBaseIsRejected)
+{
+    storeApp(0, DELTA_BASE_LENGTH, 1);
+    storeDeltaApp(1, 0, 0x400);
+    uint32_t* ops = &slotWords(1)[blockOffset(1, 0) / 4 + 1];
+    CHECK_TRUE(ops[0] & DELTA_OP_COPY);
+    ops[1] = DELTA_BASE_LENGTH - 4;
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+}
+
+TEST(BootLogicTest, InterruptedDeltaInstallResumesAtBlock)
+{
+    storeApp(0, DELTA_BASE_LENGTH, 1);
+    ImageHeader header = storeDeltaApp(1, 0, 0x400);
+    BootloaderStatus status = statusFor(BootloaderState::attemptNewApp, 1);
+    status.installedLength = header.length;
+    status.installedCrc = header.crc;
+    status.installProgress = 2;
+    writeStatus(status);
+    memset(flashSimulator.memory(BOOT_ADDRESS, 2 * IMAGE_BLOCK_SIZE), 0, 2 * IMAGE_BLOCK_SIZE);
+
+    boot();
+
+    /* Only the last block is built, from the base and the patch */
+    const uint8_t* bootFlash = flashSimulator.memory(BOOT_ADDRESS, header.length);
+    CHECK_EQUAL(0, bootFlash[2 * IMAGE_BLOCK_SIZE - 1]);
+    CHECK_EQUAL(0, memcmp(bootFlash + 2 * IMAGE_BLOCK_SIZE, slotBinary(1) + 2 * IMAGE_BLOCK_SIZE, IMAGE_BLOCK_SIZE));
+    CHECK_EQUAL(3, outStatus.installProgress);
+}
+
+TEST(BootLogicTest, RollbackFromDeltaAppKeepsItsBase)
+{
+    storeApp(0, DELTA_BASE_LENGTH, 1);
+    ImageHeader header = storeDeltaApp(1, 0, 0x400);
+    BootloaderStatus status = statusFor(BootloaderState::attemptNewApp, 1);
+    status.retryCount = BOOTLOADER_MAX_RETRIES - 1;
+    installApp(status, 1);
+    writeStatus(status);
+    CHECK_EQUAL(header.crc, status.installedCrc);
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+    CHECK_TRUE(isInstalled(0, DELTA_BASE_LENGTH));
+}
+#endif
+
+#ifdef RELOCATION
+static const uint32_t RELOCATABLE_LENGTH = 0x1000;
+
+/* Flash writes to the second slot and reads of its relocation table */
+static uint32_t slotWrites;
+static bool relocationTableRead;
+
+static void recordSlotAccess(SimulatorOperation operation, uint32_t address, uint32_t)
+{
+    uint32_t slot = BOOTLOADER_APP_ADDRESS[1];
+    if (address < slot || address >= slot + APP_SIZE) {
+        return;
+    }
+    if (operation == SimulatorOperation::flashRead && address >= slot + RELOCATABLE_LENGTH) {
+        relocationTableRead = true;
+    } else if (operation != SimulatorOperation::flashRead) {
+        slotWrites++;
+    }
+}
+
+TEST(BootLogicTest, NewRelocatableAppIsRelocatedForItsSlot)
+{
+    ImageHeader header = storeRelocatableApp(1, RELOCATABLE_LENGTH, 5, 2);
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(1, outStatus.liveAppSelect);
+    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[1], flashSimulator.bootAddress);
+    CHECK_TRUE(isRelocated(1));
+    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[1] + 0x101, slotWords(1)[1]);
+    CHECK_EQUAL(header.crc, crc32((const uint32_t*)slotBinary(1), RELOCATABLE_LENGTH / sizeof(uint32_t)));
+
+    /* The erased words are programmed in place */
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+}
+
+TEST(BootLogicTest, RelocatableAppRunsFromEitherSlot)
+{
+    storeRelocatableApp(0, RELOCATABLE_LENGTH, 5);
+    storeRelocatableApp(1, RELOCATABLE_LENGTH, 5);
+    CHECK_EQUAL(0, memcmp(slotHeader(0), slotHeader(1), sizeof(ImageHeader)));
+    writeStatus(statusFor(BootloaderState::newApp, 0));
+    boot();
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    boot();
+
+    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[1], flashSimulator.bootAddress);
+    CHECK_TRUE(isRelocated(0));
+    CHECK_TRUE(isRelocated(1));
+    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[1] - BOOTLOADER_APP_ADDRESS[0], slotWords(1)[37] - slotWords(0)[37]);
+}
+
+TEST(BootLogicTest, StableBootLeavesTheRelocationTableAlone)
+{
+    storeRelocatableApp(1, RELOCATABLE_LENGTH, 5);
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 1);
+    installApp(status, 1);
+    writeStatus(status);
+
+    slotWrites = 0;
+    relocationTableRead = false;
+    flashSimulator.observer = recordSlotAccess;
+    boot();
+    flashSimulator.observer = nullptr;
+
+    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[1], flashSimulator.bootAddress);
+    CHECK_EQUAL(0, slotWrites);
+    CHECK_FALSE(relocationTableRead);
+}
+
+TEST(BootLogicTest, RetryDoesNotRelocateAgain)
+{
+    storeRelocatableApp(1, RELOCATABLE_LENGTH, 5);
+    BootloaderStatus status = statusFor(BootloaderState::attemptNewApp, 1);
+    installApp(status, 1);
+    writeStatus(status);
+
+    slotWrites = 0;
+    flashSimulator.observer = recordSlotAccess;
+    boot();
+    flashSimulator.observer = nullptr;
+
+    CHECK_EQUAL(1, outStatus.retryCount);
+    CHECK_EQUAL(0, slotWrites);
+    CHECK_TRUE(isRelocated(1));
+}
+
+TEST(BootLogicTest, InterruptedRelocationIsCompleted)
+{
+    ImageHeader header = storeRelocatableApp(1, RELOCATABLE_LENGTH, 5);
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 1);
+    installApp(status, 1);
+    writeStatus(status);
+
+    /* A reset left one word erased and the low byte of another one programmed */
+    uint32_t* slot = slotWords(1);
+    uint32_t relocated = slot[74];
+    slot[37] |= 0xFF00;
+    slot[74] = 0xFFFFFFFF;
+    CHECK_TRUE(slot[37] != 0xFFFFFFFF);
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(1, outStatus.liveAppSelect);
+    CHECK_TRUE(isRelocated(1));
+    CHECK_EQUAL(relocated, slot[74]);
+    CHECK_EQUAL(header.crc, crc32((const uint32_t*)slotBinary(1), RELOCATABLE_LENGTH / sizeof(uint32_t)));
+
+    /* The half programmed word takes a rewrite of its page */
+    CHECK_EQUAL(1, flashSimulator.pagesErased);
+}
+
+TEST(BootLogicTest, LongGapsBetweenRelocatedWordsAreSkipped)
+{
+    const uint32_t length = 0x18000;
+    storeRelocatableApp(1, length, 5, 2, 20000);
+    const uint32_t* table = slotWords(1) + length / sizeof(uint32_t);
+    CHECK_EQUAL(3, table[0]);
+    CHECK_EQUAL(RELOCATION_SKIP, table[2] & RELOCATION_SKIP);
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_TRUE(isRelocated(1));
+    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[1] + (5 * 0x9E3779B1 + 20000) % length, slotWords(1)[20000]);
+}
+
+TEST(BootLogicTest, RelocationTableOutsideTheSlotIsRejected)
+{
+    storeRelocatableApp(1, RELOCATABLE_LENGTH, 5, 2);
+    slotWords(1)[RELOCATABLE_LENGTH / sizeof(uint32_t)] = APP_SIZE / sizeof(uint32_t);
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+
+    slotWrites = 0;
+    flashSimulator.observer = recordSlotAccess;
+    boot();
+    flashSimulator.observer = nullptr;
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+    CHECK_EQUAL(0, slotWrites);
+}
+
+TEST(BootLogicTest, RelocationOutsideTheBinaryIsRejected)
+{
+    storeRelocatableApp(1, RELOCATABLE_LENGTH, 5, 2);
+    uint32_t* entry = &slotWords(1)[RELOCATABLE_LENGTH / sizeof(uint32_t) + 2];
+    *entry = (*entry & ~RELOCATION_SKIP) | (RELOCATABLE_LENGTH + 4);
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+    CHECK_EQUAL(0xFFFFFFFF, slotWords(1)[1]);
+}
+
+#ifdef VERIFYHASH
+TEST(BootLogicTest, TamperedRelocatableAppWithMatchingCrcIsRejected)
+{
+    storeRelocatableApp(1, RELOCATABLE_LENGTH, 5, 2);
+    slotWords(1)[2] ^= 1;
+    slotHeader(1)->crc = crc32(slotWords(1), RELOCATABLE_LENGTH / sizeof(uint32_t));
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+}
+#endif
+
+#ifdef SIGNATURE
+TEST(BootLogicTest, RetryOfVerifiedRelocatableAppSkipsHashAndSignature)
+{
+    storeRelocatableApp(1, RELOCATABLE_LENGTH, 5, 2);
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+    boot();
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+    CHECK_EQUAL(1, outStatus.liveAppSelect);
+    CHECK_EQUAL(0, flashSimulator.bytesHashed);
+    CHECK_EQUAL(0, flashSimulator.signatureChecks);
+}
+#endif
+
+#ifdef VERIFYCRC
+TEST(BootLogicTest, CorruptRelocatableAppIsRejected)
+{
+    storeRelocatableApp(1, RELOCATABLE_LENGTH, 5, 2);
+    slotWords(1)[2] ^= 1;
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+}
+
+TEST(BootLogicTest, WordRelocatedForAnotherSlotIsRejected)
+{
+    storeRelocatableApp(1, RELOCATABLE_LENGTH, 5, 2);
+    slotWords(1)[37] = 0;
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+}
+#endif
+
+#ifdef MAILBOX
+TEST(BootLogicTest, MailboxTrialRelocatesTheApp)
+{
+    storeRelocatableApp(1, RELOCATABLE_LENGTH, 5, 2);
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    writeStatus(status);
+    requestMailbox(MailboxRequest::trialBoot, 1);
+
+    boot();
+
+    CHECK_EQUAL(1, flashSimulator.mailbox.trialApp);
+    CHECK_EQUAL(BOOTLOADER_APP_ADDRESS[1], flashSimulator.bootAddress);
+    CHECK_TRUE(isRelocated(1));
+}
+#endif
+#endif
+
+#ifdef MAILBOX
+/* Address the app on trial or the stable app is started from */
+static uint32_t startAddress(uint32_t app)
+{
+    #ifdef COPYBINARY
+    (void)app;
+    return BOOT_ADDRESS;
+    #else
+    return BOOTLOADER_APP_ADDRESS[app];
+    #endif
+}
+
+TEST(BootLogicTest, MailboxTrialDoesNotWriteStatus)
+{
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    installApp(status, 0);
+    writeStatus(status);
+    requestMailbox(MailboxRequest::trialBoot, 1);
+
+    boot();
+
+    /* The status still holds the stable app, only the boot is counted */
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+    CHECK_EQUAL(startAddress(1), flashSimulator.bootAddress);
+    #ifdef COPYBINARY
+    CHECK_TRUE(isInstalled(1, 0x1000));
+    #else
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+    CHECK_EQUAL(1, flashSimulator.halfWordsProgrammed);
+    #endif
+
+    const Mailbox& mailbox = flashSimulator.mailbox;
+    CHECK_EQUAL(mailboxCrc(mailbox), mailbox.crc);
+    CHECK_EQUAL(MailboxRequest::noRequest, mailbox.request);
+    CHECK_EQUAL(MailboxResponse::trialStarted, mailbox.response);
+    CHECK_EQUAL(1, mailbox.trialApp);
+    CHECK_EQUAL(1, mailbox.bootedApp);
+    CHECK_EQUAL(BootloaderState::attemptNewApp, mailbox.bootState);
+    CHECK_EQUAL(0, mailbox.retryCount);
+}
+
+TEST(BootLogicTest, MailboxStopsTheCycleCounterWithoutTrace)
+{
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    installApp(status, 0);
+    writeStatus(status);
+
+    boot();
+
+    #ifdef TRACEBOOT
+    CHECK_TRUE(flashSimulator.cycleCounterRunning);
+    #else
+    CHECK_FALSE(flashSimulator.cycleCounterRunning);
+    #endif
+}
+
+TEST(BootLogicTest, MailboxConfirmationIsWritten)
+{
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    installApp(status, 0);
+    writeStatus(status);
+    requestMailbox(MailboxRequest::trialBoot, 1);
+    boot();
+    requestMailbox(MailboxRequest::confirmStable, 0);
+
+    boot();
+
+    CHECK_EQUAL(BootloaderState::stableApp, outStatus.status);
+    CHECK_EQUAL(1, outStatus.liveAppSelect);
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+    CHECK_EQUAL(startAddress(1), flashSimulator.bootAddress);
+    CHECK_EQUAL(MailboxResponse::stableConfirmed, flashSimulator.mailbox.response);
+    CHECK_EQUAL(MAILBOX_NO_TRIAL, flashSimulator.mailbox.trialApp);
+    CHECK_EQUAL(BootloaderState::stableApp, flashSimulator.mailbox.bootState);
+}
+
+TEST(BootLogicTest, UnconfirmedMailboxTrialIsRolledBack)
+{
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    installApp(status, 0);
+    writeStatus(status);
+    requestMailbox(MailboxRequest::trialBoot, 1);
+
+    for (uint32_t i = 0; i < BOOTLOADER_MAX_RETRIES; i++) {
+        boot();
+        CHECK_EQUAL(startAddress(1), flashSimulator.bootAddress);
+        CHECK_EQUAL(i, flashSimulator.mailbox.retryCount);
+    }
+    boot();
+
+    CHECK_EQUAL(MailboxResponse::trialFailed, flashSimulator.mailbox.response);
+    CHECK_EQUAL(0, flashSimulator.mailbox.bootedApp);
+    CHECK_EQUAL(startAddress(0), flashSimulator.bootAddress);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+    CHECK_EQUAL(1, outStatus.statistics.rollbacks[1]);
+    #ifdef COPYBINARY
+    CHECK_TRUE(isInstalled(0, 0x1000));
+    #endif
+}
+
+TEST(BootLogicTest, PowerLossEndsMailboxTrial)
+{
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    installApp(status, 0);
+    writeStatus(status);
+    requestMailbox(MailboxRequest::trialBoot, 1);
+    boot();
+
+    flashSimulator.powerCycle();
+    boot();
+
+    CHECK_EQUAL(startAddress(0), flashSimulator.bootAddress);
+    CHECK_EQUAL(MAILBOX_NO_TRIAL, flashSimulator.mailbox.trialApp);
+    CHECK_EQUAL(0, flashSimulator.mailbox.bootedApp);
+    #ifdef COPYBINARY
+    CHECK_TRUE(isInstalled(0, 0x1000));
+    #endif
+}
+
+TEST(BootLogicTest, InvalidMailboxTrialIsRejected)
+{
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    installApp(status, 0);
+    writeStatus(status);
+    slotHeader(1)->magic = 0;
+    requestMailbox(MailboxRequest::trialBoot, 1);
+
+    boot();
+
+    CHECK_EQUAL(MailboxResponse::trialRejected, flashSimulator.mailbox.response);
+    CHECK_EQUAL(startAddress(0), flashSimulator.bootAddress);
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+    CHECK_EQUAL(1, flashSimulator.halfWordsProgrammed);
+}
+
+TEST(BootLogicTest, ConfirmationOfInvalidTrialAppIsRejected)
+{
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    installApp(status, 0);
+    writeStatus(status);
+    requestMailbox(MailboxRequest::trialBoot, 1);
+    boot();
+    slotHeader(1)->magic = 0;
+    requestMailbox(MailboxRequest::confirmStable, 0);
+
+    boot();
+
+    CHECK_EQUAL(MailboxResponse::trialFailed, flashSimulator.mailbox.response);
+    CHECK_EQUAL(0, outStatus.liveAppSelect);
+    CHECK_EQUAL(startAddress(0), flashSimulator.bootAddress);
+}
+
+TEST(BootLogicTest, MailboxRequestsNeedStableApp)
+{
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 1);
+    installApp(status, 0);
+    writeStatus(status);
+    requestMailbox(MailboxRequest::trialBoot, 0);
+
+    boot();
+
+    CHECK_EQUAL(MailboxResponse::requestIgnored, flashSimulator.mailbox.response);
+    CHECK_EQUAL(MailboxRequest::noRequest, flashSimulator.mailbox.request);
+    CHECK_EQUAL(1, flashSimulator.mailbox.bootedApp);
+    CHECK_EQUAL(BootloaderState::attemptNewApp, outStatus.status);
+}
+#endif
+
+#ifdef TRACEBOOT
+static uint32_t sinkPhases;
+
+static void countPhase(BootPhase, uint32_t, uint32_t)
+{
+    sinkPhases++;
+}
+
+TEST(BootLogicTest, TraceRecordsBootPhases)
+{
+    writeStatus(statusFor(BootloaderState::newApp, 1));
+
+    boot();
+
+    const BootTrace& trace = flashSimulator.bootTrace;
+    CHECK_EQUAL(BOOT_TRACE_MAGIC, trace.magic);
+    CHECK_TRUE(trace.count >= 5 && trace.count <= BOOT_TRACE_ENTRIES);
+    CHECK_EQUAL(BootPhase::bootEntered, trace.entries[0].phase);
+    CHECK_EQUAL(0, trace.entries[0].timestamp);
+    CHECK_EQUAL(BootPhase::statusRead, trace.entries[1].phase);
+    CHECK_EQUAL(BootloaderState::newApp, trace.entries[1].argument);
+    CHECK_EQUAL(BootPhase::appStarted, trace.entries[trace.count - 1].phase);
+
+    bool verified = false;
+    for (uint32_t i = 1; i < trace.count; i++) {
+        CHECK_TRUE(trace.entries[i].timestamp >= trace.entries[i - 1].timestamp);
+        if (trace.entries[i].phase == BootPhase::verifyStarted) {
+            CHECK_EQUAL(1, trace.entries[i].argument);
+            CHECK_EQUAL(BootPhase::verifyFinished, trace.entries[i + 1].phase);
+            CHECK_EQUAL(1, trace.entries[i + 1].argument);
+            verified = true;
+        }
+    }
+    CHECK_TRUE(verified);
+}
+
+TEST(BootLogicTest, TraceIsRestartedOnEachBoot)
+{
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    installApp(status, 0);
+    writeStatus(status);
+    sinkPhases = 0;
+    flashSimulator.traceSink = countPhase;
+
+    boot();
+    boot();
+
+    CHECK_EQUAL(BOOT_TRACE_MAGIC, flashSimulator.bootTrace.magic);
+    CHECK_EQUAL(2 * flashSimulator.bootTrace.count, sinkPhases);
 }
+#endif
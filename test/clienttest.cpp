@@ -0,0 +1,172 @@
+#include "CppUTest/TestHarness.h"
+
+#include "Bootloader.h"
+#include "BootloaderClient.h"
+#include "FlashSimulator.h"
+#include "SimulatedDevice.h"
+#include "System.h"
+
+TEST_GROUP(BootloaderClientTest){
+    System sys;
+    Bootloader bl;
+    BootloaderClient<System> client{ sys };
+    BootloaderStatus status;
+
+    virtual void setup()
+    {
+        flashSimulator.reset();
+        #ifdef TRACEBOOT
+        flashSimulator.traceSink = nullptr;
+        #endif
+        for (uint32_t app = 0; app < BOOTLOADER_MAX_APPS; app++) {
+            storeApp(app, 0x1000, app + 1);
+        }
+    }
+
+    virtual void teardown()
+    {
+        CHECK_EQUAL(0, flashSimulator.errors);
+        CHECK_TRUE(flashSimulator.locked);
+    }
+
+    /* Reset the device, the bootloader starts an app */
+    void reset()
+    {
+        flashSimulator.restart();
+        bl.boot(sys, false);
+        CHECK_EQUAL(1, flashSimulator.boots);
+        flashSimulator.clearCounters();
+    }
+};
+
+TEST(BootloaderClientTest, NoStatusBeforeFirstBoot)
+{
+    CHECK_FALSE(client.queryStatus(status));
+    CHECK_FALSE(client.confirmBoot());
+    CHECK_FALSE(client.stageUpdate(1));
+    CHECK_EQUAL(0, flashSimulator.halfWordsProgrammed);
+}
+
+TEST(BootloaderClientTest, ConfirmBootClearsAMark)
+{
+    reset();
+    CHECK_TRUE(client.queryStatus(status));
+    CHECK_EQUAL(BootloaderState::attemptNewApp, status.status);
+
+    CHECK_TRUE(client.confirmBoot());
+
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+    CHECK_EQUAL(1, flashSimulator.halfWordsProgrammed);
+    CHECK_TRUE(client.queryStatus(status));
+    CHECK_EQUAL(BootloaderState::stableApp, status.status);
+
+    /* The bootloader keeps the confirmed app */
+    for (uint32_t i = 0; i < BOOTLOADER_MAX_RETRIES; i++) {
+        reset();
+    }
+    CHECK_TRUE(client.queryStatus(status));
+    CHECK_EQUAL(BootloaderState::stableApp, status.status);
+    CHECK_EQUAL(0, status.liveAppSelect);
+    CHECK_EQUAL(0, status.statistics.rollbacks[0]);
+}
+
+TEST(BootloaderClientTest, ConfirmingStableAppWritesNothing)
+{
+    reset();
+    client.confirmBoot();
+    reset();
+
+    CHECK_TRUE(client.confirmBoot());
+    CHECK_TRUE(client.confirmBoot());
+
+    CHECK_EQUAL(0, flashSimulator.halfWordsProgrammed);
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+}
+
+TEST(BootloaderClientTest, StagedUpdateIsAttempted)
+{
+    reset();
+    client.confirmBoot();
+
+    CHECK_TRUE(client.stageUpdate(1));
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+    reset();
+
+    CHECK_TRUE(client.queryStatus(status));
+    CHECK_EQUAL(BootloaderState::attemptNewApp, status.status);
+    CHECK_EQUAL(1, status.liveAppSelect);
+    CHECK_TRUE(client.confirmBoot());
+    reset();
+    CHECK_TRUE(client.queryStatus(status));
+    CHECK_EQUAL(BootloaderState::stableApp, status.status);
+    CHECK_EQUAL(1, status.liveAppSelect);
+}
+
+TEST(BootloaderClientTest, StagingTwiceWritesOnce)
+{
+    reset();
+    client.confirmBoot();
+
+    CHECK_TRUE(client.stageUpdate(1));
+    flashSimulator.clearCounters();
+    CHECK_TRUE(client.stageUpdate(1));
+
+    CHECK_EQUAL(0, flashSimulator.halfWordsProgrammed);
+}
+
+TEST(BootloaderClientTest, EmptySlotIsNotStaged)
+{
+    reset();
+    client.confirmBoot();
+    slotHeader(1)->magic = 0xFFFFFFFF;
+
+    CHECK_FALSE(client.stageUpdate(1));
+    CHECK_FALSE(client.stageUpdate(BOOTLOADER_MAX_APPS));
+
+    CHECK_EQUAL(1, flashSimulator.halfWordsProgrammed);
+    CHECK_TRUE(client.queryStatus(status));
+    CHECK_EQUAL(BootloaderState::stableApp, status.status);
+}
+
+#ifdef RELOCATION
+TEST(BootloaderClientTest, RelocatableUpdateIsStaged)
+{
+    reset();
+    client.confirmBoot();
+    storeRelocatableApp(1, 0x1000, 5, 2);
+
+    CHECK_TRUE(client.stageUpdate(1));
+    reset();
+
+    CHECK_TRUE(client.queryStatus(status));
+    CHECK_EQUAL(BootloaderState::attemptNewApp, status.status);
+    CHECK_EQUAL(1, status.liveAppSelect);
+    CHECK_TRUE(isRelocated(1));
+}
+#endif
+
+#ifdef MAILBOX
+TEST(BootloaderClientTest, TrialThroughMailbox)
+{
+    reset();
+    client.confirmBoot();
+    reset();
+
+    CHECK_TRUE(client.requestTrial(1));
+    reset();
+    Mailbox mailbox;
+    CHECK_TRUE(client.readMailbox(mailbox));
+    CHECK_EQUAL(MailboxResponse::trialStarted, mailbox.response);
+    CHECK_EQUAL(1, mailbox.bootedApp);
+
+    /* The confirmation is written by the bootloader at the next reset */
+    CHECK_TRUE(client.confirmBoot());
+    CHECK_EQUAL(0, flashSimulator.halfWordsProgrammed);
+    reset();
+    CHECK_TRUE(client.readMailbox(mailbox));
+    CHECK_EQUAL(MailboxResponse::stableConfirmed, mailbox.response);
+    CHECK_TRUE(client.queryStatus(status));
+    CHECK_EQUAL(BootloaderState::stableApp, status.status);
+    CHECK_EQUAL(1, status.liveAppSelect);
+}
+#endif
@@ -0,0 +1,42 @@
+#include "CppUTest/TestHarness.h"
+
+#include "Crc32.h"
+
+TEST_GROUP(Crc32Test){};
+
+TEST(Crc32Test, EmptyBlock)
+{
+    UNSIGNED_LONGS_EQUAL(CRC32_INITIAL, crc32(nullptr, 0));
+}
+
+TEST(Crc32Test, SingleWord)
+{
+    /* Reference value of the STM32F1 CRC unit */
+    const uint32_t data[] = { 0x12345678 };
+    UNSIGNED_LONGS_EQUAL(0xDF8A8A2B, crc32(data, 1));
+}
+
+TEST(Crc32Test, MultipleWords)
+{
+    const uint32_t data[] = { 0x31323334, 0x35363738 };
+    UNSIGNED_LONGS_EQUAL(0x49E3C2FB, crc32(data, 2));
+}
+
+TEST(Crc32Test, ErasedFlash)
+{
+    const uint32_t data[] = { 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF };
+    UNSIGNED_LONGS_EQUAL(0xA79C3203, crc32(data, 4));
+}
+
+TEST(Crc32Test, ContinueOverBlocks)
+{
+    const uint32_t data[] = { 0x31323334, 0x35363738 };
+    UNSIGNED_LONGS_EQUAL(crc32(data, 2), crc32(&data[1], 1, crc32(data, 1)));
+}
+
+TEST(Crc32Test, AppendedCrcGivesZero)
+{
+    uint32_t data[] = { 0x31323334, 0x35363738, 0 };
+    data[2] = crc32(data, 2);
+    UNSIGNED_LONGS_EQUAL(0, crc32(data, 3));
+}
@@ -0,0 +1,222 @@
+#include "CppUTest/TestHarness.h"
+
+#include "FlashSimulator.h"
+#include "StatusJournal.h"
+#include "System.h"
+
+#include <string.h>
+
+TEST_GROUP(StatusJournalTest){
+    System sys;
+    StatusJournal journal{ sys };
+    BootloaderStatus status;
+    BootloaderStatus readStatus;
+
+    virtual void setup()
+    {
+        flashSimulator.reset();
+        memset(&status, 0, sizeof(status));
+    }
+
+    virtual void teardown()
+    {
+        CHECK_EQUAL(0, flashSimulator.errors);
+        CHECK_TRUE(flashSimulator.locked);
+    }
+
+    StatusRecord* record(uint32_t index, uint32_t page = 0)
+    {
+        return (StatusRecord*)flashSimulator.memory(
+            BOOTLOADER_STATUS_STRUCT_ADDR + page * FLASH_PAGE_SIZE + index * sizeof(StatusRecord));
+    }
+};
+
+TEST(StatusJournalTest, EmptyJournalReadsZeroes)
+{
+    memset(&readStatus, 0xAA, sizeof(readStatus));
+
+    CHECK_FALSE(journal.read(readStatus));
+    CHECK_EQUAL(0, readStatus.status);
+    CHECK_EQUAL(0, readStatus.liveAppSelect);
+}
+
+TEST(StatusJournalTest, WritesAreAppended)
+{
+    for (uint32_t i = 0; i < 3; i++) {
+        status.retryCount = i;
+        journal.write(status);
+    }
+
+    CHECK_TRUE(journal.read(readStatus));
+    CHECK_EQUAL(2, readStatus.retryCount);
+    CHECK_EQUAL(2, record(2)->sequence);
+    CHECK_TRUE(sys.isBlank((uint32_t)BOOTLOADER_STATUS_STRUCT_ADDR + 3 * sizeof(StatusRecord), sizeof(StatusRecord)));
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+}
+
+TEST(StatusJournalTest, UnchangedStatusIsNotWritten)
+{
+    journal.write(status);
+    flashSimulator.clearCounters();
+
+    journal.write(status);
+
+    CHECK_EQUAL(0, flashSimulator.halfWordsProgrammed);
+}
+
+TEST(StatusJournalTest, FullPageMovesOnToTheNextPage)
+{
+    for (uint32_t i = 0; i <= STATUS_RECORDS_PER_PAGE; i++) {
+        status.retryCount = i;
+        journal.write(status);
+    }
+
+    /* The full page keeps the previous record until the next page fills up */
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+    CHECK_EQUAL(STATUS_RECORDS_PER_PAGE - 1, record(STATUS_RECORDS_PER_PAGE - 1)->status.retryCount);
+    CHECK_EQUAL(STATUS_RECORDS_PER_PAGE, record(0, 1)->status.retryCount);
+    CHECK_TRUE(journal.read(readStatus));
+    CHECK_EQUAL(STATUS_RECORDS_PER_PAGE, readStatus.retryCount);
+}
+
+TEST(StatusJournalTest, FullPageIsErasedOnce)
+{
+    for (uint32_t i = 0; i <= STATUS_RECORDS_PER_PAGE * BOOTLOADER_STATUS_PAGES; i++) {
+        status.retryCount = i;
+        journal.write(status);
+    }
+
+    CHECK_EQUAL(1, flashSimulator.pagesErased);
+    CHECK_TRUE(journal.read(readStatus));
+    CHECK_EQUAL(STATUS_RECORDS_PER_PAGE * BOOTLOADER_STATUS_PAGES, readStatus.retryCount);
+}
+
+TEST(StatusJournalTest, TornRecordIsSkipped)
+{
+    status.retryCount = 1;
+    journal.write(status);
+
+    /* A reset hit while the next record was programmed */
+    const uint16_t torn[] = { 0x0001, 0x0000, 0x1234 };
+    sys.unlockFlash();
+    sys.programHalfWords(BOOTLOADER_STATUS_STRUCT_ADDR + sizeof(StatusRecord), torn, sizeof(torn));
+    sys.lockFlash();
+
+    CHECK_TRUE(journal.read(readStatus));
+    CHECK_EQUAL(1, readStatus.retryCount);
+
+    /* The next record goes behind the torn one */
+    status.retryCount = 2;
+    journal.write(status);
+    CHECK_TRUE(journal.read(readStatus));
+    CHECK_EQUAL(2, readStatus.retryCount);
+    CHECK_EQUAL(2, record(2)->status.retryCount);
+}
+
+TEST(StatusJournalTest, ProgressMarksAreClearedInPlace)
+{
+    journal.write(status);
+    flashSimulator.clearCounters();
+
+    journal.addProgress();
+    journal.addProgress();
+
+    CHECK_EQUAL(2, flashSimulator.halfWordsProgrammed);
+    CHECK_TRUE(journal.read(readStatus));
+    CHECK_EQUAL(2, readStatus.installProgress);
+}
+
+TEST(StatusJournalTest, ProgressIsFoldedIntoNextRecord)
+{
+    journal.write(status);
+    for (uint32_t i = 0; i < STATUS_PROGRESS_MARKS + 1; i++) {
+        journal.addProgress();
+    }
+
+    /* All marks of the first record were used, the last step appended a record */
+    CHECK_TRUE(journal.read(readStatus));
+    CHECK_EQUAL(STATUS_PROGRESS_MARKS + 1, readStatus.installProgress);
+    CHECK_EQUAL(STATUS_PROGRESS_MARKS + 1, record(1)->status.installProgress);
+
+    /* Writing the folded status again does not append a record */
+    flashSimulator.clearCounters();
+    journal.write(readStatus);
+    CHECK_EQUAL(0, flashSimulator.halfWordsProgrammed);
+}
+
+TEST(StatusJournalTest, ProgressNeedsARecord)
+{
+    journal.addProgress();
+
+    CHECK_FALSE(journal.read(readStatus));
+    CHECK_EQUAL(0, flashSimulator.halfWordsProgrammed);
+}
+
+TEST(StatusJournalTest, BootsAreCountedInMarks)
+{
+    journal.write(status);
+    flashSimulator.clearCounters();
+
+    for (uint32_t i = 0; i < STATUS_BOOT_MARKS + 1; i++) {
+        journal.addBoot();
+    }
+
+    /* One half-word per boot, then a record with all boots folded in */
+    CHECK_TRUE(flashSimulator.halfWordsProgrammed <= STATUS_BOOT_MARKS + sizeof(StatusRecord) / sizeof(uint16_t));
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+    CHECK_TRUE(journal.read(readStatus));
+    CHECK_EQUAL(STATUS_BOOT_MARKS + 1, readStatus.statistics.boots);
+    CHECK_EQUAL(STATUS_BOOT_MARKS + 1, record(1)->status.statistics.boots);
+    CHECK_EQUAL(0, readStatus.installProgress);
+}
+
+TEST(StatusJournalTest, StatusErasesAreCountedByTheJournal)
+{
+    for (uint32_t i = 0; i < STATUS_RECORDS_PER_PAGE * BOOTLOADER_STATUS_PAGES + 1; i++) {
+        status.retryCount = i;
+        journal.write(status);
+    }
+
+    CHECK_TRUE(journal.read(readStatus));
+    CHECK_EQUAL(1, readStatus.statistics.statusErases);
+
+    /* An outdated count of the caller is not written back */
+    status.retryCount = 0;
+    journal.write(status);
+    CHECK_TRUE(journal.read(readStatus));
+    CHECK_EQUAL(1, readStatus.statistics.statusErases);
+}
+
+TEST(StatusJournalTest, ConfirmMarkMakesNewAppStable)
+{
+    status.status = BootloaderState::attemptNewApp;
+    status.retryCount = 1;
+    journal.write(status);
+    flashSimulator.clearCounters();
+
+    CHECK_TRUE(journal.confirm());
+    CHECK_TRUE(journal.confirm());
+
+    CHECK_EQUAL(1, flashSimulator.halfWordsProgrammed);
+    CHECK_TRUE(journal.read(readStatus));
+    CHECK_EQUAL(BootloaderState::stableApp, readStatus.status);
+    CHECK_EQUAL(0, readStatus.retryCount);
+
+    /* The confirmation is folded into the next record */
+    readStatus.statistics.boots++;
+    journal.write(readStatus);
+    CHECK_EQUAL(BootloaderState::stableApp, record(1)->status.status);
+    CHECK_EQUAL(STATUS_ERASED_MARK, record(1)->confirmMark);
+}
+
+TEST(StatusJournalTest, OnlyNewAppsAreConfirmed)
+{
+    CHECK_FALSE(journal.confirm());
+
+    status.status = BootloaderState::newApp;
+    journal.write(status);
+    flashSimulator.clearCounters();
+
+    CHECK_FALSE(journal.confirm());
+    CHECK_EQUAL(0, flashSimulator.halfWordsProgrammed);
+}
@@ -0,0 +1,116 @@
+#include "CppUTest/TestHarness.h"
+
+#include "Lz4.h"
+#include "Lz4Compressor.h"
+
+#include <string.h>
+
+static const uint32_t BLOCK_SIZE = 8192;
+
+TEST_GROUP(Lz4Test){
+    uint8_t data[BLOCK_SIZE];
+    uint8_t compressed[BLOCK_SIZE + BLOCK_SIZE / 255 + 16];
+    uint8_t output[BLOCK_SIZE];
+
+    void roundTrip(uint32_t size)
+    {
+        uint32_t compressedSize = lz4Compress(data, size, compressed, sizeof(compressed));
+        CHECK_TRUE(size == 0 || compressedSize != 0);
+        LONGS_EQUAL(size, lz4Decompress(compressed, compressedSize, output, sizeof(output)));
+        MEMCMP_EQUAL(data, output, size);
+    }
+};
+
+TEST(Lz4Test, ReferenceBlock)
+{
+    /* Block written by the lz4 command line tool, lz4 -9 */
+    const uint8_t block[] = { 0x56, 0x4F, 0x6B, 0x72, 0x61, 0x20, 0x05, 0x00, 0xAF, 0x62, 0x6F, 0x6F, 0x74, 0x6C,
+        0x6F, 0x61, 0x64, 0x65, 0x72, 0x0B, 0x00, 0x04, 0xA3, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38,
+        0x39, 0x0B, 0x00, 0x50, 0x36, 0x37, 0x38, 0x39, 0x21 };
+    const char* text = "Okra Okra Okra bootloader bootloader bootloader 0123456789 0123456789!";
+
+    LONGS_EQUAL(strlen(text), lz4Decompress(block, sizeof(block), output, sizeof(output)));
+    MEMCMP_EQUAL(text, output, strlen(text));
+}
+
+TEST(Lz4Test, OverlappingMatchRepeats)
+{
+    /* "ab" and a match of 8 at offset 2 */
+    const uint8_t block[] = { 0x24, 'a', 'b', 0x02, 0x00, 0x00 };
+
+    LONGS_EQUAL(10, lz4Decompress(block, sizeof(block), output, sizeof(output)));
+    MEMCMP_EQUAL("ababababab", output, 10);
+}
+
+TEST(Lz4Test, LongLiteralsAndMatches)
+{
+    const uint8_t literals[300] = { 0 };
+    uint8_t* out = compressed;
+    CHECK_TRUE(lz4PutSequence(out, compressed + sizeof(compressed), literals, sizeof(literals), 1, 1000));
+    CHECK_TRUE(lz4PutSequence(out, compressed + sizeof(compressed), literals, 5, 0, 0));
+
+    LONGS_EQUAL(1305, lz4Decompress(compressed, out - compressed, output, sizeof(output)));
+    for (uint32_t i = 0; i < 1305; i++) {
+        LONGS_EQUAL(0, output[i]);
+    }
+}
+
+TEST(Lz4Test, RoundTripOfRepeatedWords)
+{
+    for (uint32_t i = 0; i < BLOCK_SIZE; i++) {
+        data[i] = i % 4 == 3 ? 0x20 : (i / 4) % 16;
+    }
+    roundTrip(BLOCK_SIZE);
+    CHECK_TRUE(lz4Compress(data, BLOCK_SIZE, compressed, sizeof(compressed)) < BLOCK_SIZE / 4);
+}
+
+TEST(Lz4Test, RoundTripOfRandomData)
+{
+    uint32_t state = 0x12345678;
+    for (uint32_t i = 0; i < BLOCK_SIZE; i++) {
+        state = state * 1103515245 + 12345;
+        data[i] = state >> 24;
+    }
+    roundTrip(BLOCK_SIZE);
+    roundTrip(13);
+    roundTrip(1);
+    roundTrip(0);
+}
+
+TEST(Lz4Test, CompressedBlockTooLargeIsNotWritten)
+{
+    memset(data, 0x5A, sizeof(data));
+    LONGS_EQUAL(0, lz4Compress(data, BLOCK_SIZE, compressed, 8));
+}
+
+TEST(Lz4Test, OffsetZeroIsRejected)
+{
+    const uint8_t block[] = { 0x10, 'a', 0x00, 0x00, 0x00 };
+    LONGS_EQUAL(-1, lz4Decompress(block, sizeof(block), output, sizeof(output)));
+}
+
+TEST(Lz4Test, OffsetBeforeTheOutputIsRejected)
+{
+    const uint8_t block[] = { 0x10, 'a', 0x02, 0x00, 0x00 };
+    LONGS_EQUAL(-1, lz4Decompress(block, sizeof(block), output, sizeof(output)));
+}
+
+TEST(Lz4Test, TruncatedBlockIsRejected)
+{
+    /* Literals cut short, a match without its offset and a length without its end */
+    const uint8_t literals[] = { 0x50, 'a', 'b' };
+    const uint8_t offset[] = { 0x10, 'a', 0x01 };
+    const uint8_t length[] = { 0xF0, 0xFF };
+    LONGS_EQUAL(-1, lz4Decompress(literals, sizeof(literals), output, sizeof(output)));
+    LONGS_EQUAL(-1, lz4Decompress(offset, sizeof(offset), output, sizeof(output)));
+    LONGS_EQUAL(-1, lz4Decompress(length, sizeof(length), output, sizeof(output)));
+}
+
+TEST(Lz4Test, OutputOverflowIsRejected)
+{
+    const uint8_t block[] = { 0x2F, 'a', 'b', 0x02, 0x00, 0xFF, 0x00 };
+    output[8] = 0xA5;
+
+    LONGS_EQUAL(-1, lz4Decompress(block, sizeof(block), output, 8));
+    LONGS_EQUAL(0xA5, output[8]);
+}
@@ -0,0 +1,127 @@
+#include "CppUTest/TestHarness.h"
+
+#include "P256.h"
+#include "P256Signer.h"
+#include "Sha256.h"
+#include "Config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+TEST_GROUP(P256Test){
+    uint8_t publicKey[P256_PUBLIC_KEY_SIZE];
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    uint8_t signature[P256_SIGNATURE_SIZE];
+
+    void parse(uint8_t* bytes, const char* hex)
+    {
+        for (uint32_t i = 0; i < strlen(hex) / 2; i++) {
+            unsigned int byte;
+            sscanf(hex + 2 * i, "%2x", &byte);
+            bytes[i] = byte;
+        }
+    }
+
+    void hashText(const char* text)
+    {
+        Sha256 context;
+        sha256Init(context);
+        sha256Update(context, (const uint8_t*)text, strlen(text));
+        sha256Final(context, hash);
+    }
+
+    void useTestKey()
+    {
+        parse(publicKey, "60FED4BA255A9D31C961EB74C6356D68C049B8923B61FA6CE669622E60F29FB6"
+                         "7903FE1008B8BC99A41AE9E95628BC64F2F1B20C2D7E9F5177A3C294D4462299");
+    }
+};
+
+TEST(P256Test, Rfc6979SignatureIsValid)
+{
+    /* RFC 6979 A.2.5, SHA-256 of "sample" */
+    useTestKey();
+    hashText("sample");
+    parse(signature, "EFD48B2AACB6A8FD1140DD9CD45E81D69D2C877B56AAF991C34D0EA84EAF3716"
+                     "F7CB1C942D657C41D436C7A1B6E29F65F3E900DBB9AFF4064DC4AB2F843ACDA8");
+    CHECK_TRUE(p256Verify(publicKey, hash, signature));
+}
+
+TEST(P256Test, OpensslSignatureIsValid)
+{
+    /* Key and signature from openssl ecparam -genkey and openssl dgst -sha256 -sign */
+    parse(publicKey, "FD331B1A784A41725BDBEFBE1A1676C2DEFAA6B1436E9181F6A5DF4A4D8C7B1D"
+                     "584B0C3075AB87F44EEA0E92250089CDDBAF6EC644A6E63AB5EDFA38528291EE");
+    hashText("Okra bootloader signed image");
+    parse(signature, "A32966E8BF46F5A2707FC98009C92692F5DAF41669388F589C1097A3072644FA"
+                     "DE678352B5B2A79E5974A1BC17E58F2007868B2E7DA08B34E29ECE7207AE5424");
+    CHECK_TRUE(p256Verify(publicKey, hash, signature));
+}
+
+TEST(P256Test, ChangedHashOrSignatureIsRejected)
+{
+    useTestKey();
+    hashText("sample");
+    parse(signature, "EFD48B2AACB6A8FD1140DD9CD45E81D69D2C877B56AAF991C34D0EA84EAF3716"
+                     "F7CB1C942D657C41D436C7A1B6E29F65F3E900DBB9AFF4064DC4AB2F843ACDA8");
+    hash[31] ^= 1;
+    CHECK_FALSE(p256Verify(publicKey, hash, signature));
+    hash[31] ^= 1;
+    signature[0] ^= 0x80;
+    CHECK_FALSE(p256Verify(publicKey, hash, signature));
+    signature[0] ^= 0x80;
+    signature[P256_SIZE + 5] ^= 0x10;
+    CHECK_FALSE(p256Verify(publicKey, hash, signature));
+}
+
+TEST(P256Test, OutOfRangeSignatureIsRejected)
+{
+    /* r and s must be 1 to n - 1. s = n + (s - n) would be the same s mod n */
+    const char* order = "FFFFFFFF00000000FFFFFFFFFFFFFFFFBCE6FAADA7179E84F3B9CAC2FC632551";
+    useTestKey();
+    hashText("sample");
+    parse(signature, "EFD48B2AACB6A8FD1140DD9CD45E81D69D2C877B56AAF991C34D0EA84EAF3716");
+    memset(signature + P256_SIZE, 0, P256_SIZE);
+    CHECK_FALSE(p256Verify(publicKey, hash, signature));
+    parse(signature + P256_SIZE, order);
+    CHECK_FALSE(p256Verify(publicKey, hash, signature));
+    parse(signature + P256_SIZE, "F7CB1C942D657C41D436C7A1B6E29F65F3E900DBB9AFF4064DC4AB2F843ACDA8");
+    memset(signature, 0, P256_SIZE);
+    CHECK_FALSE(p256Verify(publicKey, hash, signature));
+    parse(signature, order);
+    CHECK_FALSE(p256Verify(publicKey, hash, signature));
+}
+
+TEST(P256Test, TestPrivateKeyMatchesPublicKey)
+{
+    uint8_t derived[P256_PUBLIC_KEY_SIZE];
+    useTestKey();
+    p256PublicKey(SIGNATURE_TEST_PRIVATE_KEY, derived);
+    MEMCMP_EQUAL(publicKey, derived, sizeof(derived));
+    #ifdef SIGNATURE
+    MEMCMP_EQUAL(SIGNATURE_PUBLIC_KEY, derived, sizeof(derived));
+    #endif
+}
+
+TEST(P256Test, SignedHashesAreValid)
+{
+    useTestKey();
+    for (uint32_t i = 0; i < 8; i++) {
+        char text[16];
+        snprintf(text, sizeof(text), "image %u", (unsigned int)i);
+        hashText(text);
+        p256Sign(SIGNATURE_TEST_PRIVATE_KEY, hash, signature);
+        CHECK_TRUE(p256Verify(publicKey, hash, signature));
+        hash[i] ^= 0x01;
+        CHECK_FALSE(p256Verify(publicKey, hash, signature));
+    }
+}
+
+TEST(P256Test, HashAboveTheOrderIsReduced)
+{
+    /* All ones is above n, e is taken mod n as for any other hash */
+    useTestKey();
+    memset(hash, 0xFF, sizeof(hash));
+    p256Sign(SIGNATURE_TEST_PRIVATE_KEY, hash, signature);
+    CHECK_TRUE(p256Verify(publicKey, hash, signature));
+}
@@ -0,0 +1,614 @@
+#include "Bootloader.h"
+#include "FlashSimulator.h"
+#include "SimulatedDevice.h"
+#include "StatusJournal.h"
+#include "System.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+/*
+ * Power-fail injection for Bootloader::boot(). For each starting scenario, an
+ * uninterrupted boot records the write operations it performs. The boot is
+ * then replayed with the power failing at each of these operations, either
+ * before the operation starts or half way through it. After each failure the
+ * device restarts with the shared RAM lost, and the next boot must start the
+ * app selected by the status, from a valid image, with at most
+ * MAX_RECOVERY_ERASES page erases. The status must survive: its state and
+ * live app are those of a boot that lost the shared RAM before the
+ * interrupted one wrote anything, or those of the interrupted boot completed
+ * and followed by one more, and no boot statistics are lost. With MAILBOX, an
+ * uninterrupted boot may start the app on trial instead. With SWAPBINARY, the
+ * app in the boot region is started, and no valid image may get lost. With
+ * RELOCATION, the apps are relocatable and the app started must be relocated
+ * for its slot. A new app may hold a word left half programmed by an earlier
+ * failure, whose page the boot rewrites: if a failure interrupts that too, the
+ * app is rejected and the recovery boot may fall back to the other app.
+ *
+ * All erases and all writes to the status journal are interrupted. Within a
+ * block of app data, the first, middle and last half-word are interrupted, as
+ * the others do not lead to different states.
+ *
+ * Usage: powerfail [threads]
+ */
+
+/* Length of the apps, with COPYBINARY more than one install checkpoint */
+#ifdef COPYBINARY
+static const uint32_t APP_LENGTH = INSTALL_CHECKPOINT_SIZE + 3 * FLASH_PAGE_SIZE;
+#else
+static const uint32_t APP_LENGTH = 3 * FLASH_PAGE_SIZE;
+#endif
+
+#ifdef SWAPBINARY
+/* A restart may have to take every step of a swap, and compact the journal */
+static const uint32_t MAX_RECOVERY_ERASES = 3 * ((APP_LENGTH + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE + 1)
+    + BOOTLOADER_STATUS_PAGES;
+#else
+/* A restart may have to rewrite every page of an app, and compact the journal */
+static const uint32_t MAX_RECOVERY_ERASES = (APP_LENGTH + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE
+    + BOOTLOADER_STATUS_PAGES;
+#endif
+
+/* Flash contents and status a boot starts from */
+struct Scenario {
+    uint32_t state;          // Status in the journal, noState for an empty journal
+    uint32_t liveApp;        // liveAppSelect
+    uint32_t retryCount;     // retryCount
+    int32_t invalidApp;      // Slot without a valid image, -1 if both are valid
+    uint32_t installedApp;   // App installed at BOOT_ADDRESS with COPYBINARY
+    bool fullJournal;        // The journal page is full, the next write compacts it
+    bool warmBoot;           // With BACKUPRETRY, the backup registers hold the retry count
+    uint32_t mailbox;        // With MAILBOX, ScenarioMailbox
+    bool tornWord;           // With RELOCATION, a relocated word of the new live app is half programmed
+};
+
+/* Mailbox contents of a scenario, the trials are for the app after the live app */
+enum ScenarioMailbox {
+    noMailbox = 0,   // Not initialized, as after a power loss
+    trialRequested,  // The app requested a trial
+    trialRunning,    // A trial is running with retryCount retries
+    trialConfirmed,  // A trial is running and the app requested its confirmation
+    scenarioMailboxes,
+};
+
+/* Status before the boot, and the two a boot interrupted by a power failure may end up with */
+struct ExpectedStatus {
+    BootloaderStatus before;      // Status of the scenario
+    BootloaderStatus preWrite;    // After a boot that lost the shared RAM first
+    BootloaderStatus postWrite;   // After the uninterrupted boot and a boot after a power failure
+    BootloaderStatus rejected;    // With a torn word, after a boot that rejects the live app
+    bool tornWord;                // Scenario::tornWord
+};
+
+/* A write operation of the recorded boot */
+struct WriteOperation {
+    SimulatorOperation operation;
+    uint32_t address;
+};
+
+static thread_local std::vector<WriteOperation> recording;
+
+#ifdef SWAPBINARY
+/* Valid images in the boot region and the slots before the boot */
+static thread_local std::vector<ImageHeader> images;
+
+/* Check for a valid image in a region, and that it is the one of header if given */
+static bool holdsImage(uint32_t address, const ImageHeader* header)
+{
+    const ImageHeader* stored = (const ImageHeader*)flashSimulator.memory(address + APP_HEADER_OFFSET);
+    if (header != nullptr && memcmp(stored, header, sizeof(*header)) != 0) {
+        return false;
+    }
+    return stored->magic == IMAGE_HEADER_MAGIC && stored->length != 0 && stored->length <= (uint32_t)APP_HEADER_OFFSET
+        && crc32((const uint32_t*)flashSimulator.memory(address, stored->length), stored->length / sizeof(uint32_t))
+        == stored->crc;
+}
+#endif
+
+static void recordOperation(SimulatorOperation operation, uint32_t address, uint32_t size)
+{
+    if (operation == SimulatorOperation::pageErase || operation == SimulatorOperation::halfWordProgram) {
+        recording.push_back({ operation, address });
+    }
+}
+
+static std::vector<Scenario> scenarios()
+{
+    std::vector<Scenario> list;
+    const uint32_t states[] = { BootloaderState::noState, BootloaderState::newApp,
+        BootloaderState::attemptNewApp, BootloaderState::stableApp, 0x55 };
+    #ifdef COPYBINARY
+    const uint32_t installedApps = BOOTLOADER_MAX_APPS;
+    #else
+    const uint32_t installedApps = 1;
+    #endif
+    #ifdef BACKUPRETRY
+    const int warmBoots = 2;
+    #else
+    const int warmBoots = 1;
+    #endif
+    #ifdef MAILBOX
+    const uint32_t mailboxes = ScenarioMailbox::scenarioMailboxes;
+    #else
+    const uint32_t mailboxes = 1;
+    #endif
+    #ifdef RELOCATION
+    const int tornWords = 2;
+    #else
+    const int tornWords = 1;
+    #endif
+
+    for (uint32_t state : states) {
+        for (uint32_t liveApp = 0; liveApp < BOOTLOADER_MAX_APPS; liveApp++) {
+            for (uint32_t retryCount = 0; retryCount < BOOTLOADER_MAX_RETRIES; retryCount++) {
+                for (int32_t invalidApp = -1; invalidApp < BOOTLOADER_MAX_APPS; invalidApp++) {
+                    for (uint32_t installedApp = 0; installedApp < installedApps; installedApp++) {
+                        for (int fullJournal = 0; fullJournal < 2; fullJournal++) {
+                            for (int warmBoot = 0; warmBoot < warmBoots; warmBoot++) {
+                                for (uint32_t mailbox = 0; mailbox < mailboxes; mailbox++) {
+                                    for (int tornWord = 0; tornWord < tornWords; tornWord++) {
+                                        /* An empty journal has no other fields */
+                                        if (state == BootloaderState::noState
+                                            && (liveApp != 0 || retryCount != 0 || fullJournal || warmBoot
+                                                || mailbox)) {
+                                            continue;
+                                        }
+                                        /* Stable apps are valid, the bootloader does not
+                                         * check them */
+                                        if (state == BootloaderState::stableApp && invalidApp == (int32_t)liveApp) {
+                                            continue;
+                                        }
+                                        #ifdef DELTA
+                                        /* Without its base the delta app is invalid as well */
+                                        if (invalidApp == 0) {
+                                            continue;
+                                        }
+                                        #endif
+                                        /* Only a new app has been relocated in part. Another
+                                         * failure may cost it data, which takes a valid app
+                                         * to fall back to */
+                                        if (tornWord
+                                            && ((state != BootloaderState::newApp
+                                                    && state != BootloaderState::attemptNewApp)
+                                                || invalidApp != -1)) {
+                                            continue;
+                                        }
+                                        list.push_back({ state, liveApp, retryCount, invalidApp, installedApp,
+                                            fullJournal != 0, warmBoot != 0, mailbox, tornWord != 0 });
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return list;
+}
+
+static void setupScenario(const Scenario& scenario)
+{
+    flashSimulator.reset();
+    for (uint32_t app = 0; app < BOOTLOADER_MAX_APPS; app++) {
+        #ifdef COMPRESSION
+        storeCompressedApp(app, APP_LENGTH, app + 1);
+        #elif defined(RELOCATION)
+        storeRelocatableApp(app, APP_LENGTH, app + 1);
+        #else
+        storeApp(app, APP_LENGTH, app + 1);
+        #endif
+    }
+    #ifdef DELTA
+    /* The second app is a delta of the first, which stays a plain app */
+    storeApp(0, APP_LENGTH, 1);
+    storeDeltaApp(1, 0, FLASH_PAGE_SIZE, 1);
+    #endif
+    #ifdef SWAPBINARY
+    /* The apps share their first batch, which swaps skip. The scratch area
+     * holds the last batch of an earlier swap */
+    for (uint32_t app = 1; app < BOOTLOADER_MAX_APPS; app++) {
+        memcpy(slotWords(app), slotWords(0), SWAP_SCRATCH_SIZE);
+        slotHeader(app)->crc = crc32(slotWords(app), APP_LENGTH / sizeof(uint32_t));
+        #ifdef VERIFYHASH
+        setImageHash(*slotHeader(app), slotWords(app));
+        #endif
+        storedHeader(app) = *slotHeader(app);
+    }
+    memset(flashSimulator.memory(SWAP_SCRATCH_ADDRESS, SWAP_SCRATCH_SIZE), 0x5A, SWAP_SCRATCH_SIZE);
+    #endif
+
+    BootloaderStatus status = statusFor(scenario.state, scenario.liveApp);
+    status.retryCount = scenario.retryCount;
+    /* Counters of earlier boots, which no power failure may lose */
+    status.statistics.boots = 100;
+    status.statistics.trialBoots = 10;
+    status.statistics.statusErases = 1;
+    #ifdef RELOCATION
+    /* Only the stable app has run from its slot before */
+    if (scenario.state == BootloaderState::stableApp) {
+        installApp(status, scenario.liveApp);
+    }
+    #else
+    installApp(status, scenario.installedApp);
+    #endif
+
+    if (scenario.invalidApp >= 0) {
+        slotHeader(scenario.invalidApp)->magic = 0;
+    }
+
+    #ifdef RELOCATION
+    /* Program the first relocated words of the live app, the last one only
+     * half way as a power failure does, so that it cannot be programmed over */
+    if (scenario.tornWord) {
+        bool torn = false;
+        visitRelocations(scenario.liveApp, [&](uint32_t& word, uint32_t address) {
+            uint16_t low = (uint16_t)address | 0xFF00;
+            if (!torn) {
+                word = address;
+                torn = low != (uint16_t)address;
+                if (torn) {
+                    word = 0xFFFF0000 | low;
+                }
+            }
+        });
+    }
+    #endif
+
+    #ifdef SWAPBINARY
+    images.clear();
+    for (uint32_t region = 0; region <= BOOTLOADER_MAX_APPS; region++) {
+        uint32_t address = region == 0 ? BOOT_ADDRESS : BOOTLOADER_APP_ADDRESS[region - 1];
+        if (holdsImage(address, nullptr)) {
+            images.push_back(*(const ImageHeader*)flashSimulator.memory(address + APP_HEADER_OFFSET));
+        }
+    }
+    #endif
+
+    System sys;
+    if (scenario.fullJournal) {
+        BootloaderStatus filler = status;
+        for (uint32_t i = 0; i + 1 < STATUS_RECORDS_PER_PAGE * BOOTLOADER_STATUS_PAGES; i++) {
+            filler.retryCount = 1000 + i;
+            sys.writeStatusReg(filler);
+        }
+    }
+    if (scenario.state != BootloaderState::noState) {
+        sys.writeStatusReg(status);
+    }
+
+    #ifdef BACKUPRETRY
+    if (scenario.warmBoot) {
+        setWarmBoot(scenario.retryCount);
+    }
+    #endif
+
+    #ifdef MAILBOX
+    uint32_t trialApp = (scenario.liveApp + 1) % BOOTLOADER_MAX_APPS;
+    if (scenario.mailbox == ScenarioMailbox::trialRequested) {
+        requestMailbox(MailboxRequest::trialBoot, trialApp);
+    } else if (scenario.mailbox != ScenarioMailbox::noMailbox) {
+        requestMailbox(MailboxRequest::noRequest, 0);
+        flashSimulator.mailbox.trialApp = trialApp;
+        flashSimulator.mailbox.trialRetries = scenario.retryCount;
+        #ifdef RELOCATION
+        /* The app on trial was relocated when its trial started */
+        installApp(status, trialApp);
+        #endif
+        if (scenario.mailbox == ScenarioMailbox::trialConfirmed) {
+            flashSimulator.mailbox.request = MailboxRequest::confirmStable;
+        }
+        flashSimulator.mailbox.crc = mailboxCrc(flashSimulator.mailbox);
+    }
+    #endif
+}
+
+/* Check that the last boot started the app selected by the status, or the app
+ * on trial, from a valid image */
+static const char* checkBoot()
+{
+    if (flashSimulator.boots != 1) {
+        return "no app started";
+    }
+    if (flashSimulator.errors != 0) {
+        return "flash errors";
+    }
+    if (flashSimulator.pagesErased > MAX_RECOVERY_ERASES) {
+        return "too many erases";
+    }
+
+    System sys;
+    BootloaderStatus status;
+    sys.readStatusReg(status);
+    if (status.liveAppSelect >= BOOTLOADER_MAX_APPS) {
+        return "invalid live app";
+    }
+
+    uint32_t app = status.liveAppSelect;
+    #ifdef MAILBOX
+    const Mailbox& mailbox = flashSimulator.mailbox;
+    if (mailbox.magic != MAILBOX_MAGIC || mailbox.crc != mailboxCrc(mailbox)) {
+        return "invalid mailbox";
+    }
+    if (mailbox.trialApp != MAILBOX_NO_TRIAL) {
+        if (status.status != BootloaderState::stableApp) {
+            return "trial without a stable app";
+        }
+        app = mailbox.trialApp;
+    }
+    if (mailbox.bootedApp != app) {
+        return "mailbox reports another app";
+    }
+    #endif
+    #ifdef SWAPBINARY
+    /* The app is in the boot region, and the other images are still around */
+    (void)app;
+    if (flashSimulator.bootAddress != BOOT_ADDRESS || !holdsImage(BOOT_ADDRESS, nullptr)) {
+        return "boot region is invalid";
+    }
+    for (const ImageHeader& image : images) {
+        bool found = false;
+        for (uint32_t region = 0; region <= BOOTLOADER_MAX_APPS && !found; region++) {
+            found = holdsImage(region == 0 ? BOOT_ADDRESS : BOOTLOADER_APP_ADDRESS[region - 1], &image);
+        }
+        if (!found) {
+            return "image lost";
+        }
+    }
+    #else
+    const ImageHeader* header = slotHeader(app);
+    /* Compressed and delta binaries may be larger than the slot */
+    uint32_t maxLength = header->magic == IMAGE_HEADER_MAGIC ? (uint32_t)APP_HEADER_OFFSET : 0;
+    #ifdef RELOCATION
+    if (header->magic == IMAGE_HEADER_MAGIC_RELOC) {
+        maxLength = APP_HEADER_OFFSET;
+    }
+    #endif
+    #ifdef COMPRESSION
+    if (header->magic == IMAGE_HEADER_MAGIC_LZ4) {
+        maxLength = BOOT_SIZE;
+    }
+    #endif
+    #ifdef DELTA
+    if (header->magic == IMAGE_HEADER_MAGIC_DELTA) {
+        maxLength = BOOT_SIZE;
+    }
+    #endif
+    if (header->length == 0 || header->length > maxLength
+        || crc32((const uint32_t*)slotBinary(app), header->length / sizeof(uint32_t)) != header->crc) {
+        return "live app is invalid";
+    }
+
+    #ifdef COPYBINARY
+    if (flashSimulator.bootAddress != BOOT_ADDRESS || !isInstalled(app, header->length)) {
+        return "live app is not installed";
+    }
+    #else
+    if (flashSimulator.bootAddress != BOOTLOADER_APP_ADDRESS[app]) {
+        return "other app started";
+    }
+    #ifdef RELOCATION
+    if (!isRelocated(app)) {
+        return "live app is not relocated";
+    }
+    #endif
+    #endif
+    #endif
+    return nullptr;
+}
+
+/* Check that the status after a power failure and the next boot is one of
+ * the expected ones, and that its statistics count at most both boots */
+static const char* checkStatus(const ExpectedStatus& expected)
+{
+    System sys;
+    BootloaderStatus status;
+    sys.readStatusReg(status);
+
+    bool preWrite = status.status == expected.preWrite.status
+        && status.liveAppSelect == expected.preWrite.liveAppSelect;
+    bool postWrite = status.status == expected.postWrite.status
+        && status.liveAppSelect == expected.postWrite.liveAppSelect;
+    bool rejected = expected.tornWord && status.status == expected.rejected.status
+        && status.liveAppSelect == expected.rejected.liveAppSelect;
+    if (!preWrite && !postWrite && !rejected) {
+        return "status is lost";
+    }
+
+    const BootStatistics& before = expected.before.statistics;
+    const BootStatistics& after = status.statistics;
+    uint32_t rollbacksBefore = 0;
+    uint32_t rollbacksAfter = 0;
+    for (uint32_t app = 0; app < BOOTLOADER_MAX_APPS; app++) {
+        rollbacksBefore += before.rollbacks[app];
+        rollbacksAfter += after.rollbacks[app];
+    }
+    if (after.boots < before.boots || after.trialBoots < before.trialBoots || rollbacksAfter < rollbacksBefore
+        || after.statusErases < before.statusErases) {
+        return "statistics are lost";
+    }
+    if (after.boots > before.boots + 2 || after.trialBoots > before.trialBoots + 2
+        || rollbacksAfter > rollbacksBefore + 2) {
+        return "statistics count more than two boots";
+    }
+    return nullptr;
+}
+
+/* Pick the write operations to interrupt, by index in the recording */
+static std::vector<uint32_t> cutPoints()
+{
+    std::vector<uint32_t> cuts;
+    const uint32_t journalStart = BOOTLOADER_STATUS_STRUCT_ADDR;
+    const uint32_t journalEnd = journalStart + BOOTLOADER_STATUS_PAGES * FLASH_PAGE_SIZE;
+
+    uint32_t blockStart = 0;
+    for (uint32_t i = 0; i < recording.size(); i++) {
+        const WriteOperation& write = recording[i];
+        bool journal = write.address >= journalStart && write.address < journalEnd;
+        bool blockEnd = i + 1 == recording.size() || recording[i + 1].operation != write.operation
+            || recording[i + 1].address != write.address + sizeof(uint16_t);
+
+        if (write.operation == SimulatorOperation::pageErase || journal) {
+            cuts.push_back(i);
+        } else if (blockEnd) {
+            cuts.push_back(blockStart);
+            cuts.push_back((blockStart + i) / 2);
+            cuts.push_back(i);
+        }
+        if (blockEnd) {
+            blockStart = i + 1;
+        }
+    }
+
+    std::sort(cuts.begin(), cuts.end());
+    cuts.erase(std::unique(cuts.begin(), cuts.end()), cuts.end());
+    return cuts;
+}
+
+static void describe(char* text, size_t size, const Scenario& scenario)
+{
+    snprintf(text, size,
+        "state %u, live app %u, retries %u, invalid app %d, installed app %u, %s journal, %s boot, mailbox %u%s",
+        scenario.state, scenario.liveApp, scenario.retryCount, scenario.invalidApp, scenario.installedApp,
+        scenario.fullJournal ? "full" : "fresh", scenario.warmBoot ? "warm" : "cold", scenario.mailbox,
+        scenario.tornWord ? ", torn word" : "");
+}
+
+/* Results over all threads */
+static std::mutex reportMutex;
+static std::atomic<uint32_t> powerCuts(0);
+static std::atomic<uint32_t> failures(0);
+static std::atomic<uint32_t> maxRecoveryErases(0);
+
+static void fail(const Scenario& scenario, const char* reason, int32_t cut, bool torn)
+{
+    if (failures++ < 20) {
+        char text[192];
+        describe(text, sizeof(text), scenario);
+        std::lock_guard<std::mutex> lock(reportMutex);
+        if (cut < 0) {
+            printf("FAIL %s: %s without a power failure\n", text, reason);
+        } else {
+            printf("FAIL %s: %s after a %s power failure at write %d\n", text, reason, torn ? "torn" : "clean",
+                cut);
+        }
+    }
+}
+
+static void runScenario(const Scenario& scenario)
+{
+    Bootloader bl;
+    System sys;
+
+    setupScenario(scenario);
+    std::unique_ptr<FlashSimulator> initial(new FlashSimulator(flashSimulator));
+
+    /* Uninterrupted boot, records the writes */
+    recording.clear();
+    flashSimulator.clearCounters();
+    flashSimulator.observer = recordOperation;
+    bl.boot(sys, false);
+    flashSimulator.observer = nullptr;
+    const char* reason = checkBoot();
+    if (reason != nullptr) {
+        fail(scenario, reason, -1, false);
+        return;
+    }
+
+    ExpectedStatus expected;
+    flashSimulator = *initial;
+    sys.readStatusReg(expected.before);
+    flashSimulator.powerCycle();
+    bl.boot(sys, false);
+    sys.readStatusReg(expected.preWrite);
+    flashSimulator = *initial;
+    flashSimulator.restart();
+    bl.boot(sys, false);
+    flashSimulator.powerCycle();
+    bl.boot(sys, false);
+    sys.readStatusReg(expected.postWrite);
+    expected.tornWord = scenario.tornWord;
+    if (scenario.tornWord) {
+        flashSimulator = *initial;
+        slotHeader(scenario.liveApp)->magic = 0;
+        flashSimulator.powerCycle();
+        bl.boot(sys, false);
+        sys.readStatusReg(expected.rejected);
+    }
+
+    for (uint32_t cut : cutPoints()) {
+        for (int torn = 0; torn < 2; torn++) {
+            flashSimulator = *initial;
+            flashSimulator.restart();
+            flashSimulator.powerCut = cut;
+            flashSimulator.tornWrite = torn != 0;
+            powerCuts++;
+
+            bool powerFailed = false;
+            try {
+                bl.boot(sys, false);
+            } catch (const PowerFailure&) {
+                powerFailed = true;
+            }
+            if (!powerFailed) {
+                fail(scenario, "boot is not deterministic", cut, torn != 0);
+                continue;
+            }
+
+            /* Restart and boot without further failures */
+            flashSimulator.powerCycle();
+            bl.boot(sys, false);
+            reason = checkBoot();
+            if (reason == nullptr) {
+                reason = checkStatus(expected);
+            }
+            if (reason != nullptr) {
+                fail(scenario, reason, cut, torn != 0);
+            }
+
+            uint32_t erases = flashSimulator.pagesErased;
+            uint32_t max = maxRecoveryErases;
+            while (erases > max && !maxRecoveryErases.compare_exchange_weak(max, erases)) {
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t threads = std::thread::hardware_concurrency();
+    if (argc > 1) {
+        threads = atoi(argv[1]);
+    }
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    const std::vector<Scenario> list = scenarios();
+    std::atomic<uint32_t> next(0);
+    std::vector<std::thread> workers;
+    for (uint32_t i = 0; i < threads; i++) {
+        workers.push_back(std::thread([&]() {
+            #ifdef TRACEBOOT
+            flashSimulator.traceSink = nullptr;
+            #endif
+            for (uint32_t index = next++; index < list.size(); index = next++) {
+                runScenario(list[index]);
+            }
+        }));
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    printf("%u scenarios, %u power failures, at most %u erases on restart (limit %u), %u failures\n",
+        (uint32_t)list.size(), (uint32_t)powerCuts, (uint32_t)maxRecoveryErases, MAX_RECOVERY_ERASES,
+        (uint32_t)failures);
+    return failures == 0 ? 0 : 1;
+}
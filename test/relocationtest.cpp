@@ -0,0 +1,76 @@
+#include "CppUTest/TestHarness.h"
+
+#include "Relocation.h"
+
+TEST_GROUP(RelocationTest){
+    uint32_t table[16];
+
+    /* Decode the table and check it against the relocations */
+    void checkTable(const uint32_t* positions, const uint32_t* offsets, uint32_t count, int32_t entries)
+    {
+        uint32_t position = RELOCATION_START;
+        uint32_t relocated = 0;
+        for (int32_t i = 0; i < entries; i++) {
+            uint32_t offset;
+            if (relocationEntry(table[i], position, offset)) {
+                CHECK_TRUE(relocated < count);
+                LONGS_EQUAL(positions[relocated], position);
+                LONGS_EQUAL(offsets[relocated], offset);
+                relocated++;
+            }
+        }
+        LONGS_EQUAL(count, relocated);
+    }
+};
+
+TEST(RelocationTest, EntriesHoldDistanceAndOffset)
+{
+    const uint32_t positions[] = { 1, 4, 16 };
+    const uint32_t offsets[] = { 0x9, 0x40, 0x11 };
+
+    LONGS_EQUAL(3, relocationEncode(positions, offsets, 3, table, 16));
+    LONGS_EQUAL(0x00080009, table[0]);
+    LONGS_EQUAL(0x000C0040, table[1]);
+    LONGS_EQUAL(0x00300011, table[2]);
+    checkTable(positions, offsets, 3, 3);
+}
+
+TEST(RelocationTest, LongDistancesAreSkipped)
+{
+    const uint32_t positions[] = { 0, 2 * RELOCATION_MAX_DISTANCE + 5, 2 * RELOCATION_MAX_DISTANCE + 6 };
+    const uint32_t offsets[] = { 0, 0x3FFFE, 0x123 };
+
+    int32_t entries = relocationEncode(positions, offsets, 3, table, 16);
+    LONGS_EQUAL(5, entries);
+    LONGS_EQUAL(RELOCATION_SKIP, table[1] & RELOCATION_SKIP);
+    LONGS_EQUAL(RELOCATION_SKIP, table[2] & RELOCATION_SKIP);
+    checkTable(positions, offsets, 3, entries);
+}
+
+TEST(RelocationTest, NoRelocations)
+{
+    LONGS_EQUAL(0, relocationEncode(nullptr, nullptr, 0, table, 0));
+}
+
+TEST(RelocationTest, UnorderedPositionsAreRejected)
+{
+    const uint32_t positions[] = { 4, 4 };
+    const uint32_t offsets[] = { 0, 0 };
+    LONGS_EQUAL(-1, relocationEncode(positions, offsets, 2, table, 16));
+}
+
+TEST(RelocationTest, OffsetTooLargeIsRejected)
+{
+    const uint32_t positions[] = { 1 };
+    const uint32_t offsets[] = { RELOCATION_SKIP };
+    LONGS_EQUAL(-1, relocationEncode(positions, offsets, 1, table, 16));
+}
+
+TEST(RelocationTest, TableTooSmallIsRejected)
+{
+    const uint32_t positions[] = { 1, 2, RELOCATION_MAX_DISTANCE + 3 };
+    const uint32_t offsets[] = { 0, 0, 0 };
+    LONGS_EQUAL(-1, relocationEncode(positions, offsets, 3, table, 2));
+    LONGS_EQUAL(-1, relocationEncode(positions, offsets, 3, table, 3));
+    LONGS_EQUAL(4, relocationEncode(positions, offsets, 3, table, 4));
+}
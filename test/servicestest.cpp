@@ -0,0 +1,145 @@
+#include "CppUTest/TestHarness.h"
+
+#include "Bootloader.h"
+#include "BootloaderServices.h"
+#include "FlashSimulator.h"
+#include "SimulatedDevice.h"
+#include "System.h"
+
+#include <string.h>
+
+#ifdef SERVICES
+/* Scratch page in the middle of the simulated flash */
+static const uint32_t SCRATCH_ADDRESS = 0x08010000;
+
+TEST_GROUP(ServicesTest){
+    const BootloaderServices* services;
+
+    virtual void setup()
+    {
+        flashSimulator.reset();
+        #ifdef TRACEBOOT
+        flashSimulator.traceSink = nullptr;
+        #endif
+        for (uint32_t app = 0; app < BOOTLOADER_MAX_APPS; app++) {
+            storeApp(app, 0x1000, app + 1);
+        }
+        services = bootloaderServices(SERVICES_VERSION, &bootloaderServiceTable);
+    }
+
+    virtual void teardown()
+    {
+        CHECK_EQUAL(0, flashSimulator.errors);
+        CHECK_TRUE(flashSimulator.locked);
+    }
+};
+
+TEST(ServicesTest, TableIsFound)
+{
+    CHECK_TRUE(services != nullptr);
+    CHECK_EQUAL(sizeof(BootloaderServices), services->size);
+    CHECK_EQUAL(sizeof(BootloaderStatus), services->statusSize);
+}
+
+TEST(ServicesTest, TableOfOlderOrOtherBootloaderIsNotFound)
+{
+    CHECK_TRUE(bootloaderServices(SERVICES_VERSION + 1, &bootloaderServiceTable) == nullptr);
+
+    BootloaderServices table = bootloaderServiceTable;
+    table.magic = 0xFFFFFFFF;
+    CHECK_TRUE(bootloaderServices(1, &table) == nullptr);
+}
+
+TEST(ServicesTest, TableWithOtherStatusLayoutIsNotFound)
+{
+    BootloaderServices table = bootloaderServiceTable;
+    table.statusSize = sizeof(BootloaderStatus) + sizeof(uint32_t);
+    CHECK_TRUE(bootloaderServices(SERVICES_VERSION, &table) == nullptr);
+}
+
+TEST(ServicesTest, EraseAndProgramLockTheFlashAgain)
+{
+    uint16_t data[4] = { 0x1234, 0x5678, 0x9ABC, 0xDEF0 };
+    memset(flashSimulator.memory(SCRATCH_ADDRESS, FLASH_PAGE_SIZE), 0, FLASH_PAGE_SIZE);
+
+    CHECK_TRUE(services->erasePage(SCRATCH_ADDRESS));
+    CHECK_TRUE(flashSimulator.locked);
+    CHECK_TRUE(services->isBlank(SCRATCH_ADDRESS, FLASH_PAGE_SIZE));
+
+    CHECK_TRUE(services->programHalfWords(SCRATCH_ADDRESS, data, sizeof(data)));
+    CHECK_TRUE(flashSimulator.locked);
+    MEMCMP_EQUAL(data, flashSimulator.memory(SCRATCH_ADDRESS, sizeof(data)), sizeof(data));
+    CHECK_FALSE(services->isBlank(SCRATCH_ADDRESS, FLASH_PAGE_SIZE));
+}
+
+TEST(ServicesTest, EraseAndProgramKeepUnlockedFlashUnlocked)
+{
+    uint16_t data[2] = { 0x1234, 0x5678 };
+    System sys;
+    sys.unlockFlash();
+
+    CHECK_TRUE(services->erasePage(SCRATCH_ADDRESS));
+    CHECK_FALSE(flashSimulator.locked);
+    CHECK_TRUE(services->programHalfWords(SCRATCH_ADDRESS, data, sizeof(data)));
+    CHECK_FALSE(flashSimulator.locked);
+
+    sys.lockFlash();
+}
+
+TEST(ServicesTest, BootloaderAndJournalAreNotErasedOrProgrammed)
+{
+    uint16_t data[2] = { 0x1234, 0x5678 };
+    BootloaderStatus status = statusFor(BootloaderState::stableApp, 0);
+    services->writeStatus(&status);
+    flashSimulator.clearCounters();
+
+    CHECK_FALSE(services->erasePage(SIMULATOR_FLASH_START));
+    CHECK_FALSE(services->erasePage(BOOTLOADER_STATUS_STRUCT_ADDR));
+    CHECK_FALSE(services->erasePage(APP_FLASH_START - FLASH_PAGE_SIZE));
+    CHECK_FALSE(services->programHalfWords(BOOTLOADER_STATUS_STRUCT_ADDR, data, sizeof(data)));
+    CHECK_FALSE(services->programHalfWords(APP_FLASH_START - sizeof(data) / 2, data, sizeof(data)));
+    CHECK_FALSE(services->programHalfWords(APP_FLASH_END - sizeof(uint16_t), data, sizeof(data)));
+
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+    CHECK_EQUAL(0, flashSimulator.halfWordsProgrammed);
+    CHECK_TRUE(services->readStatus(&status));
+    CHECK_EQUAL(BootloaderState::stableApp, status.status);
+}
+
+TEST(ServicesTest, CrcOfFlashMatchesCrc32)
+{
+    const ImageHeader* header = slotHeader(0);
+
+    CHECK_EQUAL(header->crc, services->crcFlash(BOOTLOADER_APP_ADDRESS[0], header->length));
+    CHECK_EQUAL(header->crc, services->crc32(slotWords(0), header->length / sizeof(uint32_t), CRC32_INITIAL));
+}
+
+TEST(ServicesTest, StatusIsConfirmedInPlace)
+{
+    BootloaderStatus status;
+    CHECK_FALSE(services->confirmStatus());
+
+    System sys;
+    Bootloader bl;
+    bl.boot(sys, false);
+    CHECK_TRUE(services->readStatus(&status));
+    CHECK_EQUAL(BootloaderState::attemptNewApp, status.status);
+
+    flashSimulator.clearCounters();
+    CHECK_TRUE(services->confirmStatus());
+    CHECK_EQUAL(1, flashSimulator.halfWordsProgrammed);
+    CHECK_TRUE(services->readStatus(&status));
+    CHECK_EQUAL(BootloaderState::stableApp, status.status);
+}
+
+TEST(ServicesTest, WrittenStatusIsRead)
+{
+    BootloaderStatus status = statusFor(BootloaderState::newApp, 1);
+    services->writeStatus(&status);
+
+    BootloaderStatus readStatus;
+    CHECK_TRUE(services->readStatus(&readStatus));
+    CHECK_EQUAL(BootloaderState::newApp, readStatus.status);
+    CHECK_EQUAL(1, readStatus.liveAppSelect);
+}
+#endif
@@ -0,0 +1,125 @@
+#include "CppUTest/TestHarness.h"
+
+#include "Sha256.h"
+#include "Sha256Reference.h"
+
+#include <stdio.h>
+#include <string.h>
+
+TEST_GROUP(Sha256Test){
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint8_t expected[SHA256_DIGEST_SIZE];
+    /* Word aligned, so offsets into it can be aligned or not */
+    uint32_t words[1024];
+
+    void hash(const void* data, uint32_t size)
+    {
+        Sha256 context;
+        sha256Init(context);
+        sha256Update(context, (const uint8_t*)data, size);
+        sha256Final(context, digest);
+    }
+
+    void checkDigest(const char* hex)
+    {
+        for (uint32_t i = 0; i < SHA256_DIGEST_SIZE; i++) {
+            unsigned int byte;
+            sscanf(hex + 2 * i, "%2x", &byte);
+            expected[i] = byte;
+        }
+        MEMCMP_EQUAL(expected, digest, SHA256_DIGEST_SIZE);
+    }
+
+    uint8_t* fillRandom()
+    {
+        uint32_t state = 0x2545F491;
+        uint8_t* bytes = (uint8_t*)words;
+        for (uint32_t i = 0; i < sizeof(words); i++) {
+            state = state * 1103515245 + 12345;
+            bytes[i] = state >> 24;
+        }
+        return bytes;
+    }
+};
+
+/* Test vectors of FIPS 180-4 and NIST CSRC examples */
+
+TEST(Sha256Test, EmptyMessage)
+{
+    hash("", 0);
+    checkDigest("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+}
+
+TEST(Sha256Test, OneBlockMessage)
+{
+    hash("abc", 3);
+    checkDigest("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+}
+
+TEST(Sha256Test, TwoBlockMessage)
+{
+    /* 448 bits, the padding needs a block of its own */
+    const char* message = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    hash(message, strlen(message));
+    checkDigest("248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+}
+
+TEST(Sha256Test, LongMessage)
+{
+    const char* message = "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmno"
+                          "ijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu";
+    hash(message, strlen(message));
+    checkDigest("cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1");
+}
+
+TEST(Sha256Test, MillionTimesA)
+{
+    uint8_t* bytes = (uint8_t*)words;
+    memset(bytes, 'a', 1000);
+    Sha256 context;
+    sha256Init(context);
+    for (uint32_t i = 0; i < 1000; i++) {
+        sha256Update(context, bytes, 1000);
+    }
+    sha256Final(context, digest);
+    checkDigest("cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+TEST(Sha256Test, AllPaddingLengthsMatchTheReference)
+{
+    uint8_t* bytes = fillRandom();
+    for (uint32_t size = 0; size <= 3 * SHA256_BLOCK_SIZE; size++) {
+        hash(bytes, size);
+        sha256Reference(bytes, size, expected);
+        MEMCMP_EQUAL(expected, digest, SHA256_DIGEST_SIZE);
+    }
+}
+
+TEST(Sha256Test, SplitUpdatesMatchOneUpdate)
+{
+    /* Pieces of every alignment, some with whole blocks in them */
+    uint8_t* bytes = fillRandom();
+    sha256Reference(bytes, sizeof(words), expected);
+
+    Sha256 context;
+    sha256Init(context);
+    uint32_t position = 0;
+    for (uint32_t piece = 1; position < sizeof(words); piece = piece * 7 % 199) {
+        uint32_t size = piece < sizeof(words) - position ? piece : sizeof(words) - position;
+        sha256Update(context, bytes + position, size);
+        position += size;
+    }
+    sha256Final(context, digest);
+    MEMCMP_EQUAL(expected, digest, SHA256_DIGEST_SIZE);
+}
+
+TEST(Sha256Test, UnalignedDataMatchesAlignedData)
+{
+    uint8_t* bytes = fillRandom();
+    hash(bytes + 1, 5 * SHA256_BLOCK_SIZE);
+    memcpy(expected, digest, sizeof(expected));
+
+    memmove(bytes, bytes + 1, 5 * SHA256_BLOCK_SIZE);
+    hash(bytes, 5 * SHA256_BLOCK_SIZE);
+    MEMCMP_EQUAL(expected, digest, SHA256_DIGEST_SIZE);
+}
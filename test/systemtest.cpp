@@ -0,0 +1,157 @@
+#include "CppUTest/TestHarness.h"
+
+#include "FlashSimulator.h"
+#include "System.h"
+
+#include <string.h>
+
+/* Two scratch areas in the middle of the simulated flash */
+static const uint32_t SOURCE_ADDRESS = 0x08010000;
+static const uint32_t DESTINATION_ADDRESS = 0x08020000;
+
+TEST_GROUP(SystemTest){
+    System sys;
+
+    virtual void setup()
+    {
+        flashSimulator.reset();
+        uint8_t* source = flashSimulator.memory(SOURCE_ADDRESS, 4 * FLASH_PAGE_SIZE);
+        for (uint32_t i = 0; i < 4 * FLASH_PAGE_SIZE; i++) {
+            source[i] = i * 7 + 1;
+        }
+    }
+
+    bool isCopied(uint32_t size)
+    {
+        return memcmp(flashSimulator.memory(SOURCE_ADDRESS, size),
+                   flashSimulator.memory(DESTINATION_ADDRESS, size), size)
+            == 0;
+    }
+};
+
+TEST(SystemTest, ErasedFlashReadsOnes)
+{
+    uint32_t word = 0;
+    sys.readFlash(DESTINATION_ADDRESS, (uint8_t*)&word, sizeof(word));
+
+    CHECK_EQUAL(0xFFFFFFFF, word);
+    CHECK_TRUE(sys.isBlank(DESTINATION_ADDRESS, FLASH_PAGE_SIZE));
+}
+
+TEST(SystemTest, LockedFlashIsNotWritten)
+{
+    const uint16_t data = 0x1234;
+    sys.programHalfWords(DESTINATION_ADDRESS, &data, sizeof(data));
+    sys.erasePage(SOURCE_ADDRESS);
+
+    CHECK_EQUAL(2, flashSimulator.errors);
+    CHECK_TRUE(sys.isBlank(DESTINATION_ADDRESS, sizeof(uint32_t)));
+    CHECK_FALSE(sys.isBlank(SOURCE_ADDRESS, FLASH_PAGE_SIZE));
+}
+
+TEST(SystemTest, ProgrammedHalfWordCanOnlyBeCleared)
+{
+    const uint16_t data[] = { 0x1234, 0x5678, 0x0000 };
+    sys.unlockFlash();
+    sys.programHalfWords(DESTINATION_ADDRESS, data, sizeof(uint16_t));
+
+    /* 0x1234 -> 0x5678 fails (PGERR), 0x1234 -> 0x0000 works */
+    CHECK_FALSE(sys.isProgrammable(DESTINATION_ADDRESS, &data[1], sizeof(uint16_t)));
+    sys.programHalfWords(DESTINATION_ADDRESS, &data[1], sizeof(uint16_t));
+    CHECK_EQUAL(1, flashSimulator.errors);
+    CHECK_EQUAL(0x1234, *(uint16_t*)flashSimulator.memory(DESTINATION_ADDRESS));
+
+    CHECK_TRUE(sys.isProgrammable(DESTINATION_ADDRESS, &data[2], sizeof(uint16_t)));
+    sys.programHalfWords(DESTINATION_ADDRESS, &data[2], sizeof(uint16_t));
+    CHECK_EQUAL(0x0000, *(uint16_t*)flashSimulator.memory(DESTINATION_ADDRESS));
+    sys.lockFlash();
+}
+
+TEST(SystemTest, ErasePageErasesWholePage)
+{
+    sys.unlockFlash();
+    sys.erasePage(SOURCE_ADDRESS + FLASH_PAGE_SIZE + 0x10);
+    sys.lockFlash();
+
+    CHECK_EQUAL(1, flashSimulator.pagesErased);
+    CHECK_FALSE(sys.isBlank(SOURCE_ADDRESS, FLASH_PAGE_SIZE));
+    CHECK_TRUE(sys.isBlank(SOURCE_ADDRESS + FLASH_PAGE_SIZE, FLASH_PAGE_SIZE));
+    CHECK_FALSE(sys.isBlank(SOURCE_ADDRESS + 2 * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE));
+}
+
+TEST(SystemTest, CopyToBlankFlashDoesNotErase)
+{
+    CopyResult result = sys.copyFlashBlock(SOURCE_ADDRESS, DESTINATION_ADDRESS, 2 * FLASH_PAGE_SIZE);
+
+    CHECK_TRUE(isCopied(2 * FLASH_PAGE_SIZE));
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+    CHECK_EQUAL(FLASH_PAGE_SIZE, flashSimulator.halfWordsProgrammed);
+    CHECK_EQUAL(0, result.pagesSkipped);
+    CHECK_EQUAL(2, result.pagesWritten);
+    CHECK_EQUAL(0, flashSimulator.errors);
+    CHECK_TRUE(flashSimulator.locked);
+}
+
+TEST(SystemTest, CopySkipsEqualPages)
+{
+    sys.copyFlashBlock(SOURCE_ADDRESS, DESTINATION_ADDRESS, 2 * FLASH_PAGE_SIZE);
+    flashSimulator.clearCounters();
+
+    CopyResult result = sys.copyFlashBlock(SOURCE_ADDRESS, DESTINATION_ADDRESS, 2 * FLASH_PAGE_SIZE);
+
+    CHECK_EQUAL(2, result.pagesSkipped);
+    CHECK_EQUAL(0, result.pagesWritten);
+    CHECK_EQUAL(0, flashSimulator.halfWordsProgrammed);
+}
+
+TEST(SystemTest, CopyErasesOnlyChangedPages)
+{
+    sys.copyFlashBlock(SOURCE_ADDRESS, DESTINATION_ADDRESS, 3 * FLASH_PAGE_SIZE);
+    flashSimulator.memory(SOURCE_ADDRESS + FLASH_PAGE_SIZE)[5] ^= 0x11;
+    flashSimulator.clearCounters();
+
+    CopyResult result = sys.copyFlashBlock(SOURCE_ADDRESS, DESTINATION_ADDRESS, 3 * FLASH_PAGE_SIZE);
+
+    CHECK_TRUE(isCopied(3 * FLASH_PAGE_SIZE));
+    CHECK_EQUAL(1, flashSimulator.pagesErased);
+    CHECK_EQUAL(2, result.pagesSkipped);
+    CHECK_EQUAL(1, result.pagesWritten);
+    CHECK_EQUAL(0, flashSimulator.errors);
+}
+
+TEST(SystemTest, PartialCopyIsCompletedInPlace)
+{
+    memcpy(flashSimulator.memory(DESTINATION_ADDRESS, 100), flashSimulator.memory(SOURCE_ADDRESS, 100), 100);
+
+    sys.copyFlashBlock(SOURCE_ADDRESS, DESTINATION_ADDRESS, FLASH_PAGE_SIZE);
+
+    CHECK_TRUE(isCopied(FLASH_PAGE_SIZE));
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+    CHECK_EQUAL(0, flashSimulator.errors);
+}
+
+#ifdef RELOCATION
+TEST(SystemTest, WordIsProgrammedOverErasedFlash)
+{
+    CHECK_TRUE(sys.writeFlashWord(DESTINATION_ADDRESS + 8, 0x08012345));
+    CHECK_FALSE(sys.writeFlashWord(DESTINATION_ADDRESS + 8, 0x08012345));
+
+    CHECK_EQUAL(0x08012345, *(const uint32_t*)flashSimulator.memory(DESTINATION_ADDRESS + 8));
+    CHECK_EQUAL(0, flashSimulator.pagesErased);
+    CHECK_TRUE(flashSimulator.locked);
+}
+
+TEST(SystemTest, HalfProgrammedWordRewritesItsPage)
+{
+    sys.copyFlashBlock(SOURCE_ADDRESS, DESTINATION_ADDRESS, FLASH_PAGE_SIZE);
+    uint32_t* word = (uint32_t*)flashSimulator.memory(DESTINATION_ADDRESS + 8);
+    uint32_t value = *word;
+    *word |= 0xFF00FF00;
+
+    CHECK_TRUE(sys.writeFlashWord(DESTINATION_ADDRESS + 8, value));
+
+    CHECK_TRUE(isCopied(FLASH_PAGE_SIZE));
+    CHECK_EQUAL(1, flashSimulator.pagesErased);
+    CHECK_EQUAL(0, flashSimulator.errors);
+}
+#endif
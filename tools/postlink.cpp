@@ -0,0 +1,377 @@
+/*
+ * Okra Bootloader
+ * Copyright (C) 2019 Okra Solar Pty Ltd
+ * https://www.okrasolar.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <cstdint>
+
+#include "Config.h"
+#include "Crc32.h"
+#include "Relocation.h"
+
+#ifdef VERIFYHASH
+#include "Sha256.h"
+#endif
+#ifdef SIGNATURE
+#include "P256.h"
+#endif
+
+#include <algorithm>
+#include <iterator>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+/*
+ * Post-link tool for relocatable apps (RELOCATION build option). It reads the
+ * ELF file of an app linked with -Wl,--emit-relocs, for any flash address,
+ * and writes the image to store in a slot: the binary with the relocated words
+ * erased, the relocation table, and the image header to store at
+ * APP_HEADER_OFFSET of the slot at the end of the file.
+ *
+ * Words with an absolute address inside the binary (R_ARM_ABS32 and
+ * R_ARM_TARGET1, as in vector tables, literal pools, function pointers and
+ * the initial values of .data) are relocated. Absolute addresses that are not
+ * held in a word, like those built with MOVW and MOVT, are rejected.
+ *
+ * With SIGNATURE, the signature of the image header is taken from the file
+ * SIGNATURE_DER, the ECDSA signature in DER as written by openssl over the
+ * binary part of the image (the first length bytes). Run postlink without it
+ * first, sign the binary, and run postlink again with the signature. It is
+ * checked against SIGNATURE_PUBLIC_KEY.
+ *
+ * Usage: postlink APP_ELF IMAGE [VERSION [SIGNATURE_DER]]
+ */
+
+/* The parts of the ELF format used here, see the ELF and ARM ELF specifications */
+struct ElfHeader {
+    uint8_t ident[16];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uint32_t entry;
+    uint32_t programHeaderOffset;
+    uint32_t sectionHeaderOffset;
+    uint32_t flags;
+    uint16_t headerSize;
+    uint16_t programHeaderSize;
+    uint16_t programHeaders;
+    uint16_t sectionHeaderSize;
+    uint16_t sectionHeaders;
+    uint16_t sectionNames;
+};
+
+struct ElfProgramHeader {
+    uint32_t type;
+    uint32_t offset;
+    uint32_t virtualAddress;
+    uint32_t physicalAddress;
+    uint32_t fileSize;
+    uint32_t memorySize;
+    uint32_t flags;
+    uint32_t align;
+};
+
+struct ElfSectionHeader {
+    uint32_t name;
+    uint32_t type;
+    uint32_t flags;
+    uint32_t address;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t link;
+    uint32_t info;
+    uint32_t align;
+    uint32_t entrySize;
+};
+
+struct ElfSymbol {
+    uint32_t name;
+    uint32_t value;
+    uint32_t size;
+    uint8_t info;
+    uint8_t other;
+    uint16_t section;
+};
+
+struct ElfRelocation {
+    uint32_t offset;
+    uint32_t info;
+};
+
+static const uint16_t ELF_TYPE_EXECUTABLE = 2;
+static const uint16_t ELF_MACHINE_ARM = 40;
+static const uint32_t ELF_SEGMENT_LOAD = 1;
+static const uint32_t ELF_SECTION_REL = 9;
+static const uint32_t ELF_SECTION_ALLOC = 0x2;
+
+/* Relocation types of absolute addresses */
+static const uint32_t R_ARM_ABS32 = 2;
+static const uint32_t R_ARM_TARGET1 = 38;
+static const uint32_t UNSUPPORTED_TYPES[] = {
+    5,    // R_ARM_ABS16
+    6,    // R_ARM_ABS12
+    7,    // R_ARM_THM_ABS5
+    8,    // R_ARM_ABS8
+    43,   // R_ARM_MOVW_ABS_NC
+    44,   // R_ARM_MOVT_ABS
+    47,   // R_ARM_THM_MOVW_ABS_NC
+    48,   // R_ARM_THM_MOVT_ABS
+};
+
+static std::vector<uint8_t> elf;
+
+static void fail(const char* message, uint32_t value = 0)
+{
+    fprintf(stderr, "postlink: ");
+    fprintf(stderr, message, value);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+/* Get a struct from the ELF file, checking that it is inside the file */
+template <typename T> static T elfRead(uint32_t offset)
+{
+    T value;
+    if (offset > elf.size() || elf.size() - offset < sizeof(value)) {
+        fail("ELF file is truncated at offset 0x%x", offset);
+    }
+    memcpy(&value, &elf[offset], sizeof(value));
+    return value;
+}
+
+static ElfSectionHeader sectionHeader(const ElfHeader& header, uint32_t section)
+{
+    if (section >= header.sectionHeaders) {
+        fail("section %u does not exist", section);
+    }
+    return elfRead<ElfSectionHeader>(header.sectionHeaderOffset + section * header.sectionHeaderSize);
+}
+
+#ifdef SIGNATURE
+/* Read an INTEGER of a DER signature as a big endian number of P256_SIZE bytes */
+static const uint8_t* derInteger(const uint8_t* der, const uint8_t* end, uint8_t* number)
+{
+    if (end - der < 2 || der[0] != 0x02 || der[1] > end - der - 2) {
+        fail("signature is not a DER ECDSA signature");
+    }
+    uint32_t length = der[1];
+    const uint8_t* value = der + 2;
+    for (; length > P256_SIZE && *value == 0; length--) {
+        value++;
+    }
+    if (length > P256_SIZE) {
+        fail("signature is not a P-256 signature");
+    }
+    memset(number, 0, P256_SIZE - length);
+    memcpy(number + P256_SIZE - length, value, length);
+    return der + 2 + der[1];
+}
+
+/* Read the DER signature file into r and s of the image header */
+static void readSignature(const char* fileName, ImageHeader& image)
+{
+    uint8_t der[2 * P256_SIZE + 16];
+    FILE* file = fopen(fileName, "rb");
+    if (file == nullptr) {
+        fail("cannot open the signature file");
+    }
+    size_t size = fread(der, 1, sizeof(der), file);
+    fclose(file);
+
+    /* SEQUENCE of the INTEGERs r and s */
+    if (size < 2 || der[0] != 0x30 || der[1] != size - 2) {
+        fail("signature is not a DER ECDSA signature");
+    }
+    const uint8_t* s = derInteger(der + 2, der + size, image.signature);
+    if (derInteger(s, der + size, image.signature + P256_SIZE) != der + size) {
+        fail("signature is not a DER ECDSA signature");
+    }
+    if (!p256Verify(SIGNATURE_PUBLIC_KEY, image.sha256, image.signature)) {
+        fail("signature does not match SIGNATURE_PUBLIC_KEY");
+    }
+}
+#endif
+
+int main(int argc, char** argv)
+{
+    #ifdef SIGNATURE
+    if (argc < 3 || argc > 5) {
+        fprintf(stderr, "Usage: postlink APP_ELF IMAGE [VERSION [SIGNATURE_DER]]\n");
+        return 2;
+    }
+    #else
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "Usage: postlink APP_ELF IMAGE [VERSION]\n");
+        return 2;
+    }
+    #endif
+    uint32_t version = argc > 3 ? strtoul(argv[3], nullptr, 0) : 1;
+
+    FILE* file = fopen(argv[1], "rb");
+    if (file == nullptr) {
+        fail("cannot open the ELF file");
+    }
+    uint8_t buffer[4096];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        elf.insert(elf.end(), buffer, buffer + read);
+    }
+    fclose(file);
+
+    ElfHeader header = elfRead<ElfHeader>(0);
+    if (memcmp(header.ident, "\x7F" "ELF\x01\x01", 6) != 0 || header.machine != ELF_MACHINE_ARM
+        || header.type != ELF_TYPE_EXECUTABLE) {
+        fail("not a little endian 32 bit ARM executable");
+    }
+
+    /* The binary holds the loaded segments at their load addresses, like
+     * objcopy -O binary. The initial values of .data follow the code */
+    std::vector<ElfProgramHeader> segments;
+    uint32_t base = 0xFFFFFFFF;
+    uint32_t end = 0;
+    for (uint32_t i = 0; i < header.programHeaders; i++) {
+        ElfProgramHeader segment
+            = elfRead<ElfProgramHeader>(header.programHeaderOffset + i * header.programHeaderSize);
+        if (segment.type != ELF_SEGMENT_LOAD || segment.fileSize == 0) {
+            continue;
+        }
+        segments.push_back(segment);
+        base = std::min(base, segment.physicalAddress);
+        end = std::max(end, segment.physicalAddress + segment.fileSize);
+    }
+    if (segments.empty()) {
+        fail("no loaded segments");
+    }
+    uint32_t length = (end - base + 3) & ~3U;
+    if (length > (uint32_t)APP_HEADER_OFFSET) {
+        fail("binary of %u bytes does not fit into a slot", length);
+    }
+    std::vector<uint32_t> binary(length / sizeof(uint32_t), 0xFFFFFFFF);
+    for (const ElfProgramHeader& segment : segments) {
+        if (segment.offset > elf.size() || elf.size() - segment.offset < segment.fileSize) {
+            fail("segment at 0x%x is truncated", segment.physicalAddress);
+        }
+        memcpy((uint8_t*)binary.data() + segment.physicalAddress - base, &elf[segment.offset], segment.fileSize);
+    }
+
+    /* Collect the words with an address inside the binary */
+    std::vector<std::pair<uint32_t, uint32_t>> relocations;
+    for (uint32_t i = 0; i < header.sectionHeaders; i++) {
+        ElfSectionHeader rel = sectionHeader(header, i);
+        if (rel.type != ELF_SECTION_REL || !(sectionHeader(header, rel.info).flags & ELF_SECTION_ALLOC)) {
+            continue;
+        }
+        ElfSectionHeader symbols = sectionHeader(header, rel.link);
+        for (uint32_t offset = 0; offset + sizeof(ElfRelocation) <= rel.size; offset += sizeof(ElfRelocation)) {
+            ElfRelocation relocation = elfRead<ElfRelocation>(rel.offset + offset);
+            uint32_t type = relocation.info & 0xFF;
+            ElfSymbol symbol = elfRead<ElfSymbol>(symbols.offset + (relocation.info >> 8) * sizeof(ElfSymbol));
+            bool inside = symbol.value >= base && symbol.value <= end;
+
+            if (std::find(std::begin(UNSUPPORTED_TYPES), std::end(UNSUPPORTED_TYPES), type)
+                != std::end(UNSUPPORTED_TYPES)) {
+                if (inside) {
+                    fail("absolute address at 0x%x cannot be relocated, it is not held in a word",
+                        relocation.offset);
+                }
+                continue;
+            }
+            if (type != R_ARM_ABS32 && type != R_ARM_TARGET1) {
+                continue;
+            }
+
+            /* Find the word in the binary, .data is stored after the code */
+            uint32_t address = 0;
+            bool stored = false;
+            for (const ElfProgramHeader& segment : segments) {
+                if (relocation.offset - segment.virtualAddress < segment.fileSize) {
+                    address = relocation.offset - segment.virtualAddress + segment.physicalAddress;
+                    stored = true;
+                }
+            }
+            if (!stored) {
+                continue;
+            }
+            if ((address - base) % sizeof(uint32_t) != 0) {
+                fail("address at 0x%x is not word aligned", relocation.offset);
+            }
+            uint32_t position = (address - base) / sizeof(uint32_t);
+            uint32_t value = binary[position];
+            if (value >= base && value <= end) {
+                relocations.push_back({ position, value - base });
+            }
+        }
+    }
+    if (relocations.empty()) {
+        fail("no relocations found, the app must be linked with -Wl,--emit-relocs");
+    }
+    std::sort(relocations.begin(), relocations.end());
+    relocations.erase(std::unique(relocations.begin(), relocations.end()), relocations.end());
+
+    std::vector<uint32_t> positions;
+    std::vector<uint32_t> offsets;
+    for (const std::pair<uint32_t, uint32_t>& relocation : relocations) {
+        if (!positions.empty() && positions.back() == relocation.first) {
+            fail("word at offset 0x%x is relocated twice", relocation.first * sizeof(uint32_t));
+        }
+        positions.push_back(relocation.first);
+        offsets.push_back(relocation.second);
+        binary[relocation.first] = 0xFFFFFFFF;
+    }
+
+    /* The table follows the binary, before the image header */
+    uint32_t capacity = (APP_HEADER_OFFSET - length) / sizeof(uint32_t);
+    std::vector<uint32_t> table(capacity > 0 ? capacity : 1);
+    int32_t entries = capacity > 0
+        ? relocationEncode(positions.data(), offsets.data(), positions.size(), table.data() + 1, capacity - 1)
+        : -1;
+    if (entries < 0) {
+        fail("relocation table does not fit into the slot");
+    }
+    table[0] = entries;
+    table.resize(entries + 1);
+
+    ImageHeader image = { IMAGE_HEADER_MAGIC_RELOC, length, base, crc32(binary.data(), binary.size()), version };
+    #ifdef VERIFYHASH
+    Sha256 context;
+    sha256Init(context);
+    sha256Update(context, (const uint8_t*)binary.data(), length);
+    sha256Final(context, image.sha256);
+    #endif
+    #ifdef SIGNATURE
+    if (argc > 4) {
+        readSignature(argv[4], image);
+    }
+    #endif
+
+    file = fopen(argv[2], "wb");
+    if (file == nullptr || fwrite(binary.data(), sizeof(uint32_t), binary.size(), file) != binary.size()
+        || fwrite(table.data(), sizeof(uint32_t), table.size(), file) != table.size()
+        || fwrite(&image, sizeof(image), 1, file) != 1 || fclose(file) != 0) {
+        fail("cannot write the image");
+    }
+    printf("%s: %u bytes linked at 0x%08x, %u words relocated in %d table entries, crc 0x%08x\n", argv[2],
+        length, base, (uint32_t)positions.size(), entries, image.crc);
+    return 0;
+}